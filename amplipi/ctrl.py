@@ -217,10 +217,14 @@ class Api:
         self.set_source(src.id, update, force_update=True, internal=True)
     # configure all of the zones so that they are in a known state
     #   we mute all zones on startup to keep audio from playing immediately at startup
-    for zone in self.status.zones:
-      # TODO: disable zones that are not found and add zones that are found
-      zone_update = models.ZoneUpdate(source_id=zone.source_id, mute=True, vol=zone.vol)
-      self.set_zone(zone.id, zone_update, force_update=True, internal=True)
+    try:
+      with self._rt.batch():
+        for zone in self.status.zones:
+          # TODO: disable zones that are not found and add zones that are found
+          zone_update = models.ZoneUpdate(source_id=zone.source_id, mute=True, vol=zone.vol)
+          self.set_zone(zone.id, zone_update, force_update=True, internal=True)
+    except Exception as exc:
+      print(f'Error configuring zones: {exc}')
     # configure all of the groups (some fields may need to be updated)
     self._update_groups()
 
@@ -510,8 +514,12 @@ class Api:
     if vol_change != 0:
       # TODO: make this use volume delta adjustment, for now its a fixed group volume
       zone_update.vol = vol_delta # vol = z.vol + vol_change
-    for zone in [self.status.zones[zone] for zone in zones]:
-      self.set_zone(zone.id, zone_update, internal=True)
+    try:
+      with self._rt.batch(): # Apply the whole group's hardware changes in one transfer
+        for zone in [self.status.zones[zone] for zone in zones]:
+          self.set_zone(zone.id, zone_update, internal=True)
+    except Exception as exc:
+      return ApiResponse.error('set group failed: ' + str(exc))
 
     # save the volume
     group.vol_delta = vol_delta
@@ -18,19 +18,27 @@
 """Runtimes to communicate with the AmpliPi hardware
 """
 
+import ctypes
+import errno
 import math
 import io
 import os
+import re
+import socket
+import threading
 import time
+import zlib
+from concurrent.futures import ThreadPoolExecutor, wait
+from contextlib import contextmanager, nullcontext
 import amplipi.extras as extras
 
-from typing import Dict, List, Tuple, Union
+from typing import Any, Callable, Dict, List, Optional, Sequence, Set, Tuple, Union
 
 # TODO: move constants like this to their own file
 DEBUG_PREAMPS = False # print out preamp state after register write
 
 from serial import Serial
-from smbus2 import SMBus
+from smbus2 import SMBus, i2c_msg
 
 # Preamp register addresses
 _REG_ADDRS = {
@@ -53,6 +61,71 @@ _REG_ADDRS = {
   'HV2_VOLTAGE'     : 0x11,
   'HV1_TEMP'        : 0x12,
   'HV2_TEMP'        : 0x13,
+  'STATUS_PERIOD'   : 0x14,
+  'STATUS_VALID'    : 0x15,
+  'STATUS_AGE'      : 0x16,
+  'POWER_STATE'     : 0x17,
+  'STAGE'           : 0x18,
+  'COMMIT'          : 0x19,
+  'CH1_RAMP'        : 0x1A,
+  'CH2_RAMP'        : 0x1B,
+  'CH3_RAMP'        : 0x1C,
+  'CH4_RAMP'        : 0x1D,
+  'CH5_RAMP'        : 0x1E,
+  'CH6_RAMP'        : 0x1F,
+  'CH1_RAMP_INT'    : 0x20,
+  'CH2_RAMP_INT'    : 0x21,
+  'CH3_RAMP_INT'    : 0x22,
+  'CH4_RAMP_INT'    : 0x23,
+  'CH5_RAMP_INT'    : 0x24,
+  'CH6_RAMP_INT'    : 0x25,
+  'BOOT_STATUS'     : 0x26,
+  'PERF_SEL'        : 0x27,
+  'PERF_DATA0'      : 0x28,
+  'PERF_DATA1'      : 0x29,
+  'PERF_DATA2'      : 0x2A,
+  'PERF_DATA3'      : 0x2B,
+  'PERF_RESET'      : 0x2C,
+  'STATUS_BLOCK'    : 0x2D,
+  'FAN_MODE'        : 0x2E,
+  'FAN_ON_TEMP'     : 0x2F,
+  'FAN_OFF_TEMP'    : 0x30,
+  'FAN_DUTY'        : 0x31,
+  'HV1_TEMP_C'      : 0x32,
+  'HV2_TEMP_C'      : 0x33,
+  'TELEM_PERIOD'    : 0x34,
+  'TELEM_COUNT'     : 0x35,
+  'TELEM_DATA'      : 0x36,
+  'EVENTS'          : 0x37,
+  'EVENT_MASK'      : 0x38,
+  'FW_CTRL'         : 0x39,
+  'FW_DATA'         : 0x3A,
+  'FW_CRC'          : 0x3B,
+  'FW_OFFSET'       : 0x3C,
+  'IDLE'            : 0x3D,
+  'PRESET_SAVE'     : 0x3E,
+  'PRESET_RECALL'   : 0x3F,
+  'GROUP1_MEMBERS'  : 0x40,
+  'GROUP2_MEMBERS'  : 0x41,
+  'GROUP3_MEMBERS'  : 0x42,
+  'GROUP4_MEMBERS'  : 0x43,
+  'GROUP1_VOL'      : 0x44,
+  'GROUP2_VOL'      : 0x45,
+  'GROUP3_VOL'      : 0x46,
+  'GROUP4_VOL'      : 0x47,
+  'GROUP1_MUTE'     : 0x48,
+  'GROUP2_MUTE'     : 0x49,
+  'GROUP3_MUTE'     : 0x4A,
+  'GROUP4_MUTE'     : 0x4B,
+  'SNAPSHOT'        : 0x4C,
+  'TRACE_CTRL'      : 0x4D,
+  'TRACE_TRIG'      : 0x4E,
+  'TRACE_DATA'      : 0x4F,
+  'LED_PATTERN'     : 0x50,
+  'LED_PERIOD'      : 0x51,
+  'PEC_CTRL'        : 0x52,
+  'XFER_COUNT'      : 0x53,
+  'XFER_ERRORS'     : 0x54,
   'VERSION_MAJOR'   : 0xFA,
   'VERSION_MINOR'   : 0xFB,
   'GIT_HASH_27_20'  : 0xFC,
@@ -60,11 +133,168 @@ _REG_ADDRS = {
   'GIT_HASH_11_04'  : 0xFE,
   'GIT_HASH_STATUS' : 0xFF,
 }
+# Preamp POWER_STATE values
+_POWER_STANDBY = 0
+_POWER_POWERING_UP = 1
+_POWER_READY = 2
+_POWER_POWERING_DOWN = 3
+# EVENTS bits
+_EVENT_PG_9V = 0x01
+_EVENT_PG_12V = 0x02
+_EVENT_OVR_TMP = 0x04
+_EVENT_FAN_FAIL = 0x08
+_EVENT_FAN_ON = 0x10
+_EVENT_WATCHDOG = 0x40
+_EVENT_BOOT = 0x80
+_EVENT_FAULTS = _EVENT_PG_9V | _EVENT_PG_12V | _EVENT_OVR_TMP | _EVENT_FAN_FAIL
+# FW_CTRL commands and states
+_FW_CMD_BEGIN = 0x01
+_FW_CMD_COMMIT = 0x02
+_FW_RECEIVING = 0x02
+_FW_STAGED = 0x03
+_FW_ERASE_S = 1.2 # 30 flash pages at up to 40 ms each, the preamp can't answer meanwhile
+_FW_ERASE_TIMEOUT_S = 0.5 # Extra time to finish erasing once _FW_ERASE_S has passed
+_FW_CHUNK_LEN = 31 # FW_DATA bytes per write, keeps each write under 32 bytes
+_FW_MAX_LEN = 29 * 1024
+# TRACE_DATA returns a count and first sequence number, then up to 31 records
+_TRACE_HEADER_LEN = 3
+_TRACE_RECORD_LEN = 8
+_TRACE_READ_MAX = 31
+_TRACE_RECORD = 0x01
+_TRACE_TRIGGER = 0x02
+_TRACE_READ = 0x8000
+# LED_PATTERN values, blinked by the preamps themselves
+LED_PATTERN_STATUS = 0
+LED_PATTERN_IDENTIFY = 1
+LED_PATTERN_FAULT = 2
+LED_PATTERN_ALTERNATE = 3
+_LED_PERIOD_UNIT_MS = 10
+# PEC_CTRL bits and the transfers confirmed with XFER_COUNT, see _PecBus
+_PEC_ENABLE = 0x01
+_PEC_MAX_WRITES = 8 # Write transactions to one preamp XFER_ERRORS reports on
+_STREAM_REGS = (_REG_ADDRS['FW_DATA'], _REG_ADDRS['FW_CRC']) # Written repeatedly without auto-incrementing
+# Presets hold staged writes of SRC_AD through CH6_ATTEN
+_NUM_PRESETS = 8
+_PRESET_LAST_REG = 0x0A
+_PRESET_PERSIST = 0x80
+# Linked zone groups on each preamp
+_NUM_GROUPS = 4
+# FAN_MODE values
+_FAN_MODE_HOST = 0
+_FAN_MODE_HYSTERESIS = 1
+_FAN_MODE_PWM = 2
+# BOOT_STATUS bits
+_BOOT_INITIALIZED = 0x02
+_BOOT_CHAIN_DONE = 0x08
+_BOOT_TIMEOUT_S = 0.5
 _SRC_TYPES = {
   1 : 'Digital',
   0 : 'Analog',
 }
-_DEV_ADDRS = [0x08, 0x10, 0x18, 0x20, 0x28, 0x30, 0x38, 0x40, 0x48, 0x50, 0x58, 0x60, 0x68, 0x70, 0x78]
+# PERF_SEL values
+_PERF_COUNTERS = {
+  'i2c1_xfers'      : 0x00,
+  'i2c1_writes'     : 0x01,
+  'i2c1_reads'      : 0x02,
+  'i2c1_stretch_us' : 0x03,
+  'cmd_max_us'      : 0x04,
+  'cmd_avg_us'      : 0x05,
+  'i2c2_xfers'      : 0x06,
+  'i2c2_bytes'      : 0x07,
+  'i2c2_nacks'      : 0x08,
+  'uart_ovf'        : 0x09,
+  'uptime_ms'       : 0x0A,
+  'i2c2_timeouts'   : 0x0B,
+  'i2c2_bus_errors' : 0x0C,
+  'i2c2_recoveries' : 0x0D,
+  'i2c2_last_error' : 0x0E,
+  'sleep_us'        : 0x0F,
+  'i2c1_rejects'    : 0x10,
+}
+_PERF_REG_BASE = 0x80
+_PERF_NUM_REGS = 0x60
+# Registers returned by STATUS_BLOCK, in order
+_STATUS_BLOCK_REGS = [
+  'POWER_GOOD', 'FAN_STATUS', 'EXTERNAL_GPIO', 'LED_OVERRIDE',
+  'HV1_VOLTAGE', 'HV2_VOLTAGE', 'HV1_TEMP', 'HV2_TEMP',
+  'STATUS_VALID', 'STATUS_AGE', 'POWER_STATE', 'BOOT_STATUS',
+  'VERSION_MAJOR', 'VERSION_MINOR', 'GIT_HASH_27_20', 'GIT_HASH_19_12', 'GIT_HASH_11_04', 'GIT_HASH_STATUS',
+  'EVENTS', 'XFER_COUNT', 'XFER_ERRORS',
+]
+# TELEM_DATA returns a count and first sequence number, then up to 48 records
+_TELEM_HEADER_LEN = 3
+_TELEM_RECORD_LEN = 5
+_TELEM_DRAIN_MAX = 48
+# Register writes and reads are sent as I2C_RDWR messages, several per transfer
+_I2C_RDWR_MAX_MSGS = 42 # i2c-dev limit per transfer
+_I2C_RETRIES = 3
+_I2C_RETRY_S = 0.001
+# Audio register writes can be held and coalesced, see _Preamps.__init__()
+_WRITE_BEHIND_REGS = range(0x00, 0x0B) # SRC_AD through CH6_ATTEN
+_WRITE_BEHIND_S = 0.02
+# UART address assignment, the message carries 8-bit addresses
+_ADDR_MSG = bytes((0x41, 0x10, 0x0D, 0x0A))
+_ADDR_FIRST = 0x08 # 7-bit address of the first preamp on each bus
+_ADDR_LAST = 0x78  # Highest address handed out
+_ADDR_STRIDE = 8   # Between the addresses of consecutive preamps on a bus
+_ADDR_BAUD = 115200
+_ADDR_RETRY_S = 0.01
+_ADDR_TIMEOUT_S = 0.5
+# Every preamp also answers this address, for writing a subset of registers at once
+_BROADCAST_ADDR = 0x0C
+# Set to a file path to record every preamp transaction, for replaying with fw/preamp/sim
+_I2C_TRACE_ENV = 'AMPLIPI_I2C_TRACE'
+# Set to a directory of virtual preamp sockets, named by 7-bit address like 08.sock, to use fw/preamp/sim instead of hardware
+_PREAMP_SIM_ENV = 'AMPLIPI_PREAMP_SIM'
+# Preamps on the Nth bus of a _MultiBus are addressed as N * _BUS_ADDR_SPAN + their 7-bit address
+_BUS_ADDR_SPAN = 0x80
+
+def _unit_addrs(num_buses: int, stride: int, units_per_bus: Optional[int]) -> List[int]:
+  """ Address of every preamp that can be connected, in chain order
+
+    Args:
+      num_buses:     I2C buses the chain is split over
+      stride:        7-bit address step between consecutive preamps on a bus
+      units_per_bus: preamps on each bus, or None for as many as the stride fits
+
+    Returns:
+      the addresses, see _BUS_ADDR_SPAN for the buses after the first
+  """
+  fit = (_ADDR_LAST - _ADDR_FIRST) // stride + 1 if stride > 0 else 0
+  if units_per_bus is None:
+    units_per_bus = fit
+  if not 0 < stride < 0x80 or not 1 <= units_per_bus <= fit:
+    raise ValueError(f'{units_per_bus} preamps {stride} apart do not fit on a bus')
+  addrs = [_ADDR_FIRST + i * stride for i in range(units_per_bus)]
+  if _BROADCAST_ADDR in addrs:
+    raise ValueError(f'An address stride of {stride} puts a preamp at the broadcast address')
+  return [b * _BUS_ADDR_SPAN + a for b in range(num_buses) for a in addrs]
+
+def _pec(data: Sequence[int]) -> int:
+  """ SMBus packet error code of a transaction's bytes, a CRC-8 with polynomial 0x07 """
+  crc = 0
+  for d in data:
+    crc ^= d
+    for _ in range(8):
+      crc = ((crc << 1) ^ 0x07) & 0xFF if crc & 0x80 else (crc << 1) & 0xFF
+  return crc
+
+def _read_len(reg: int, first: int) -> int:
+  """ Length of the data a preamp read of reg returns before its PEC, as readLen() in fw/preamp/src/main.c
+
+    Args:
+      reg:   register read
+      first: the first byte returned, the count of what follows for multi-byte registers
+  """
+  if reg == _REG_ADDRS['STATUS_BLOCK']:
+    return 1 + first
+  if reg == _REG_ADDRS['TELEM_DATA']:
+    return _TELEM_HEADER_LEN + first * _TELEM_RECORD_LEN
+  if reg == _REG_ADDRS['TRACE_DATA']:
+    return _TRACE_HEADER_LEN + first * _TRACE_RECORD_LEN
+  if reg in (_REG_ADDRS['FW_OFFSET'], _REG_ADDRS['XFER_COUNT']):
+    return 2
+  return 1
 
 def is_amplipi():
   """ Check if the current hardware is an AmpliPi
@@ -103,36 +333,559 @@ def is_amplipi():
   return is_amplipi
 
 
+def summarize_trace(records: List[Dict[str, int]]) -> str:
+  """ Summarize a preamp command trace from _Preamps.read_trace()
+
+    Lists the accesses of each register with their service times, and the
+    time between accesses, so polling intervals and write coalescing can be
+    checked against what the controller board really sends.
+  """
+  if not records:
+    return 'No accesses traced'
+  names = {addr: name for name, addr in _REG_ADDRS.items()}
+  def dist(vals: List[int]) -> str:
+    vals = sorted(vals)
+    pct = lambda p: vals[min(len(vals) - 1, len(vals) * p // 100)]
+    return f'{sum(vals) / len(vals):8.1f} {pct(50):6} {pct(99):6} {vals[-1]:6}'
+  span_us = (records[-1]['time_us'] - records[0]['time_us']) & 0xFFFFFFFF
+  lines = [f'{len(records)} accesses over {span_us / 1000:.1f} ms, service times in us',
+           f'{"register":<16} {"op":<2} {"count":>5}  {"mean":>8} {"p50":>6} {"p99":>6} {"max":>6}']
+  by_op: Dict[Tuple[int, bool], List[int]] = {}
+  for r in records:
+    by_op.setdefault((r['reg'], r['read']), []).append(r['service_us'])
+  for (reg, read), service in sorted(by_op.items(), key=lambda kv: -len(kv[1])):
+    name = names.get(reg, f'0x{reg:02X}')
+    lines.append(f'{name:<16} {"r" if read else "w":<2} {len(service):5}  {dist(service)}')
+  gaps = [(b['time_us'] - a['time_us']) & 0xFFFFFFFF for a, b in zip(records, records[1:])]
+  if gaps:
+    lines.append(f'{"time between, us":<25}  {dist(gaps)}')
+  return '\n'.join(lines)
+
+
+class _TraceBus(SMBus):
+  """ SMBus that also records each transaction in the preamp simulator's stream format
+
+    Writes are recorded as 'w ADDR REG DATA...', reads as the register write
+    followed by 'r ADDR LEN', and gaps of a millisecond or more as 's MS'.
+  """
+
+  def __init__(self, bus: int, path: str):
+    super().__init__(bus)
+    self._trace = open(path, 'a', buffering=1)
+    self._last = time.monotonic()
+
+  def _log(self, op: str, addr: int, data: List[int]):
+    now = time.monotonic()
+    gap_ms = int((now - self._last) * 1000)
+    if gap_ms > 0:
+      self._trace.write(f's {gap_ms}\n')
+    self._last = now
+    self._trace.write(' '.join([op, f'{addr:02X}'] + [f'{d:02X}' for d in data]) + '\n')
+
+  def write_byte_data(self, i2c_addr, register, value, force=None):
+    self._log('w', i2c_addr, [register, value])
+    return super().write_byte_data(i2c_addr, register, value, force)
+
+  def read_byte_data(self, i2c_addr, register, force=None):
+    self._log('w', i2c_addr, [register])
+    self._log('r', i2c_addr, [1])
+    return super().read_byte_data(i2c_addr, register, force)
+
+  def read_i2c_block_data(self, i2c_addr, register, length, force=None):
+    self._log('w', i2c_addr, [register])
+    self._log('r', i2c_addr, [length])
+    return super().read_i2c_block_data(i2c_addr, register, length, force)
+
+  def i2c_rdwr(self, *i2c_msgs):
+    for msg in i2c_msgs:
+      if msg.flags & 1: # I2C_M_RD
+        self._log('r', msg.addr, [msg.len])
+      else:
+        self._log('w', msg.addr, list(msg))
+    return super().i2c_rdwr(*i2c_msgs)
+
+
+class _SimBus:
+  """ Stand-in for SMBus(1) that runs each transaction on virtual preamps
+
+    Each preamp is a preamp_bench process from fw/preamp/sim started with -l,
+    running the firmware in real time. A transaction takes as long to answer
+    as it would on the hardware, and one to a preamp that isn't running isn't
+    acknowledged, so the rest of the stack can't tell the difference.
+    The preamps of each further bus of a _MultiBus are in a numbered
+    subdirectory, 1 for the second bus and so on.
+  """
+
+  def __init__(self, path: str):
+    self._socks: Dict[int, socket.socket] = {}
+    for addr in range(_ADDR_FIRST, _ADDR_LAST + 1):
+      sock_path = os.path.join(path, f'{addr:02X}.sock')
+      if os.path.exists(sock_path):
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.connect(sock_path)
+        self._socks[addr] = sock
+    self._files = {addr: sock.makefile('r') for addr, sock in self._socks.items()}
+
+  def _run(self, addr: int, line: str) -> List[int]:
+    """ Send one transaction line to the preamp at addr, or every preamp for the broadcast address """
+    addrs = [a for a in self._socks if addr in (a, _BROADCAST_ADDR)]
+    vals: List[int] = []
+    acked = False
+    for a in addrs: # A broadcast runs on every preamp at once
+      self._socks[a].sendall(line.encode() + b'\n')
+    for a in addrs:
+      reply = self._files[a].readline().split()
+      if reply and reply[0] == 'a':
+        acked = True
+        vals = [int(v, 16) for v in reply[1:]]
+    if not acked:
+      raise OSError(f'Virtual preamp 0x{addr:02X} did not acknowledge')
+    return vals
+
+  def _write_line(self, addr: int, data: List[int]):
+    self._run(addr, ' '.join(['w', f'{addr:02X}'] + [f'{d:02X}' for d in data]))
+
+  def _read_line(self, addr: int, length: int) -> List[int]:
+    return self._run(addr, f'r {addr:02X} {length:02X}')
+
+  def write_byte_data(self, i2c_addr, register, value, force=None):
+    self._write_line(i2c_addr, [register, value])
+
+  def read_byte_data(self, i2c_addr, register, force=None):
+    self._write_line(i2c_addr, [register])
+    return self._read_line(i2c_addr, 1)[0]
+
+  def read_i2c_block_data(self, i2c_addr, register, length, force=None):
+    self._write_line(i2c_addr, [register])
+    return self._read_line(i2c_addr, length)
+
+  def i2c_rdwr(self, *i2c_msgs):
+    for msg in i2c_msgs:
+      if msg.flags & 1: # I2C_M_RD
+        ctypes.memmove(msg.buf, bytes(self._read_line(msg.addr, msg.len)), msg.len)
+      else:
+        self._write_line(msg.addr, list(msg))
+
+
+class _MultiBus:
+  """ Several I2C buses used as one, so a long chain of preamps can be split over them
+
+    Each bus is an SMBus, or a stand-in for one. A preamp on the Nth bus is
+    addressed as N * _BUS_ADDR_SPAN + its 7-bit address, so the first bus
+    keeps the plain addresses, and the broadcast address goes to every bus.
+    The messages of an I2C_RDWR transfer are split by bus, keeping their
+    order on each bus, and the buses run their part at the same time. The
+    time a transfer takes is then that of its busiest bus instead of the sum.
+    Buses behind an I2C mux still share the bus before the mux, so they
+    extend the addresses available but don't run in parallel.
+  """
+
+  def __init__(self, buses: List[Any]):
+    self._buses = buses
+    self._pool = ThreadPoolExecutor(max_workers=len(buses))
+
+  def _bus(self, addr: int) -> Tuple[Any, int]:
+    return self._buses[addr // _BUS_ADDR_SPAN], addr % _BUS_ADDR_SPAN
+
+  def write_byte_data(self, i2c_addr, register, value, force=None):
+    if i2c_addr == _BROADCAST_ADDR:
+      for bus in self._buses:
+        bus.write_byte_data(i2c_addr, register, value, force)
+      return
+    bus, addr = self._bus(i2c_addr)
+    bus.write_byte_data(addr, register, value, force)
+
+  def read_byte_data(self, i2c_addr, register, force=None):
+    bus, addr = self._bus(i2c_addr)
+    return bus.read_byte_data(addr, register, force)
+
+  def read_i2c_block_data(self, i2c_addr, register, length, force=None):
+    bus, addr = self._bus(i2c_addr)
+    return bus.read_i2c_block_data(addr, register, length, force)
+
+  def i2c_rdwr(self, *i2c_msgs):
+    parts: Dict[int, List[i2c_msg]] = {}
+    addrs = [msg.addr for msg in i2c_msgs]
+    for msg in i2c_msgs:
+      if msg.addr == _BROADCAST_ADDR:
+        for b in range(len(self._buses)):
+          parts.setdefault(b, []).append(msg)
+      else:
+        parts.setdefault(msg.addr // _BUS_ADDR_SPAN, []).append(msg)
+        msg.addr %= _BUS_ADDR_SPAN
+    try:
+      if len(parts) == 1:
+        for b, msgs in parts.items():
+          self._buses[b].i2c_rdwr(*msgs)
+      else:
+        runs = [self._pool.submit(self._buses[b].i2c_rdwr, *msgs) for b, msgs in parts.items()]
+        wait(runs) # Every bus is done with the messages before they are given back
+        for run in runs:
+          run.result() # Raises the error of a bus that failed
+    finally:
+      for msg, addr in zip(i2c_msgs, addrs):
+        msg.addr = addr
+
+
+class _PecBus:
+  """ Stand-in for a bus that protects every preamp transaction with an SMBus PEC
+
+    Each write with data gets its PEC appended, and a preamp with PEC_CTRL
+    set drops a write whose PEC doesn't match instead of applying it. Rather
+    than reading the registers back, confirm() reads XFER_COUNT and
+    XFER_ERRORS once from each preamp written to since it last ran, which
+    says which of those writes were applied. _Preamps calls it once per
+    batch. Only the rejected writes are sent again, less any register a
+    later write set, and writes still rejected after _I2C_RETRIES rounds
+    raise OSError. It also runs before a preamp gets more writes than
+    XFER_ERRORS reports on. A write of _STREAM_REGS isn't sent again, it
+    would land after the chunks that followed it. The image then fails its
+    CRC and is sent again from the start, see _Preamps.update_firmware().
+
+    Reads are checked against the PEC the preamp sends after the data, see
+    _read_len(), and a mismatch raises OSError as if the read wasn't
+    acknowledged. A preamp that doesn't send a valid PEC and reads PEC_CTRL
+    as cleared was reset, so it is sent no more PECs. Until then each of its
+    writes had the PEC taken as data for the register after it.
+  """
+
+  def __init__(self, bus: Any, preamps: Callable[[], List[int]]):
+    """ Args:
+          bus:     the preamps' bus, an SMBus or a stand-in for one
+          preamps: returns the address of every preamp a broadcast reaches
+    """
+    self.bus = bus
+    self._preamps = preamps
+    self._counts: Dict[int, int] = {} # Key: i2c address, Val: XFER_COUNT before the unconfirmed writes
+    self._unconfirmed: Dict[int, List[List[int]]] = {} # Key: i2c address, Val: the data of each write
+    self._off: Set[int] = set() # Preamps found with PEC_CTRL cleared
+    self._lock = threading.RLock()
+
+  @staticmethod
+  def _addr_byte(addr: int) -> int:
+    """ Address byte of a write to addr, the first byte of its PEC """
+    return (addr % _BUS_ADDR_SPAN) << 1
+
+  @staticmethod
+  def _regs(data: List[int]) -> List[Tuple[int, int]]:
+    """ Register and value of each byte of a write, the register auto-increments except for _STREAM_REGS """
+    reg = data[0]
+    pairs = []
+    for val in data[1:]:
+      pairs.append((reg, val))
+      if reg not in _STREAM_REGS:
+        reg += 1
+    return pairs
+
+  def _targets(self, addr: int) -> List[int]:
+    return self._preamps() if addr == _BROADCAST_ADDR else [addr]
+
+  def _pec_off(self, addr: int) -> bool:
+    """ Check whether a preamp that sent a bad PEC has PEC_CTRL cleared, and stop sending it PECs if so """
+    if self.bus.read_byte_data(addr, _REG_ADDRS['PEC_CTRL']) == _PEC_ENABLE:
+      return False
+    print(f'Error: preamp 0x{addr:02X} was reset and has PEC disabled, its last writes may have set the next register')
+    self._off.add(addr)
+    self._counts.pop(addr, None)
+    self._unconfirmed.pop(addr, None)
+    return True
+
+  def _check_read(self, addr: int, reg: Optional[int], data: List[int]):
+    """ Raise OSError if the PEC after the data read from reg doesn't match """
+    if reg is None or addr in self._off:
+      return # Continues an earlier read, or has no PEC
+    n = _read_len(reg, data[0])
+    a = self._addr_byte(addr)
+    if (n >= len(data) or data[n] != _pec([a, reg, a | 1] + data[:n])) and not self._pec_off(addr):
+      raise OSError(errno.EIO, f'PEC mismatch reading register 0x{reg:02X} of preamp 0x{addr:02X}')
+
+  def _status_msgs(self, addr: int) -> List[i2c_msg]:
+    """ Read of XFER_COUNT, XFER_ERRORS and their PEC """
+    return [i2c_msg.write(addr, [_REG_ADDRS['XFER_COUNT']]), i2c_msg.read(addr, 3)]
+
+  def _status(self, addr: int, read: i2c_msg) -> Optional[Tuple[int, int]]:
+    """ XFER_COUNT and XFER_ERRORS from a read of _status_msgs(), or None if its PEC didn't match """
+    data = list(read)
+    a = self._addr_byte(addr)
+    if data[2] != _pec([a, _REG_ADDRS['XFER_COUNT'], a | 1] + data[:2]):
+      return None
+    return data[0], data[1]
+
+  def _run(self, msgs: List[i2c_msg]):
+    for start in range(0, len(msgs), _I2C_RDWR_MAX_MSGS):
+      self.bus.i2c_rdwr(*msgs[start:start + _I2C_RDWR_MAX_MSGS])
+
+  @classmethod
+  def _unset(cls, addr: int, data: List[int], later: List[List[int]]) -> List[i2c_msg]:
+    """ Writes of the registers set by data that none of the later writes set again, to resend it """
+    set_later = {reg for d in later for reg, _ in cls._regs(d)}
+    runs: List[List[int]] = [] # Register, then the values of consecutive registers
+    for reg, val in cls._regs(data):
+      if reg in set_later:
+        continue
+      if runs and runs[-1][0] + len(runs[-1]) - 1 == reg:
+        runs[-1].append(val)
+      else:
+        runs.append([reg, val])
+    return [i2c_msg.write(addr, run) for run in runs]
+
+  def _send(self, i2c_msgs: List[i2c_msg]):
+    """ Run one transfer with its PECs, leaving its writes to be confirmed """
+    out: List[i2c_msg] = []
+    reads: List[Tuple[i2c_msg, i2c_msg, Optional[int]]] = [] # Message, read with its PEC, register read
+    written: List[Tuple[int, List[int]]] = [] # Preamp and data of each write that reaches it
+    ptr: Dict[int, int] = {} # Register set by a write without data
+    for msg in i2c_msgs:
+      if msg.flags & 1: # I2C_M_RD
+        read = i2c_msg.read(msg.addr, msg.len + 1)
+        reads.append((msg, read, ptr.pop(msg.addr, None)))
+        out.append(read)
+        continue
+      data = list(msg)
+      if len(data) < 2:
+        ptr[msg.addr] = data[0]
+        out.append(msg)
+        continue
+      ptr.pop(msg.addr, None)
+      # Only some preamps take a PEC, so each gets its own copy of a broadcast
+      addrs = self._preamps() if msg.addr == _BROADCAST_ADDR and self._off else [msg.addr]
+      for addr in addrs:
+        if addr in self._off:
+          out.append(i2c_msg.write(addr, data))
+        else:
+          out.append(i2c_msg.write(addr, data + [_pec([self._addr_byte(addr)] + data)]))
+          written += [(t, data) for t in self._targets(addr)]
+
+    # A preamp with no writes waiting has its count read first
+    first = {t: self._status_msgs(t) for t, _ in written
+             if t not in self._counts and t not in self._unconfirmed}
+    try:
+      self._run([m for s in first.values() for m in s] + out)
+    except OSError:
+      for t, _ in written:
+        self._counts.pop(t, None) # How many of the writes arrived is unknown
+      raise
+    for t, s in first.items():
+      status = self._status(t, s[1])
+      if status is not None:
+        self._counts[t] = status[0]
+      elif self._pec_off(t):
+        written = [w for w in written if w[0] != t]
+    for t, data in written:
+      self._unconfirmed.setdefault(t, []).append(data)
+    for msg, read, reg in reads:
+      data = list(read)
+      self._check_read(msg.addr, reg, data)
+      ctypes.memmove(msg.buf, bytes(data[:msg.len]), msg.len)
+
+  def _confirmed(self, addr: int, read: i2c_msg) -> List[i2c_msg]:
+    """ Check a preamp's writes against its read of _status_msgs()
+
+      Returns:
+        the writes to send again
+    """
+    writes = self._unconfirmed.pop(addr)
+    count = self._counts.pop(addr, None)
+    status = self._status(addr, read)
+    if status is None and self._pec_off(addr):
+      return []
+    if status is not None:
+      self._counts[addr] = status[0]
+    if status is None or count is None or (status[0] - count) & 0xFF != len(writes):
+      errors = 0xFF # Which writes were applied is unknown, so all are sent again
+    else:
+      errors = status[1]
+    resend: List[i2c_msg] = []
+    for i, data in enumerate(writes):
+      failed = errors >> (len(writes) - 1 - i) & 1 # Bit 0 is the newest
+      if failed and not any(reg in _STREAM_REGS for reg, _ in self._regs(data)):
+        resend += self._unset(addr, data, writes[i + 1:])
+    return resend
+
+  def _confirm_round(self) -> List[i2c_msg]:
+    """ Read the status of every preamp with unconfirmed writes in one transfer, returns the writes to resend """
+    if not self._unconfirmed:
+      return []
+    reads = {addr: self._status_msgs(addr) for addr in self._unconfirmed}
+    try:
+      self._run([m for s in reads.values() for m in s])
+    except OSError:
+      for addr in reads:
+        self._counts.pop(addr, None) # Every write is sent again at the next confirm()
+      raise
+    resend: List[i2c_msg] = []
+    for addr, s in reads.items():
+      resend += self._confirmed(addr, s[1])
+    return resend
+
+  def confirm(self):
+    """ Confirm every write since the last call, sending the rejected ones again """
+    with self._lock:
+      resend = self._confirm_round()
+      for _ in range(_I2C_RETRIES):
+        if not resend:
+          return
+        self._send(resend)
+        resend = self._confirm_round()
+      if resend:
+        addrs = ', '.join(sorted({f'0x{msg.addr:02X}' for msg in resend}))
+        raise OSError(errno.EIO, f'Writes to preamp {addrs} failed their PEC {_I2C_RETRIES + 1} times')
+
+  def write_byte_data(self, i2c_addr, register, value, force=None):
+    self.i2c_rdwr(i2c_msg.write(i2c_addr, [register, value]))
+
+  def read_byte_data(self, i2c_addr, register, force=None):
+    return self.read_i2c_block_data(i2c_addr, register, 1)[0]
+
+  def read_i2c_block_data(self, i2c_addr, register, length, force=None):
+    read = i2c_msg.read(i2c_addr, length)
+    self.i2c_rdwr(i2c_msg.write(i2c_addr, [register]), read)
+    return list(read)
+
+  def i2c_rdwr(self, *i2c_msgs):
+    with self._lock:
+      part: List[i2c_msg] = []
+      writes: Dict[int, int] = {} # Key: i2c address, Val: writes to it in part
+      for msg in i2c_msgs:
+        if not msg.flags & 1 and msg.len > 1:
+          targets = self._targets(msg.addr)
+          if any(len(self._unconfirmed.get(a, [])) + writes.get(a, 0) >= _PEC_MAX_WRITES for a in targets):
+            self._send(part)
+            self.confirm()
+            part, writes = [], {}
+          for addr in targets:
+            writes[addr] = writes.get(addr, 0) + 1
+        part.append(msg)
+      self._send(part)
+
+
+class _BatchState(threading.local):
+  """ The batch a thread has open on a _Preamps, see _Preamps.batch() """
+
+  def __init__(self):
+    self.depth = 0
+    self.pending: List[i2c_msg] = [] # Writes waiting for the end of the batch
+
+
 class _Preamps:
   """ Low level discovery and communication for the AmpliPi firmware
   """
 
   preamps: Dict[int, List[int]] # Key: i2c address, Val: register values
 
-  def __init__(self, reset: bool = True, set_addr: bool = True, bootloader: bool = False):
+  def __init__(self, reset: bool = True, set_addr: bool = True, bootloader: bool = False, write_behind: float = 0,
+               buses: Sequence[int] = (1,), stride: int = _ADDR_STRIDE, units_per_bus: Optional[int] = None,
+               pec: bool = False):
+    """ Find the preamps and open the bus
+
+      Args:
+        write_behind: seconds to hold writes of SRC_AD through CH6_ATTEN for,
+                      or 0 to send every write right away. Writes of the same
+                      register in that time are sent once with the newest
+                      value, so a preamp gets at most one transfer per period
+                      however fast the zones change. Other writes, writes in
+                      a batch, and flush(), send anything held first.
+        buses:        I2C bus numbers, /dev/i2c-N, in the order the chain of
+                      preamps reaches them. The first units_per_bus preamps
+                      are on the first bus, the next on the second and so on,
+                      each bus reusing the same addresses. Transfers that
+                      touch several buses run on them in parallel, see _MultiBus.
+        stride:       7-bit address step between consecutive preamps on a bus
+        units_per_bus: preamps wired to each bus, defaults to as many as the stride fits
+        pec:          protect every transaction with an SMBus PEC and confirm
+                      the writes with XFER_COUNT, see enable_pec()
+    """
+    self.addrs = _unit_addrs(len(buses), stride, units_per_bus) # Of each preamp number, from 1
+    if len(buses) == 1 and stride == _ADDR_STRIDE:
+      self._addr_msg = _ADDR_MSG # Understood by older firmware too
+    else:
+      last = self.addrs[-1] % _BUS_ADDR_SPAN
+      self._addr_msg = bytes((0x41, _ADDR_FIRST << 1, stride << 1, _ADDR_FIRST << 1, last << 1, 0x0D, 0x0A))
     self.preamps = dict()
-    if not is_amplipi():
-      self.bus = None # TODO: Use i2c-stub
+    self.bus: Any = None
+    self.broadcast = False
+    self._batch = _BatchState() # Of each thread, so one thread's batch doesn't hold another's writes
+    self._behind: Dict[Tuple[int, int], int] = {} # Key: (i2c address, register), Val: newest value
+    self._behind_s = write_behind
+    self._lock = threading.RLock() # Held while the queued writes or the bus are used
+    self._behind_ready = threading.Condition(self._lock)
+    self._presets: Dict[Tuple[int, int], Dict[int, int]] = {} # Key: (i2c address, slot)
+    self._groups: Dict[Tuple[int, int], int] = {} # Key: (i2c address, group), Val: member bits
+    sim = os.environ.get(_PREAMP_SIM_ENV)
+    if sim is None and not is_amplipi():
+      self.bus = None
       print('Not running on AmpliPi hardware, mocking preamp connection')
     else:
-      if reset:
-        self.reset_preamps(bootloader)
-      if set_addr:
-        self.set_i2c_addr()
-
-      # Setup self._bus as I2C1 from the RPi
-      self.bus = SMBus(1)
+      if sim is not None:
+        # Virtual preamps are addressed when they're started
+        bus_list = [_SimBus(os.path.join(sim, str(i)) if i else sim) for i in range(len(buses))]
+        print(f'Using virtual preamps in {sim}')
+      else:
+        if reset:
+          self.reset_preamps(bootloader)
+        if set_addr:
+          found = self.set_i2c_addr()
+          if found is not None:
+            print(f'{found} preamp(s) acknowledged their address')
+
+        # Setup self._bus as I2C1 from the RPi, the trace of each further bus gets its index appended
+        trace = os.environ.get(_I2C_TRACE_ENV)
+        bus_list = [_TraceBus(b, f'{trace}.{i}' if i else trace) if trace else SMBus(b)
+                    for i, b in enumerate(buses)]
+      self.bus = bus_list[0] if len(bus_list) == 1 else _MultiBus(bus_list)
+
+      # The master preamp is ready once every preamp after it acknowledged,
+      # which each does after it is initialized
+      self.wait_boot(self.addrs[0], _BOOT_TIMEOUT_S)
 
       # Discover connected preamp boards
-      for p in _DEV_ADDRS:
+      for p in self.addrs:
         if self.probe_preamp(p):
           print(f'Preamp found at address {p}')
           self.new_preamp(p)
         else:
-          if p == _DEV_ADDRS[0]:
+          if p == self.addrs[0]:
             print('Error: no preamps found')
           break
 
+      # Only broadcast when every preamp answers it. Firmware without BOOT_STATUS doesn't.
+      self.broadcast = len(self.preamps) > 0 and all(
+        self._read(p, _REG_ADDRS['BOOT_STATUS']) != 0xFF for p in self.preamps)
+
+      if pec and self.preamps:
+        self.enable_pec()
+
+      if write_behind > 0:
+        threading.Thread(target=self._write_behind, daemon=True).start()
+
+  def enable_pec(self) -> bool:
+    """ Protect every later transaction with the preamps by an SMBus PEC, see _PecBus
+
+      PEC is only used if every preamp found supports it, older firmware
+      reads PEC_CTRL as 0xFF. The preamps clear PEC_CTRL on any reset but
+      a watchdog one, so it is enabled again after reset_preamps().
+
+      Returns:
+        True if PEC is in use
+    """
+    if self.bus is None:
+      return False
+    reg = _REG_ADDRS['PEC_CTRL']
+    with self._lock:
+      if isinstance(self.bus, _PecBus):
+        self.bus = self.bus.bus # A preamp that still has PEC rejects the unprotected write, which is harmless
+      for addr in self.preamps:
+        self.bus.write_byte_data(addr, reg, _PEC_ENABLE)
+      enabled = [addr for addr in self.preamps if self._read(addr, reg) == _PEC_ENABLE]
+      if len(enabled) < len(self.preamps):
+        for addr in enabled: # Once enabled, disabling it needs a PEC
+          a = (addr % _BUS_ADDR_SPAN) << 1
+          self.bus.i2c_rdwr(i2c_msg.write(addr, [reg, 0, _pec([a, reg, 0])]))
+        print('Not every preamp supports PEC, writes are sent unconfirmed')
+        return False
+      self.bus = _PecBus(self.bus, lambda: list(self.preamps))
+    return True
+
   def reset_preamps(self, bootloader: bool = False):
     """ Resets the preamp board.
         Any slave preamps will be reset one-by-one by the previous preamp.
@@ -143,6 +896,8 @@ class _Preamps:
     """
     import RPi.GPIO as GPIO
     boot0 = 1 if bootloader else 0
+    if isinstance(self.bus, _PecBus):
+      self.bus = self.bus.bus # The preamps come back without PEC, see enable_pec()
 
     # Reset preamp board before establishing a communication channel
     GPIO.setmode(GPIO.BCM)
@@ -153,25 +908,47 @@ class _Preamps:
     time.sleep(0.001)
     GPIO.output(4, 1)
 
-    # Each box theoretically takes ~11ms to undergo a reset.
-    # Estimating for six boxes, including some padding,
-    # wait 100ms for the resets to propagate down the line
-    time.sleep(0.1)
+    if bootloader:
+      # Each box theoretically takes ~11ms to undergo a reset.
+      # Estimating for six boxes, including some padding,
+      # wait 100ms for the resets to propagate down the line
+      time.sleep(0.1)
+    # Otherwise set_i2c_addr() retries until the first preamp is listening
 
     # Done with GPIO, they will default back to inputs with pullups
     GPIO.cleanup()
 
-  def set_i2c_addr(self):
+  def set_i2c_addr(self) -> Union[int, None]:
     """ Sends the first preamp's I2C address via UART
-        The master preamp will set any expansion unit addresses
+        The master preamp will set any expansion unit addresses.
+        Once every preamp has its address the master preamp acknowledges
+        with the number of preamps in the chain.
+
+      Returns:
+        the number of preamps found, or None if the address was not acknowledged
     """
-    # Setup serial connection via UART pins
+    # Setup serial connection via UART pins.
+    # The preamps measure the baud rate from the address message itself.
+    with Serial('/dev/serial0', baudrate=_ADDR_BAUD, timeout=_ADDR_RETRY_S) as ser:
+      resp = b''
+      start = time.time()
+      while time.time() - start < _ADDR_TIMEOUT_S:
+        # Resend until acknowledged in case the preamp was not listening yet
+        ser.write(self._addr_msg)
+        resp += ser.read(16)
+        match = re.search(rb'N(.)\r\n', resp)
+        if match:
+          return match.group(1)[0] - ord('0')
+
+    # Older firmware only listens at 9600 baud and does not acknowledge
+    time.sleep(0.1)
     with Serial('/dev/serial0', baudrate=9600) as ser:
-      ser.write((0x41, 0x10, 0x0D, 0x0A))
+      ser.write(self._addr_msg)
 
     # Delay to account for addresses being set
     # Each box theoretically takes ~5ms to receive its address. Again, estimate for six boxes and include some padding
     time.sleep(0.1)
+    return None
 
   def reset_expander(self, preamp: int, bootload: bool = False):
     """ Resets an expansion unit's preamp board.
@@ -185,6 +962,14 @@ class _Preamps:
     assert 2 <= preamp <= 6
     # TODO: release firmware and add support here
 
+  def _addr(self, preamp: int) -> int:
+    """ Address of a preamp by number, 1 for the master """
+    return self.addrs[preamp - 1]
+
+  def _number(self, addr: int) -> int:
+    """ Number of the preamp at an address, see _addr() """
+    return self.addrs.index(addr) + 1
+
   def new_preamp(self, addr: int):
     """ Populate initial register values """
     self.preamps[addr] = [
@@ -201,8 +986,122 @@ class _Preamps:
                             0x4F,
                           ]
 
+  @contextmanager
+  def batch(self):
+    """ Send every register write made inside this context in one I2C_RDWR transfer
+
+      Writes keep their order. Batches can be nested, the writes are sent
+      when the outermost batch ends. Each thread has its own batch.
+    """
+    batch = self._batch
+    batch.depth += 1
+    try:
+      yield self
+    finally:
+      batch.depth -= 1
+      if batch.depth == 0:
+        with self._lock:
+          msgs, batch.pending = batch.pending, []
+          self._transfer(msgs) # Writes held behind stay held
+          self._confirm()
+
+  def flush(self):
+    """ Send any writes held by this thread's batch or write-behind now, before reading back their effect """
+    with self._lock:
+      msgs, self._batch.pending = self._batch.pending + self._take_behind(), []
+      self._transfer(msgs)
+      self._confirm()
+
+  def _take_behind(self) -> List[i2c_msg]:
+    """ Empty the write-behind queue into one write per run of consecutive registers of each preamp
+
+      The preamp auto-increments the register address, so each run is a
+      single burst write. Writes are sent in register order.
+    """
+    runs: List[Tuple[int, int, List[int]]] = []
+    for (addr, reg), val in sorted(self._behind.items()):
+      if runs and runs[-1][0] == addr and runs[-1][1] + len(runs[-1][2]) == reg:
+        runs[-1][2].append(val)
+      else:
+        runs.append((addr, reg, [val]))
+    self._behind = {}
+    return [i2c_msg.write(addr, [reg] + data) for addr, reg, data in runs]
+
+  def _write_behind(self):
+    """ Send the queued writes once they've been held for a period """
+    while True:
+      with self._lock:
+        self._behind_ready.wait_for(lambda: self._behind)
+      time.sleep(self._behind_s) # Later writes replace the held values meanwhile
+      with self._lock:
+        try:
+          self._transfer(self._take_behind())
+          self._confirm()
+        except OSError as e:
+          print(f'Error: write-behind transfer failed: {e}')
+
+  def _transfer(self, msgs: List[i2c_msg]):
+    """ Run I2C_RDWR transfers on the open bus, retrying each a few times
+
+      The preamp stretches the clock until it can accept more writes, so
+      no delay between writes is needed.
+    """
+    for start in range(0, len(msgs), _I2C_RDWR_MAX_MSGS):
+      chunk = msgs[start:start + _I2C_RDWR_MAX_MSGS]
+      for attempt in range(_I2C_RETRIES):
+        try:
+          self.bus.i2c_rdwr(*chunk)
+          break
+        except OSError:
+          if attempt == _I2C_RETRIES - 1:
+            raise
+          time.sleep(_I2C_RETRY_S)
+
+  def _read(self, addr: int, reg: int) -> int:
+    """ Read a register once every write queued before it has been sent
+
+      Holds the lock, so the write-behind thread and the bus wrappers only
+      see whole transactions.
+    """
+    with self._lock:
+      self.flush()
+      return self.bus.read_byte_data(addr, reg)
+
+  def _read_transfer(self, msgs: List[i2c_msg]):
+    """ Run an I2C_RDWR transfer of reads once every write queued before it has been sent, see _read() """
+    with self._lock:
+      self.flush()
+      self._transfer(msgs)
+
+  def _confirm(self):
+    """ Confirm the writes sent since the last call when they have a PEC, see _PecBus.confirm() """
+    if isinstance(self.bus, _PecBus):
+      self.bus.confirm()
+
+  def _write(self, addr: int, reg: int, data: List[int]):
+    """ Write consecutive registers starting at reg, or queue them if batching or writing behind """
+    if self.bus is None:
+      return
+    with self._lock:
+      # A batch is already sent as one transfer, and has to keep its order
+      # with writes that aren't held, e.g. the preset writes after STAGE
+      if self._behind_s > 0 and self._batch.depth == 0 and addr != _BROADCAST_ADDR and \
+         all(r in _WRITE_BEHIND_REGS for r in range(reg, reg + len(data))):
+        if not self._behind:
+          self._behind_ready.notify()
+        for i, d in enumerate(data):
+          self._behind[(addr, reg + i)] = d
+        return
+      # Anything held behind was written first, so it goes first
+      msgs = self._take_behind() + [i2c_msg.write(addr, [reg] + data)]
+      if self._batch.depth > 0:
+        self._batch.pending += msgs
+      else:
+        self._transfer(msgs)
+        self._confirm()
+
   def write_byte_data(self, preamp_addr, reg, data):
-    assert preamp_addr in _DEV_ADDRS
+    assert preamp_addr in self.addrs
     assert type(preamp_addr) == int
     assert type(reg) == int
     assert type(data) == int
@@ -217,21 +1116,116 @@ class _Preamps:
       print("writing to 0x{:02x} @ 0x{:02x} with 0x{:02x}".format(preamp_addr, reg, data))
     self.preamps[preamp_addr][reg] = data
     # TODO: need to handle volume modifying mute state in mock
-    if self.bus is not None:
+    self._write(preamp_addr, reg, [data])
+
+  def write_all_byte_data(self, reg: int, data: int):
+    """ Write a register of every preamp
+
+      Uses a single broadcast transaction when every preamp supports it,
+      so the time taken doesn't grow with the number of expansion units.
+      Only the registers listed under Broadcast in preamp_i2c_regs.md can be broadcast.
+
+      Args:
+        reg:  register to write
+        data: value for reg
+    """
+    if not self.broadcast:
+      with self.batch():
+        for p in self.preamps:
+          self.write_byte_data(p, reg, data)
+      return
+    if DEBUG_PREAMPS:
+      print("broadcasting @ 0x{:02x} with 0x{:02x}".format(reg, data))
+    for p in self.preamps:
+      self.preamps[p][reg] = data
+    self._write(_BROADCAST_ADDR, reg, [data])
+
+  def write_block_data(self, preamp_addr: int, reg: int, data: List[int]):
+    """ Write consecutive registers of a preamp in a single transaction
+
+      The preamp auto-increments the register address after each data byte.
+
+      Args:
+        preamp_addr: i2c address of the preamp
+        reg:         first register to write
+        data:        values for reg, reg + 1, ...
+    """
+    assert preamp_addr in self.addrs
+    assert type(reg) == int
+    assert len(data) > 0
+    for d in data:
+      assert type(d) == int
+    # dynamically update preamps (to support mock)
+    if preamp_addr not in self.preamps:
+      if self.bus is None:
+        self.new_preamp(preamp_addr)
+      else:
+        return None # Preamp is not connected, do nothing
+
+    if DEBUG_PREAMPS:
+      vals = ', '.join(f'0x{d:02x}' for d in data)
+      print(f'writing to 0x{preamp_addr:02x} @ 0x{reg:02x} with [{vals}]')
+    self.preamps[preamp_addr][reg:reg + len(data)] = data
+    self._write(preamp_addr, reg, data)
+
+  def wait_power_state(self, state: int, timeout: float):
+    """ Wait for every preamp to finish powering up or down
+
+      Args:
+        state:   POWER_STATE every preamp should reach
+        timeout: seconds to wait, also used as a fixed delay on
+                 firmware without the POWER_STATE register
+    """
+    if self.bus is None:
+      return
+    self.flush()
+    end = time.time() + timeout
+    waiting = set(self.preamps.keys())
+    while waiting and time.time() < end:
+      for p in list(waiting):
+        try:
+          val = self._read(p, _REG_ADDRS['POWER_STATE'])
+        except Exception:
+          continue # Busy, retry
+        if val == state:
+          waiting.remove(p)
+        elif val not in (_POWER_STANDBY, _POWER_POWERING_UP, _POWER_READY, _POWER_POWERING_DOWN):
+          # Older firmware, just wait the worst case
+          time.sleep(max(end - time.time(), 0))
+          return
+      if waiting:
+        time.sleep(0.005)
+
+  def wait_boot(self, addr: int, timeout: float) -> bool:
+    """ Wait for a preamp to finish starting up
+
+      Args:
+        addr:    I2C address of the preamp
+        timeout: seconds to wait
+
+      Returns:
+        True if the preamp is ready, or has firmware without BOOT_STATUS
+    """
+    if self.bus is None:
+      return False
+    ready = _BOOT_INITIALIZED | _BOOT_CHAIN_DONE
+    end = time.time() + timeout
+    while time.time() < end:
       try:
-        time.sleep(0.001) # space out sequential calls to avoid bus errors
-        self.bus.write_byte_data(preamp_addr, reg, data)
+        val = self._read(addr, _REG_ADDRS['BOOT_STATUS'])
+        if val == 0xFF or val & ready == ready:
+          return True
       except Exception:
-        time.sleep(0.001)
-        self.bus = SMBus(1)
-        self.bus.write_byte_data(preamp_addr, reg, data)
+        pass # Not addressed yet, or not present
+      time.sleep(0.002)
+    return False
 
   def probe_preamp(self, addr: int):
     # Scan for preamps, and set source registers to be completely digital
     # TODO: This should read version instead, but I haven't checked what relies on this yet.
     if self.bus is not None:
       try:
-        self.bus.read_byte_data(addr, _REG_ADDRS['VERSION_MAJOR'])
+        self._read(addr, _REG_ADDRS['VERSION_MAJOR'])
         return True
       except Exception:
         return False
@@ -242,11 +1236,398 @@ class _Preamps:
     """ Read all registers of every preamp and print """
     if self.bus is not None:
       for preamp in self.preamps:
-        print(f'Preamp {preamp // 8}:')
+        print(f'Preamp {self.addrs.index(preamp) + 1}:')
         for reg, addr in _REG_ADDRS.items():
-          val = self.bus.read_byte_data(preamp, addr)
+          val = self._read(preamp, addr)
           print(f'  0x{addr:02X}:{reg:<15} = 0x{val:02X}')
 
+  def read_perf(self, preamp: int = 1, reset: bool = False) -> Dict[str, int]:
+    """ Read the performance counters of a preamp
+
+      Args:
+        preamp: preamp number from 1
+        reset:  clear the counters after reading them
+
+      Returns:
+        counters by name, with per-register access counts as 'reg_<name>'
+    """
+    addr = self._addr(preamp)
+    counters: Dict[str, int] = {}
+    if self.bus is None or addr not in self.preamps:
+      return counters
+    def read(sel: int) -> int:
+      self._write(addr, _REG_ADDRS['PERF_SEL'], [sel])
+      val = 0
+      for i in range(4): # PERF_DATA0 must be read first
+        val |= self._read(addr, _REG_ADDRS['PERF_DATA0'] + i) << (8 * i)
+      return val
+    with self._lock: # PERF_SEL can't change between the reads of a counter
+      for name, sel in _PERF_COUNTERS.items():
+        counters[name] = read(sel)
+      for name, reg in _REG_ADDRS.items():
+        if reg < _PERF_NUM_REGS:
+          counters[f'reg_{name}'] = read(_PERF_REG_BASE + reg)
+      if reset:
+        self._write(addr, _REG_ADDRS['PERF_RESET'], [0x01])
+    return counters
+
+  def _parse_status(self, addr: int, block: List[int]) -> Dict[str, int]:
+    """ Decode a STATUS_BLOCK read, reading each register on firmware without it """
+    status: Dict[str, int] = {}
+    if block[0] == 0xFF:
+      for reg in _STATUS_BLOCK_REGS:
+        status[reg] = self._read(addr, _REG_ADDRS[reg])
+    else:
+      for reg, val in zip(_STATUS_BLOCK_REGS[:block[0]], block[1:]):
+        status[reg] = val
+    return status
+
+  def read_status(self, preamp: int = 1) -> Dict[str, int]:
+    """ Read every status and version register of a preamp in one transaction
+
+      Falls back to reading each register on firmware without STATUS_BLOCK.
+
+      Args:
+        preamp: preamp number from 1
+
+      Returns:
+        register values by name, see _STATUS_BLOCK_REGS
+    """
+    assert 1 <= preamp <= len(self.addrs)
+    if self.bus is None:
+      return {}
+    addr = self._addr(preamp)
+    read = i2c_msg.read(addr, len(_STATUS_BLOCK_REGS) + 1)
+    self._read_transfer([i2c_msg.write(addr, [_REG_ADDRS['STATUS_BLOCK']]), read])
+    return self._parse_status(addr, list(read))
+
+  def read_status_all(self) -> Dict[int, Dict[str, int]]:
+    """ Read every preamp's STATUS_BLOCK in a single I2C_RDWR transfer
+
+      Returns:
+        register values by name for each preamp number, see read_status()
+    """
+    if self.bus is None:
+      return {}
+    reads = {}
+    msgs = []
+    for addr in self.preamps:
+      reads[addr] = i2c_msg.read(addr, len(_STATUS_BLOCK_REGS) + 1)
+      msgs += [i2c_msg.write(addr, [_REG_ADDRS['STATUS_BLOCK']]), reads[addr]]
+    self._read_transfer(msgs)
+    return {self._number(addr): self._parse_status(addr, list(msg)) for addr, msg in reads.items()}
+
+  def save_preset(self, preamp: int, slot: int, regs: Dict[int, int], persist: bool = False):
+    """ Save audio register values as one of the preamp's presets, without applying them
+
+      Args:
+        preamp:  preamp number from 1
+        slot:    preset slot from 0 to 7
+        regs:    values keyed by register address, SRC_AD through CH6_ATTEN.
+                 Registers left out are not changed when the preset is recalled.
+        persist: also store every preset in the preamp's flash, so they survive a reset
+    """
+    assert 1 <= preamp <= len(self.addrs)
+    assert 0 <= slot < _NUM_PRESETS
+    assert all(0 <= reg <= _PRESET_LAST_REG for reg in regs)
+    addr = self._addr(preamp)
+    self._presets[(addr, slot)] = dict(regs)
+    with self.batch():
+      # Zone writes held behind are sent ahead of STAGE, so they're applied instead of saved
+      self._write(addr, _REG_ADDRS['STAGE'], [1])
+      for reg, val in sorted(regs.items()):
+        self._write(addr, reg, [val])
+      self._write(addr, _REG_ADDRS['PRESET_SAVE'], [slot | (_PRESET_PERSIST if persist else 0)])
+
+  def recall_preset(self, slot: int):
+    """ Apply a preset on every preamp, with one broadcast write when every preamp supports it
+
+      Each preamp applies what was saved in its own slot, preamps with nothing there don't change.
+    """
+    assert 0 <= slot < _NUM_PRESETS
+    for p in self.preamps:
+      for reg, val in self._presets.get((p, slot), {}).items():
+        self.preamps[p][reg] = val
+    if self.broadcast:
+      self._write(_BROADCAST_ADDR, _REG_ADDRS['PRESET_RECALL'], [slot])
+    else:
+      with self.batch():
+        for p in self.preamps:
+          self._write(p, _REG_ADDRS['PRESET_RECALL'], [slot])
+
+  def set_group_members(self, preamp: int, group: int, zones: List[int]):
+    """ Set which of a preamp's zones are in a group
+
+      Args:
+        preamp: preamp number from 1
+        group:  group from 0 to 3
+        zones:  the preamp's zones in the group, from 0 to 5
+    """
+    assert 1 <= preamp <= len(self.addrs)
+    assert 0 <= group < _NUM_GROUPS
+    assert all(0 <= z < 6 for z in zones)
+    addr = self._addr(preamp)
+    members = sum(1 << z for z in set(zones))
+    self._groups[(addr, group)] = members
+    self._write(addr, _REG_ADDRS['GROUP1_MEMBERS'] + group, [members])
+
+  def _write_group(self, group: int, reg: int, data: int):
+    """ Write a register of every preamp with members in group """
+    if self.broadcast:
+      self._write(_BROADCAST_ADDR, reg, [data])
+      return
+    with self.batch():
+      for p in self.preamps:
+        if self._groups.get((p, group)):
+          self._write(p, reg, [data])
+
+  def set_group_vol(self, group: int, vol: int):
+    """ Set the volume of every zone in a group, on every preamp, in one write per preamp or one broadcast
+
+      Args:
+        group: group from 0 to 3
+        vol:   attenuation in dB from 0 to 79, as CHx_ATTEN
+    """
+    assert 0 <= group < _NUM_GROUPS
+    assert 0 <= vol <= 79
+    for p in self.preamps:
+      members = self._groups.get((p, group), 0)
+      for z in range(6):
+        if members & (1 << z):
+          self.preamps[p][_REG_ADDRS['CH1_ATTEN'] + z] = vol
+    self._write_group(group, _REG_ADDRS['GROUP1_VOL'] + group, vol)
+
+  def set_group_mute(self, group: int, muted: bool):
+    """ Mute or unmute every zone in a group, on every preamp, in one write per preamp or one broadcast """
+    assert 0 <= group < _NUM_GROUPS
+    for p in self.preamps:
+      members = self._groups.get((p, group), 0)
+      if muted:
+        self.preamps[p][_REG_ADDRS['MUTE']] |= members
+      else:
+        self.preamps[p][_REG_ADDRS['MUTE']] &= ~members
+    self._write_group(group, _REG_ADDRS['GROUP1_MUTE'] + group, 1 if muted else 0)
+
+  def set_snapshot(self, enable: bool = True):
+    """ Have every preamp keep its zone state in flash and restore it after a power cut """
+    with self.batch():
+      for p in self.preamps:
+        self._write(p, _REG_ADDRS['SNAPSHOT'], [1 if enable else 0])
+
+  def set_event_mask(self, preamp: int = 1, mask: int = _EVENT_FAULTS):
+    """ Select the events that pull the preamp's EXT_GPIO interrupt line low
+
+      A mask of 0 makes EXT_GPIO a normal output again.
+    """
+    assert 1 <= preamp <= len(self.addrs)
+    assert 0 <= mask <= 0xFF
+    self._write(self._addr(preamp), _REG_ADDRS['EVENT_MASK'], [mask])
+
+  def poll_events(self) -> Dict[int, int]:
+    """ Read every preamp's EVENTS in one I2C_RDWR transfer and clear them
+
+      Returns:
+        the latched EVENTS bits of each preamp number that had any
+    """
+    if self.bus is None:
+      return {}
+    reads = {}
+    msgs = []
+    for addr in self.preamps:
+      reads[addr] = i2c_msg.read(addr, 1)
+      msgs += [i2c_msg.write(addr, [_REG_ADDRS['EVENTS']]), reads[addr]]
+    self._read_transfer(msgs)
+    events = {addr: list(msg)[0] for addr, msg in reads.items()}
+    events = {addr: ev for addr, ev in events.items() if ev != 0}
+    with self.batch():
+      for addr, ev in events.items():
+        self._write(addr, _REG_ADDRS['EVENTS'], [ev]) # Write 1 to clear
+    return {self._number(addr): ev for addr, ev in events.items()}
+
+  def wait_events(self, pin: int, timeout: float) -> Dict[int, int]:
+    """ Sleep until a preamp pulls the event line low, then read and clear the events
+
+      Args:
+        pin:     BCM number of the Pi GPIO the preamps' EXT_GPIO lines are wired to
+        timeout: seconds to wait for an event
+
+      Returns:
+        the latched EVENTS bits of each preamp number that had any, see poll_events()
+    """
+    import RPi.GPIO as GPIO
+    GPIO.setmode(GPIO.BCM)
+    GPIO.setup(pin, GPIO.IN, pull_up_down=GPIO.PUD_UP)
+    if GPIO.input(pin): # Not already held low by an unread event
+      GPIO.wait_for_edge(pin, GPIO.FALLING, timeout=max(1, int(timeout * 1000)))
+    return self.poll_events()
+
+  def set_telemetry_period(self, preamp: int = 1, period_ms: int = 20):
+    """ Start recording the preamp's power board history, 0 stops it
+
+      Args:
+        preamp:    preamp number from 1
+        period_ms: time between records from 5 to 255 ms, or 0
+    """
+    assert 1 <= preamp <= len(self.addrs)
+    assert period_ms == 0 or 5 <= period_ms <= 255
+    self._write(self._addr(preamp), _REG_ADDRS['TELEM_PERIOD'], [period_ms])
+
+  def read_telemetry(self, preamp: int = 1) -> List[Dict[str, int]]:
+    """ Read the records taken since the last call, oldest first
+
+      Call at least every TELEM_PERIOD * 128 ms, or the oldest records are
+      dropped. Dropped records show up as a gap in 'seq'.
+
+      Args:
+        preamp: preamp number from 1
+
+      Returns:
+        records with the sequence number 'seq', the raw 'HV1_VOLTAGE',
+        'HV2_VOLTAGE', 'HV1_TEMP' and 'HV2_TEMP' values and the power board
+        'GPIO' byte. A sample that failed reads 0xFF for every value.
+    """
+    assert 1 <= preamp <= len(self.addrs)
+    if self.bus is None:
+      return []
+    addr = self._addr(preamp)
+    records = []
+    while True:
+      read = i2c_msg.read(addr, _TELEM_HEADER_LEN + _TELEM_DRAIN_MAX * _TELEM_RECORD_LEN)
+      self._read_transfer([i2c_msg.write(addr, [_REG_ADDRS['TELEM_DATA']]), read])
+      block = list(read)
+      count = block[0]
+      if count > _TELEM_DRAIN_MAX:
+        return records # Firmware without TELEM_DATA
+      seq = block[1] | block[2] << 8
+      for i in range(count):
+        rec = block[_TELEM_HEADER_LEN + i * _TELEM_RECORD_LEN:][:_TELEM_RECORD_LEN]
+        records.append({
+          'seq': (seq + i) & 0xFFFF,
+          'HV1_VOLTAGE': rec[0],
+          'HV2_VOLTAGE': rec[1],
+          'HV1_TEMP': rec[2],
+          'HV2_TEMP': rec[3],
+          'GPIO': rec[4],
+        })
+      if count < _TELEM_DRAIN_MAX:
+        return records
+
+  def start_trace(self, preamp: int = 1, trigger: Union[int, None] = None):
+    """ Clear the preamp's command trace and start recording
+
+      Args:
+        preamp:  preamp number from 1
+        trigger: register whose next write stops the trace 32 accesses later,
+                 or None to keep the newest 64 accesses until read
+    """
+    assert 1 <= preamp <= len(self.addrs)
+    addr = self._addr(preamp)
+    with self.batch():
+      if trigger is not None:
+        self._write(addr, _REG_ADDRS['TRACE_TRIG'], [trigger])
+      self._write(addr, _REG_ADDRS['TRACE_CTRL'], [_TRACE_RECORD | (_TRACE_TRIGGER if trigger is not None else 0)])
+
+  def read_trace(self, preamp: int = 1) -> List[Dict[str, int]]:
+    """ Stop the preamp's command trace and read it, oldest first
+
+      Args:
+        preamp: preamp number from 1
+
+      Returns:
+        records with the sequence number 'seq', the start 'time_us', the
+        'reg' accessed, its 'data', 'read' set for reads and the
+        'service_us' the preamp took, see summarize_trace()
+    """
+    assert 1 <= preamp <= len(self.addrs)
+    if self.bus is None:
+      return []
+    addr = self._addr(preamp)
+    records = []
+    while True:
+      read = i2c_msg.read(addr, _TRACE_HEADER_LEN + _TRACE_READ_MAX * _TRACE_RECORD_LEN)
+      self._read_transfer([i2c_msg.write(addr, [_REG_ADDRS['TRACE_DATA']]), read])
+      block = list(read)
+      count = block[0]
+      if count > _TRACE_READ_MAX:
+        return records # Firmware without TRACE_DATA
+      seq = block[1] | block[2] << 8
+      for i in range(count):
+        rec = block[_TRACE_HEADER_LEN + i * _TRACE_RECORD_LEN:][:_TRACE_RECORD_LEN]
+        service = rec[6] | rec[7] << 8
+        records.append({
+          'seq': (seq + i) & 0xFFFF,
+          'time_us': int.from_bytes(bytes(rec[0:4]), 'little'),
+          'reg': rec[4],
+          'data': rec[5],
+          'read': bool(service & _TRACE_READ),
+          'service_us': service & ~_TRACE_READ,
+        })
+      if count < _TRACE_READ_MAX:
+        return records
+
+  def update_firmware(self, image: bytes, install: bool = True) -> bool:
+    """ Send a new firmware image to every preamp to be installed on their next reset
+
+      The image is broadcast once when every preamp supports it, then each
+      preamp is checked. A preamp that didn't stage it is sent it again, up
+      to _I2C_RETRIES times in all. Firmware without FW_CTRL is never staged.
+
+      Args:
+        image:   the firmware .bin, linked to run after the bootloader
+        install: reset the preamps and reassign their addresses once staged
+
+      Returns:
+        True if every preamp staged the image
+    """
+    assert 0 < len(image) <= _FW_MAX_LEN
+    if self.bus is None:
+      return False
+    self.flush()
+    addrs = [_BROADCAST_ADDR] if self.broadcast else list(self.preamps)
+
+    def wait_state(preamps: List[int], state: int, timeout: float) -> List[int]:
+      """ Returns the preamps that didn't reach state """
+      end = time.time() + timeout
+      waiting = list(preamps)
+      while True:
+        waiting = [p for p in waiting if self._read(p, _REG_ADDRS['FW_CTRL']) != state]
+        if not waiting or time.time() >= end:
+          return waiting
+
+    # A chunk rejected by its PEC isn't sent again, so the preamps it was for
+    # fail the CRC check and start over, see _PecBus
+    crc = zlib.crc32(image)
+    todo = list(self.preamps)
+    for _ in range(_I2C_RETRIES):
+      with self._lock:
+        # Nothing is sent to the preamps while they erase, not even the PEC
+        # confirmation, since the erase stalls them for _FW_ERASE_S
+        self.flush()
+        self._transfer([i2c_msg.write(addr, [_REG_ADDRS['FW_CTRL'], _FW_CMD_BEGIN]) for addr in addrs])
+        time.sleep(_FW_ERASE_S)
+      if wait_state(todo, _FW_RECEIVING, _FW_ERASE_TIMEOUT_S):
+        return False
+      with self.batch():
+        for addr in addrs:
+          for start in range(0, len(image), _FW_CHUNK_LEN):
+            self._write(addr, _REG_ADDRS['FW_DATA'], list(image[start:start + _FW_CHUNK_LEN]))
+          self._write(addr, _REG_ADDRS['FW_CRC'], list(crc.to_bytes(4, 'little')))
+          self._write(addr, _REG_ADDRS['FW_CTRL'], [_FW_CMD_COMMIT])
+      todo = wait_state(todo, _FW_STAGED, 0) # Committing finishes before the write is acknowledged
+      if not todo:
+        break
+      addrs = todo
+    else:
+      return False
+    if install:
+      pec = isinstance(self.bus, _PecBus)
+      self.reset_preamps()
+      self.set_i2c_addr()
+      self.wait_boot(self.addrs[0], _BOOT_TIMEOUT_S)
+      if pec:
+        self.enable_pec()
+    return True
+
   def read_version(self, preamp: int = 1):
     """ Read the version of the first preamp if present
 
@@ -256,14 +1637,14 @@ class _Preamps:
         git_hash: The git hash of the build (7-digit abbreviation)
         dirty:    False if the git hash is valid, True otherwise
     """
-    assert 1 <= preamp <= 6
+    assert 1 <= preamp <= len(self.addrs)
     if self.bus is not None:
-      major = self.bus.read_byte_data(preamp*8, _REG_ADDRS['VERSION_MAJOR'])
-      minor = self.bus.read_byte_data(preamp*8, _REG_ADDRS['VERSION_MINOR'])
-      git_hash = self.bus.read_byte_data(preamp*8, _REG_ADDRS['GIT_HASH_27_20']) << 20
-      git_hash |= (self.bus.read_byte_data(preamp*8, _REG_ADDRS['GIT_HASH_19_12']) << 12)
-      git_hash |= (self.bus.read_byte_data(preamp*8, _REG_ADDRS['GIT_HASH_11_04']) << 4)
-      git_hash4_stat = self.bus.read_byte_data(preamp*8, _REG_ADDRS['GIT_HASH_STATUS'])
+      major = self._read(self._addr(preamp), _REG_ADDRS['VERSION_MAJOR'])
+      minor = self._read(self._addr(preamp), _REG_ADDRS['VERSION_MINOR'])
+      git_hash = self._read(self._addr(preamp), _REG_ADDRS['GIT_HASH_27_20']) << 20
+      git_hash |= (self._read(self._addr(preamp), _REG_ADDRS['GIT_HASH_19_12']) << 12)
+      git_hash |= (self._read(self._addr(preamp), _REG_ADDRS['GIT_HASH_11_04']) << 4)
+      git_hash4_stat = self._read(self._addr(preamp), _REG_ADDRS['GIT_HASH_STATUS'])
       git_hash |= (git_hash4_stat >> 4)
       dirty = (git_hash4_stat & 0x01) != 0
       return major, minor, git_hash, dirty
@@ -276,9 +1657,9 @@ class _Preamps:
         pg_12v: True if the 12V rail is good
         pg_9v:  True if the 9V rail is good
     """
-    assert 1 <= preamp <= 6
+    assert 1 <= preamp <= len(self.addrs)
     if self.bus is not None:
-      pgood = self.bus.read_byte_data(preamp*8, _REG_ADDRS['POWER_GOOD'])
+      pgood = self._read(self._addr(preamp), _REG_ADDRS['POWER_GOOD'])
       pg_12v = (pgood & 0x02) != 0
       pg_9v = (pgood & 0x01) != 0
       return pg_12v, pg_9v
@@ -288,19 +1669,19 @@ class _Preamps:
     """ Read the fan status of a single preamp
 
       Args:
-        preamp: preamp number from 1 to 6
+        preamp: preamp number from 1
 
       Returns:
         fan_on:   True if the fan is on, False otherwise
         ovr_tmp:  True if the AmpliPi is over temp, False otherwise
         fan_fail: True if the fan has failed, False otherwise
     """
-    assert 1 <= preamp <= 6
+    assert 1 <= preamp <= len(self.addrs)
     fan_on = False
     ovr_tmp = False
     fan_fail = False
     if self.bus is not None:
-      val = self.bus.read_byte_data(preamp*8, _REG_ADDRS['FAN_STATUS'])
+      val = self._read(self._addr(preamp), _REG_ADDRS['FAN_STATUS'])
       fan_on = (val & 0x8) != 0
       ovr_tmp = (val & 0x2) != 0x2 # Active-low
       fan_fail = (val & 0x1) != 0x1 # Active-low
@@ -327,8 +1708,8 @@ class _Preamps:
 
   def read_temps(self, preamp: int = 1) -> Tuple[Union[float, None], Union[float, None]]:
     if self.bus is not None:
-      temp_adc1 = self.bus.read_byte_data(preamp*8, _REG_ADDRS['HV1_TEMP'])
-      temp_adc2 = self.bus.read_byte_data(preamp*8, _REG_ADDRS['HV2_TEMP'])
+      temp_adc1 = self._read(self._addr(preamp), _REG_ADDRS['HV1_TEMP'])
+      temp_adc2 = self._read(self._addr(preamp), _REG_ADDRS['HV2_TEMP'])
       temp1 = self._adc2temp(temp_adc1)
       temp2 = self._adc2temp(temp_adc2)
       return temp1, temp2
@@ -338,7 +1719,7 @@ class _Preamps:
     """ Read the high-voltage voltages and temps of the first preamp if present
 
       Args:
-        preamp: preamp number from 1 to 6
+        preamp: preamp number from 1
 
       Returns:
         hv1:  Voltage of the HV1 rail
@@ -346,27 +1727,52 @@ class _Preamps:
         tmp1: Temperature of HV1 in degC
         tmp2: Temperature of HV2 in degC
     """
-    assert 1 <= preamp <= 6
+    assert 1 <= preamp <= len(self.addrs)
     if self.bus is not None:
       adc_to_volts = (100 + 4.7) / 4.7 * 3.3 / 255
-      hv1_adc = self.bus.read_byte_data(preamp*8, _REG_ADDRS['HV1_VOLTAGE'])
-      hv2_adc = self.bus.read_byte_data(preamp*8, _REG_ADDRS['HV2_VOLTAGE'])
+      hv1_adc = self._read(self._addr(preamp), _REG_ADDRS['HV1_VOLTAGE'])
+      hv2_adc = self._read(self._addr(preamp), _REG_ADDRS['HV2_VOLTAGE'])
       hv1 = hv1_adc * adc_to_volts
       hv2 = hv2_adc * adc_to_volts
       return hv1, hv2
     return None, None
 
   def force_fans(self, preamp: int = 1, force: bool = True):
-    assert 1 <= preamp <= 6
+    assert 1 <= preamp <= len(self.addrs)
     if self.bus is not None:
-      self.bus.write_byte_data(preamp*8, _REG_ADDRS['FAN_STATUS'],
-                               1 if force is True else 0)
+      self._write(self._addr(preamp), _REG_ADDRS['FAN_STATUS'], [1 if force is True else 0])
+
+  def set_fan_policy(self, preamp: int = 1, mode: int = _FAN_MODE_HYSTERESIS,
+                     on_temp: int = 45, off_temp: int = 40):
+    """ Set how the preamp runs the fan from its heatsink temperatures
+
+      The preamp samples the temperatures and drives the fan itself,
+      so they don't need to be polled to keep it cool. It starts in
+      _FAN_MODE_HOST and only runs the fan itself once this is called.
+
+      Args:
+        preamp:   preamp number from 1
+        mode:     _FAN_MODE_HOST, _FAN_MODE_HYSTERESIS or _FAN_MODE_PWM
+        on_temp:  degC the fan is fully on at
+        off_temp: degC the fan is off at
+    """
+    assert 1 <= preamp <= len(self.addrs)
+    assert mode in (_FAN_MODE_HOST, _FAN_MODE_HYSTERESIS, _FAN_MODE_PWM)
+    assert 0 <= off_temp <= on_temp <= 127
+    self._write(self._addr(preamp), _REG_ADDRS['FAN_MODE'], [mode, on_temp, off_temp])
+
+  def read_fan_duty(self, preamp: int = 1) -> Union[int, None]:
+    """ Read the percent of the time the fan is on, as set by the preamp """
+    assert 1 <= preamp <= len(self.addrs)
+    if self.bus is not None:
+      return self._read(self._addr(preamp), _REG_ADDRS['FAN_DUTY'])
+    return None
 
   def read_leds(self, preamp: int = 1):
     """ Read the state of the front-panel LEDs
 
       Args:
-        preamp: preamp number from 1 to 6
+        preamp: preamp number from 1
 
       Returns:
         leds:   A 1-byte number with each bit corresponding to an LED
@@ -374,9 +1780,9 @@ class _Preamps:
                 Red => Bit 1
                 Zone[1-6] => Bit[2-7]
     """
-    assert 1 <= preamp <= 6
+    assert 1 <= preamp <= len(self.addrs)
     if self.bus is not None:
-      leds = self.bus.read_byte_data(preamp*8, _REG_ADDRS['LED_OVERRIDE'])
+      leds = self._read(self._addr(preamp), _REG_ADDRS['LED_OVERRIDE'])
       return leds
     return None
 
@@ -384,9 +1790,9 @@ class _Preamps:
     """ Print the state of the front-panel LEDs
 
       Args:
-        preamp: preamp number from 1 to 6
+        preamp: preamp number from 1
     """
-    assert 1 <= preamp <= 6
+    assert 1 <= preamp <= len(self.addrs)
     led = self.read_leds(preamp)
     if led is not None:
       green = led & 0x01
@@ -402,22 +1808,46 @@ class _Preamps:
     """ Override the LED board's LEDs
 
       Args:
-        preamp: preamp number from 1 to 6
+        preamp: preamp number from 1
         leds:   A 1-byte number with each bit corresponding to an LED
                 Green => Bit 0
                 Red => Bit 1
                 Zone[1-6] => Bit[2-7]
     """
-    assert 1 <= preamp <= 6
+    assert 1 <= preamp <= len(self.addrs)
     assert 0 <= leds <= 255
     if self.bus is not None:
-      self.bus.write_byte_data(preamp*8, _REG_ADDRS['LED_OVERRIDE'], leds)
+      self._write(self._addr(preamp), _REG_ADDRS['LED_OVERRIDE'], [leds])
+
+  def set_led_pattern(self, pattern: int, period_ms: int = 1000, preamp: Union[int, None] = None):
+    """ Blink the front panel LEDs from the preamps, with no further writes needed
+
+      Args:
+        pattern:   one of the LED_PATTERN_* values, LED_PATTERN_STATUS stops blinking
+        period_ms: time for one on and off cycle, from 20 to 2550 ms
+        preamp:    preamp number from 1, or None to blink every preamp in step
+    """
+    assert LED_PATTERN_STATUS <= pattern <= LED_PATTERN_ALTERNATE
+    assert 2 * _LED_PERIOD_UNIT_MS <= period_ms <= 255 * _LED_PERIOD_UNIT_MS
+    if preamp is None:
+      addrs = [_BROADCAST_ADDR] if self.broadcast else list(self.preamps)
+    else:
+      assert 1 <= preamp <= len(self.addrs)
+      addrs = [self._addr(preamp)]
+    with self.batch():
+      for addr in addrs:
+        self._write(addr, _REG_ADDRS['LED_PERIOD'], [period_ms // _LED_PERIOD_UNIT_MS])
+        self._write(addr, _REG_ADDRS['LED_PATTERN'], [pattern])
+
+  def identify(self, preamp: Union[int, None] = None, on: bool = True):
+    """ Blink every LED of a preamp, or of the whole chain, to find it in a rack """
+    self.set_led_pattern(LED_PATTERN_IDENTIFY if on else LED_PATTERN_STATUS, preamp=preamp)
 
   def print(self):
     for preamp_addr in self.preamps.keys():
-      preamp = int(preamp_addr / 8)
+      preamp = self._number(preamp_addr)
       print('preamp {}:'.format(preamp))
-      src_types = self.preamps[0x08][_REG_ADDRS['SRC_AD']]
+      src_types = self.preamps[self.addrs[0]][_REG_ADDRS['SRC_AD']]
       src_cfg = []
       for src in range(4):
         src_type = _SRC_TYPES.get((src_types >> src) & 0b01)
@@ -428,10 +1858,10 @@ class _Preamps:
 
   def print_zone_state(self, zone):
     assert zone >= 0
-    preamp = (int(zone / 6) + 1) * 8
+    preamp = self._addr(zone // 6 + 1)
     zone = zone % 6
     regs = self.preamps[preamp]
-    src_types = self.preamps[0x08][_REG_ADDRS['SRC_AD']]
+    src_types = self.preamps[self.addrs[0]][_REG_ADDRS['SRC_AD']]
     src = ((regs[_REG_ADDRS['CH456_SRC']] << 8) | regs[_REG_ADDRS['CH123_SRC']] >> 2 * zone) & 0b11
     src_type = _SRC_TYPES.get((src_types >> src) & 0b01)
     vol = -regs[_REG_ADDRS['CH1_ATTEN'] + zone]
@@ -450,6 +1880,13 @@ class Mock:
   def __init__(self):
     pass
 
+  def batch(self):
+    """ Group several updates, nothing to send for the mock """
+    return nullcontext()
+
+  def flush(self):
+    """ Send held updates, nothing to send for the mock """
+
   def update_sources(self, digital):
     """ modify all of the 4 system sources
 
@@ -527,10 +1964,24 @@ class Rpi:
       This acts as an Amplipi Runtime, expected to be executed on a raspberrypi
   """
 
-  def __init__(self):
-    self._bus = _Preamps()
+  def __init__(self, write_behind: float = _WRITE_BEHIND_S, buses: Sequence[int] = (1,),
+               stride: int = _ADDR_STRIDE, units_per_bus: Optional[int] = None, pec: bool = True):
+    """ Args:
+          write_behind: seconds zone updates are held to coalesce, see _Preamps.__init__()
+          buses, stride, units_per_bus: how the preamps are spread over the I2C buses, see _Preamps.__init__()
+          pec: confirm every write with the preamps' PEC checks where the firmware supports it
+    """
+    self._bus = _Preamps(write_behind=write_behind, buses=buses, stride=stride, units_per_bus=units_per_bus, pec=pec)
     self._all_muted = True # preamps start up in muted/standby state
 
+  def batch(self):
+    """ Send the register writes of several updates together, see _Preamps.batch() """
+    return self._bus.batch()
+
+  def flush(self):
+    """ Send every held zone update now, before anything that depends on it reaching the preamps """
+    self._bus.flush()
+
   def update_zone_mutes(self, zone, mutes):
     """ Update the mute level to all of the zones
 
@@ -550,22 +2001,21 @@ class Rpi:
       assert type(mutes[preamp * 6 + z]) == bool
       if mutes[preamp * 6 + z]:
         mute_cfg = mute_cfg | (0x01 << z)
-    self._bus.write_byte_data(_DEV_ADDRS[preamp], _REG_ADDRS['MUTE'], mute_cfg)
+    with self._bus.batch(): # The mute and standby writes go out together
+      self._bus.write_byte_data(self._bus.addrs[preamp], _REG_ADDRS['MUTE'], mute_cfg)
 
-    # Audio power needs to be on each box when subsequent boxes are playing audio
-    all_muted = False not in mutes
-    if self._all_muted != all_muted:
-      if all_muted:
-        for p in self._bus.preamps.keys():
+      # Audio power needs to be on each box when subsequent boxes are playing audio
+      all_muted = False not in mutes
+      if self._all_muted != all_muted:
+        if all_muted:
           # Standby all preamps
-          self._bus.write_byte_data(p, _REG_ADDRS['STANDBY'], 0x00)
-        time.sleep(0.1)
-      else:
-        for p in self._bus.preamps.keys():
-          # Unstandby all preamps
-          self._bus.write_byte_data(p, _REG_ADDRS['STANDBY'], 0x3F)
-        time.sleep(0.3)
-      self._all_muted = all_muted
+          self._bus.write_all_byte_data(_REG_ADDRS['STANDBY'], 0x00)
+          self._bus.wait_power_state(_POWER_STANDBY, 0.1)
+        else:
+          # Unstandby all preamps, they power up together
+          self._bus.write_all_byte_data(_REG_ADDRS['STANDBY'], 0x3F)
+          self._bus.wait_power_state(_POWER_READY, 0.3)
+        self._all_muted = all_muted
     return True
 
   def update_zone_sources(self, zone, sources):
@@ -592,10 +2042,10 @@ class Rpi:
         source_cfg123 = source_cfg123 | (src << (z*2))
       else:
         source_cfg456 = source_cfg456 | (src << ((z-3)*2))
-    self._bus.write_byte_data(_DEV_ADDRS[preamp], _REG_ADDRS['CH123_SRC'], source_cfg123)
-    self._bus.write_byte_data(_DEV_ADDRS[preamp], _REG_ADDRS['CH456_SRC'], source_cfg456)
+    # CH123_SRC and CH456_SRC are consecutive so both are sent in one transaction
+    self._bus.write_block_data(self._bus.addrs[preamp], _REG_ADDRS['CH123_SRC'], [source_cfg123, source_cfg456])
 
-    # TODO: Add error checking on successful write
+    # With PEC the preamp confirms the write, see _PecBus
     return True
 
   def update_zone_vol(self, zone, vol):
@@ -610,16 +2060,16 @@ class Rpi:
     """
     preamp = int(zone / 6) # int(x/y) does the same thing as (x // y)
     assert zone >= 0
-    assert preamp < 15
+    assert preamp < len(self._bus.addrs)
     assert vol <= 0 and vol >= -79
 
     chan = zone - (preamp * 6)
     hvol = abs(vol)
 
     chan_reg = _REG_ADDRS['CH1_ATTEN'] + chan
-    self._bus.write_byte_data(_DEV_ADDRS[preamp], chan_reg, hvol)
+    self._bus.write_byte_data(self._bus.addrs[preamp], chan_reg, hvol)
 
-    # TODO: Add error checking on successful write
+    # With PEC the preamp confirms the write, see _PecBus
     return True
 
   def update_sources(self, digital):
@@ -646,15 +2096,15 @@ class Rpi:
         output = output | (0x01 << i)
 
     # Send out the updated source information to the appropriate preamp
-    self._bus.write_byte_data(_DEV_ADDRS[0], _REG_ADDRS['SRC_AD'], output)
+    self._bus.write_byte_data(self._bus.addrs[0], _REG_ADDRS['SRC_AD'], output)
 
     # TODO: update this to allow for different preamps on the bus
-    # TODO: Add error checking on successful write
+    # With PEC the preamp confirms the write, see _PecBus
     return True
 
   def exists(self, zone):
     if self._bus:
       preamp = zone // 6
-      return preamp in self._bus.preamps
+      return preamp < len(self._bus.addrs) and self._bus.addrs[preamp] in self._bus.preamps
     else:
       return True
@@ -0,0 +1,156 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "async_i2c.h"
+
+const char* i2cResultStr(I2CResult result) {
+  switch (result) {
+    case I2CResult::pending:
+      return " BUSY";
+    case I2CResult::ok:
+      return " PASS";
+    case I2CResult::nack:
+      return " NACK";
+    case I2CResult::timeout:
+      return "TMOUT";
+  }
+  return "";
+}
+
+void AsyncI2C::begin() {
+  cwgr_ = twi_->TWI_CWGR;
+  twi_->TWI_IDR = 0xFFFFFFFF;  // Polled, no interrupts
+}
+
+bool AsyncI2C::write(uint8_t addr, const uint8_t* data, uint8_t len,
+                     uint32_t timeout_us) {
+  if (busy() || len == 0 || len > MAX_LEN) {
+    return false;
+  }
+  for (uint8_t i = 0; i < len; i++) {
+    buf_[i] = data[i];
+  }
+  len_ = len;
+  idx_ = 1;
+
+  twi_->TWI_MMR = TWI_MMR_DADR(addr);
+  twi_->TWI_THR = buf_[0];  // Writing the first byte starts the transaction
+  state_ = len == 1 ? State::stopping : State::writing;
+  if (len == 1) {
+    twi_->TWI_CR = TWI_CR_STOP;
+  }
+  return start(timeout_us);
+}
+
+bool AsyncI2C::writeReg(uint8_t addr, uint8_t reg, uint8_t val,
+                        uint32_t timeout_us) {
+  uint8_t data[] = {reg, val};
+  return write(addr, data, sizeof(data), timeout_us);
+}
+
+bool AsyncI2C::read(uint8_t addr, int16_t reg, uint8_t len,
+                    uint32_t timeout_us) {
+  if (busy() || len == 0 || len > MAX_LEN) {
+    return false;
+  }
+  len_ = len;
+  idx_ = 0;
+
+  if (reg >= 0) {
+    twi_->TWI_MMR =
+        TWI_MMR_DADR(addr) | TWI_MMR_MREAD | TWI_MMR_IADRSZ_1_BYTE;
+    twi_->TWI_IADR = TWI_IADR_IADR(reg);
+  } else {
+    twi_->TWI_MMR = TWI_MMR_DADR(addr) | TWI_MMR_MREAD;
+  }
+  // A single byte read has to request the stop along with the start
+  twi_->TWI_CR = len == 1 ? TWI_CR_START | TWI_CR_STOP : TWI_CR_START;
+  state_       = State::reading;
+  return start(timeout_us);
+}
+
+bool AsyncI2C::start(uint32_t timeout_us) {
+  result_     = I2CResult::pending;
+  start_us_   = micros();
+  timeout_us_ = timeout_us;
+  return true;
+}
+
+I2CResult AsyncI2C::poll() {
+  if (!busy()) {
+    return result_;
+  }
+
+  // Reading the status clears NACK, so it is only read once per call
+  uint32_t sr = twi_->TWI_SR;
+  if (sr & (TWI_SR_NACK | TWI_SR_ARBLST)) {
+    finish(I2CResult::nack);
+    return result_;
+  }
+
+  switch (state_) {
+    case State::writing:
+      if (sr & TWI_SR_TXRDY) {
+        if (idx_ < len_) {
+          twi_->TWI_THR = buf_[idx_++];
+        } else {
+          twi_->TWI_CR = TWI_CR_STOP;
+          state_       = State::stopping;
+        }
+      }
+      break;
+    case State::reading:
+      if (sr & TWI_SR_RXRDY) {
+        buf_[idx_++] = twi_->TWI_RHR;
+        if (idx_ == len_ - 1) {
+          twi_->TWI_CR = TWI_CR_STOP;  // Sent after the next byte
+        } else if (idx_ == len_) {
+          state_ = State::stopping;
+        }
+      }
+      break;
+    case State::stopping:
+      if (sr & TWI_SR_TXCOMP) {
+        finish(I2CResult::ok);
+        return result_;
+      }
+      break;
+    case State::idle:
+      break;
+  }
+
+  if (busy() && micros() - start_us_ > timeout_us_) {
+    reset();
+    finish(I2CResult::timeout);
+  }
+  return result_;
+}
+
+void AsyncI2C::finish(I2CResult result) {
+  result_ = result;
+  state_  = State::idle;
+}
+
+// Puts the peripheral back in master mode after a transaction got stuck
+void AsyncI2C::reset() {
+  twi_->TWI_CR   = TWI_CR_SWRST;
+  twi_->TWI_RHR;  // Discard anything left over
+  twi_->TWI_CR   = TWI_CR_SVDIS | TWI_CR_MSDIS;
+  twi_->TWI_CWGR = cwgr_;
+  twi_->TWI_CR   = TWI_CR_MSEN;
+}
@@ -0,0 +1,98 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * Non-blocking I2C master transactions with timeouts
+ *
+ * Drives a SAM3X TWI peripheral directly, one transaction at a time. A
+ * transaction is started and then advanced by calling poll() from loop(),
+ * which never waits on the bus. A device that doesn't answer fails with
+ * NACK, and a bus that stops moving fails with TIMEOUT and resets the
+ * peripheral, so one bad board can't hang the tester.
+ */
+
+#ifndef ASYNC_I2C_H_
+#define ASYNC_I2C_H_
+
+#include <Arduino.h>
+
+enum class I2CResult : uint8_t
+{
+  pending,  // Still running
+  ok,
+  nack,     // The device didn't acknowledge its address or a byte
+  timeout,  // The transaction didn't finish in time
+};
+
+// Short text for a result, at most 5 characters to fit a drawTest() column
+const char* i2cResultStr(I2CResult result);
+
+class AsyncI2C {
+ public:
+  static constexpr uint8_t  MAX_LEN            = 8;
+  static constexpr uint32_t DEFAULT_TIMEOUT_US = 2000;
+
+  explicit AsyncI2C(Twi* twi) : twi_(twi) {}
+
+  // The peripheral must already be set up as a master, e.g. by Wire.begin()
+  void begin();
+
+  // Start a transaction, returns false if one is still running or len is
+  // out of range. Addresses are 7-bit right-aligned.
+  bool write(uint8_t addr, const uint8_t* data, uint8_t len,
+             uint32_t timeout_us = DEFAULT_TIMEOUT_US);
+  bool writeReg(uint8_t addr, uint8_t reg, uint8_t val,
+                uint32_t timeout_us = DEFAULT_TIMEOUT_US);
+  // Reads len bytes, after writing reg with a repeated start if reg >= 0
+  bool read(uint8_t addr, int16_t reg, uint8_t len,
+            uint32_t timeout_us = DEFAULT_TIMEOUT_US);
+
+  // Advance the current transaction. Returns its result, which stays
+  // available until the next transaction is started.
+  I2CResult poll();
+
+  bool busy() const { return state_ != State::idle; }
+  I2CResult result() const { return result_; }
+
+  // Bytes received by the last read
+  const uint8_t* data() const { return buf_; }
+
+ private:
+  enum class State : uint8_t
+  {
+    idle,
+    writing,
+    reading,
+    stopping,  // Waiting for the stop condition to finish
+  };
+
+  bool start(uint32_t timeout_us);
+  void finish(I2CResult result);
+  void reset();
+
+  Twi*      twi_;
+  uint32_t  cwgr_       = 0;  // Clock setting, restored after a reset
+  State     state_      = State::idle;
+  I2CResult result_     = I2CResult::ok;
+  uint8_t   buf_[MAX_LEN];
+  uint8_t   len_        = 0;
+  uint8_t   idx_        = 0;
+  uint32_t  start_us_   = 0;
+  uint32_t  timeout_us_ = 0;
+};
+
+#endif /* ASYNC_I2C_H_ */
@@ -0,0 +1,146 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * Drivers for the power board's I2C devices
+ *
+ * Each driver remembers what it last wrote to the device's configuration
+ * registers and doesn't start a write that wouldn't change anything. A
+ * cached value is only kept once its write succeeded, and every cached
+ * value is forgotten when a transaction fails. A board that is swapped
+ * without a failed transaction keeps the old cache, so the sketch calls
+ * invalidate() when a new board is inserted. Reads of a register use a
+ * single repeated-start transaction.
+ */
+
+#ifndef I2C_DEVICES_H_
+#define I2C_DEVICES_H_
+
+#include "async_i2c.h"
+
+// Slave addresses are 7-bit right-aligned
+enum SlaveAddr : uint8_t
+{
+  due  = 0x0F,
+  gpio = 0x21,
+  dpot = 0x2F,
+  adc  = 0x64,
+};
+
+// Base of the drivers: one cached byte per configuration register
+template <uint8_t NUM_REGS>
+class CachedDevice {
+ public:
+  explicit CachedDevice(AsyncI2C& i2c) : i2c_(i2c) { invalidate(); }
+
+  // Call with the result of every transaction the driver started
+  void finish(I2CResult result) {
+    if (result == I2CResult::ok && pending_ >= 0) {
+      cache_[pending_] = pending_val_;
+    } else if (result != I2CResult::ok) {
+      invalidate();
+    }
+    pending_ = -1;
+  }
+
+  // Forget the cached registers, so the next writes go to the device
+  void invalidate() {
+    for (uint8_t i = 0; i < NUM_REGS; i++) {
+      cache_[i] = -1;
+    }
+  }
+
+ protected:
+  bool cached(uint8_t idx, uint8_t val) const { return cache_[idx] == val; }
+
+  void setPending(int8_t idx, uint8_t val) {
+    pending_     = idx;
+    pending_val_ = val;
+  }
+
+  AsyncI2C& i2c_;
+
+ private:
+  int16_t cache_[NUM_REGS];  // -1 if unknown
+  int8_t  pending_     = -1;  // Cache index being written
+  uint8_t pending_val_ = 0;
+};
+
+// 8-channel GPIO expander
+template <SlaveAddr ADDR>
+class Mcp23008 : public CachedDevice<2> {
+ public:
+  static constexpr uint8_t REG_IODIR = 0x00;
+  static constexpr uint8_t REG_GPIO  = 0x09;
+  static constexpr uint8_t REG_OLAT  = 0x0A;
+
+  explicit Mcp23008(AsyncI2C& i2c) : CachedDevice(i2c) {}
+
+  // Start a write of IODIR or OLAT. Returns false if nothing was started,
+  // either because the device already holds val or the bus is busy.
+  bool setDir(uint8_t dir) { return writeCached(IODIR, REG_IODIR, dir); }
+  bool setOutputs(uint8_t olat) { return writeCached(OLAT, REG_OLAT, olat); }
+
+  bool readGpio() {
+    setPending(-1, 0);
+    return i2c_.read(ADDR, REG_GPIO, 1);
+  }
+
+  // Port value read by readGpio(), valid until the next transaction
+  uint8_t gpio() const { return i2c_.data()[0]; }
+
+ private:
+  enum : uint8_t { IODIR, OLAT };
+
+  bool writeCached(uint8_t idx, uint8_t reg, uint8_t val) {
+    if (cached(idx, val) || !i2c_.writeReg(ADDR, reg, val)) {
+      return false;
+    }
+    setPending(idx, val);
+    return true;
+  }
+};
+
+// 4-channel 8-bit ADC
+template <SlaveAddr ADDR>
+class Max11601 : public CachedDevice<1> {
+ public:
+  static constexpr uint8_t NUM_CH = 4;
+
+  explicit Max11601(AsyncI2C& i2c) : CachedDevice(i2c) {}
+
+  // Start a write of the configuration byte. Returns false if nothing was
+  // started, either because the device already holds it or the bus is busy.
+  bool configure(uint8_t config) {
+    if (cached(0, config) || !i2c_.write(ADDR, &config, 1)) {
+      return false;
+    }
+    setPending(0, config);
+    return true;
+  }
+
+  // Each read converts and returns all channels the configuration scans
+  bool readChannels() {
+    setPending(-1, 0);
+    return i2c_.read(ADDR, -1, NUM_CH);
+  }
+
+  // Channel read by readChannels(), valid until the next transaction
+  uint8_t channel(uint8_t ch) const { return i2c_.data()[ch]; }
+};
+
+#endif /* I2C_DEVICES_H_ */
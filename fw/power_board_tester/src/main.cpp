@@ -24,6 +24,8 @@
  * The 4 power rails are checked:
  *    +5VD, +12VD
  *    +5VA, +9VA
+ * Each rail is sampled at 20 kHz in the background, checking its min/max
+ * against limits and its RMS ripple.
  * All I2C devices are verified:
  *    MAX11601 (0x64): 4-channel ADC measures HV1/2 and up to 2 thermistors
  *    MCP23008 (0x21): 8-channel GPIO expander. Currently only GP4/5/7 are used
@@ -33,6 +35,12 @@
  *
  * I2C Bus connector for the LED board is tested as a loopback.
  *
+ * By default every test runs continuously and the results are only drawn
+ * on the LCD. Sending 'p' over SerialUSB selects production mode, where
+ * each inserted board is tested once and a CSV record of its measurements
+ * and test times is sent back for the host to log. 'b' goes back to the
+ * continuous bench mode.
+ *
  * Hardware required:
  *    Arduino Due
  *    +24V power supply
@@ -95,6 +103,10 @@
 #include <Arduino.h>
 #include <Wire.h>
 
+#include "async_i2c.h"
+#include "i2c_devices.h"
+#include "rail_capture.h"
+
 #define TFT_CS       10
 #define TFT_DC       11
 #define TFT_SPI_FREQ (50 * 1000000)  // Default = 24 MHz
@@ -106,20 +118,33 @@ Adafruit_ILI9341 tft = Adafruit_ILI9341(TFT_CS, TFT_DC);
 #define TFT_FONT_HEIGHT 8
 #define TEXT_MARGIN     4
 
+// Time between test samples. Only changed results are redrawn, so a sample
+// costs a few ms of SPI at most.
+#define TEST_PERIOD_MS 100
+
+// Largest RMS ripple allowed on a rail
+#define RIPPLE_MAX_MV 50
+
+// Production mode sees a board as inserted while any of the rails A0-A4 is
+// above PRESENT_VOLTS, and tests it once it has stayed there SETTLE_MS
+#define PRESENT_VOLTS 1.0
+#define SETTLE_MS     250
+
 static constexpr uint8_t MAX_DPOT_VAL = 0x7F;
 static constexpr uint8_t I2C_TEST_VAL = 0xA4;
 
-static constexpr uint8_t MCP23008_REG_IODIR = 0x00;
-static constexpr uint8_t MCP23008_REG_OLAT  = 0x0A;
-
-enum SlaveAddr : uint8_t
+// What the tester is doing with the board
+enum class Station : uint8_t
 {
-  due  = 0x0F,
-  gpio = 0x21,
-  dpot = 0x2F,
-  adc  = 0x64,
+  bench,     // Run every test continuously, results only on the LCD
+  waiting,   // Production mode, no board inserted
+  settling,  // Board inserted, waiting for its rails to settle
+  testing,   // One capture and I2C run in progress
+  removing,  // Record sent, waiting for the board to be removed
 };
 
+Station station_ = Station::bench;
+
 // I2C1 slave RX callback
 bool i2c_loopback_ok_ = false;
 void i2cSlaveRx(int rxBufLen) {
@@ -129,8 +154,11 @@ void i2cSlaveRx(int rxBufLen) {
   // Verify the received byte is the test byte that was sent
   i2c_loopback_ok_ = rx == I2C_TEST_VAL;
 
-  SerialUSB.print("Got I2C byte 0x");
-  SerialUSB.println(rx, HEX);
+  // Production mode only sends records
+  if (station_ == Station::bench) {
+    SerialUSB.print("Got I2C byte 0x");
+    SerialUSB.println(rx, HEX);
+  }
 }
 
 constexpr float adcToVolts(uint32_t adc_val, uint8_t bits, float v_ref,
@@ -140,6 +168,47 @@ constexpr float adcToVolts(uint32_t adc_val, uint8_t bits, float v_ref,
   return scale * adc_val;
 }
 
+// Rails A0-A4 are measured through a 33k/100k divider, A5 through 100k/100k
+RailCapture rails_;
+
+float railVolts(uint8_t rail, uint16_t adc_val) {
+  return rail == 5 ? adcToVolts(adc_val, 12, 3.3, 100, 100)
+                   : adcToVolts(adc_val, 12, 3.3, 33, 100);
+}
+
+// Formats the mean of a rail, which passes if every sample of the last
+// capture was within [lo, hi] so a dropout or spike fails it too
+bool railTest(uint8_t rail, float lo, float hi, char* str) {
+  const RailStats& s = rails_.stats(rail);
+  sprintf(str, "%5.2fV", railVolts(rail, s.mean));
+  return railVolts(rail, s.min) > lo && railVolts(rail, s.max) < hi;
+}
+
+// Formats the RMS ripple of a rail in mV, which passes below RIPPLE_MAX_MV
+bool rippleTest(uint8_t rail, char* str) {
+  uint32_t mv =
+      (uint32_t)(1000 * railVolts(rail, rails_.stats(rail).rms) + 0.5);
+  mv = mv > 9999 ? 9999 : mv;
+  sprintf(str, "%4lumV", (unsigned long)mv);
+  return rails_.stats(rail).max > 0 && mv < RIPPLE_MAX_MV;
+}
+
+// One line per capture: min/max/mean/rms of each rail in mV
+void printRailStats() {
+  SerialUSB.print("Rails min/max/mean/rms mV:");
+  for (uint8_t i = 0; i < RailCapture::NUM_RAILS; i++) {
+    const RailStats& s = rails_.stats(i);
+    char strbuf[32];
+    sprintf(strbuf, " A%u %u/%u/%u/%u", i,
+            (unsigned)(1000 * railVolts(i, s.min)),
+            (unsigned)(1000 * railVolts(i, s.max)),
+            (unsigned)(1000 * railVolts(i, s.mean)),
+            (unsigned)(1000 * railVolts(i, s.rms)));
+    SerialUSB.print(strbuf);
+  }
+  SerialUSB.println();
+}
+
 float adcToTemp(uint8_t ntc_adc) {
   if (ntc_adc == 0) {
     // 0 causes divide-by-zero
@@ -166,62 +235,196 @@ uint16_t rgb565(float red, float green, float blue) {
   return (r5 << 11) | (g6 << 5) | b5;
 }
 
-bool readI2CADC(uint8_t* ch0, uint8_t* ch1, uint8_t* ch2, uint8_t* ch3) {
-  Wire.beginTransmission(SlaveAddr::adc);
-  Wire.write((uint8_t)0b00000111);  // Send configuration byte, set CS=0x2
-  Wire.endTransmission();
-
-  Wire.requestFrom(SlaveAddr::adc, 4);
-  if (Wire.available() >= 4) {
-    *ch0 = (uint8_t)Wire.read();
-    *ch1 = (uint8_t)Wire.read();
-    *ch2 = (uint8_t)Wire.read();
-    *ch3 = (uint8_t)Wire.read();
-    return true;
-  } else {
-    *ch0 = 0;
-    *ch1 = 0;
-    *ch2 = 0;
-    *ch3 = 0;
-    return false;
+// The power board I2C tests run one transaction at a time in the background,
+// each step starting when the previous one finishes. A step that fails skips
+// the steps that depend on it so a dead board fails within a few timeouts.
+// Configuration writes that wouldn't change the device are skipped, so a
+// passing board only costs the loopback and the two reads per run.
+enum class I2CStep : uint8_t
+{
+  loopback,    // Write the test byte to the Due's own slave through J2/J3
+  adc_config,  // MAX11601 configuration byte, scan AIN0-3
+  adc_read,
+  gpio_dir,    // MCP23008 GP7 (FAN_ON) and GP1 (EN_12V) as outputs
+  gpio_olat,
+  gpio_read,   // PG_12V = GP3, FAN_FAIL = GP4, OVR_TMP = GP5
+  done,
+};
+
+struct I2CTests {
+  I2CResult loopback = I2CResult::pending;
+  I2CResult adc      = I2CResult::pending;
+  I2CResult gpio     = I2CResult::pending;
+  uint8_t   adc_vals[4] = {};  // HV1, HV2, NTC1, NTC2
+  uint8_t   gpio_val    = 0;
+
+  // Time spent on each device's transactions
+  uint32_t loopback_us = 0;
+  uint32_t adc_us      = 0;
+  uint32_t gpio_us     = 0;
+};
+
+AsyncI2C                  i2c(WIRE_INTERFACE);
+Max11601<SlaveAddr::adc>  adc_(i2c);
+Mcp23008<SlaveAddr::gpio> gpio_(i2c);
+I2CTests                  i2c_tests_;
+I2CStep                   i2c_step_ = I2CStep::done;
+uint32_t                  i2c_step_start_us_ = 0;
+
+// A newly inserted board powers up unconfigured, so nothing cached applies to it
+void forgetBoard() {
+  adc_.invalidate();
+  gpio_.invalidate();
+}
+
+// Returns false if the step had nothing to do
+bool startI2CStep(I2CStep step, bool fan_on, bool en_12v) {
+  switch (step) {
+    case I2CStep::loopback:
+      i2c_loopback_ok_ = false;
+      return i2c.write(SlaveAddr::due, &I2C_TEST_VAL, 1);
+    case I2CStep::adc_config:
+      return adc_.configure(0b00000111);  // Configuration byte, set CS=0x2
+    case I2CStep::adc_read:
+      return adc_.readChannels();
+    case I2CStep::gpio_dir:
+      return gpio_.setDir(0x7D);
+    case I2CStep::gpio_olat: {
+      uint8_t val = fan_on ? 0x80 : 0x00;
+      val         = en_12v ? 0x02 | val : val;
+      return gpio_.setOutputs(val);
+    }
+    case I2CStep::gpio_read:
+      return gpio_.readGpio();
+    case I2CStep::done:
+      break;
+  }
+  return false;
+}
+
+// Records the result of a step and returns the next step to run
+I2CStep finishI2CStep(I2CStep step, I2CResult result) {
+  bool ok = result == I2CResult::ok;
+  switch (step) {
+    case I2CStep::loopback:
+      i2c_tests_.loopback = result;
+      return I2CStep::adc_config;
+    case I2CStep::adc_config:
+      adc_.finish(result);
+      i2c_tests_.adc = result;
+      return ok ? I2CStep::adc_read : I2CStep::gpio_dir;
+    case I2CStep::adc_read:
+      adc_.finish(result);
+      i2c_tests_.adc = result;
+      for (uint8_t i = 0; i < Max11601<SlaveAddr::adc>::NUM_CH; i++) {
+        i2c_tests_.adc_vals[i] = ok ? adc_.channel(i) : 0;
+      }
+      return I2CStep::gpio_dir;
+    case I2CStep::gpio_dir:
+    case I2CStep::gpio_olat:
+      gpio_.finish(result);
+      i2c_tests_.gpio = result;
+      return ok ? (I2CStep)((uint8_t)step + 1) : I2CStep::done;
+    case I2CStep::gpio_read:
+      gpio_.finish(result);
+      i2c_tests_.gpio     = result;
+      i2c_tests_.gpio_val = ok ? gpio_.gpio() : 0;
+      return I2CStep::done;
+    case I2CStep::done:
+      break;
   }
+  return I2CStep::done;
 }
 
-void writeGPIO(bool fan_on, bool en_12v) {
-  // FAN_ON = GP7
-  // EN_12V = GP1
-  Wire.beginTransmission(SlaveAddr::gpio);
-  Wire.write(MCP23008_REG_IODIR);
-  Wire.write((uint8_t)0x7D);  // Set GP7 and GP1 as outputs
-  Wire.endTransmission();
-
-  uint8_t val = fan_on ? 0x80 : 0x00;
-  val         = en_12v ? 0x02 | val : val;
-  Wire.beginTransmission(SlaveAddr::gpio);
-  Wire.write(MCP23008_REG_OLAT);
-  Wire.write(val);
-  Wire.endTransmission();
+// Adds the time a finished step took to the device it tested
+void timeI2CStep(I2CStep step, uint32_t us) {
+  switch (step) {
+    case I2CStep::loopback:
+      i2c_tests_.loopback_us += us;
+      break;
+    case I2CStep::adc_config:
+    case I2CStep::adc_read:
+      i2c_tests_.adc_us += us;
+      break;
+    case I2CStep::gpio_dir:
+    case I2CStep::gpio_olat:
+    case I2CStep::gpio_read:
+      i2c_tests_.gpio_us += us;
+      break;
+    case I2CStep::done:
+      break;
+  }
 }
 
-// For now just returns PG_12V's status
-bool readGPIO() {
-  // OVR_TMP  = GP5
-  // FAN_FAIL = GP4
-  // PG_12V   = GP3
-  Wire.beginTransmission(SlaveAddr::gpio);
-  Wire.write(MCP23008_REG_OLAT);
-  Wire.requestFrom(SlaveAddr::gpio, 1);
-  Wire.endTransmission();
-  if (Wire.available() && (Wire.read() & 0x08)) {
-    return true;
+// Called every loop, never waits on the bus
+void serviceI2CTests(bool fan_on, bool en_12v) {
+  if (i2c_step_ == I2CStep::done) {
+    return;
+  }
+  if (!i2c.busy()) {
+    if (!startI2CStep(i2c_step_, fan_on, en_12v)) {
+      // Nothing to write, the device already holds the value
+      i2c_step_ = finishI2CStep(i2c_step_, I2CResult::ok);
+      return;
+    }
+    i2c_step_start_us_ = micros();
+  }
+  I2CResult result = i2c.poll();
+  if (result != I2CResult::pending) {
+    timeI2CStep(i2c_step_, micros() - i2c_step_start_us_);
+    i2c_step_ = finishI2CStep(i2c_step_, result);
+  }
+}
+
+// Starts a run of the I2C tests, unless the last one is somehow still going.
+// Every step is bounded by its timeout.
+bool fan_on_ = false;
+void startI2CTests() {
+  if (i2c_step_ == I2CStep::done) {
+    // Toggle FAN_ON (for now just turn on since there is no feedback)
+    fan_on_    = true;
+    i2c_tests_ = I2CTests();
+    i2c_step_  = I2CStep::loopback;
   }
-  return false;
 }
 
-// N = test number, AKA what line # on the screen
+// A text cell of up to LEN characters that remembers what it last drew, so
+// it only sends anything over SPI when its text or color changes
+template <uint8_t LEN>
+class ScreenCell {
+ public:
+  // Returns true if the cell was repainted
+  bool draw(int16_t x, int16_t y, int16_t w, int16_t h, const char* text,
+            uint16_t color) {
+    if (valid_ && color == color_ && strncmp(text, text_, LEN) == 0) {
+      return false;
+    }
+    tft.fillRect(x, y, w, h, ILI9341_BLACK);
+    tft.setCursor(x, y);
+    tft.setTextColor(color);
+    tft.println(text);
+
+    strncpy(text_, text, LEN);
+    text_[LEN] = '\0';
+    color_     = color;
+    valid_     = true;
+    return true;
+  }
+
+ private:
+  char     text_[LEN + 1] = {0};
+  uint16_t color_         = 0;
+  bool     valid_         = false;  // Nothing drawn yet
+};
+
+// Cells repainted since the count was last read, for the loop timing print
+uint32_t cells_drawn_ = 0;
+
+// N = test number, AKA what line # on the screen. Returns bit 2 * N if the
+// first result failed and bit 2 * N + 1 if the second one did.
 template <uint8_t N>
-void drawTest(const char* desc, const char* val1, bool ok1, const char* val2,
-              bool ok2) {
+uint32_t drawTest(const char* desc, const char* val1, bool ok1,
+                  const char* val2, bool ok2) {
   static constexpr uint8_t n1 = 12;  // Number of characters in first column
   static constexpr uint8_t n2 = 6;   // Number of characters in second column
   static constexpr uint8_t n3 = 6;   // Number of characters in third column
@@ -269,30 +472,265 @@ void drawTest(const char* desc, const char* val1, bool ok1, const char* val2,
     tft.drawLine(c3xl, yt, c3xl, yb, ILI9341_LIGHTGREY);
     tft.drawLine(c3xr, yt, c3xr, yb, ILI9341_LIGHTGREY);
     init = false;
+  }
+
+  // Update test result text, only where it changed since the last draw
+  static ScreenCell<n2> cell2;
+  static ScreenCell<n3> cell3;
+  cells_drawn_ += cell2.draw(c2xtl, ytt, n2 * fw, fh, val1,
+                             ok1 ? ILI9341_GREEN : ILI9341_RED);
+  cells_drawn_ += cell3.draw(c3xtl, ytt, n3 * fw, fh, val2,
+                             ok2 ? ILI9341_GREEN : ILI9341_RED);
+  return (ok1 ? 0 : 1UL << (2 * N)) | (ok2 ? 0 : 2UL << (2 * N));
+}
+
+// The bar down the right edge of the screen shows production mode's verdict
+void drawVerdict(uint16_t color) {
+  tft.fillRect(TFT_WIDTH - TEXT_MARGIN, 0, TEXT_MARGIN, TFT_HEIGHT, color);
+}
+
+// Draws every test from the last rail capture and I2C run, returning the
+// failed results as from drawTest()
+uint32_t drawResults() {
+  char     strbuf1[7] = {0};
+  char     strbuf2[7] = {0};
+  uint32_t fails      = 0;
+
+  // Rails, from the last burst capture
+  bool ok1 = railTest(0, 4.0, 6.0, strbuf1);
+  bool ok2 = railTest(1, 4.0, 6.0, strbuf2);
+  fails |= drawTest<0>("Ctrl 5VA/5VD", strbuf1, ok1, strbuf2, ok2);
+
+  ok1 = railTest(2, 8.0, 11.0, strbuf1);
+  ok2 = railTest(3, 4.0, 6.0, strbuf2);
+  fails |= drawTest<1>("Preamp 9V/5V", strbuf1, ok1, strbuf2, ok2);
+
+  ok1 = railTest(4, 8.0, 11.0, strbuf1);
+  fails |= drawTest<2>("Preout 9V", strbuf1, ok1, "", true);
+
+  // A missing device has already failed with NACK or TMOUT instead of hanging
+  ok1          = railTest(5, 2.7, 4.0, strbuf1);
+  bool loop_ok = i2c_tests_.loopback == I2CResult::ok && i2c_loopback_ok_;
+  fails |= drawTest<3>("I2C out (J3)", strbuf1, ok1,
+                       i2c_tests_.loopback != I2CResult::ok
+                           ? i2cResultStr(i2c_tests_.loopback)
+                           : (i2c_loopback_ok_ ? " PASS" : " FAIL"),
+                       loop_ok);
+
+  // I2C ADC
+  bool  adc_ok = i2c_tests_.adc == I2CResult::ok;
+  float hv1    = adcToVolts(i2c_tests_.adc_vals[0], 8, 3.3, 4.7, 100);
+  float hv2    = adcToVolts(i2c_tests_.adc_vals[1], 8, 3.3, 4.7, 100);
+  // float ntc1 = adcToVolts(i2c_tests_.adc_vals[2], 8, 3.3, 4.7, 0);
+  if (adc_ok) {
+    sprintf(strbuf1, "%5.2fV", hv1);
+    sprintf(strbuf2, "%5.2fV", hv2);
   } else {
-    // Clear the area that will be re-written with voltage text
-    tft.fillRect(c2xtl, ytt, n2 * fw, fh, ILI9341_BLACK);
-    tft.fillRect(c3xtl, ytt, n3 * fw, fh, ILI9341_BLACK);
+    sprintf(strbuf1, "%s", i2cResultStr(i2c_tests_.adc));
+    strbuf2[0] = '\0';
+  }
+  fails |= drawTest<4>("I2C ADC HV", strbuf1, adc_ok && hv1 < 28 && hv1 > 20,
+                       strbuf2, adc_ok && hv2 < 28 && hv2 > 20);
+
+  float temp1 = adcToTemp(i2c_tests_.adc_vals[2]);
+  if (!adc_ok) {
+    sprintf(strbuf1, "%s", i2cResultStr(i2c_tests_.adc));
+  } else if (temp1 == -INFINITY) {
+    sprintf(strbuf1, "%s", " D/C");
+  } else if (temp1 == INFINITY) {
+    sprintf(strbuf1, "%s", "SHORT");
+  } else {
+    sprintf(strbuf1, "%5.1fC", temp1);
+  }
+  fails |= drawTest<5>("I2C ADC NTC", strbuf1,
+                       adc_ok && temp1 > 15 && temp1 < 30, "", true);
+
+  // I2C GPIO
+  bool gpio_ok = i2c_tests_.gpio == I2CResult::ok;
+  bool pg_12v  = gpio_ok && (i2c_tests_.gpio_val & 0x08);
+  fails |= drawTest<6>("PG_12V",
+                       gpio_ok ? (pg_12v ? " PASS" : " FAIL")
+                               : i2cResultStr(i2c_tests_.gpio),
+                       pg_12v, "", true);
+
+  // Ripple on the rails
+  ok1 = rippleTest(0, strbuf1);
+  ok2 = rippleTest(1, strbuf2);
+  fails |= drawTest<7>("Ripple 5VA/D", strbuf1, ok1, strbuf2, ok2);
+
+  ok1 = rippleTest(2, strbuf1);
+  ok2 = rippleTest(3, strbuf2);
+  fails |= drawTest<8>("Ripple 9V/5V", strbuf1, ok1, strbuf2, ok2);
+
+  ok1 = rippleTest(4, strbuf1);
+  fails |= drawTest<9>("Ripple Out", strbuf1, ok1, "", true);
+  return fails;
+}
+
+// Continuous testing, the I2C results drawn are from the run started by the
+// previous test
+void benchTests(bool captured) {
+  static uint32_t test_timer = 0;
+  if (millis() > test_timer) {
+    uint32_t start = millis();
+    drawResults();
+
+    // The next capture runs while the tests are drawn and the I2C tests run
+    rails_.start();
+    startI2CTests();
+
+    uint32_t elapsedTime = millis() - start;
+    SerialUSB.print("Tests took ");
+    SerialUSB.print(elapsedTime);
+    SerialUSB.print(" ms, redrew ");
+    SerialUSB.print(cells_drawn_);
+    SerialUSB.println(" cells");
+    cells_drawn_ = 0;
+
+    test_timer = start + TEST_PERIOD_MS;
+  }
+  if (captured) {
+    printRailStats();
+  }
+}
+
+// Production mode: one CSV line per board tested, after a header line naming
+// the fields. Voltages are in mV and times in us.
+uint32_t units_tested_ = 0;
+
+void printRecordHeader() {
+  SerialUSB.print("H,unit,result,fails,test_us,capture_us,loopback_us,adc_us,"
+                  "gpio_us");
+  for (uint8_t i = 0; i < RailCapture::NUM_RAILS; i++) {
+    char strbuf[40];
+    sprintf(strbuf, ",A%u_mean,A%u_min,A%u_max,A%u_rms", i, i, i, i);
+    SerialUSB.print(strbuf);
   }
+  SerialUSB.println(",hv1,hv2,ntc1_adc,ntc2_adc,gpio");
+}
 
-  // Update test result text
-  tft.setCursor(c2xtl, ytt);
-  tft.setTextColor(ok1 ? ILI9341_GREEN : ILI9341_RED);
-  tft.println(val1);
-  tft.setCursor(c3xtl, ytt);
-  tft.setTextColor(ok2 ? ILI9341_GREEN : ILI9341_RED);
-  tft.println(val2);
+void printRecord(uint32_t fails, uint32_t test_us, uint32_t capture_us) {
+  char strbuf[64];
+  sprintf(strbuf, "R,%lu,%s,%05lX,%lu,%lu,", (unsigned long)units_tested_,
+          fails ? "FAIL" : "PASS", (unsigned long)fails,
+          (unsigned long)test_us, (unsigned long)capture_us);
+  SerialUSB.print(strbuf);
+  sprintf(strbuf, "%lu,%lu,%lu", (unsigned long)i2c_tests_.loopback_us,
+          (unsigned long)i2c_tests_.adc_us, (unsigned long)i2c_tests_.gpio_us);
+  SerialUSB.print(strbuf);
+  for (uint8_t i = 0; i < RailCapture::NUM_RAILS; i++) {
+    const RailStats& s = rails_.stats(i);
+    sprintf(strbuf, ",%u,%u,%u,%u", (unsigned)(1000 * railVolts(i, s.mean)),
+            (unsigned)(1000 * railVolts(i, s.min)),
+            (unsigned)(1000 * railVolts(i, s.max)),
+            (unsigned)(1000 * railVolts(i, s.rms)));
+    SerialUSB.print(strbuf);
+  }
+  float hv1 = adcToVolts(i2c_tests_.adc_vals[0], 8, 3.3, 4.7, 100);
+  float hv2 = adcToVolts(i2c_tests_.adc_vals[1], 8, 3.3, 4.7, 100);
+  sprintf(strbuf, ",%u,%u,%u,%u,%02X", (unsigned)(1000 * hv1),
+          (unsigned)(1000 * hv2), i2c_tests_.adc_vals[2],
+          i2c_tests_.adc_vals[3], i2c_tests_.gpio_val);
+  SerialUSB.println(strbuf);
+}
+
+bool boardPresent() {
+  for (uint8_t i = 0; i < 5; i++) {
+    if (railVolts(i, rails_.stats(i).mean) > PRESENT_VOLTS) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Tests each board once, as soon as it has settled. Captures run back to
+// back to watch for insertion and removal, and the test itself is one
+// capture with the I2C run alongside it.
+void productionTests(bool captured) {
+  static uint32_t settle_start = 0;
+  static uint32_t test_start   = 0;
+  static uint32_t capture_us   = 0;
+  switch (station_) {
+    case Station::waiting:
+      if (captured && boardPresent()) {
+        settle_start = millis();
+        station_     = Station::settling;
+        forgetBoard();
+        drawVerdict(ILI9341_YELLOW);
+      }
+      break;
+    case Station::settling:
+      if (!captured) {
+        break;
+      }
+      if (!boardPresent()) {
+        station_ = Station::waiting;
+        drawVerdict(ILI9341_BLACK);
+      } else if (millis() - settle_start >= SETTLE_MS) {
+        test_start = micros();
+        rails_.start();
+        startI2CTests();
+        station_ = Station::testing;
+        return;
+      }
+      break;
+    case Station::testing:
+      if (captured) {
+        capture_us = micros() - test_start;
+      }
+      if (rails_.busy() || i2c_step_ != I2CStep::done) {
+        return;
+      }
+      {
+        uint32_t fails = drawResults();
+        units_tested_++;
+        printRecord(fails, micros() - test_start, capture_us);
+        drawVerdict(fails ? ILI9341_RED : ILI9341_GREEN);
+      }
+      station_ = Station::removing;
+      break;
+    case Station::removing:
+      // The results stay on the screen until the next board is inserted
+      if (captured && !boardPresent()) {
+        station_ = Station::waiting;
+      }
+      break;
+    case Station::bench:
+      break;
+  }
+  if (!rails_.busy()) {
+    rails_.start();
+  }
+}
+
+// Single character commands from the host select the mode
+void serviceHost() {
+  while (SerialUSB.available() > 0) {
+    int c = SerialUSB.read();
+    if (c == 'p' && station_ == Station::bench) {
+      station_ = Station::waiting;
+      forgetBoard();
+      drawVerdict(ILI9341_BLACK);
+      printRecordHeader();
+    } else if (c == 'b' && station_ != Station::bench) {
+      station_ = Station::bench;
+      drawVerdict(ILI9341_BLACK);
+    }
+  }
 }
 
 void setup() {
   // Setup onboard LED
   pinMode(LED_BUILTIN, OUTPUT);
 
-  // Setup ADC
+  // Setup ADC, the rails are sampled in the background by rails_
   analogReadResolution(12);
+  rails_.begin();
+  rails_.start();
 
-  // Setup I2C master
+  // Setup I2C master, transactions are then run by i2c without blocking
   Wire.begin();
+  i2c.begin();
 
   // Setup I2C slave
   Wire1.begin(SlaveAddr::due);  // Set I2C1 as slave with the given address
@@ -312,8 +750,6 @@ void setup() {
 }
 
 void loop() {
-  uint32_t loopStartTime = millis();
-
   // Blink LED, 100 ms on, 1000 ms off
   static uint32_t led_timer = 0;
   static uint32_t led_state = LOW;
@@ -323,79 +759,14 @@ void loop() {
     led_timer += led_state == HIGH ? 100 : 900;
   }
 
-  static uint32_t test_timer = 0;
-  static bool     fan_on     = false;
-  if (millis() > test_timer) {
-    char strbuf1[7] = {0};
-    char strbuf2[7] = {0};
-
-    // Measure ADCs
-    float ctrl5va = adcToVolts(analogRead(A0), 12, 3.3, 33, 100);
-    float ctrl5vd = adcToVolts(analogRead(A1), 12, 3.3, 33, 100);
-    sprintf(strbuf1, "%5.2fV", ctrl5va);
-    sprintf(strbuf2, "%5.2fV", ctrl5vd);
-    bool ok1 = ctrl5va < 6.0 && ctrl5va > 4.0;
-    bool ok2 = ctrl5vd < 6.0 && ctrl5va > 4.0;
-    drawTest<0>("Ctrl 5VA/5VD", strbuf1, ok1, strbuf2, ok2);
-
-    float preamp9v = adcToVolts(analogRead(A2), 12, 3.3, 33, 100);
-    float preamp5v = adcToVolts(analogRead(A3), 12, 3.3, 33, 100);
-    sprintf(strbuf1, "%5.2fV", preamp9v);
-    sprintf(strbuf2, "%5.2fV", preamp5v);
-    ok1 = preamp9v < 11.0 && preamp9v > 8.0;
-    ok2 = preamp5v < 6.0 && preamp5v > 4.0;
-    drawTest<1>("Preamp 9V/5V", strbuf1, ok1, strbuf2, ok2);
-
-    float preout9v = adcToVolts(analogRead(A4), 12, 3.3, 33, 100);
-    sprintf(strbuf1, "%5.2fV", preout9v);
-    ok1 = preout9v < 11.0 && preout9v > 8.0;
-    drawTest<2>("Preout 9V", strbuf1, ok1, "", true);
-
-    // Check I2C loopback
-    // Update from previous transmission
-    float i2c3v3 = adcToVolts(analogRead(A5), 12, 3.3, 100, 100);
-    sprintf(strbuf1, "%5.2fV", i2c3v3);
-    drawTest<3>("I2C out (J3)", strbuf1, i2c3v3 < 4.0 && i2c3v3 > 2.7,
-                i2c_loopback_ok_ ? " PASS" : " FAIL", i2c_loopback_ok_);
-
-    // Start a new transmission
-    i2c_loopback_ok_ = false;
-    Wire.beginTransmission(SlaveAddr::due);
-    Wire.write((uint8_t)I2C_TEST_VAL);
-    Wire.endTransmission();
-
-    // TODO: Don't lock up on I2C failure
-    // Read I2C ADC
-    uint8_t hv1_adc;
-    uint8_t hv2_adc;
-    uint8_t ntc1_adc;
-    uint8_t ntc2_adc;
-    readI2CADC(&hv1_adc, &hv2_adc, &ntc1_adc, &ntc2_adc);
-    float hv1 = adcToVolts(hv1_adc, 8, 3.3, 4.7, 100);
-    float hv2 = adcToVolts(hv2_adc, 8, 3.3, 4.7, 100);
-    // float ntc1 = adcToVolts(ntc1_adc, 8, 3.3, 4.7, 0);
-    sprintf(strbuf1, "%5.2fV", hv1);
-    sprintf(strbuf2, "%5.2fV", hv2);
-    drawTest<4>("I2C ADC HV", strbuf1, hv1 < 28 && hv1 > 20, strbuf2,
-                hv2 < 28 && hv2 > 20);
-
-    float temp1 = adcToTemp(ntc1_adc);
-    if (temp1 == -INFINITY) {
-      sprintf(strbuf1, "%s", " D/C");
-    } else if (temp1 == INFINITY) {
-      sprintf(strbuf1, "%s", "SHORT");
-    } else {
-      sprintf(strbuf1, "%5.1fC", temp1);
-    }
-    drawTest<5>("I2C ADC NTC", strbuf1, temp1 > 15 && temp1 < 30, "", true);
-
-    // Toggle FAN_ON (for now just turn on since there is no feedback)
-    writeGPIO(true, true);
-    bool pg_12v = readGPIO();
-    drawTest<6>("PG_12V", pg_12v ? " PASS" : " FAIL", pg_12v, "", true);
-
-    test_timer += 250;
+  serviceHost();
+  bool captured = rails_.poll();
+  if (station_ == Station::bench) {
+    benchTests(captured);
+  } else {
+    productionTests(captured);
   }
+  serviceI2CTests(fan_on_, true);
 
   // Adjust DPOT to control +12V
   /*
@@ -415,8 +786,4 @@ void loop() {
   }
   */
 
-  uint32_t elapsedTime = millis() - loopStartTime;
-  SerialUSB.print("Loop took ");
-  SerialUSB.print(elapsedTime);
-  SerialUSB.println(" ms");
 }
@@ -0,0 +1,144 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "rail_capture.h"
+
+// TC0 channel 0 drives TIOA0, which is ADC hardware trigger 1
+static constexpr uint32_t TRIG_TC_CH = 0;
+
+static uint32_t isqrt(uint32_t x) {
+  uint32_t root = 0;
+  uint32_t bit  = 1UL << 30;
+  while (bit > x) {
+    bit >>= 2;
+  }
+  while (bit) {
+    if (x >= root + bit) {
+      x -= root + bit;
+      root = (root >> 1) + bit;
+    } else {
+      root >>= 1;
+    }
+    bit >>= 2;
+  }
+  return root;
+}
+
+void RailCapture::begin() {
+  for (uint8_t i = 0; i < NUM_RAILS; i++) {
+    channel_[i] = g_APinDescription[A0 + i].ulADCChannelNumber;
+  }
+
+  // Square wave on TIOA0 at SAMPLE_RATE, each rising edge converts all rails
+  pmc_enable_periph_clk(ID_TC0);
+  TC_Configure(TC0, TRIG_TC_CH,
+               TC_CMR_TCCLKS_TIMER_CLOCK1 | TC_CMR_WAVE |
+                   TC_CMR_WAVSEL_UP_RC | TC_CMR_ACPA_CLEAR |
+                   TC_CMR_ACPC_SET);
+  uint32_t rc = VARIANT_MCK / 2 / SAMPLE_RATE;  // TIMER_CLOCK1 is MCK/2
+  TC_SetRC(TC0, TRIG_TC_CH, rc);
+  TC_SetRA(TC0, TRIG_TC_CH, rc / 2);
+}
+
+void RailCapture::start() {
+  if (busy_) {
+    return;
+  }
+
+  // analogRead() leaves its channel enabled, only the rails are converted
+  ADC->ADC_CHDR = 0xFFFF;
+  for (uint8_t i = 0; i < NUM_RAILS; i++) {
+    ADC->ADC_CHER = 1 << channel_[i];
+  }
+  // Tag each result with its channel so the buffer can be sorted by rail
+  ADC->ADC_EMR |= ADC_EMR_TAG;
+  ADC->ADC_MR = (ADC->ADC_MR & ~ADC_MR_TRGSEL_Msk) | ADC_MR_TRGEN_EN |
+                ADC_MR_TRGSEL_ADC_TRIG1;
+  ADC->ADC_LCDR;  // Discard an old result
+
+  ADC->ADC_RPR  = (uint32_t)buf_;
+  ADC->ADC_RCR  = NUM_RAILS * SAMPLES;
+  ADC->ADC_PTCR = ADC_PTCR_RXTEN;
+
+  TC_Start(TC0, TRIG_TC_CH);
+  busy_ = true;
+}
+
+bool RailCapture::poll() {
+  if (!busy_ || ADC->ADC_RCR != 0) {
+    return false;
+  }
+  stop();
+  compute();
+  return true;
+}
+
+// Hands the ADC back to analogRead()
+void RailCapture::stop() {
+  TC_Stop(TC0, TRIG_TC_CH);
+  ADC->ADC_PTCR = ADC_PTCR_RXTDIS;
+  ADC->ADC_MR &= ~ADC_MR_TRGEN_EN;
+  ADC->ADC_EMR &= ~ADC_EMR_TAG;
+  ADC->ADC_CHDR = 0xFFFF;
+  busy_ = false;
+}
+
+void RailCapture::compute() {
+  uint16_t min[NUM_RAILS];
+  uint16_t max[NUM_RAILS];
+  uint16_t n[NUM_RAILS] = {};
+  uint32_t sum[NUM_RAILS] = {};
+  uint64_t sum_sq[NUM_RAILS] = {};
+  int8_t   rail_of_ch[16];  // -1 for a channel that isn't a rail
+
+  for (uint8_t ch = 0; ch < 16; ch++) {
+    rail_of_ch[ch] = -1;
+  }
+  for (uint8_t i = 0; i < NUM_RAILS; i++) {
+    rail_of_ch[channel_[i]] = i;
+    min[i]                  = 0xFFFF;
+    max[i]                  = 0;
+  }
+
+  for (uint16_t s = 0; s < NUM_RAILS * SAMPLES; s++) {
+    int8_t   rail = rail_of_ch[buf_[s] >> 12];
+    uint16_t val  = buf_[s] & 0x0FFF;
+    if (rail < 0) {
+      continue;
+    }
+    min[rail] = val < min[rail] ? val : min[rail];
+    max[rail] = val > max[rail] ? val : max[rail];
+    sum[rail] += val;
+    sum_sq[rail] += (uint32_t)val * val;
+    n[rail]++;
+  }
+
+  for (uint8_t i = 0; i < NUM_RAILS; i++) {
+    if (n[i] == 0) {
+      stats_[i] = RailStats();
+      continue;
+    }
+    // Variance = (n * sum(x^2) - sum(x)^2) / n^2, exact in 64 bits
+    uint64_t var = ((uint64_t)n[i] * sum_sq[i] - (uint64_t)sum[i] * sum[i]) /
+                   ((uint64_t)n[i] * n[i]);
+    stats_[i].min  = min[i];
+    stats_[i].max  = max[i];
+    stats_[i].mean = (sum[i] + n[i] / 2) / n[i];
+    stats_[i].rms  = isqrt((uint32_t)var);
+  }
+}
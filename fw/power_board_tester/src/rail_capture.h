@@ -0,0 +1,70 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * Burst capture of the power rails with the SAM3X ADC
+ *
+ * A timer triggers a conversion of every rail at SAMPLE_RATE and the PDC
+ * (the SAM3X's peripheral DMA) moves each result into a buffer, so a
+ * capture runs in the background while loop() keeps going. Once the
+ * buffer is full the min, max, mean and RMS ripple of each rail are
+ * computed in integer ADC counts.
+ */
+
+#ifndef RAIL_CAPTURE_H_
+#define RAIL_CAPTURE_H_
+
+#include <Arduino.h>
+
+struct RailStats {
+  uint16_t min  = 0;
+  uint16_t max  = 0;
+  uint16_t mean = 0;
+  uint16_t rms  = 0;  // RMS deviation from the mean, i.e. AC ripple
+};
+
+class RailCapture {
+ public:
+  static constexpr uint8_t  NUM_RAILS   = 6;      // A0 to A5
+  static constexpr uint16_t SAMPLES     = 1024;   // Per rail
+  static constexpr uint32_t SAMPLE_RATE = 20000;  // Hz per rail
+
+  void begin();
+
+  // Starts a capture of SAMPLES per rail, about 51 ms
+  void start();
+
+  // Returns true once, when the capture started last has finished and the
+  // stats have been updated
+  bool poll();
+
+  bool busy() const { return busy_; }
+
+  // Stats of rail 0-5 (A0-A5) from the last finished capture
+  const RailStats& stats(uint8_t rail) const { return stats_[rail]; }
+
+ private:
+  void stop();
+  void compute();
+
+  uint16_t  buf_[NUM_RAILS * SAMPLES];
+  uint8_t   channel_[NUM_RAILS];  // ADC channel of each rail
+  RailStats stats_[NUM_RAILS];
+  bool      busy_ = false;
+};
+
+#endif /* RAIL_CAPTURE_H_ */
@@ -0,0 +1,87 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Bootloader, installs a staged firmware image and starts the firmware
+ *
+ * The firmware receives a new image into the staging slot and writes an
+ * FwMeta record once its CRC has been checked (see fw_update.c). On reset
+ * this copies the staged image over the running one, checks the copy and
+ * only then erases the record, so losing power part way through just
+ * installs it again on the next reset. The Cortex-M0 can't move its vector
+ * table and the images aren't position independent, so every image is
+ * linked to run from APP_ADDR instead of swapping between two slots.
+ *
+ * A staged image that doesn't match its record is left where it is and the
+ * current firmware is started. Once a valid image has started installing
+ * the firmware at APP_ADDR may be partly erased, so it is never started
+ * until the copy has been checked, the install is retried instead. If
+ * there's no firmware to start this waits, and the STM32's ROM bootloader
+ * (BOOT0 high) is still there to recover.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include "flash.h"
+#include "stm32f0xx.h"
+
+static bool stagedValid(const FwMeta * meta){
+	return meta->magic == FW_META_MAGIC && meta->len > 0 && meta->len <= SLOT_SIZE &&
+	       crc32(0, (const uint8_t *)STAGE_ADDR, meta->len) == meta->crc;
+}
+
+// Copies the staged image to APP_ADDR a page at a time. An odd length was
+// padded when the image was committed, so whole half-words are copied.
+static bool install(const FwMeta * meta){
+	const uint16_t * src = (const uint16_t *)STAGE_ADDR;
+	uint32_t addr;
+	for(addr = 0; addr < meta->len; addr += 2){
+		if(addr % FLASH_PAGE_SIZE == 0 && !flashErasePage(APP_ADDR + addr)){
+			return false;
+		}
+		if(!flashProgram(APP_ADDR + addr, src[addr / 2])){
+			return false;
+		}
+	}
+	return crc32(0, (const uint8_t *)APP_ADDR, meta->len) == meta->crc;
+}
+
+// The firmware's initial stack pointer must point into RAM
+static bool appPresent(){
+	uint32_t sp = *(const uint32_t *)APP_ADDR;
+	return sp > SRAM_BASE && sp <= SRAM_BASE + 0x2000;
+}
+
+int main(){
+	const FwMeta * meta = (const FwMeta *)META_ADDR;
+	if(stagedValid(meta)){
+		flashUnlock();
+		while(!install(meta)); // What is at APP_ADDR can't be trusted until this succeeds
+		flashErasePage(META_ADDR);
+		flashLock();
+	}
+
+	if(!appPresent()){
+		while(1);
+	}
+
+	// Start the firmware as the core would from reset, it remaps its own
+	// vector table
+	const uint32_t * vectors = (const uint32_t *)APP_ADDR;
+	void (*reset)() = (void (*)())(uintptr_t)vectors[1];
+	__set_MSP(vectors[0]);
+	reset();
+	while(1);
+}
@@ -84,6 +84,39 @@
 #define pSCL_VOL                   GPIO_Pin_10 // B
 #define pSDA_VOL                   GPIO_Pin_11 // B
 
+// I2C bus speeds in kHz, selected at build time with PREAMP_I2C1_KHZ and PREAMP_I2C2_KHZ.
+// I2C1 is the controller board, I2C2 is the volume ICs, power board and front panel.
+#ifndef I2C1_KHZ
+#define I2C1_KHZ (100)
+#endif
+#ifndef I2C2_KHZ
+#define I2C2_KHZ (100)
+#endif
+
+// TIMINGR values for a 48 MHz I2C clock, from the reference manual
+#define I2C_TIMING_100KHZ          0xB0420F13
+#define I2C_TIMING_400KHZ          0x50330309
+#define I2C_TIMING_1MHZ            0x50100103
+
+#if I2C1_KHZ == 100
+#define I2C1_TIMING I2C_TIMING_100KHZ
+#elif I2C1_KHZ == 400
+#define I2C1_TIMING I2C_TIMING_400KHZ
+#elif I2C1_KHZ == 1000
+#define I2C1_TIMING I2C_TIMING_1MHZ // Fast-mode Plus, needs the high current drive on PB6/PB7
+#else
+#error "I2C1_KHZ must be 100, 400 or 1000"
+#endif
+
+// PB10/PB11 do not support Fast-mode Plus, and the power board ADC is limited to 400 kHz
+#if I2C2_KHZ == 100
+#define I2C2_TIMING I2C_TIMING_100KHZ
+#elif I2C2_KHZ == 400
+#define I2C2_TIMING I2C_TIMING_400KHZ
+#else
+#error "I2C2_KHZ must be 100 or 400"
+#endif
+
 #define CH1_MUTE()   GPIOB->BRR  = pCH1_MUTE
 #define CH1_UNMUTE() GPIOB->BSRR = pCH1_MUTE
 
@@ -48,6 +48,9 @@ void PendSV_Handler(void);
 void SysTick_Handler(void);
 
 void USART1_IRQHandler(void);
+void I2C1_IRQHandler(void);
+void I2C2_IRQHandler(void);
+void USART2_IRQHandler(void);
 
 /*void PPP_IRQHandler(void);*/
 
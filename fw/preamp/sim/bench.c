@@ -0,0 +1,535 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Command latency benchmark for the preamp firmware, run on a host
+ *
+ * Replays a stream of controller board I2C transactions against the
+ * firmware running on simulated hardware and reports the I2C2 traffic and
+ * time each one causes. Streams are text, one transaction per line, with
+ * addresses and data in hex as written by rt.py when AMPLIPI_I2C_TRACE is set:
+ *
+ *   w ADDR REG [DATA...]  Write DATA to consecutive registers from REG,
+ *                         with no DATA only set the register to read
+ *   r ADDR N [VAL...]     Read N bytes from the last register set, checking
+ *                         the first bytes read against any VALs given
+ *   s MS                  Run the main loop for MS milliseconds (decimal)
+ *   p DEV REG VAL         Set a register of a simulated I2C2 device, by its
+ *                         8-bit address, e.g. a power board input
+ *   x DEV REG VAL         Check a register of a simulated I2C2 device
+ *   # ...                 Comment
+ *
+ * ADDR is the 7-bit address. Only the simulated preamp and the broadcast
+ * address are answered, other preamps' transactions only take bus time.
+ * Each value that doesn't match is reported and the bench then exits with 1.
+ *
+ * With -l the preamp is instead a virtual device for the host software. It
+ * listens on a Unix socket and runs in real time, so timers, power
+ * sequencing and bus time take as long as on the hardware. Every 'w', 'r'
+ * or 'p' line it receives is answered once done with "a" and any bytes read
+ * in hex, or "n" if the address isn't this preamp's. The reply is held for
+ * the I2C1 bus time and clock stretching of the transaction. rt.py talks to
+ * a chain of these when AMPLIPI_PREAMP_SIM is set, one process per preamp.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "sim_hw.h"
+#include "main.h"
+#include "channel.h"
+#include "events.h"
+#include "front_panel.h"
+#include "i2c_master.h"
+#include "i2c_slave.h"
+#include "pec.h"
+#include "perf.h"
+#include "port_defs.h"
+#include "power_board.h"
+#include "presets.h"
+#include "scheduler.h"
+#include "snapshot.h"
+#include "sleep.h"
+#include "status.h"
+#include "systick.h"
+#include "telemetry.h"
+#include "thermal.h"
+#include "trace.h"
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// Not declared in a header, main.c is built with its main() renamed
+void init_gpio();
+void init_i2c1(uint8_t preamp_addr);
+void init_i2c2();
+void writeReg(uint8_t reg, uint8_t data);
+
+#define MAX_LINE  (256)
+#define MAX_BYTES (64)
+#define MAX_READ  (256) // A read's length is one byte
+#define SETTLE_MS (300) // Power on sequencing and the first samples
+
+typedef struct{
+	uint32_t cmds;
+	uint32_t xfers;
+	uint32_t bytes;
+	uint64_t bus_ns;
+	uint64_t latency_ns;
+	uint64_t max_latency_ns;
+}Totals;
+
+static uint8_t preamp_addr = 0x08;
+static bool verbose = false;
+static uint8_t last_reg = 0; // Register pointer set by the last write to the preamp
+static uint32_t line_num = 0; // Line of the stream being run
+static uint32_t mismatches = 0;
+
+// One pass of the firmware's main loop, sleeping if nothing is due
+static void loopOnce(){
+	runScheduler();
+	sleepIfIdle();
+}
+
+static void runFor(uint32_t ms){
+	uint64_t end = simNow() + (uint64_t)ms * 1000000;
+	while(simNow() < end){
+		loopOnce();
+	}
+}
+
+// Time the controller board holds I2C1 for a transaction of n bytes
+static uint64_t i2c1Ns(uint32_t n){
+	return (uint64_t)(n + 1) * 9 * 1000000 / I2C1_KHZ;
+}
+
+// Returns false if addr isn't this preamp's or the broadcast address. As in
+// i2c_slave.c a transaction with PEC enabled is dropped if its PEC is wrong.
+static bool applyWrite(uint8_t addr, const uint8_t * b, uint32_t n){
+	uint32_t i;
+	bool bcast = addr == (I2C_BROADCAST_ADDR >> 1);
+	if(addr != preamp_addr && !bcast){
+		return false;
+	}
+	last_reg = b[0];
+	if(n == 1){
+		return true;
+	}
+	if(pecEnabled()){
+		uint8_t pec = updatePec(0, addr << 1);
+		for(i = 0; i < n - 1; i++){
+			pec = updatePec(pec, b[i]);
+		}
+		if(b[--n] != pec){
+			perfCount(PERF_I2C1_REJECTS, 1);
+			countWriteXfer(false);
+			return true;
+		}
+	}
+	countWriteXfer(true);
+	uint8_t reg = b[0];
+	for(i = 1; i < n; i++){
+		if(!bcast || broadcastReg(reg)){
+			uint32_t start = micros();
+			writeReg(reg, b[i]);
+			flushFrontPanel();
+			perfCmdTime(micros() - start);
+			perfCountReg(reg);
+			traceAccess(reg, b[i], false, start);
+		}
+		if(!streamReg(reg)){
+			reg++;
+		}
+	}
+	return true;
+}
+
+static bool applyRead(uint8_t addr, uint8_t * out, uint32_t n){
+	uint32_t i;
+	if(addr != preamp_addr){
+		return false;
+	}
+	uint32_t start = micros();
+	bool pec_on = pecEnabled();
+	uint32_t len = 1;
+	uint8_t pec = updatePec(updatePec(updatePec(0, addr << 1), last_reg), addr << 1 | 1);
+	for(i = 0; i < n; i++){
+		if(pec_on && i >= len){
+			out[i] = i == len ? pec : 0xFF;
+			continue;
+		}
+		out[i] = readReg(last_reg, i);
+		if(i == 0 && pec_on){
+			len = readLen(last_reg, out[0]);
+		}
+		pec = updatePec(pec, out[i]);
+	}
+	traceAccess(last_reg, out[0], true, start);
+	return true;
+}
+
+// Parses the hex bytes left in a line being split by strtok
+static uint32_t parseBytes(uint8_t * bytes){
+	uint32_t n = 0;
+	char * tok;
+	while((tok = strtok(NULL, " \t\r\n")) && n < MAX_BYTES){
+		bytes[n++] = strtoul(tok, NULL, 16);
+	}
+	return n;
+}
+
+// Sets a register of a simulated device from the bytes of a 'p' line
+static bool poke(const uint8_t * bytes, uint32_t n){
+	uint8_t * regs = n == 3 ? simDevRegs(bytes[0]) : NULL;
+	if(!regs){
+		return false;
+	}
+	regs[bytes[1]] = bytes[2];
+	return true;
+}
+
+// Checks a register of a simulated device against the bytes of an 'x' line
+static bool expectDev(const uint8_t * bytes, uint32_t n){
+	uint8_t * regs = n == 3 ? simDevRegs(bytes[0]) : NULL;
+	if(!regs){
+		return false;
+	}
+	if(regs[bytes[1]] != bytes[2]){
+		fprintf(stderr, "line %u: device %02X register %02X is %02X, expected %02X\n",
+				line_num, bytes[0], bytes[1], regs[bytes[1]], bytes[2]);
+		mismatches++;
+	}
+	return true;
+}
+
+// Runs one transaction and the I2C2 traffic it causes to completion
+static bool runLine(char * line, Totals * t){
+	char * tok = strtok(line, " \t\r\n");
+	if(!tok || tok[0] == '#'){
+		return true;
+	}
+
+	if(tok[0] == 's'){
+		tok = strtok(NULL, " \t\r\n");
+		if(!tok){
+			return false;
+		}
+		runFor(strtoul(tok, NULL, 10));
+		return true;
+	}
+
+	uint8_t bytes[MAX_BYTES];
+	if(tok[0] == 'p'){
+		// Changes a simulated device, e.g. a power board input
+		return poke(bytes, parseBytes(bytes));
+	}
+	if(tok[0] == 'x'){
+		return expectDev(bytes, parseBytes(bytes));
+	}
+
+	char op = tok[0];
+	tok = strtok(NULL, " \t\r\n");
+	if((op != 'w' && op != 'r') || !tok){
+		return false;
+	}
+	uint8_t addr = strtoul(tok, NULL, 16);
+	uint32_t n = parseBytes(bytes);
+	if(n == 0 || (op == 'r' && n - 1 > bytes[0])){
+		return false;
+	}
+
+	SimBusStats before, after;
+	simI2C2Stats(&before);
+	simAdvance(i2c1Ns(op == 'w' ? n : bytes[0]));
+	uint64_t start = simNow();
+
+	if(verbose){
+		printf("%c %02X", op, addr);
+	}
+	if(op == 'w'){
+		applyWrite(addr, bytes, n);
+	}else{
+		uint8_t vals[MAX_READ];
+		uint32_t i;
+		bool read = applyRead(addr, vals, bytes[0]);
+		if(read && verbose){
+			for(i = 0; i < bytes[0]; i++){
+				printf(" %02X", vals[i]);
+			}
+		}
+		for(i = 1; i < n; i++){
+			if(!read || vals[i - 1] != bytes[i]){
+				if(read){
+					fprintf(stderr, "line %u: byte %u read %02X, expected %02X\n", line_num, i - 1, vals[i - 1], bytes[i]);
+				}else{
+					fprintf(stderr, "line %u: read not answered\n", line_num);
+				}
+				mismatches++;
+				break;
+			}
+		}
+	}
+
+	// Deferred work runs on the next pass of the main loop
+	runScheduler();
+	flushI2C2();
+	while(!simI2C2Idle()){
+		loopOnce();
+	}
+
+	simI2C2Stats(&after);
+	uint64_t latency = simNow() - start;
+	uint64_t bus = after.busy_ns - before.busy_ns;
+	t->cmds++;
+	t->xfers += after.xfers - before.xfers;
+	t->bytes += after.bytes - before.bytes;
+	t->bus_ns += bus;
+	t->latency_ns += latency;
+	if(latency > t->max_latency_ns){
+		t->max_latency_ns = latency;
+	}
+	if(verbose){
+		printf(": %u xfers, %u bytes, %.1f us bus, %.1f us\n", after.xfers - before.xfers,
+				after.bytes - before.bytes, bus / 1000.0, latency / 1000.0);
+	}
+	return true;
+}
+
+static void boot(bool sample){
+	simInit();
+	systickInit();
+	initSleep();
+	init_gpio();
+	init_i2c2();
+	enableFrontPanel();
+	enablePowerBoard();
+	enablePSU();
+	init_i2c1(preamp_addr << 1);
+	initChannels();
+	initSources();
+	initPresets();
+	initSnapshot(NULL);
+	initStatus();
+	initThermal();
+	initTelemetry();
+	initEvents();
+	if(!sample){
+		writeReg(REG_STATUS_PERIOD, 0); // Only measure the traffic caused by the stream
+	}
+	runFor(SETTLE_MS);
+	perfReset();
+}
+
+// Offset of simulated time from the host's monotonic clock while serving
+static uint64_t wall_offset = 0;
+
+static uint64_t wallNs(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec - wall_offset;
+}
+
+// Runs the firmware up to the current time, or waits for the time to catch
+// up with a transaction that ran ahead of it. The firmware only sleeps until
+// something due by now, so the next transaction doesn't arrive in the past.
+static void syncWall(){
+	uint64_t wall = wallNs();
+	if(simNow() > wall){
+		uint64_t ahead = simNow() - wall;
+		struct timespec ts = {ahead / 1000000000, ahead % 1000000000};
+		nanosleep(&ts, NULL);
+	}
+	while(simNow() < wall){
+		if(simNextEvent() <= wall){
+			loopOnce();
+		}else{
+			runScheduler();
+			simAdvance(wall - simNow());
+		}
+	}
+}
+
+// Runs one transaction from the host and writes the reply line for it
+static void serveLine(char * line, char * reply){
+	char * tok = strtok(line, " \t\r\n");
+	uint8_t bytes[MAX_BYTES];
+	uint8_t vals[MAX_READ];
+	uint32_t n = 0;
+	uint32_t i;
+	bool ok = false;
+	if(tok && tok[0] == 'p'){
+		ok = poke(bytes, parseBytes(bytes));
+	}else if(tok && (tok[0] == 'w' || tok[0] == 'r')){
+		char op = tok[0];
+		tok = strtok(NULL, " \t\r\n");
+		uint8_t addr = tok ? strtoul(tok, NULL, 16) : 0;
+		uint32_t len = tok ? parseBytes(bytes) : 0;
+		bool ours = addr == preamp_addr || (op == 'w' && addr == (I2C_BROADCAST_ADDR >> 1));
+		if(op == 'w' && len > 0){
+			simAdvance(i2c1Ns(ours ? len : 0)); // Only the address is sent if it isn't acknowledged
+			ok = applyWrite(addr, bytes, len);
+		}else if(op == 'r' && len == 1){
+			simAdvance(i2c1Ns(ours ? bytes[0] : 0));
+			ok = applyRead(addr, vals, bytes[0]);
+			n = ok ? bytes[0] : 0;
+		}
+	}
+	reply += sprintf(reply, ok ? "a" : "n");
+	for(i = 0; i < n; i++){
+		reply += sprintf(reply, " %02X", vals[i]);
+	}
+	sprintf(reply, "\n");
+}
+
+// Answers transactions from the host on a Unix socket until killed, one
+// connection at a time. The preamp keeps its state between connections.
+static int serve(const char * path){
+	struct sockaddr_un sa = {.sun_family = AF_UNIX};
+	int srv = socket(AF_UNIX, SOCK_STREAM, 0);
+	strncpy(sa.sun_path, path, sizeof(sa.sun_path) - 1);
+	unlink(path);
+	if(srv < 0 || bind(srv, (struct sockaddr *)&sa, sizeof(sa)) || listen(srv, 1)){
+		perror(path);
+		return 1;
+	}
+	wall_offset = wallNs() - simNow();
+
+	struct pollfd pfd = {.fd = srv, .events = POLLIN};
+	int client = -1;
+	char line[MAX_LINE];
+	char reply[4 + 3 * MAX_READ];
+	uint32_t len = 0;
+	while(true){
+		// The firmware keeps running, a millisecond at a time, while waiting
+		if(poll(&pfd, 1, 1) > 0){
+			if(client < 0){
+				client = accept(srv, NULL, NULL);
+				pfd.fd = client >= 0 ? client : srv;
+				len = 0;
+			}else{
+				ssize_t got = read(client, line + len, sizeof(line) - 1 - len);
+				if(got <= 0){
+					close(client);
+					client = -1;
+					pfd.fd = srv;
+					continue;
+				}
+				len += got;
+				char * end;
+				while((end = memchr(line, '\n', len))){
+					uint32_t used = end - line + 1;
+					*end = '\0';
+					syncWall(); // The transaction starts now
+					serveLine(line, reply);
+					syncWall(); // Holds the reply for the time it took
+					send(client, reply, strlen(reply), MSG_NOSIGNAL);
+					memmove(line, line + used, len - used);
+					len -= used;
+				}
+				if(len == sizeof(line) - 1){
+					len = 0; // Drop a line that's too long
+				}
+			}
+		}
+		syncWall();
+	}
+}
+
+static void usage(const char * name){
+	fprintf(stderr, "usage: %s [-a ADDR] [-s] [-v] [STREAM]\n"
+			"       %s [-a ADDR] -l SOCKET\n"
+			"  -a ADDR    7-bit preamp address in hex, default 08\n"
+			"  -l SOCKET  run in real time as a virtual preamp for rt.py, on a Unix socket\n"
+			"  -s         keep background status sampling running\n"
+			"  -v         print each transaction\n"
+			"Reads the stream from stdin if no file is given\n", name, name);
+}
+
+int main(int argc, char * argv[]){
+	bool sample = false;
+	const char * socket_path = NULL;
+	int opt;
+	while((opt = getopt(argc, argv, "a:l:svh")) != -1){
+		switch(opt){
+		case 'a':
+			preamp_addr = strtoul(optarg, NULL, 16);
+			break;
+		case 'l':
+			socket_path = optarg;
+			break;
+		case 's':
+			sample = true;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 2;
+		}
+	}
+
+	if(socket_path){
+		boot(true);
+		return serve(socket_path);
+	}
+
+	FILE * in = stdin;
+	if(optind < argc){
+		in = fopen(argv[optind], "r");
+		if(!in){
+			perror(argv[optind]);
+			return 1;
+		}
+	}
+
+	boot(sample);
+
+	Totals t = {0};
+	SimBusStats first, last;
+	simI2C2Stats(&first);
+	uint64_t begin = simNow();
+	char line[MAX_LINE];
+	while(fgets(line, sizeof(line), in)){
+		line_num++;
+		if(!runLine(line, &t)){
+			fprintf(stderr, "line %u: invalid transaction\n", line_num);
+			return 1;
+		}
+	}
+
+	simI2C2Stats(&last);
+	printf("I2C2 at %u kHz, I2C1 at %u kHz\n", I2C2_KHZ, I2C1_KHZ);
+	printf("transactions:     %u\n", t.cmds);
+	printf("I2C2 xfers:       %u\n", t.xfers);
+	printf("I2C2 bytes:       %u\n", t.bytes);
+	printf("I2C2 bus time:    %.1f us\n", t.bus_ns / 1000.0);
+	if(t.cmds){
+		printf("avg latency:      %.1f us\n", t.latency_ns / 1000.0 / t.cmds);
+		printf("max latency:      %.1f us\n", t.max_latency_ns / 1000.0);
+	}
+	printf("background xfers: %u (%.1f us bus)\n", last.xfers - first.xfers - t.xfers,
+			(last.busy_ns - first.busy_ns - t.bus_ns) / 1000.0);
+	printf("elapsed:          %.3f ms\n", (simNow() - begin) / 1000000.0);
+	printf("max write time:   %u us (firmware PERF_CMD_MAX_US)\n", perfGet(PERF_CMD_MAX_US));
+	if(mismatches){
+		fprintf(stderr, "%u values didn't match the stream\n", mismatches);
+		return 1;
+	}
+	return 0;
+}
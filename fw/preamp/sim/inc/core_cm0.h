@@ -0,0 +1,66 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Simulated Cortex-M0 core for building the preamp firmware on a host
+ *
+ * Stands in for CMSIS/core/core_cm0.h. The interrupt intrinsics, NVIC and
+ * SysTick are implemented by sim_hw.c, which steps the simulated hardware
+ * whenever the firmware enables interrupts or waits for one.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIM_CORE_CM0_H_
+#define SIM_CORE_CM0_H_
+
+#include <stdint.h>
+
+#define __I  volatile const
+#define __O  volatile
+#define __IO volatile
+#define __STATIC_INLINE static inline
+
+typedef struct{
+	__IO uint32_t CTRL;
+	__IO uint32_t LOAD;
+	__IO uint32_t VAL;
+	__I  uint32_t CALIB;
+}SysTick_Type;
+
+typedef struct{
+	__I  uint32_t CPUID;
+	__IO uint32_t ICSR;
+}SCB_Type;
+
+#define SCB_ICSR_PENDSTSET_Msk (1UL << 26)
+
+extern SysTick_Type sim_systick;
+extern SCB_Type sim_scb;
+#define SysTick (&sim_systick)
+#define SCB     (&sim_scb)
+
+void __disable_irq(void);
+void __enable_irq(void);
+uint32_t __get_PRIMASK(void);
+void __set_PRIMASK(uint32_t primask);
+void __WFI(void);
+void __NOP(void);
+
+void NVIC_EnableIRQ(IRQn_Type irq);
+void NVIC_DisableIRQ(IRQn_Type irq);
+void NVIC_SetPriority(IRQn_Type irq, uint32_t priority);
+uint32_t SysTick_Config(uint32_t ticks);
+
+#endif /* SIM_CORE_CM0_H_ */
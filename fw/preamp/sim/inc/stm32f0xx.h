@@ -0,0 +1,79 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Simulated STM32F030 peripherals for building the preamp firmware on a host
+ *
+ * Uses the real device header for the register layouts and bit definitions,
+ * then points the peripherals the firmware uses at structs in sim_hw.c.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIM_STM32F0XX_H_
+#define SIM_STM32F0XX_H_
+
+#include "../../CMSIS/device/stm32f0xx.h"
+
+#undef GPIOA
+#undef GPIOB
+#undef GPIOC
+#undef GPIOD
+#undef GPIOF
+#undef I2C1
+#undef I2C2
+#undef USART1
+#undef USART2
+#undef RCC
+#undef SYSCFG
+#undef FLASH
+#undef IWDG
+
+// The GPIO ports have a page to themselves so sim_hw.c can catch writes to them
+#define SIM_PAGE_SIZE (4096)
+typedef union{
+	GPIO_TypeDef port[6];
+	uint8_t page[SIM_PAGE_SIZE];
+}SimGpio;
+
+extern SimGpio sim_gpio;
+extern I2C_TypeDef sim_i2c1;
+extern I2C_TypeDef sim_i2c2;
+extern USART_TypeDef sim_usart1;
+extern USART_TypeDef sim_usart2;
+extern RCC_TypeDef sim_rcc;
+extern SYSCFG_TypeDef sim_syscfg;
+extern FLASH_TypeDef sim_flash_regs;
+extern IWDG_TypeDef sim_iwdg;
+extern uint8_t sim_flash[];
+
+#define GPIOA  (&sim_gpio.port[0])
+#define GPIOB  (&sim_gpio.port[1])
+#define GPIOC  (&sim_gpio.port[2])
+#define GPIOD  (&sim_gpio.port[3])
+#define GPIOF  (&sim_gpio.port[5])
+#define I2C1   (&sim_i2c1)
+#define I2C2   (&sim_i2c2)
+#define USART1 (&sim_usart1)
+#define USART2 (&sim_usart2)
+#define RCC    (&sim_rcc)
+#define SYSCFG (&sim_syscfg)
+#define FLASH  (&sim_flash_regs)
+#define IWDG   (&sim_iwdg)
+
+// The firmware's flash layout is placed in sim_flash, which like the other
+// simulated peripherals is linked below 4 GB
+#define FLASH_ORIGIN ((uint32_t)(uintptr_t)sim_flash)
+
+#endif /* SIM_STM32F0XX_H_ */
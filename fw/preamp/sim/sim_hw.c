@@ -0,0 +1,505 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Simulated preamp hardware: clock, interrupts, GPIO and the I2C2 bus
+ *
+ * The firmware runs unmodified against these register structs. Simulated
+ * time only moves when the firmware re-enables interrupts or waits for one,
+ * which is where the hardware is stepped and pending interrupts are taken.
+ * GPIO writes are caught as they happen so BSRR and BRR update ODR before
+ * the next instruction, as the firmware expects. I2C2 is modelled at the register level: START, TXIS/TXDR, RXNE/RXDR, TC,
+ * NACKF and STOPF behave as on the STM32F030, with each byte taking 9 SCL
+ * periods. The volume ICs, front panel, power board GPIO expander and ADC
+ * answer at their real addresses. I2C1, the UARTs, the RCC and the flash
+ * are plain memory.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // REG_EFL
+#include "sim_hw.h"
+#include "stm32f0xx.h"
+#include "main.h"
+#include "stm32f0xx_it.h"
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+
+// Peripherals used by the firmware
+SimGpio sim_gpio __attribute__((aligned(SIM_PAGE_SIZE)));
+I2C_TypeDef sim_i2c1;
+I2C_TypeDef sim_i2c2;
+USART_TypeDef sim_usart1;
+USART_TypeDef sim_usart2;
+RCC_TypeDef sim_rcc;
+SYSCFG_TypeDef sim_syscfg;
+FLASH_TypeDef sim_flash_regs;
+IWDG_TypeDef sim_iwdg; // Never resets the simulation
+uint8_t sim_flash[0x10000]; // Programming is a plain store, erasing does nothing
+SysTick_Type sim_systick;
+SCB_Type sim_scb;
+uint32_t SystemCoreClock = 48000000;
+
+void SystemInit(void){}
+void SystemCoreClockUpdate(void){}
+
+#define NS_PER_MS (1000000ULL)
+#define SCL_NS    (1000000ULL / I2C2_KHZ) // One SCL period
+#define BYTE_NS   (9 * SCL_NS)            // 8 data bits and the ACK
+
+static uint64_t now_ns = 0;
+static uint64_t tick_base = 0;       // When SysTick was started
+static uint64_t tick_ns = NS_PER_MS; // When the next SysTick interrupt is due
+static uint32_t primask = 0;
+static bool in_isr = false;
+static bool i2c2_irq_enabled = false;
+
+// I2C2 devices, each a bank of registers with an auto-incrementing pointer
+typedef struct{
+	uint8_t dev;
+	uint8_t ptr_mask; // Bits of the first byte written that address a register
+	bool rewind;      // Reads start from register 0, like the ADC's scan results
+	uint8_t regs[256];
+	uint8_t ptr;
+	bool first;       // The next byte written is the register address
+}SimDev;
+
+static SimDev devs[] = {
+	{ .dev = 0x88, .ptr_mask = 0x0F }, // Volume IC, channels 1-3
+	{ .dev = 0x8A, .ptr_mask = 0x0F }, // Volume IC, channels 4-6
+	{ .dev = 0x40, .ptr_mask = 0xFF }, // Front panel GPIO expander
+	{ .dev = 0x42, .ptr_mask = 0xFF }, // Power board GPIO expander
+	{ .dev = 0xC8, .ptr_mask = 0x00, .rewind = true }, // ADC
+};
+#define NUM_DEVS (sizeof(devs) / sizeof(devs[0]))
+
+typedef enum{
+	BUS_IDLE,    // Waiting for START
+	BUS_ADDR,    // Sending the address
+	BUS_TX,      // Waiting for the firmware to write TXDR
+	BUS_TX_BYTE, // Shifting out a byte
+	BUS_RX_BYTE, // Shifting in a byte
+	BUS_RX,      // Waiting for the firmware to read RXDR
+	BUS_RESTART, // Transfer complete, waiting for a repeated START
+	BUS_STOP,    // Sending STOP
+}BusState;
+
+#define TXDR_EMPTY (0xFFFFFFFF) // TXDR only holds 8 bits, so this means unwritten
+
+static struct{
+	BusState state;
+	uint64_t due;   // When the current bus step finishes
+	SimDev * dev;
+	bool read;
+	bool autoend;
+	uint8_t nbytes;
+	uint8_t count;
+	SimBusStats stats;
+}bus;
+
+static void applyGpio(){
+	uint8_t p;
+	for(p = 0; p < 6; p++){
+		GPIO_TypeDef * g = &sim_gpio.port[p];
+		uint32_t bsrr = g->BSRR;
+		g->ODR = (g->ODR & ~(bsrr >> 16) & ~g->BRR) | (bsrr & 0xFFFF);
+		g->BSRR = 0;
+		g->BRR = 0;
+		// Outputs read back what they drive, inputs stay pulled up
+		uint32_t out = 0;
+		uint8_t pin;
+		for(pin = 0; pin < 16; pin++){
+			if(((g->MODER >> (2 * pin)) & 3) == 1){
+				out |= 1 << pin;
+			}
+		}
+		g->IDR = (g->IDR & ~out) | (g->ODR & out);
+	}
+}
+
+// The counter keeps running while the interrupt is pending, like the real one
+#if defined(__linux__) && defined(__x86_64__)
+#define TRAP_FLAG (0x100) // EFLAGS.TF, trap after the next instruction
+
+// A write to the GPIO page faults, the page is unprotected and the write is
+// single-stepped, then the trap applies it and protects the page again
+static void gpioWriteFault(int sig, siginfo_t * info, void * context){
+	uint8_t * addr = info->si_addr;
+	if(addr < sim_gpio.page || addr >= sim_gpio.page + SIM_PAGE_SIZE){
+		signal(sig, SIG_DFL); // A real crash
+		return;
+	}
+	mprotect(sim_gpio.page, SIM_PAGE_SIZE, PROT_READ | PROT_WRITE);
+	((ucontext_t *)context)->uc_mcontext.gregs[REG_EFL] |= TRAP_FLAG;
+}
+
+static void gpioWriteDone(int sig, siginfo_t * info, void * context){
+	(void)sig;
+	(void)info;
+	((ucontext_t *)context)->uc_mcontext.gregs[REG_EFL] &= ~TRAP_FLAG;
+	applyGpio();
+	mprotect(sim_gpio.page, SIM_PAGE_SIZE, PROT_READ);
+}
+
+static void trapGpioWrites(){
+	struct sigaction sa = {0};
+	sa.sa_flags = SA_SIGINFO;
+	sa.sa_sigaction = gpioWriteFault;
+	sigaction(SIGSEGV, &sa, NULL);
+	sa.sa_sigaction = gpioWriteDone;
+	sigaction(SIGTRAP, &sa, NULL);
+	applyGpio();
+	mprotect(sim_gpio.page, SIM_PAGE_SIZE, PROT_READ);
+}
+
+// Every write was applied by the trap, writing the page here would fault
+static void updateGpio(){}
+#else
+// GPIO writes only take effect when interrupts are next enabled, so a pin
+// read straight after it is written returns the old value
+static void trapGpioWrites(){}
+
+static void updateGpio(){
+	applyGpio();
+}
+#endif
+
+void simInit(){
+	memset(&bus, 0, sizeof(bus));
+	memset(sim_flash, 0xFF, sizeof(sim_flash)); // Erased
+	uint8_t i;
+	for(i = 0; i < NUM_DEVS; i++){
+		memset(devs[i].regs, 0, sizeof(devs[i].regs));
+	}
+	// Both supplies good, no fan failure or over temp
+	devs[3].regs[0x09] = 0x3F;
+	// ADC: HV1 and HV2 at about 24 V, both heatsinks at about 25 C
+	devs[4].regs[0] = 0x54;
+	devs[4].regs[1] = 0x54;
+	devs[4].regs[2] = 0x51;
+	devs[4].regs[3] = 0x51;
+	for(i = 0; i < 6; i++){
+		sim_gpio.port[i].IDR = 0xFFFF; // Pulled up
+	}
+	trapGpioWrites();
+}
+
+uint64_t simNow(){
+	return now_ns;
+}
+
+static void busStep(uint64_t ns){
+	bus.due = now_ns + ns;
+	bus.stats.busy_ns += ns;
+}
+
+static void busStart(){
+	I2C_TypeDef * i = &sim_i2c2;
+	uint8_t addr = i->CR2 & I2C_CR2_SADD;
+	i->CR2 &= ~I2C_CR2_START;
+	i->ISR &= ~I2C_ISR_TC;
+	i->ISR |= I2C_ISR_BUSY;
+	if(bus.state == BUS_IDLE){
+		bus.stats.xfers++;
+	}
+	bus.dev = NULL;
+	uint8_t d;
+	for(d = 0; d < NUM_DEVS; d++){
+		if(devs[d].dev == (addr & 0xFE)){
+			bus.dev = &devs[d];
+		}
+	}
+	bus.read = (i->CR2 & I2C_CR2_RD_WRN) != 0;
+	bus.autoend = (i->CR2 & I2C_CR2_AUTOEND) != 0;
+	bus.nbytes = (i->CR2 & I2C_CR2_NBYTES) >> 16;
+	bus.count = 0;
+	if(bus.dev){
+		bus.dev->first = !bus.read;
+		if(bus.read && bus.dev->rewind){
+			bus.dev->ptr = 0;
+		}
+	}
+	bus.state = BUS_ADDR;
+	busStep(SCL_NS + BYTE_NS); // START and the address
+}
+
+static void busEndOfBytes(){
+	if(bus.autoend){
+		bus.state = BUS_STOP;
+		busStep(SCL_NS);
+	}else{
+		sim_i2c2.ISR |= I2C_ISR_TC;
+		bus.state = BUS_RESTART;
+	}
+}
+
+static void devWrite(SimDev * d, uint8_t b){
+	if(d->first){
+		d->ptr = b & d->ptr_mask;
+		d->first = false;
+	}else{
+		d->regs[d->ptr++] = b;
+	}
+}
+
+static uint8_t devRead(SimDev * d){
+	return d->regs[d->ptr++];
+}
+
+// Moves the I2C2 bus on to the current time, returns true if anything changed
+static bool stepI2C2(){
+	I2C_TypeDef * i = &sim_i2c2;
+	BusState was = bus.state;
+
+	// Flags cleared by the firmware
+	i->ISR &= ~(i->ICR & (I2C_ISR_ADDR | I2C_ISR_NACKF | I2C_ISR_STOPF | I2C_ISR_BERR | I2C_ISR_ARLO | I2C_ISR_OVR));
+	i->ICR = 0;
+
+	if(!(i->CR1 & I2C_CR1_PE)){
+		// Disabling the peripheral resets it and frees the bus
+		i->ISR = I2C_ISR_TXE;
+		i->CR2 &= ~I2C_CR2_START;
+		bus.state = BUS_IDLE;
+		return was != BUS_IDLE;
+	}
+
+	switch(bus.state){
+	case BUS_IDLE:
+	case BUS_RESTART:
+		if(i->CR2 & I2C_CR2_START){
+			busStart();
+		}
+		break;
+	case BUS_ADDR:
+		if(now_ns >= bus.due){
+			if(!bus.dev){
+				i->ISR |= I2C_ISR_NACKF; // A STOP follows automatically
+				bus.stats.nacks++;
+				bus.state = BUS_STOP;
+				busStep(SCL_NS);
+			}else if(bus.read){
+				bus.state = BUS_RX_BYTE;
+				busStep(BYTE_NS);
+			}else{
+				i->TXDR = TXDR_EMPTY;
+				i->ISR |= I2C_ISR_TXIS;
+				bus.state = BUS_TX;
+			}
+		}
+		break;
+	case BUS_TX:
+		if(i->TXDR != TXDR_EMPTY){
+			i->ISR &= ~I2C_ISR_TXIS;
+			devWrite(bus.dev, i->TXDR);
+			bus.state = BUS_TX_BYTE;
+			busStep(BYTE_NS);
+		}
+		break;
+	case BUS_TX_BYTE:
+		if(now_ns >= bus.due){
+			bus.stats.bytes++;
+			if(++bus.count >= bus.nbytes){
+				busEndOfBytes();
+			}else{
+				i->TXDR = TXDR_EMPTY;
+				i->ISR |= I2C_ISR_TXIS;
+				bus.state = BUS_TX;
+			}
+		}
+		break;
+	case BUS_RX_BYTE:
+		if(now_ns >= bus.due){
+			i->RXDR = devRead(bus.dev);
+			i->ISR |= I2C_ISR_RXNE;
+			bus.stats.bytes++;
+			bus.count++;
+			bus.state = BUS_RX;
+		}
+		break;
+	case BUS_RX:
+		if(!(i->ISR & I2C_ISR_RXNE)){
+			if(bus.count >= bus.nbytes){
+				busEndOfBytes();
+			}else{
+				bus.state = BUS_RX_BYTE;
+				busStep(BYTE_NS);
+			}
+		}
+		break;
+	case BUS_STOP:
+		if(now_ns >= bus.due){
+			i->ISR |= I2C_ISR_STOPF;
+			i->ISR &= ~I2C_ISR_BUSY;
+			bus.state = BUS_IDLE;
+		}
+		break;
+	}
+	return bus.state != was;
+}
+
+static bool i2c2IrqPending(){
+	uint32_t cr1 = sim_i2c2.CR1;
+	uint32_t isr = sim_i2c2.ISR;
+	return i2c2_irq_enabled && (
+		((cr1 & I2C_CR1_TXIE) && (isr & I2C_ISR_TXIS)) ||
+		((cr1 & I2C_CR1_RXIE) && (isr & I2C_ISR_RXNE)) ||
+		((cr1 & I2C_CR1_TCIE) && (isr & I2C_ISR_TC)) ||
+		((cr1 & I2C_CR1_NACKIE) && (isr & I2C_ISR_NACKF)) ||
+		((cr1 & I2C_CR1_STOPIE) && (isr & I2C_ISR_STOPF)) ||
+		((cr1 & I2C_CR1_ERRIE) && (isr & (I2C_ISR_BERR | I2C_ISR_ARLO))));
+}
+
+static void updateSysTick(){
+	uint64_t into_tick = (now_ns - tick_base) % NS_PER_MS;
+	sim_systick.VAL = sim_systick.LOAD - (uint32_t)(into_tick * (SystemCoreClock / 1000000) / 1000);
+	if(now_ns >= tick_ns){
+		sim_scb.ICSR |= SCB_ICSR_PENDSTSET_Msk;
+	}
+}
+
+// Steps the hardware and takes any pending interrupts
+static void pump(){
+	bool changed;
+	do{
+		updateGpio();
+		changed = stepI2C2();
+		updateSysTick();
+		if(primask || in_isr){
+			break;
+		}
+		in_isr = true;
+		if(sim_scb.ICSR & SCB_ICSR_PENDSTSET_Msk){
+			sim_scb.ICSR &= ~SCB_ICSR_PENDSTSET_Msk;
+			tick_ns += NS_PER_MS;
+			SysTick_Handler();
+			changed = true;
+		}
+		if(i2c2IrqPending()){
+			bool rxne = sim_i2c2.ISR & I2C_ISR_RXNE;
+			I2C2_IRQHandler();
+			if(rxne){
+				sim_i2c2.ISR &= ~I2C_ISR_RXNE; // The handler always reads RXDR
+			}
+			changed = true;
+		}
+		in_isr = false;
+	}while(changed);
+}
+
+void simAdvance(uint64_t ns){
+	uint64_t end = now_ns + ns;
+	while(now_ns < end){
+		uint64_t next = end;
+		if(tick_ns < next){
+			next = tick_ns;
+		}
+		if(bus.state != BUS_IDLE && bus.due > now_ns && bus.due < next){
+			next = bus.due;
+		}
+		now_ns = next;
+		pump();
+	}
+}
+
+bool simI2C2Idle(){
+	return bus.state == BUS_IDLE && !(sim_i2c2.CR2 & I2C_CR2_START);
+}
+
+void simI2C2Stats(SimBusStats * stats){
+	*stats = bus.stats;
+}
+
+uint8_t * simDevRegs(uint8_t dev){
+	uint8_t d;
+	for(d = 0; d < NUM_DEVS; d++){
+		if(devs[d].dev == dev){
+			return devs[d].regs;
+		}
+	}
+	return NULL;
+}
+
+void __disable_irq(void){
+	primask = 1;
+}
+
+void __enable_irq(void){
+	primask = 0;
+	now_ns += SIM_CPU_STEP_NS;
+	pump();
+}
+
+uint32_t __get_PRIMASK(void){
+	return primask;
+}
+
+void __set_PRIMASK(uint32_t p){
+	if(p){
+		__disable_irq();
+	}else{
+		__enable_irq();
+	}
+}
+
+uint64_t simNextEvent(){
+	uint64_t next = tick_ns;
+	if(bus.state != BUS_IDLE && bus.due > now_ns && bus.due < next){
+		next = bus.due;
+	}
+	return next;
+}
+
+// Sleeps until the next thing the hardware does
+void __WFI(void){
+	uint64_t next = simNextEvent();
+	if(next <= now_ns){
+		next = now_ns + SIM_CPU_STEP_NS;
+	}
+	uint32_t p = primask;
+	now_ns = next;
+	primask = 0; // Interrupts wake the core even while masked, then run once unmasked
+	pump();
+	primask = p;
+}
+
+void __NOP(void){
+	now_ns += SIM_CPU_STEP_NS;
+}
+
+void NVIC_EnableIRQ(IRQn_Type irq){
+	if(irq == I2C2_IRQn){
+		i2c2_irq_enabled = true;
+	}
+}
+
+void NVIC_DisableIRQ(IRQn_Type irq){
+	if(irq == I2C2_IRQn){
+		i2c2_irq_enabled = false;
+	}
+}
+
+void NVIC_SetPriority(IRQn_Type irq, uint32_t priority){
+	(void)irq;
+	(void)priority;
+}
+
+uint32_t SysTick_Config(uint32_t ticks){
+	sim_systick.LOAD = ticks - 1;
+	sim_systick.VAL = ticks - 1; // Reloads as soon as it is enabled
+	tick_base = now_ns;
+	tick_ns = now_ns + NS_PER_MS;
+	return 0;
+}
@@ -0,0 +1,49 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Simulated preamp hardware: clock, interrupts, GPIO and the I2C2 bus
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIM_HW_H_
+#define SIM_HW_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Simulated time charged each time the firmware enables interrupts,
+// a rough stand-in for the CPU time spent between those points
+#define SIM_CPU_STEP_NS (500)
+
+typedef struct{
+	uint32_t xfers;   // Transactions started, a repeated start counts as one
+	uint32_t bytes;   // Data bytes, not including addresses
+	uint32_t nacks;   // Transactions that were not acknowledged
+	uint64_t busy_ns; // Time SCL was running
+}SimBusStats;
+
+void simInit();
+uint64_t simNow();
+void simAdvance(uint64_t ns);
+uint64_t simNextEvent(); // When the next interrupt is due if nothing else happens
+
+bool simI2C2Idle();
+void simI2C2Stats(SimBusStats * stats);
+
+// Registers of a simulated I2C2 device, by 8-bit address. NULL if there is none.
+uint8_t * simDevRegs(uint8_t dev);
+
+#endif /* SIM_HW_H_ */
@@ -0,0 +1,207 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * On-target timing of the I2C2 driver and GPIO paths
+ *
+ * Built into preamp_bench.elf instead of the normal firmware. Each operation
+ * is run BENCH_ITERATIONS times and timed with micros() from SysTick->VAL,
+ * including the time for any I2C2 transactions it queues to finish. The
+ * results are printed as a table over USART1 to the controller board every
+ * BENCH_PERIOD ms. Channels stay muted, the amps are only taken out of
+ * standby so the volume ICs accept writes.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+#include <stdbool.h>
+#include "channel.h"
+#include "front_panel.h"
+#include "i2c_master.h"
+#include "main.h"
+#include "port_defs.h"
+#include "ports.h"
+#include "power_board.h"
+#include "scheduler.h"
+#include "systick.h"
+#include "uart.h"
+
+typedef void (*BenchOp)(uint32_t i);
+
+typedef struct{
+	const char * name;
+	BenchOp op;
+}Bench;
+
+#define BENCH_VOL (79) // Minimum volume
+
+static uint8_t olat; // Power board outputs, written back unchanged
+
+static void benchReadI2C2(uint32_t i){
+	(void)i;
+	readI2C2(pwr_temp_mntr_gpio);
+}
+
+static void benchWriteI2C2(uint32_t i){
+	(void)i;
+	writeI2C2(pwr_temp_mntr_olat, olat);
+}
+
+// One channel's left and right registers in one transaction
+static void benchSetVolume(uint32_t i){
+	setChannelVolume(0, BENCH_VOL - i % 2); // Alternate so every call is written
+}
+
+// Every channel's volume changing at once, two transactions like restoring after standby
+static void benchSetChannels(uint32_t i){
+	uint8_t srcs[NUM_CHANNELS], vols[NUM_CHANNELS];
+	uint8_t ch;
+	for(ch = 0; ch < NUM_CHANNELS; ch++){
+		srcs[ch] = getChannelSource(ch);
+		vols[ch] = BENCH_VOL - i % 2; // Alternate so every volume changes
+	}
+	setChannels(srcs, 0x3F, vols);
+}
+
+static void benchUpdateFrontPanel(uint32_t i){
+	updateFrontPanel(i % 2); // Alternate the red LED so every call is written
+	flushFrontPanel();
+}
+
+static void benchConnectChannel(uint32_t i){
+	connectChannel(i % NUM_SRCS, 0);
+}
+
+static void benchReadADC(uint32_t i){
+	(void)i;
+	read_ADC();
+}
+
+static const Bench benches[] = {
+	{ "readI2C2",         benchReadI2C2 },
+	{ "writeI2C2",        benchWriteI2C2 },
+	{ "setChannelVolume", benchSetVolume },
+	{ "setChannels",      benchSetChannels },
+	{ "updateFrontPanel", benchUpdateFrontPanel },
+	{ "connectChannel",   benchConnectChannel },
+	{ "read_ADC",         benchReadADC },
+};
+#define NUM_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+// Appends val to the string at s, right aligned to width. Returns the new end.
+static char * putNum(char * s, uint32_t val, uint8_t width){
+	char digits[10];
+	uint8_t n = 0;
+	do{
+		digits[n++] = '0' + val % 10;
+		val /= 10;
+	}while(val);
+	while(width-- > n){
+		*s++ = ' ';
+	}
+	while(n){
+		*s++ = digits[--n];
+	}
+	return s;
+}
+
+static char * putStr(char * s, const char * str, uint8_t width){
+	while(*str){
+		*s++ = *str++;
+		if(width){
+			width--;
+		}
+	}
+	while(width--){
+		*s++ = ' ';
+	}
+	return s;
+}
+
+static void printLine(char * line, char * end){
+	*end++ = 0x0D;
+	*end++ = 0x0A;
+	*end = 0;
+	uartPutString(&uart1, line);
+}
+
+// Times one operation and prints: name, average (0.1 us), min and max in us
+static void runOne(const Bench * b){
+	uint32_t i, min = UINT32_MAX, max = 0, total = 0;
+	for(i = 0; i < BENCH_ITERATIONS; i++){
+		uint32_t start = micros();
+		b->op(i);
+		flushI2C2();
+		uint32_t us = micros() - start;
+		total += us;
+		if(us < min){
+			min = us;
+		}
+		if(us > max){
+			max = us;
+		}
+	}
+
+	char line[64];
+	char * s = putStr(line, b->name, 18);
+	uint32_t avg10 = total * 10 / BENCH_ITERATIONS;
+	s = putNum(s, avg10 / 10, 8);
+	*s++ = '.';
+	s = putNum(s, avg10 % 10, 1);
+	s = putNum(s, min, 8);
+	s = putNum(s, max, 8);
+	printLine(line, s);
+}
+
+static void runAll(){
+	char line[64];
+	char * s = putStr(line, "I2C2 kHz", 18);
+	s = putNum(s, I2C2_KHZ, 10);
+	printLine(line, s);
+	s = putStr(line, "op", 18);
+	s = putStr(s, "  avg us", 0);
+	s = putStr(s, "  min us", 0);
+	s = putStr(s, "  max us", 0);
+	printLine(line, s);
+
+	uint8_t b;
+	for(b = 0; b < NUM_BENCHES; b++){
+		runOne(&benches[b]);
+		runScheduler(); // Keeps the I2C2 timeout check and ramps serviced
+	}
+	printLine(line, line);
+}
+
+// Runs the benchmarks forever in place of the main loop
+void runBench(){
+	initChannels();
+	initSources();
+	int prev = readI2C2(pwr_temp_mntr_olat);
+	olat = prev >= 0 ? prev : PWR_EN_9V | PWR_EN_12V; // Keep the supplies on if it can't be read
+
+	// The volume ICs only accept writes once the amps are out of standby
+	unstandby();
+	while(getPowerState() != PWR_READY){
+		runScheduler();
+	}
+
+	while(1){
+		uint32_t start = millis();
+		runAll();
+		while(millis() - start < BENCH_PERIOD){
+			runScheduler();
+		}
+	}
+}
@@ -27,96 +27,259 @@
 #include "channel.h"
 #include "ports.h"
 #include "front_panel.h"
+#include "i2c_master.h"
+#include "scheduler.h"
 #include "systick.h"
 #include "port_defs.h"
 
 #define DEFAULT_VOL (79) // The minimum volume. Scale goes from 0-79 with 0 being maximum
+#define VOL_AUTO_INC (0x10) // Volume IC subaddress bit that auto-increments the register address
+#define CH_PER_VOL_IC (3)   // Each volume IC has a left and right register for three channels
+#define STANDBY_DELAY (32)    // ms, 16ms is the cutoff value at which the delay prevents speaker popping. 2x factor for safety.
+#define UNSTANDBY_DELAY (250) // ms, need time for volume IC to turn on
+#define DEFAULT_RAMP_INTERVAL (1) // 10 ms per dB
 
-// Keep track of volumes so they are not lost when we standby
-uint8_t volumes[NUM_CHANNELS];
+#define VOL_UNKNOWN (0xFF) // The volume IC register may not hold the volume, e.g. after it was powered off
+#define ALL_CHANNELS ((1 << NUM_CHANNELS) - 1)
+#define ALL_SRCS ((1 << NUM_SRCS) - 1)
 
-static void writeVolume(int ch, uint8_t vol);
-static void restoreVolumes();
+// Everything the channels drive. want is what was last asked for and applied
+// is what the GPIO pins and volume ICs were last set to. applyChannels()
+// only touches the pins and volume registers that differ between the two,
+// so repeating a write costs nothing.
+typedef struct{
+	uint8_t vol[NUM_CHANNELS]; // Attenuation in dB, kept so it is not lost in standby
+	uint8_t src[NUM_CHANNELS]; // Source connected to each channel, NUM_SRCS if none
+	uint8_t mutes;             // Bit N set if channel N is muted
+	uint8_t standby;           // Bit N set if channel N's amp is in standby
+	uint8_t digital;           // Bit N set if input N uses its digital source
+}ChannelState;
+
+static ChannelState want;
+static ChannelState applied;
+
+// Linked channels, so one write changes the volume or mute of every member
+static uint8_t group_members[NUM_GROUPS]; // Bit N set if channel N is in the group
+static uint8_t group_vol[NUM_GROUPS];     // Last volume written to the group
+
+static void applyChannels();
+static void serviceRamps();
 
 // returns true if ch unmuted (HI)
 bool isOn(int ch){
-	return readPin(ch_mute[ch]);
+	return !(applied.mutes & (1 << ch));
 }
 
 // returns true if any ch unmuted (HI)
 bool anyOn(){
-	bool on = false;
-	uint8_t ch;
-	for(ch = 0; ch < NUM_CHANNELS; ch++){
-		on = on | isOn(ch);
-	}
-	return on;
+	return (applied.mutes & ALL_CHANNELS) != ALL_CHANNELS;
+}
+
+// Volume ramps, a channel is ramping while its volume differs from its target
+static uint8_t ramp_target[NUM_CHANNELS];
+static uint8_t ramp_interval[NUM_CHANNELS];
+static uint32_t ramp_stamp[NUM_CHANNELS]; // millis() at the last step
+
+// Power sequencing is timed from the main loop so I2C is serviced meanwhile
+static volatile PowerState power_state = PWR_STANDBY;
+static TimerId power_timer = NO_TIMER;
+
+// Turns off audio power once the amps have settled after standby()
+static void finishStandby(){
+	power_timer = NO_TIMER;
+	setAudioPower(OFF);
+	power_state = PWR_STANDBY;
+}
+
+// Enables the amps once the volume ICs have turned on after unstandby()
+static void finishUnstandby(){
+	power_timer = NO_TIMER;
+	power_state = PWR_READY;
+	want.standby = 0;
+	applyChannels(); // The volume ICs were off, so every volume is written again
 }
 
 // pull all pins LOW to standby all amps
 void standby(){
-	uint8_t ch;
-	for(ch = 0; ch < NUM_CHANNELS; ch++){
-		clearPin(ch_standby[ch]);
+	if(power_state == PWR_STANDBY && applied.standby == ALL_CHANNELS){
+		return; // Already off
 	}
-	delay_ms(32); // 16ms is the cutoff value at which the delay prevents speaker popping. 2x factor for safety.
-	setAudioPower(OFF);
+	want.standby = ALL_CHANNELS;
+	applyChannels();
+	stopTimer(power_timer);
+	power_timer = startTimer(finishStandby, STANDBY_DELAY, 0);
+	power_state = PWR_POWERING_DOWN;
 }
 
 // pull all pins HI to un-standby all amps
 void unstandby(){
-	setAudioPower(ON);
-	uint8_t ch;
-	for(ch = 0; ch < NUM_CHANNELS; ch++){
-		setPin(ch_standby[ch]);
+	if(power_state == PWR_READY){
+		return; // Already on and the volume ICs are up to date
 	}
-	// After returning from standby we need to configure each of the volumes again
-	restoreVolumes();
+	setAudioPower(ON);
+	stopTimer(power_timer);
+	power_timer = startTimer(finishUnstandby, UNSTANDBY_DELAY, 0);
+	power_state = PWR_POWERING_UP;
 }
 
-bool inStandby(){
-	// Checks if any of the channels are in standby
+PowerState getPowerState(){
+	return power_state;
+}
+
+// pull pin LOW to mute
+void mute(int ch){
+	want.mutes |= 1 << ch;
+	applyChannels();
+}
+
+// pull pin HI to unmute
+void unmute(int ch){
+	want.mutes &= ~(1 << ch);
+	applyChannels();
+}
+
+// Bit N of mutes set mutes channel N
+void setMutes(uint8_t mutes){
+	want.mutes = mutes & ALL_CHANNELS;
+	applyChannels();
+}
+
+void setGroupMembers(int group, uint8_t members){
+	group_members[group] = members & ALL_CHANNELS;
+}
+
+uint8_t getGroupMembers(int group){
+	return group_members[group];
+}
+
+// Sets every member's volume in one pass, so each volume IC is written once
+void setGroupVolume(int group, uint8_t vol){
 	uint8_t ch;
-	bool in_stby = false;
+	group_vol[group] = vol;
 	for(ch = 0; ch < NUM_CHANNELS; ch++){
-		in_stby = in_stby || (!readPin(ch_standby[ch]));
+		if(group_members[group] & (1 << ch)){
+			want.vol[ch] = vol;
+			ramp_target[ch] = vol; // Cancels any ramp in progress
+		}
 	}
-	return in_stby;
+	applyChannels();
 }
 
-static inline void quick_mute(int ch){
-	clearPin(ch_mute[ch]);
+uint8_t getGroupVolume(int group){
+	return group_vol[group];
 }
 
-static inline void quick_unmute(int ch){
-	setPin(ch_mute[ch]);
+void setGroupMute(int group, bool muted){
+	if(muted){
+		want.mutes |= group_members[group];
+	}else{
+		want.mutes &= ~group_members[group];
+	}
+	applyChannels();
 }
 
-// pull pin LOW to mute
-void mute(int ch){
-	quick_mute(ch);
-	updateFrontPanel(true);
+// True if the group has members and all of them are muted
+bool isGroupMuted(int group){
+	return group_members[group] && (want.mutes & group_members[group]) == group_members[group];
 }
 
-// pull pin HI to unmute
-void unmute(int ch){
-	quick_unmute(ch);
-	updateFrontPanel(true);
+// Writes the volumes that changed, each volume IC in at most one transaction.
+// The left and right registers of a volume IC's three channels are
+// consecutive, so one burst covers the first to the last changed channel.
+static void applyVolumes(){
+	uint8_t regs[2*CH_PER_VOL_IC];
+	uint8_t first, ch, lo, hi, n;
+	for(first = 0; first < NUM_CHANNELS; first += CH_PER_VOL_IC){
+		lo = NUM_CHANNELS;
+		hi = 0;
+		for(ch = first; ch < first + CH_PER_VOL_IC; ch++){
+			if(want.vol[ch] != applied.vol[ch]){
+				lo = lo < ch ? lo : ch;
+				hi = ch;
+			}
+		}
+		if(lo == NUM_CHANNELS){
+			continue;
+		}
+		n = 0;
+		for(ch = lo; ch <= hi; ch++){
+			regs[n++] = want.vol[ch];
+			regs[n++] = want.vol[ch];
+			applied.vol[ch] = want.vol[ch];
+		}
+		I2CReg r = {ch_left[lo].dev, ch_left[lo].reg | VOL_AUTO_INC};
+		writeBurstI2C2(r, regs, n);
+	}
 }
 
-void writeVolume(int ch, uint8_t vol){
-	// Writes volume level to the volume ICs
-	if (!inStandby()){ // we can't write to the volume registers if they are disabled
-		writeI2C2(ch_left[ch], vol);
-		writeI2C2(ch_right[ch], vol);
+// Brings the hardware in line with want, changing only what differs from applied
+static void applyChannels(){
+	PinMasks before = {{0}, {0}}; // Mutes and amps entering standby
+	PinMasks route = {{0}, {0}};  // Routing, input types and amps leaving standby
+	PinMasks after = {{0}, {0}};  // Unmutes, once the routing and volumes are in place
+	uint8_t ch, src;
+	uint8_t entering = want.standby & ~applied.standby;
+	uint8_t leaving = applied.standby & ~want.standby;
+
+	for(ch = 0; ch < NUM_CHANNELS; ch++){
+		uint8_t bit = 1 << ch;
+		bool reroute = want.src[ch] != applied.src[ch];
+		bool on = !(applied.mutes & bit);
+		bool on_after = !(want.mutes & bit);
+		// mute the channel during a source switch to avoid an audible pop
+		if(on && (reroute || !on_after)){
+			addPin(&before, ch_mute[ch], false);
+		}
+		if(on_after && (reroute || !on)){
+			addPin(&after, ch_mute[ch], true);
+		}
+		if(reroute){
+			for(src = 0; src < NUM_SRCS; src++){
+				addPin(&route, ch_src[ch][src], src == want.src[ch]);
+			}
+		}
+		if(entering & bit){
+			addPin(&before, ch_standby[ch], false);
+		}
+		if(leaving & bit){
+			addPin(&route, ch_standby[ch], true);
+		}
+	}
+	for(src = 0; src < NUM_SRCS; src++){
+		uint8_t bit = 1 << src;
+		if((want.digital ^ applied.digital) & bit){
+			// each input selects between a digital source and an analog one
+			addPin(&route, src_den[src], want.digital & bit);
+			addPin(&route, src_aen[src], !(want.digital & bit));
+		}
 	}
-}
 
-static void restoreVolumes() {
-	// restores the volume state when returning from standby
-	uint8_t ch;
-	for (ch = 0; ch < NUM_CHANNELS; ch++) {
-		writeVolume(ch, volumes[ch]);
+	if(entering){
+		flushI2C2(); // Let any queued volume changes reach the amps first
+	}
+	applyPinMasks(&before);
+	applyPinMasks(&route);
+	bool mutes_changed = want.mutes != applied.mutes;
+	for(ch = 0; ch < NUM_CHANNELS; ch++){
+		applied.src[ch] = want.src[ch];
+		if(entering & (1 << ch)){
+			applied.vol[ch] = VOL_UNKNOWN; // Lost when audio power turns off
+		}
+	}
+	applied.mutes = want.mutes;
+	applied.standby = want.standby;
+	applied.digital = want.digital;
+
+	// we can't write to the volume registers if they are disabled
+	if(!applied.standby){
+		applyVolumes();
+		if(after.set[0] | after.set[1] | after.set[2] | after.set[3] | after.set[4]){
+			flushI2C2(); // Unmute only once the new volumes are in place
+		}
+	}
+	applyPinMasks(&after);
+	if(mutes_changed){
+		updateFrontPanel(true);
 	}
 }
 
@@ -124,11 +287,24 @@ void initChannels(){
 	// initialize each channel's volume state (does not write to volume control ICs)
 	uint8_t ch;
 	for (ch = 0; ch < NUM_CHANNELS; ch++) {
-		volumes[ch] = DEFAULT_VOL;
-		connectChannel(0,  ch);
-		mute(ch);
+		want.vol[ch] = DEFAULT_VOL;
+		want.src[ch] = 0;
+		applied.vol[ch] = VOL_UNKNOWN;
+		applied.src[ch] = VOL_UNKNOWN; // Not a source, so every routing pin is written
+		ramp_target[ch] = DEFAULT_VOL;
+		ramp_interval[ch] = DEFAULT_RAMP_INTERVAL;
 	}
+	for (ch = 0; ch < NUM_GROUPS; ch++) {
+		group_vol[ch] = DEFAULT_VOL;
+	}
+	// The pins start in an unknown state, so mark each as the opposite of what is wanted
+	want.mutes = ALL_CHANNELS;
+	want.digital = ALL_SRCS;
+	applied.mutes = 0;
+	applied.standby = 0;
+	applied.digital = 0;
 	standby();
+	startTimer(serviceRamps, RAMP_TICK, RAMP_TICK);
 }
 
 void initSources(){
@@ -149,54 +325,104 @@ void setChannelVolume(int ch, uint8_t vol){
 	}
 #endif
 
-	// keep track of the volume so it is not lost when we standby
-	volumes[ch] = vol;
+	want.vol[ch] = vol;
+	ramp_target[ch] = vol; // Cancels any ramp in progress
+	applyChannels();
+}
+
+// Steps the volume of a channel towards vol by 1 dB every ramp interval
+void rampChannelVolume(int ch, uint8_t vol){
+	if(ramp_interval[ch] == 0){
+		setChannelVolume(ch, vol);
+		return;
+	}
+	ramp_target[ch] = vol;
+	ramp_stamp[ch] = millis() - RAMP_TICK * ramp_interval[ch]; // First step right away
+}
+
+// Steps any ramping channels, runs every RAMP_TICK
+static void serviceRamps(){
+	uint32_t now = millis();
+	bool stepped = false;
+	uint8_t ch;
+	for(ch = 0; ch < NUM_CHANNELS; ch++){
+		if(want.vol[ch] != ramp_target[ch] && now - ramp_stamp[ch] >= RAMP_TICK * ramp_interval[ch]){
+			want.vol[ch] += want.vol[ch] < ramp_target[ch] ? 1 : -1;
+			ramp_stamp[ch] = now;
+			stepped = true;
+		}
+	}
+	if(stepped){
+		applyChannels(); // Every channel that stepped, each volume IC in one transaction
+	}
+}
 
-	// actually write the volume to the volume control IC
-	writeVolume(ch, vol);
+// Time between ramp steps in units of RAMP_TICK, 0 makes ramps jump straight to the target
+void setRampInterval(int ch, uint8_t interval){
+	ramp_interval[ch] = interval;
 }
 
-static inline void clearConnection(int src, int ch){
-	// Removes a source/channel dependency
-	clearPin(ch_src[ch][src]);
+uint8_t getRampInterval(int ch){
+	return ramp_interval[ch];
 }
 
-static inline void addConnection(int src, int ch){
-	// Connects a source to a channel
-	setPin(ch_src[ch][src]);
+uint8_t getRampTarget(int ch){
+	return ramp_target[ch];
 }
 
 void configInput(int src, InputType type){
-	// each input can select between a digital source and an analog one
-	switch(type){
-	case IT_ANALOG:
-		setPin(src_aen[src]);
-		clearPin(src_den[src]);
-		break;
-	case IT_DIGITAL:
-		setPin(src_den[src]);
-		clearPin(src_aen[src]);
-		break;
+	if(type == IT_DIGITAL){
+		want.digital |= 1 << src;
+	}else{
+		want.digital &= ~(1 << src);
 	}
+	applyChannels();
 }
 
-void connectChannel(int src, int ch){
-	// mute the channel during the switch to avoid an audible pop
-	bool was_unmuted = isOn(ch);
-	if (was_unmuted) {
-		quick_mute(ch);
+// Connects srcs[i] to channel first + i for num channels. A source of NUM_SRCS
+// or above disconnects the channel. Every routing pin changes at once, inside
+// one mute window for the channels that are playing.
+void connectChannels(int first, int num, const uint8_t * srcs){
+	uint8_t ch;
+	for(ch = first; ch < first + num; ch++){
+		want.src[ch] = srcs[ch - first] < NUM_SRCS ? srcs[ch - first] : NUM_SRCS;
 	}
+	applyChannels();
+}
 
-	uint8_t asrc;
-	for(asrc = 0; asrc < NUM_SRCS; asrc++){
-		clearConnection(asrc, ch);
-	}
+void connectChannel(int src, int ch){
+	uint8_t s = src;
+	connectChannels(ch, 1, &s);
+}
 
-	if(src < NUM_SRCS){
-		addConnection(src, ch);
+// Sets the source, mute and volume of every channel in one pass. Only what
+// changes is touched, and source switches share a single mute window.
+// Bit N of mutes set mutes channel N.
+void setChannels(const uint8_t * srcs, uint8_t mutes, const uint8_t * vols){
+	uint8_t ch;
+	for(ch = 0; ch < NUM_CHANNELS; ch++){
+		want.src[ch] = srcs[ch] < NUM_SRCS ? srcs[ch] : NUM_SRCS;
+		want.vol[ch] = vols[ch];
+		ramp_target[ch] = vols[ch];
 	}
+	want.mutes = mutes & ALL_CHANNELS;
+	applyChannels();
+}
 
-	if (was_unmuted) {
-		quick_unmute(ch);
-	}
+uint8_t getChannelSource(int ch){
+	return want.src[ch];
+}
+
+uint8_t getChannelVolume(int ch){
+	return want.vol[ch];
+}
+
+// Bit N set if channel N is muted
+uint8_t getMutes(){
+	return want.mutes;
+}
+
+// Bit N set if input N uses its digital source
+uint8_t getDigitalInputs(){
+	return want.digital;
 }
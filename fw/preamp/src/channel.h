@@ -28,23 +28,56 @@
 // Uncomment this line to enable automatic mute control via high/low volume.
 // #define AUTO_MUTE_CTRL
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#define NUM_GROUPS (4)
+
 typedef enum{IT_ANALOG, IT_DIGITAL} InputType;
 
+// Readable by the controller board in REG_POWER_STATE
+typedef enum{
+	PWR_STANDBY = 0,       // Amps in standby, audio power off
+	PWR_POWERING_UP = 1,   // Waiting on the volume ICs before enabling the amps
+	PWR_READY = 2,         // Amps enabled
+	PWR_POWERING_DOWN = 3  // Waiting on the amps before turning off audio power
+}PowerState;
+
 bool isOn(int ch);
 bool anyOn();
 
 void standby();
 void unstandby();
+PowerState getPowerState();
 
 void mute(int ch);
 void unmute(int ch);
+void setMutes(uint8_t mutes);
+
+void setGroupMembers(int group, uint8_t members);
+uint8_t getGroupMembers(int group);
+void setGroupVolume(int group, uint8_t vol);
+uint8_t getGroupVolume(int group);
+void setGroupMute(int group, bool muted);
+bool isGroupMuted(int group);
 
 void initChannels();
 void initSources();
 void setChannelVolume(int ch_out, uint8_t vol);
+
+#define RAMP_TICK (10) // ms, unit of the ramp interval
+
+void rampChannelVolume(int ch, uint8_t vol);
+void setRampInterval(int ch, uint8_t interval);
+uint8_t getRampInterval(int ch);
+uint8_t getRampTarget(int ch);
 void configInput(int src, InputType type);
 void connectChannel(int ch_in, int ch_out);
+void connectChannels(int first, int num, const uint8_t * srcs);
+void setChannels(const uint8_t * srcs, uint8_t mutes, const uint8_t * vols);
+uint8_t getChannelSource(int ch);
+uint8_t getChannelVolume(int ch);
+uint8_t getMutes();
+uint8_t getDigitalInputs();
 
 #endif /* CHANNEL_H_ */
@@ -0,0 +1,141 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Diagnostics over the UART once the preamp is addressed
+ *
+ * After the address chain has been acknowledged USART1 stays up as a slow
+ * side channel, so counters and register values can be pulled without
+ * using time on the I2C bus that carries the controller board's commands.
+ * Commands are hex, one per line ending in "\r\n", and checked every
+ * DIAG_PERIOD ms:
+ *   V          Version, answered with "V<major>.<minor> <hash>"
+ *   P<sel>     Performance counter sel, as PERF_SEL, answered "P<sel> <value>"
+ *   R<reg>     Register value as read over I2C, answered "R<reg> <value>"
+ *   R<reg><i>  Byte i of a multi-byte register
+ *   T          Oldest trace record, answered "T<seq> <record>" with the record
+ *              as in TRACE_DATA, or just "T" once there are none left. Stops
+ *              the trace recording.
+ *   ><cmd>     Passed to the next preamp, whose answers are passed back up
+ * Anything else is answered with "?". Answers that don't fit the transmit
+ * ring are dropped rather than waited for.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "diag.h"
+#include <stdbool.h>
+#include "i2c_slave.h"
+#include "perf.h"
+#include "scheduler.h"
+#include "trace.h"
+#include "uart.h"
+#include "version.h"
+
+static UartLine upstream;
+static UartLine downstream;
+
+static const char hex[] = "0123456789ABCDEF";
+
+// Parses two hex digits, returns -1 if they aren't
+static int16_t parseHex8(const uint8_t * s){
+	int16_t val = 0;
+	uint8_t i;
+	for(i = 0; i < 2; i++){
+		uint8_t c = s[i];
+		val <<= 4;
+		if(c >= '0' && c <= '9'){
+			val |= c - '0';
+		}else if(c >= 'A' && c <= 'F'){
+			val |= c - 'A' + 10;
+		}else if(c >= 'a' && c <= 'f'){
+			val |= c - 'a' + 10;
+		}else{
+			return -1;
+		}
+	}
+	return val;
+}
+
+// Appends len hex digits of val to buf at *pos
+static void putHex(uint8_t * buf, uint8_t * pos, uint32_t val, uint8_t digits){
+	while(digits--){
+		buf[(*pos)++] = hex[(val >> (4 * digits)) & 0xF];
+	}
+}
+
+static void answer(const UartLine * l){
+	uint8_t args = l->len - 3; // Characters between the command and "\r\n"
+	uint8_t out[24];
+	uint8_t n = 0;
+	int16_t a = args >= 2 ? parseHex8(&l->data[1]) : -1;
+	int16_t b = args >= 4 ? parseHex8(&l->data[3]) : 0;
+
+	out[n++] = l->data[0];
+	if(l->data[0] == 'V' && args == 0){
+		putHex(out, &n, VERSION_MAJOR, 2);
+		out[n++] = '.';
+		putHex(out, &n, VERSION_MINOR, 2);
+		out[n++] = ' ';
+		putHex(out, &n, GIT_HASH_27_20, 2);
+		putHex(out, &n, GIT_HASH_19_12, 2);
+		putHex(out, &n, GIT_HASH_11_04, 2);
+		putHex(out, &n, GIT_HASH_03_00_STATUS, 2);
+	}else if(l->data[0] == 'P' && args == 2 && a >= 0){
+		putHex(out, &n, a, 2);
+		out[n++] = ' ';
+		putHex(out, &n, perfGet(a), 8);
+	}else if(l->data[0] == 'R' && (args == 2 || args == 4) && a >= 0 && b >= 0){
+		putHex(out, &n, a, 2);
+		out[n++] = ' ';
+		putHex(out, &n, readReg(a, b), 2);
+	}else if(l->data[0] == 'T' && args == 0){
+		uint16_t seq;
+		uint8_t record[TRACE_RECORD_LEN];
+		uint8_t i;
+		if(nextTraceRecord(&seq, record)){
+			putHex(out, &n, seq, 4);
+			out[n++] = ' ';
+			for(i = 0; i < TRACE_RECORD_LEN; i++){
+				putHex(out, &n, record[i], 2);
+			}
+		}
+	}else{
+		out[0] = '?';
+	}
+	out[n++] = 0x0D;
+	out[n++] = 0x0A;
+	uartWrite(&uart1, out, n);
+}
+
+static void serviceDiag(){
+	if(uartReadLine(&uart1, &upstream) && !upstream.ovf && upstream.len > 2){
+		if(upstream.data[0] == '>'){
+			uartWrite(&uart2, &upstream.data[1], upstream.len - 1);
+		}else{
+			answer(&upstream);
+		}
+	}
+	if(uartReadLine(&uart2, &downstream) && !downstream.ovf){
+		uartWrite(&uart1, downstream.data, downstream.len);
+	}
+}
+
+// Called once the chain has acknowledged its addresses, so nothing else is
+// still reading the UARTs
+void initDiag(){
+	uartDiscard(&uart1);
+	uartDiscard(&uart2);
+	startTimer(serviceDiag, DIAG_PERIOD, DIAG_PERIOD);
+}
@@ -0,0 +1,102 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Latched fault and state-change events with an interrupt line to the Pi
+ *
+ * Changes of the power board GPIO inputs are latched into EVENTS from the
+ * status cache. While EVENT_MASK is set, EXT_GPIO becomes an open-drain
+ * interrupt line that is pulled low while any unmasked event is latched.
+ * The lines of every preamp can be wired together to one Pi GPIO, so the
+ * Pi waits for a falling edge and only reads EVENTS of the preamps that
+ * flag one instead of polling every preamp's status.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "events.h"
+#include "power_board.h"
+#include "scheduler.h"
+#include "status.h"
+#include "systick.h"
+
+static volatile uint8_t events = EVENT_BOOT;
+static volatile uint8_t mask = 0; // 0 leaves EXT_GPIO as a normal output
+static uint8_t last_gpio;
+static bool asserted = false;
+static uint32_t last_poll = 0;
+
+// Latches the changes since the last call and updates the interrupt line
+static void serviceEvents(){
+	uint8_t gpio = getStatus(STATUS_PWR_GPIO);
+	uint8_t changed = gpio ^ last_gpio;
+	last_gpio = gpio;
+	if(changed & PWR_PG_9V){
+		events |= EVENT_PG_9V;
+	}
+	if(changed & PWR_PG_12V){
+		events |= EVENT_PG_12V;
+	}
+	if(changed & PWR_OVR_TMP){
+		events |= EVENT_OVR_TMP;
+	}
+	if(changed & PWR_FAN_FAIL){
+		events |= EVENT_FAN_FAIL;
+	}
+	if(changed & PWR_FAN_ON){
+		events |= EVENT_FAN_ON;
+	}
+
+	bool assert = (events & mask) != 0;
+	if(assert != asserted){
+		asserted = assert;
+		assertIntLine(assert);
+	}
+
+	uint32_t now = millis();
+	if(mask && getStatusPeriod() == 0 && now - last_poll >= EVENT_POLL_PERIOD){
+		last_poll = now;
+		refreshStatus(STATUS_PWR_GPIO); // Keep watching while background sampling is paused
+	}
+}
+
+void initEvents(){
+	last_gpio = getStatus(STATUS_PWR_GPIO);
+	startTimer(serviceEvents, 1, 1);
+}
+
+uint8_t getEvents(){
+	return events;
+}
+
+// Latches events raised outside of the power board inputs
+void latchEvents(uint8_t e){
+	events |= e;
+}
+
+// Clears the given events, events that happen again later are latched again
+void clearEvents(uint8_t e){
+	events &= ~e;
+}
+
+// Events that pull the interrupt line low, 0 hands EXT_GPIO back to EXTERNAL_GPIO
+void setEventMask(uint8_t m){
+	mask = m;
+	enableIntLine(m != 0);
+	asserted = false; // The line starts released, the next service asserts it if needed
+}
+
+uint8_t getEventMask(){
+	return mask;
+}
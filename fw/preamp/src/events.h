@@ -0,0 +1,45 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Latched fault and state-change events with an interrupt line to the Pi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVENTS_H_
+#define EVENTS_H_
+
+#include <stdint.h>
+
+// EVENTS bits, each is set when the condition changes and held until cleared
+#define EVENT_PG_9V    (0x01) // 9V power good changed
+#define EVENT_PG_12V   (0x02) // 12V power good changed
+#define EVENT_OVR_TMP  (0x04) // Power board over temp changed
+#define EVENT_FAN_FAIL (0x08) // Fan failure changed
+#define EVENT_FAN_ON   (0x10) // Fan turned on or off
+#define EVENT_WATCHDOG (0x40) // The preamp recovered from a watchdog reset, see watchdog.c
+#define EVENT_BOOT     (0x80) // The preamp has reset since this was last cleared
+
+#define EVENT_POLL_PERIOD (10) // ms between GPIO samples while status sampling is paused
+
+void initEvents();
+
+uint8_t getEvents();
+void latchEvents(uint8_t events);
+void clearEvents(uint8_t events);
+void setEventMask(uint8_t mask);
+uint8_t getEventMask();
+
+#endif /* EVENTS_H_ */
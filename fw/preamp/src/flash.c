@@ -0,0 +1,78 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Flash layout and programming, shared by the bootloader and the firmware
+ *
+ * The flash is programmed a half-word at a time and erased a page at a
+ * time. Both stall instruction fetches from flash until they finish, so
+ * the firmware only ever erases one page at a time between other work.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "flash.h"
+
+void flashUnlock(){
+	if(FLASH->CR & FLASH_CR_LOCK){
+		FLASH->KEYR = FLASH_FKEY1;
+		FLASH->KEYR = FLASH_FKEY2;
+	}
+}
+
+void flashLock(){
+	FLASH->CR |= FLASH_CR_LOCK;
+}
+
+// Waits for the last operation and returns false if it failed
+static bool waitFlash(){
+	while(FLASH->SR & FLASH_SR_BSY);
+	uint32_t sr = FLASH->SR;
+	FLASH->SR = sr & (FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR); // Write 1 to clear
+	return !(sr & (FLASH_SR_PGERR | FLASH_SR_WRPRTERR));
+}
+
+// Erases the page holding addr, the flash must be unlocked
+bool flashErasePage(uint32_t addr){
+	FLASH->CR |= FLASH_CR_PER;
+	FLASH->AR = addr;
+	FLASH->CR |= FLASH_CR_STRT;
+	bool ok = waitFlash();
+	FLASH->CR &= ~FLASH_CR_PER;
+	return ok;
+}
+
+// Programs an erased half-word and reads it back, the flash must be unlocked
+bool flashProgram(uint32_t addr, uint16_t val){
+	volatile uint16_t * p = (volatile uint16_t *)(uintptr_t)addr;
+	FLASH->CR |= FLASH_CR_PG;
+	*p = val;
+	bool ok = waitFlash();
+	FLASH->CR &= ~FLASH_CR_PG;
+	return ok && *p == val;
+}
+
+// CRC-32 as used by zlib. Start with crc = 0 and pass the result of the
+// previous call to continue.
+uint32_t crc32(uint32_t crc, const uint8_t * data, uint32_t len){
+	crc = ~crc;
+	while(len--){
+		crc ^= *data++;
+		uint8_t bit;
+		for(bit = 0; bit < 8; bit++){
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+		}
+	}
+	return ~crc;
+}
@@ -0,0 +1,61 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Flash layout and programming, shared by the bootloader and the firmware
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FLASH_H_
+#define FLASH_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "stm32f0xx.h"
+
+#ifndef FLASH_ORIGIN
+#define FLASH_ORIGIN (FLASH_BASE)
+#endif
+
+// The 64 KB of flash, these must match the MEMORY regions of LinkerScript.ld
+// and boot/LinkerScript.ld
+#define FLASH_PAGE_SIZE (0x400)
+#define BOOT_ADDR       (FLASH_ORIGIN)          // 4 KB bootloader, the code fits in the first 2 KB
+#define SNAPSHOT_ADDR   (BOOT_ADDR + 0x800)     // The bootloader's last two pages, channel state snapshots
+#define SNAPSHOT_PAGES  (2)
+#define APP_ADDR        (FLASH_ORIGIN + 0x1000) // The firmware runs from here
+#define SLOT_SIZE       (0x7400)                // 29 KB for each image
+#define STAGE_ADDR      (APP_ADDR + SLOT_SIZE)  // A new image is received here
+#define META_ADDR       (STAGE_ADDR + SLOT_SIZE) // One page describing the staged image
+#define PRESET_ADDR     (META_ADDR + FLASH_PAGE_SIZE) // The last page, scene presets
+
+#define FW_META_MAGIC (0x31574650) // "PFW1"
+
+// Written to META_ADDR once a staged image has been received and checked.
+// The bootloader copies it to APP_ADDR on the next reset and then erases this.
+typedef struct{
+	uint32_t magic;
+	uint32_t len; // Bytes
+	uint32_t crc; // CRC-32 of the image, as zlib.crc32()
+}FwMeta;
+
+void flashUnlock();
+void flashLock();
+bool flashErasePage(uint32_t addr);
+bool flashProgram(uint32_t addr, uint16_t val);
+
+uint32_t crc32(uint32_t crc, const uint8_t * data, uint32_t len);
+
+#endif /* FLASH_H_ */
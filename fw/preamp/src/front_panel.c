@@ -4,6 +4,13 @@
  *
  * Control for front panel LEDs
  *
+ * The LEDs follow the power and channel state unless LED_PATTERN selects a
+ * blink pattern, which is rendered here from a scheduler timer toggling the
+ * phase every half LED_PERIOD. The expander is only written when the
+ * rendered byte changes, so a pattern costs one I2C2 write per transition
+ * and no traffic from the controller board. The red blink while waiting for
+ * an address uses the same timer.
+ *
  * This program is free software: you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
  * the Free Software Foundation, either version 3 of the License, or
@@ -22,7 +29,8 @@
 #include <stdbool.h>
 #include "ports.h"
 #include "channel.h"
-#include "systick.h"
+#include "status.h"
+#include "scheduler.h"
 
 bool audio_power_on = false;
 
@@ -43,10 +51,7 @@ void setAudioPower(bool on){
 //
 //	writeI2C2(pwr_temp_mntr_olat, msg);
 	updateFrontPanel(!on);
-	if(on == 1)
-	{
-		delay_ms(250); // need time for volume IC to turn on
-	}
+	// The volume ICs need time to turn on, unstandby() waits before enabling the amps
 }
 
 void enableFrontPanel(){
@@ -56,12 +61,37 @@ void enableFrontPanel(){
 	writeI2C2(front_panel_dir, ALL_OUTPUT);
 }
 
-// Updates the LEDs on the front panel depending on the system state
+// Last byte written to the front panel, so unchanged LEDs are not rewritten
+static uint8_t led_shadow = 0;
+static bool led_shadow_valid = false;
+static bool led_dirty = false;
+static bool led_red_on = false;
+
+static uint8_t led_pattern = LED_PATTERN_STATUS;
+static uint8_t led_period = LED_PERIOD_DEFAULT;
+static bool led_phase = true; // First half of the period, LEDs on
+static TimerId led_timer = NO_TIMER;
+
+// Marks the LEDs on the front panel as needing an update. The LEDs are
+// written once by flushFrontPanel() so several changes cost one I2C2 write.
 void updateFrontPanel(bool red_on){
+	led_red_on = red_on;
+	led_dirty = true;
+	deferWork(flushFrontPanel);
+}
+
+// Updates the LEDs on the front panel depending on the system state
+void flushFrontPanel(){
+	if(!led_dirty){
+		return;
+	}
+	led_dirty = false;
+
 	// bit 0: Green "System On" LED
 	// bit 1: Red "System Standby" LED
 	// bits 2-7: channels 1 to 6 (in that corresponding order)
 	uint8_t bits = 0;
+	bool red_on = led_red_on;
 	if(audio_power_on == true){
 		red_on = false; // Turn off the RED LED when the GREEN LED is going to be on
 	}
@@ -74,5 +104,69 @@ void updateFrontPanel(bool red_on){
 		bits |= (isOn(ch) ? 1 : 0) << (ch + 2);
 	}
 
+	switch(led_pattern){
+		case LED_PATTERN_IDENTIFY:
+			bits = led_phase ? 0xFF : 0x00;
+			break;
+		case LED_PATTERN_FAULT:
+			bits = (bits & ~3) | (led_phase ? 2 : 0);
+			break;
+		case LED_PATTERN_ALTERNATE:
+			bits = led_phase ? 2 : 1;
+			break;
+	}
+
+	if(!led_shadow_valid || bits != led_shadow){
+		writeFrontPanel(bits);
+	}
+}
+
+// Sets every LED directly
+void writeFrontPanel(uint8_t bits){
 	writeI2C2(front_panel, bits);
+	led_shadow = bits;
+	led_shadow_valid = true;
+	setStatus(STATUS_FRONT_PANEL, bits);
+}
+
+static void toggleLedPhase(){
+	led_phase = !led_phase;
+	led_dirty = true;
+	flushFrontPanel();
+}
+
+// Restarts the pattern from the start of its on phase
+static void restartPattern(){
+	stopTimer(led_timer);
+	led_timer = NO_TIMER;
+	led_phase = true;
+	if(led_pattern != LED_PATTERN_STATUS){
+		uint32_t half = led_period * 5; // 10 ms units, half a period
+		led_timer = startTimer(toggleLedPhase, half, half);
+	}
+	led_dirty = true;
+	deferWork(flushFrontPanel);
+}
+
+// Unknown patterns are ignored. Every write restarts the pattern, so a
+// broadcast write starts the whole chain blinking in step.
+void setLedPattern(uint8_t pattern){
+	if(pattern >= LED_PATTERN_COUNT){
+		return;
+	}
+	led_pattern = pattern;
+	restartPattern();
+}
+
+uint8_t getLedPattern(){
+	return led_pattern;
+}
+
+void setLedPeriod(uint8_t period){
+	led_period = period < LED_PERIOD_MIN ? LED_PERIOD_MIN : period;
+	restartPattern();
+}
+
+uint8_t getLedPeriod(){
+	return led_period;
 }
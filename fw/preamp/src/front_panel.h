@@ -26,9 +26,26 @@
 #define ON (true)
 #define OFF (false)
 
+// LED_PATTERN values, rendered by the preamp on top of the usual LED state
+#define LED_PATTERN_STATUS    (0) // LEDs follow power and channel state
+#define LED_PATTERN_IDENTIFY  (1) // Every LED blinks together
+#define LED_PATTERN_FAULT     (2) // Red blinks, green off, zones as usual
+#define LED_PATTERN_ALTERNATE (3) // Red and green alternate, zones off
+#define LED_PATTERN_COUNT     (4)
+
+#define LED_PERIOD_DEFAULT (100) // LED_PERIOD in 10 ms units, one on/off cycle
+#define LED_PERIOD_MIN     (2)
+
 void setAudioPower(bool on);
 
 void enableFrontPanel();
 void updateFrontPanel(bool on);
+void flushFrontPanel();
+void writeFrontPanel(uint8_t bits);
+
+void setLedPattern(uint8_t pattern);
+uint8_t getLedPattern();
+void setLedPeriod(uint8_t period);
+uint8_t getLedPeriod();
 
 #endif /* FRONT_PANEL_H_ */
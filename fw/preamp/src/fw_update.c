@@ -0,0 +1,155 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Firmware update over I2C, installed by the bootloader on the next reset
+ *
+ * A new image is streamed into the staging slot through FW_DATA while the
+ * firmware keeps running: FW_CMD_BEGIN erases the slot, one page per
+ * millisecond so the main loop keeps up, then each byte written to FW_DATA
+ * is appended and programmed. Once FW_CRC holds the image's CRC-32,
+ * FW_CMD_COMMIT checks it and writes the FwMeta record that tells the
+ * bootloader to install the image. The update registers are accepted on
+ * the broadcast address, so every preamp in a chain can be sent the same
+ * image at once and then checked one by one.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "fw_update.h"
+#include "flash.h"
+#include "scheduler.h"
+
+#define NUM_STAGE_PAGES (SLOT_SIZE / FLASH_PAGE_SIZE)
+
+static uint8_t state = FW_IDLE;
+static uint16_t offset = 0;    // Bytes received
+static uint32_t crc = 0;       // CRC-32 of the bytes received
+static uint32_t expected = 0;  // Written through FW_CRC, least significant byte first
+static int16_t odd_byte = -1;  // First byte of a half-word not yet programmed
+static uint8_t erase_page = 0; // Next page for FW_ERASING to erase
+static TimerId erase_timer = NO_TIMER;
+
+// Stops erasing and locks the flash until the next begin
+static void finish(uint8_t new_state){
+	stopTimer(erase_timer);
+	erase_timer = NO_TIMER;
+	flashLock();
+	state = new_state;
+}
+
+// Erases the meta page first so an image that was staged before is dropped,
+// then the staging slot a page at a time. Each page stalls the CPU and the
+// I2C1 interrupt for 20-40 ms, so the controller board waits out the whole
+// erase instead of polling FW_CTRL through it.
+static void eraseNext(){
+	uint32_t addr = erase_page == 0 ? META_ADDR : STAGE_ADDR + (erase_page - 1) * FLASH_PAGE_SIZE;
+	if(!flashErasePage(addr)){
+		finish(FW_ERR_FLASH);
+		return;
+	}
+	if(++erase_page > NUM_STAGE_PAGES){
+		stopTimer(erase_timer);
+		erase_timer = NO_TIMER;
+		state = FW_RECEIVING; // The flash stays unlocked for programming
+	}
+}
+
+static bool programMeta(){
+	FwMeta meta = {.magic = FW_META_MAGIC, .len = offset, .crc = crc};
+	const uint16_t * p = (const uint16_t *)&meta;
+	uint8_t i;
+	for(i = 0; i < sizeof(meta) / 2; i++){
+		if(!flashProgram(META_ADDR + 2 * i, p[i])){
+			return false;
+		}
+	}
+	return true;
+}
+
+void fwUpdateCtrl(uint8_t cmd){
+	switch(cmd){
+	case FW_CMD_BEGIN:
+		finish(FW_ERASING); // Restarts an update in progress
+		flashUnlock();
+		offset = 0;
+		crc = 0;
+		odd_byte = -1;
+		erase_page = 0;
+		erase_timer = startTimer(eraseNext, 0, 1);
+		break;
+	case FW_CMD_COMMIT:
+		if(state != FW_RECEIVING){
+			finish(state == FW_STAGED ? FW_STAGED : FW_ERR_ORDER);
+		}else if(odd_byte >= 0 && !flashProgram(STAGE_ADDR + offset - 1, 0xFF00 | odd_byte)){
+			finish(FW_ERR_FLASH);
+		}else if(offset == 0 || crc != expected){
+			finish(FW_ERR_CRC);
+		}else{
+			finish(programMeta() ? FW_STAGED : FW_ERR_FLASH);
+		}
+		break;
+	case FW_CMD_ABORT:
+	default:
+		if(state == FW_STAGED){
+			flashUnlock();
+			flashErasePage(META_ADDR); // The bootloader ignores an erased page
+		}
+		finish(FW_IDLE);
+		break;
+	}
+}
+
+void fwUpdateData(uint8_t data){
+	if(state != FW_RECEIVING){
+		if(state == FW_IDLE || state == FW_ERASING){
+			finish(FW_ERR_ORDER);
+		}
+		return;
+	}
+	if(offset >= SLOT_SIZE){
+		finish(FW_ERR_SIZE);
+		return;
+	}
+	crc = crc32(crc, &data, 1);
+	offset++;
+	if(odd_byte < 0){
+		odd_byte = data;
+	}else{
+		// Little-endian, so the first byte is the low half
+		if(!flashProgram(STAGE_ADDR + offset - 2, odd_byte | (data << 8))){
+			finish(FW_ERR_FLASH);
+		}
+		odd_byte = -1;
+	}
+}
+
+void fwUpdateCrc(uint8_t data){
+	expected = (expected >> 8) | ((uint32_t)data << 24);
+}
+
+uint8_t getFwUpdateState(){
+	return state;
+}
+
+// The flash is unlocked and being written by an update, so nothing else may
+// erase or program it
+bool fwUpdateUsingFlash(){
+	return state == FW_ERASING || state == FW_RECEIVING;
+}
+
+// Bytes received so far, least significant byte first
+uint8_t readFwOffset(uint8_t index){
+	return index == 0 ? offset & 0xFF : offset >> 8;
+}
@@ -0,0 +1,50 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Firmware update over I2C, installed by the bootloader on the next reset
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FW_UPDATE_H_
+#define FW_UPDATE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Commands written to FW_CTRL
+#define FW_CMD_ABORT  (0x00) // Stop receiving and drop any staged image
+#define FW_CMD_BEGIN  (0x01) // Erase the staging slot and start receiving
+#define FW_CMD_COMMIT (0x02) // Check the received image against FW_CRC and stage it
+
+// States read from FW_CTRL
+#define FW_IDLE      (0x00)
+#define FW_ERASING   (0x01) // FW_DATA is not accepted yet
+#define FW_RECEIVING (0x02)
+#define FW_STAGED    (0x03) // Installed by the bootloader on the next reset
+#define FW_ERR_CRC   (0x80) // The image didn't match FW_CRC
+#define FW_ERR_SIZE  (0x81) // More data than fits in the staging slot
+#define FW_ERR_FLASH (0x82) // Erasing or programming failed
+#define FW_ERR_ORDER (0x83) // Data or a commit without a begin
+
+void fwUpdateCtrl(uint8_t cmd);
+void fwUpdateData(uint8_t data);
+void fwUpdateCrc(uint8_t data);
+
+uint8_t getFwUpdateState();
+bool fwUpdateUsingFlash();
+uint8_t readFwOffset(uint8_t index);
+
+#endif /* FW_UPDATE_H_ */
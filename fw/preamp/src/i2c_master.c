@@ -0,0 +1,244 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Interrupt-driven I2C2 master transaction queue
+ *
+ * I2C2 connects to the volume ICs, the power board and the front panel.
+ * Transactions are queued and driven by the I2C2 interrupt, so they run
+ * back to back while the main loop keeps servicing the controller board.
+ * Transactions complete in the order they were queued.
+ *
+ * A transaction that does not finish in time, or hits a bus error, is
+ * aborted and reported as failed so one bad device can't hang the preamp.
+ * If a device is left holding SDA low the bus is recovered by clocking SCL.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "i2c_master.h"
+#include "main.h"
+#include "perf.h"
+#include "scheduler.h"
+#include "stm32f0xx.h"
+#include "systick.h"
+
+// Longest a transaction can take: the largest write and read plus addresses
+// and the restart, 9 clocks each, with margin for devices stretching the clock
+#define I2C_XFER_TIMEOUT_US ((I2C_XFER_MAX_TX + 8) * 9 * 1000 / I2C2_KHZ + 500)
+
+// Half an SCL period while recovering the bus, at 100 kHz or less
+#define RECOVERY_HALF_CLOCK_US (5)
+
+// Transactions waiting on or using I2C2. The indices are free-running,
+// only the lower bits are used to index the queue.
+static volatile I2CXfer xfer_queue[I2C_XFER_QUEUE_LEN];
+static volatile uint8_t xfer_head = 0;
+static volatile uint8_t xfer_tail = 0; // The active transaction
+static volatile bool active = false;
+
+// Each queued transaction gets a ticket, tickets complete in order
+static volatile uint32_t issued = 0;
+static volatile uint32_t completed = 0;
+
+// Progress of the active transaction
+static volatile uint8_t pos = 0;
+static volatile bool nacked = false;
+static volatile uint32_t xfer_start = 0; // micros() when the active transaction started
+
+static void checkI2C2();
+
+void enableI2CMaster(){
+	I2C_ITConfig(I2C2, I2C_IT_TXI | I2C_IT_RXI | I2C_IT_TCI | I2C_IT_STOPI | I2C_IT_NACKI | I2C_IT_ERRI, ENABLE);
+	NVIC_SetPriority(I2C2_IRQn, 1); // The controller board on I2C1 takes priority
+	NVIC_EnableIRQ(I2C2_IRQn);
+	startTimer(checkI2C2, 1, 1); // Catch transactions that never finish
+}
+
+static void startXfer(){
+	volatile I2CXfer * x = &xfer_queue[xfer_tail & (I2C_XFER_QUEUE_LEN - 1)];
+	pos = 0;
+	nacked = false;
+	xfer_start = micros();
+	I2C2->ISR |= I2C_ISR_TXE; // Flush anything left from a NACKed write
+	if(x->tx_len > 0){
+		// Reads first write the register address, then restart once it is sent
+		uint32_t end = x->rx_len > 0 ? I2C_SoftEnd_Mode : I2C_AutoEnd_Mode;
+		I2C_TransferHandling(I2C2, x->dev, x->tx_len, end, I2C_Generate_Start_Write);
+	}else{
+		I2C_TransferHandling(I2C2, x->dev, x->rx_len, I2C_AutoEnd_Mode, I2C_Generate_Start_Read);
+	}
+}
+
+// Completes the active transaction and starts the next one.
+// Called from the I2C2 interrupt or with interrupts disabled.
+static void finishXfer(I2CError err){
+	volatile I2CXfer * x = &xfer_queue[xfer_tail & (I2C_XFER_QUEUE_LEN - 1)];
+	perfCount(PERF_I2C2_XFERS, 1);
+	if(err != I2C_ERR_NONE){
+		perfCount(err == I2C_ERR_NACK ? PERF_I2C2_NACKS : err == I2C_ERR_TIMEOUT ? PERF_I2C2_TIMEOUTS : PERF_I2C2_BUS_ERRORS, 1);
+		perfSet(PERF_I2C2_LAST_ERROR, ((uint32_t)x->dev << 8) | err);
+	}
+	if(x->done){
+		x->done(err == I2C_ERR_NONE);
+	}
+	xfer_tail++;
+	completed++;
+	if(xfer_head != xfer_tail){
+		startXfer();
+	}else{
+		active = false;
+	}
+}
+
+static void waitUs(uint32_t us){
+	uint32_t start = micros();
+	while(micros() - start < us);
+}
+
+// Frees a device holding SDA low partway through a byte by clocking SCL
+// until it lets go, up to 9 times, and then sending a STOP
+static void recoverI2C2(){
+	GPIO_InitTypeDef gpio;
+	gpio.GPIO_Pin = pSCL_VOL | pSDA_VOL;
+	gpio.GPIO_Mode = GPIO_Mode_OUT;
+	gpio.GPIO_Speed = GPIO_Speed_2MHz;
+	gpio.GPIO_OType = GPIO_OType_OD;
+	gpio.GPIO_PuPd = GPIO_PuPd_NOPULL;
+	GPIOB->BSRR = pSCL_VOL | pSDA_VOL;
+	GPIO_Init(GPIOB, &gpio);
+
+	uint8_t i;
+	for(i = 0; i < 9 && !(GPIOB->IDR & pSDA_VOL); i++){
+		GPIOB->BRR = pSCL_VOL;
+		waitUs(RECOVERY_HALF_CLOCK_US);
+		GPIOB->BSRR = pSCL_VOL;
+		waitUs(RECOVERY_HALF_CLOCK_US);
+	}
+
+	// STOP: SDA rises while SCL is high
+	GPIOB->BRR = pSCL_VOL;
+	waitUs(RECOVERY_HALF_CLOCK_US);
+	GPIOB->BRR = pSDA_VOL;
+	waitUs(RECOVERY_HALF_CLOCK_US);
+	GPIOB->BSRR = pSCL_VOL;
+	waitUs(RECOVERY_HALF_CLOCK_US);
+	GPIOB->BSRR = pSDA_VOL;
+	waitUs(RECOVERY_HALF_CLOCK_US);
+
+	gpio.GPIO_Mode = GPIO_Mode_AF;
+	GPIO_Init(GPIOB, &gpio);
+	perfCount(PERF_I2C2_RECOVERIES, 1);
+}
+
+// Gives up on the active transaction, resetting I2C2 and the bus if needed.
+// Called from the I2C2 interrupt or with interrupts disabled.
+static void abortXfer(I2CError err){
+	I2C_Cmd(I2C2, DISABLE); // Resets the peripheral's state and flags and releases SCL and SDA
+	if(!(GPIOB->IDR & pSDA_VOL) || !(GPIOB->IDR & pSCL_VOL)){
+		recoverI2C2();
+	}
+	I2C_Cmd(I2C2, ENABLE);
+	finishXfer(err);
+}
+
+// Aborts the active transaction if it has taken too long
+static void checkI2C2(){
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if(active && micros() - xfer_start > I2C_XFER_TIMEOUT_US){
+		abortXfer(I2C_ERR_TIMEOUT);
+	}
+	__set_PRIMASK(primask);
+}
+
+// Adds a transaction to the queue, waiting for room if it is full.
+// The transaction is copied so x does not need to outlive the call.
+// Returns a ticket that can be passed to waitI2C2().
+uint32_t queueI2C2(const I2CXfer * x){
+	while((uint8_t)(xfer_head - xfer_tail) >= I2C_XFER_QUEUE_LEN){
+		checkI2C2();
+	}
+
+	volatile I2CXfer * q = &xfer_queue[xfer_head & (I2C_XFER_QUEUE_LEN - 1)];
+	q->dev = x->dev;
+	q->tx_len = x->tx_len;
+	uint8_t i;
+	for(i = 0; i < x->tx_len; i++){
+		q->tx[i] = x->tx[i];
+	}
+	q->rx_len = x->rx_len;
+	q->rx = x->rx;
+	q->done = x->done;
+
+	__disable_irq();
+	xfer_head++;
+	uint32_t ticket = ++issued;
+	if(!active){
+		active = true;
+		startXfer();
+	}
+	__enable_irq();
+	return ticket;
+}
+
+// Waits until the transaction with the given ticket has completed
+void waitI2C2(uint32_t ticket){
+	while((int32_t)(completed - ticket) < 0){
+		checkI2C2();
+	}
+}
+
+// Waits until every queued transaction has completed
+void flushI2C2(){
+	waitI2C2(issued);
+}
+
+void I2C2_IRQHandler(void){
+	uint32_t isr = I2C2->ISR;
+	volatile I2CXfer * x = &xfer_queue[xfer_tail & (I2C_XFER_QUEUE_LEN - 1)];
+
+	if(isr & I2C_ISR_TXIS){
+		I2C_SendData(I2C2, x->tx[pos++]);
+		perfCount(PERF_I2C2_BYTES, 1);
+	}
+
+	if(isr & I2C_ISR_RXNE){
+		x->rx[pos++] = I2C_ReceiveData(I2C2);
+		perfCount(PERF_I2C2_BYTES, 1);
+	}
+
+	if(isr & I2C_ISR_TC){
+		// Register address sent, read it back after a repeated start
+		pos = 0;
+		I2C_TransferHandling(I2C2, x->dev, x->rx_len, I2C_AutoEnd_Mode, I2C_Generate_Start_Read);
+	}
+
+	if(isr & I2C_ISR_NACKF){
+		// A STOP is generated automatically after a NACK
+		I2C_ClearFlag(I2C2, I2C_FLAG_NACKF);
+		nacked = true;
+	}
+
+	if(isr & (I2C_ISR_BERR | I2C_ISR_ARLO)){
+		// A misplaced START/STOP or another master, the transaction won't finish
+		abortXfer(I2C_ERR_BUS);
+		return;
+	}
+
+	if(isr & I2C_ISR_STOPF){
+		I2C_ClearFlag(I2C2, I2C_FLAG_STOPF);
+		finishXfer(nacked ? I2C_ERR_NACK : I2C_ERR_NONE);
+	}
+}
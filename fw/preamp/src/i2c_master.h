@@ -0,0 +1,59 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Interrupt-driven I2C2 master transaction queue
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef I2C_MASTER_H_
+#define I2C_MASTER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Number of transactions that can be waiting on I2C2. Must be a power of 2.
+#define I2C_XFER_QUEUE_LEN (8)
+// Largest write, a register address followed by all six registers of a volume IC
+#define I2C_XFER_MAX_TX (8)
+
+// Why a transaction failed, reported through the performance counters
+typedef enum{
+	I2C_ERR_NONE,
+	I2C_ERR_NACK,    // The device did not acknowledge
+	I2C_ERR_TIMEOUT, // The transaction did not finish in time
+	I2C_ERR_BUS,     // Bus error or lost arbitration
+}I2CError;
+
+// Called from the I2C2 interrupt when a transaction completes.
+// ok is false if the transaction failed.
+typedef void (*I2CDone)(bool ok);
+
+typedef struct{
+	uint8_t dev;                  // Device address
+	uint8_t tx_len;               // Bytes to write, usually the register address first
+	uint8_t tx[I2C_XFER_MAX_TX];
+	uint8_t rx_len;               // Bytes to read after the write, with a repeated start
+	uint8_t * rx;                 // Where read bytes are stored
+	I2CDone done;                 // Optional completion callback
+}I2CXfer;
+
+void enableI2CMaster();
+
+uint32_t queueI2C2(const I2CXfer * x);
+void waitI2C2(uint32_t ticket);
+void flushI2C2();
+
+#endif /* I2C_MASTER_H_ */
@@ -0,0 +1,280 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Interrupt-driven I2C1 slave interface to the controller board
+ *
+ * The controller writes a register address followed by data, or writes a
+ * register address and then issues a repeated start to read it back.
+ * Any number of data bytes may follow the register address, the register
+ * address auto-increments after each one so consecutive registers can be
+ * written in a single transaction. Register writes are queued for the main
+ * loop to apply. Register reads are answered immediately from RAM, unless
+ * writes are still queued. Then the clock is stretched until the main loop
+ * has applied them and replies with the register's value.
+ *
+ * With PEC enabled the last byte of a write transaction is its PEC, and the
+ * writes are only released to the main loop at the stop once it matches.
+ * A read returns its PEC after the register's data, see readLen().
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "i2c_slave.h"
+#include "pec.h"
+#include "perf.h"
+#include "systick.h"
+#include "trace.h"
+#include "stm32f0xx.h"
+
+typedef enum{
+	SLAVE_IDLE,    // No transaction in progress
+	SLAVE_RX_REG,  // Next byte received is a register address
+	SLAVE_RX_DATA, // Next byte received is data for the current register
+	SLAVE_TX,      // Controller is reading the current register
+}SlaveState;
+
+static volatile SlaveState state = SLAVE_IDLE;
+static volatile uint8_t reg_ptr = 0; // Register the controller is accessing
+static volatile uint8_t read_index = 0; // Bytes already read in this transaction
+static volatile bool broadcast = false; // The transaction is to I2C_BROADCAST_ADDR
+static volatile uint8_t addr_byte = 0;  // Address the transaction matched, in 8-bit form
+static volatile bool xfer_pec = false;  // PEC was enabled when the transaction started
+
+// The write transaction in progress. With PEC enabled each byte is held until
+// the next one arrives, since the last one is the PEC and not data.
+static bool xfer_data = false;   // A byte followed the register address
+static bool xfer_failed = false; // Too long to hold until its PEC was checked
+static uint8_t rx_pec = 0;       // PEC of the bytes before the held one
+static uint8_t held = 0;
+
+// The read in progress, the PEC is sent once read_len bytes have been
+static uint8_t read_len = 1;
+static uint8_t tx_pec = 0;
+
+// Single producer (ISR), single consumer (main loop) queue of register writes.
+// The indices are free-running, only the lower bits are used to index the queue.
+// Writes from write_head to write_pend are from the current transaction and
+// not yet checked.
+static volatile RegWrite write_queue[REG_WRITE_QUEUE_LEN];
+static volatile uint8_t write_head = 0;
+static volatile uint8_t write_pend = 0;
+static volatile uint8_t write_tail = 0;
+static bool write_popped = false; // The write at write_tail is being applied
+
+static volatile bool rx_stalled = false;   // Receiving is paused until the queue has room
+static volatile bool read_pending = false; // The controller is waiting on the main loop for read data
+static volatile uint32_t read_start = 0;   // When the read started waiting, for the trace
+
+void enableI2CSlave(){
+	I2C_ITConfig(I2C1, I2C_IT_ADDRI | I2C_IT_RXI | I2C_IT_TXI | I2C_IT_STOPI | I2C_IT_NACKI, ENABLE);
+	NVIC_EnableIRQ(I2C1_IRQn);
+}
+
+// Returns the oldest register write not yet applied, if any.
+// A write stays in the queue until the next call, after it has been applied.
+bool popRegWrite(RegWrite * w){
+	if(write_popped){
+		write_tail++;
+		write_popped = false;
+
+		if(rx_stalled){
+			// There is room in the queue again, release the clock
+			rx_stalled = false;
+			perfStretchEnd();
+			__disable_irq();
+			I2C_ITConfig(I2C1, I2C_IT_RXI | I2C_IT_ADDRI, ENABLE);
+			__enable_irq();
+		}
+	}
+
+	if(write_head == write_tail){
+		return false;
+	}
+	uint8_t i = write_tail & (REG_WRITE_QUEUE_LEN - 1);
+	w->reg = write_queue[i].reg;
+	w->data = write_queue[i].data;
+	write_popped = true;
+	return true;
+}
+
+// Returns true if the controller is waiting to read a register
+bool regReadPending(uint8_t * reg, uint8_t * index){
+	*reg = reg_ptr;
+	*index = read_index;
+	return read_pending;
+}
+
+// True if the main loop has writes to apply or a read to answer
+bool i2cSlaveBusy(){
+	return write_head != write_tail || read_pending;
+}
+
+// True if no transaction is in progress and none has left anything for the
+// main loop, so stalling the core won't stretch the controller's clock
+bool i2cSlaveIdle(){
+	return state == SLAVE_IDLE && !i2cSlaveBusy();
+}
+
+// Sends a byte of register data
+static void sendRead(uint8_t data, uint32_t start){
+	I2C_SendData(I2C1, data);
+	if(read_index++ == 0){
+		read_len = readLen(reg_ptr, data);
+		traceAccess(reg_ptr, data, true, start);
+	}
+	tx_pec = updatePec(tx_pec, data);
+}
+
+// Queues a byte written to the current register. Returns false, leaving the
+// byte in RXDR, if the queue has no room for it yet.
+static bool receiveData(){
+	if(xfer_pec && !xfer_data){
+		held = I2C_ReceiveData(I2C1); // Could be the PEC
+		xfer_data = true;
+		return true;
+	}
+	if(!xfer_failed && (uint8_t)(write_pend - write_tail) >= REG_WRITE_QUEUE_LEN){
+		if((uint8_t)(write_pend - write_head) < REG_WRITE_QUEUE_LEN){
+			// Queue is full. Leave the byte in RXDR so the clock is stretched
+			// and stop accepting new transactions until the main loop catches up.
+			I2C_ITConfig(I2C1, I2C_IT_RXI | I2C_IT_ADDRI, DISABLE);
+			rx_stalled = true;
+			perfStretchStart();
+			return false;
+		}
+		xfer_failed = true; // The whole queue is this transaction, it can't be held
+	}
+
+	uint8_t data = I2C_ReceiveData(I2C1);
+	xfer_data = true;
+	if(xfer_pec){
+		// The held byte is data now that another one followed it
+		uint8_t next = data;
+		data = held;
+		held = next;
+		rx_pec = updatePec(rx_pec, data);
+	}
+	if(!xfer_failed && (!broadcast || broadcastReg(reg_ptr))){ // Not every register can be written by broadcast
+		uint8_t i = write_pend & (REG_WRITE_QUEUE_LEN - 1);
+		write_queue[i].reg = reg_ptr;
+		write_queue[i].data = data;
+		write_pend++;
+		if(!xfer_pec){
+			write_head = write_pend;
+		}
+	}
+	if(!streamReg(reg_ptr)){
+		reg_ptr++; // Burst writes continue on to the next register
+	}
+	return true;
+}
+
+// Releases the writes of a finished write transaction to the main loop, or
+// drops them if its PEC didn't match
+static void endWrite(){
+	if(state != SLAVE_RX_DATA || !xfer_data){
+		return; // Only set the register to read
+	}
+	bool ok = !xfer_failed && (!xfer_pec || held == rx_pec);
+	if(ok){
+		write_head = write_pend;
+	}else{
+		write_pend = write_head;
+		perfCount(PERF_I2C1_REJECTS, 1);
+	}
+	countWriteXfer(ok);
+	xfer_data = false;
+	xfer_failed = false;
+}
+
+// Send the value of the register being read and release the clock
+void replyRegRead(uint8_t data){
+	sendRead(data, read_start);
+	read_pending = false;
+	perfStretchEnd();
+	perfCount(PERF_I2C1_READS, 1);
+	perfCountReg(reg_ptr);
+	__disable_irq();
+	I2C_ITConfig(I2C1, I2C_IT_TXI, ENABLE);
+	__enable_irq();
+}
+
+void I2C1_IRQHandler(void){
+	uint32_t isr = I2C1->ISR;
+
+	if((isr & I2C_ISR_RXNE) && !rx_stalled){
+		if(state == SLAVE_RX_REG){
+			reg_ptr = I2C_ReceiveData(I2C1);
+			rx_pec = updatePec(updatePec(0, addr_byte), reg_ptr);
+			state = SLAVE_RX_DATA;
+		}else{
+			receiveData();
+		}
+	}
+
+	if((isr & I2C_ISR_TXIS) && !read_pending){
+		if(broadcast){
+			// Every preamp is driving SDA, so only release it
+			I2C_SendData(I2C1, 0xFF);
+		}else if(xfer_pec && read_index >= read_len){
+			// The register's data has been sent, the controller can read its PEC
+			I2C_SendData(I2C1, read_index++ == read_len ? tx_pec : 0xFF);
+		}else if(write_head == write_tail){
+			uint32_t start = tracing() ? micros() : 0;
+			sendRead(readReg(reg_ptr, read_index), start);
+			perfCount(PERF_I2C1_READS, 1);
+			perfCountReg(reg_ptr);
+		}else{
+			// Let the main loop apply the queued writes first and then supply
+			// the data, the clock is stretched until it does
+			I2C_ITConfig(I2C1, I2C_IT_TXI, DISABLE);
+			read_pending = true;
+			read_start = tracing() ? micros() : 0;
+			perfStretchStart();
+		}
+	}
+
+	if(isr & I2C_ISR_NACKF){
+		// The controller NACKs the last byte it wants to read
+		I2C_ClearFlag(I2C1, I2C_FLAG_NACKF);
+	}
+
+	if(isr & I2C_ISR_STOPF){
+		I2C_ClearFlag(I2C1, I2C_FLAG_STOPF);
+		endWrite();
+		state = SLAVE_IDLE;
+		perfCount(PERF_I2C1_XFERS, 1);
+	}
+
+	if((isr & I2C_ISR_ADDR) && !rx_stalled){
+		// Reads are a register address write followed by a repeated start, so the address matches twice
+		endWrite();
+		addr_byte = I2C_GetAddressMatched(I2C1);
+		broadcast = addr_byte == I2C_BROADCAST_ADDR;
+		xfer_pec = pecEnabled();
+		if(I2C_GetTransferDirection(I2C1) == I2C_Direction_Receiver){
+			// Flush anything left in TXDR from a previous read
+			I2C1->ISR |= I2C_ISR_TXE;
+			read_index = 0;
+			read_len = 1;
+			// As for an SMBus read, the PEC covers writing the register address too
+			tx_pec = updatePec(updatePec(updatePec(0, addr_byte), reg_ptr), addr_byte | 1);
+			state = SLAVE_TX;
+		}else{
+			state = SLAVE_RX_REG;
+		}
+		I2C_ClearFlag(I2C1, I2C_FLAG_ADDR);
+	}
+}
@@ -0,0 +1,55 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Interrupt-driven I2C1 slave interface to the controller board
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef I2C_SLAVE_H_
+#define I2C_SLAVE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Secondary address answered by every preamp, in the same 8-bit form as the
+// address assigned over UART (7-bit 0x0C). Reads of it return 0xFF.
+#define I2C_BROADCAST_ADDR (0x18)
+
+// Number of register writes that can be waiting on the main loop. Must be a power of 2.
+#define REG_WRITE_QUEUE_LEN (32)
+
+typedef struct{
+	uint8_t reg;
+	uint8_t data;
+}RegWrite;
+
+// Implemented by the application. Called from the I2C1 interrupt so it must not block.
+// index is the number of bytes already read in this transaction, most
+// registers return the same value for every byte of a multi-byte read.
+uint8_t readReg(uint8_t reg, uint8_t index);
+bool broadcastReg(uint8_t reg); // True if writes to reg are accepted on I2C_BROADCAST_ADDR
+bool streamReg(uint8_t reg);    // True if a burst write to reg writes every byte to reg instead of moving on
+uint8_t readLen(uint8_t reg, uint8_t first); // Bytes of data in a read of reg whose first byte is first, the PEC follows them
+
+void enableI2CSlave();
+
+bool popRegWrite(RegWrite * w);
+bool regReadPending(uint8_t * reg, uint8_t * index);
+void replyRegRead(uint8_t data);
+bool i2cSlaveBusy();
+bool i2cSlaveIdle();
+
+#endif /* I2C_SLAVE_H_ */
@@ -23,15 +23,52 @@
 #include "power_board.h"
 #include "systick.h"
 #include "channel.h"
+#include "diag.h"
+#include "events.h"
+#include "flash.h"
+#include "fw_update.h"
 #include "port_defs.h"
+#include "presets.h"
+#include "i2c_master.h"
+#include "i2c_slave.h"
+#include "pec.h"
+#include "perf.h"
+#include "scheduler.h"
+#include "snapshot.h"
+#include "sleep.h"
+#include "status.h"
+#include "telemetry.h"
+#include "thermal.h"
+#include "trace.h"
+#include "uart.h"
+#include "watchdog.h"
 #include <stm32f0xx.h>
+#ifdef PREAMP_BENCH
+#include "bench.h"
+#endif
 
 void init_i2c1(uint8_t preamp_addr);
-void USART_PutString(USART_TypeDef* USARTx, volatile uint8_t * str);
+void writeReg(uint8_t reg, uint8_t data);
 
 // uncomment the line below to use the debugger
 //#define DEBUG_OVER_UART2
 
+// The Cortex-M0 always takes its vectors from address 0, where the
+// bootloader's are, so the firmware's are copied to the start of RAM and
+// RAM is mapped there instead. LinkerScript.ld keeps .ram_vectors first.
+#define NUM_VECTORS (48)
+static volatile uint32_t ram_vectors[NUM_VECTORS] __attribute__((section(".ram_vectors")));
+
+static void relocateVectors(){
+	const uint32_t * vectors = (const uint32_t *)(uintptr_t)APP_ADDR;
+	uint8_t i;
+	for(i = 0; i < NUM_VECTORS; i++){
+		ram_vectors[i] = vectors[i];
+	}
+	RCC_APB2PeriphClockCmd(RCC_APB2Periph_SYSCFG, ENABLE);
+	SYSCFG->CFGR1 |= SYSCFG_CFGR1_MEM_MODE; // Embedded SRAM at address 0
+}
+
 void init_gpio()
 {
 	// Enable peripheral clocks for GPIO ports
@@ -94,6 +131,7 @@ void init_gpio()
 	GPIO_InitStructureF.GPIO_OType = GPIO_OType_PP;
 	GPIO_InitStructureF.GPIO_PuPd = GPIO_PuPd_NOPULL;
 	GPIO_InitStructureF.GPIO_Speed = GPIO_Speed_2MHz;
+	GPIO_SetBits(GPIOF, pNRST_OUT); // The next preamp is only reset when main() pulses NRST_OUT
 	GPIO_Init(GPIOF, &GPIO_InitStructureF);
 }
 
@@ -101,8 +139,15 @@ void init_i2c1(uint8_t preamp_addr)
 {
 	// I2C1 is from control board
 
-	// enable peripheral clock for I2C1
+	// enable peripheral clock for I2C1, clocked from SYSCLK so both buses share the same timings
 	RCC_APB1PeriphClockCmd(RCC_APB1Periph_I2C1, ENABLE);
+	RCC_I2CCLKConfig(RCC_I2C1CLK_SYSCLK);
+
+#if I2C1_KHZ == 1000
+	// Fast-mode Plus needs the 20 mA drive on SCL and SDA
+	RCC_APB2PeriphClockCmd(RCC_APB2Periph_SYSCFG, ENABLE);
+	SYSCFG->CFGR1 |= SYSCFG_CFGR1_I2C_FMP_PB6 | SYSCFG_CFGR1_I2C_FMP_PB7;
+#endif
 
 	// connect pins to alternate function for I2C1
 	GPIO_PinAFConfig(GPIOB, GPIO_PinSource6, GPIO_AF_1); //I2C1_SCL
@@ -125,8 +170,10 @@ void init_i2c1(uint8_t preamp_addr)
 	I2C_InitStructure1.I2C_OwnAddress1 = preamp_addr;
 	I2C_InitStructure1.I2C_Ack = I2C_Ack_Enable;
 	I2C_InitStructure1.I2C_AcknowledgedAddress = I2C_AcknowledgedAddress_7bit;
-	//I2C_InitStructure1.I2C_Timing = 0x10805E89; // TODO: Determine and document why this value is needed for I2C2 but not I2C1
+	I2C_InitStructure1.I2C_Timing = I2C1_TIMING; // As a slave only the data setup and hold times are used
 	I2C_Init(I2C1, &I2C_InitStructure1);
+	I2C_OwnAddress2Config(I2C1, I2C_BROADCAST_ADDR, I2C_OA2_NoMask); // Shared by every preamp
+	I2C_DualAddressCmd(I2C1, ENABLE);
 	I2C_Cmd(I2C1, ENABLE);
 }
 
@@ -161,9 +208,10 @@ void init_i2c2()
 	I2C_InitStructure2.I2C_OwnAddress1 = 0x00;
 	I2C_InitStructure2.I2C_Ack = I2C_Ack_Enable;
 	I2C_InitStructure2.I2C_AcknowledgedAddress = I2C_AcknowledgedAddress_7bit;
-	I2C_InitStructure2.I2C_Timing = 0x10805E89; // From 48-MHz PCLK with 100ns rise, 10ns fall -> 100 KHz
+	I2C_InitStructure2.I2C_Timing = I2C2_TIMING; // From 48-MHz PCLK
 	I2C_Init(I2C2, &I2C_InitStructure2);
 	I2C_Cmd(I2C2, ENABLE);
+	enableI2CMaster(); // Transactions are driven by the I2C2 interrupt
 }
 
 void init_uart()
@@ -215,6 +263,10 @@ void init_uart()
 	USART_InitStructure.USART_HardwareFlowControl = USART_HardwareFlowControl_None;
 	USART_InitStructure.USART_Mode = USART_Mode_Rx | USART_Mode_Tx;
 	USART_Init(USART1, &USART_InitStructure);
+	// The baud rate is measured from the start bit of the 'A' of the address message,
+	// so the controller can send it faster than 9600 baud
+	USART_AutoBaudRateConfig(USART1, USART_AutoBaudRate_StartBit);
+	USART_AutoBaudRateCmd(USART1, ENABLE);
 	USART_Cmd(USART1,ENABLE);
 
 #ifndef DEBUG_OVER_UART2
@@ -234,334 +286,812 @@ void init_uart()
 	// USART1 interrupt handler setup
 	USART_ITConfig(USART1, USART_IT_RXNE, ENABLE);
 	NVIC_EnableIRQ(USART1_IRQn);
+
+#ifndef DEBUG_OVER_UART2
+	// USART2 receives acknowledgements from the next preamp
+	USART_ITConfig(USART2, USART_IT_RXNE, ENABLE);
+	NVIC_EnableIRQ(USART2_IRQn);
+#endif
 }
 
-// Serial buffer for UART handling of I2C addresses
-#define SB_MAX_SIZE (64)
-typedef struct {
-  unsigned char data[SB_MAX_SIZE];  // byte buffer
-  unsigned char ind;        		// index (current location)
-  unsigned char done;         		// buffer is complete (terminator reached)
-  unsigned char ovf;          		// buffer has overflowed!
-} SerialBuffer;
-volatile SerialBuffer UART_Preamp_RxBuffer;
-volatile SerialBuffer UART_Preamp_TxBuffer;
-
-// Add a character to the serial buffer (UART)
-void RxBuf_Add(volatile SerialBuffer *sb, unsigned char data_in)
-{
-  // Add new byte to buffer (as long as it isn't complete or overflowed). Post-increment index.
-  if(!(sb->done) && !(sb->ovf))
-    sb->data[sb->ind++] = data_in;
-  // Check for completion (i.e. when last two bytes are <CR><LF>)
-  if(sb->ind >= 2 && sb->data[(sb->ind)-2] == 0x0D && sb->data[(sb->ind)-1] == 0x0A)
-    sb->done = 1;
-  // Check for overflow (i.e. when index exceeds buffer)
-  if(sb->ind >= SB_MAX_SIZE)
-    sb->ovf = 1;
+// Address assignment travels down the chain of preamps over UART and an
+// acknowledgement with the number of preamps travels back up:
+//   - each preamp sends CHAIN_LISTENING upstream once it is waiting for an address
+//   - an address is only passed on once the next preamp is listening, or once
+//     DOWNSTREAM_TIMEOUT has passed without hearing from it
+//   - "N<count>\r\n" is sent upstream once I2C is running, where count is
+//     '0' + the number of preamps from this one to the end of the chain
+//   - "A<addr>\r\n" gives the next preamp addr + ADDR_STRIDE, while
+//     "A<addr><stride><first><last>\r\n" gives it addr + stride, or first once
+//     that would pass last. The controller board can then spread a long
+//     chain over several I2C buses that each reuse the same addresses.
+#define CHAIN_LISTENING    'R'
+#define CHAIN_ACK          'N'
+#define CHAIN_COUNT_MAX    (63) // Longest chain the acknowledgement counts, '0' + 63 is 'o'
+#define ADDR_STRIDE        (16) // Between the 8-bit addresses of the classic address message
+#define ADDR_MSG_SPLIT_LEN (7)  // Length of the address message with a stride, including "\r\n"
+#define DOWNSTREAM_TIMEOUT (20) // ms after resetting the next preamp for it to start listening
+#define CHAIN_ACK_TIMEOUT  (50) // ms to wait for the rest of the chain to acknowledge
+static bool downstream_listening = false;
+static uint8_t i2c_addr; // I2C address received via UART
+
+// Lines being received during addressing
+static UartLine address_line;
+static UartLine downstream_line;
+static bool downstream_acked = false;
+
+// Reads what the next preamp sent: CHAIN_LISTENING on its own once it is
+// waiting for an address, then its acknowledgement line
+static void readDownstream(){
+	if(!downstream_listening){
+		uint8_t c;
+		while(uartRead(&uart2, &c)){
+			if(c == CHAIN_LISTENING){
+				downstream_listening = true;
+				break;
+			}
+		}
+	}else if(!downstream_acked && uartReadLine(&uart2, &downstream_line)){
+		downstream_acked = !downstream_line.ovf && downstream_line.data[0] == CHAIN_ACK;
+	}
 }
 
-// Clear the serial buffer
-void RxBuf_Clear(volatile SerialBuffer *sb)
-{
-  // clear flags
-  sb->ind = 0; sb->done = 0; sb->ovf = 0;
-  // clear data
-  int i = 0;
-  while(i<SB_MAX_SIZE){
-	  sb->data[i] = 0x00;
-	  i++;
-  }
+
+// Writes to the audio registers, SRC_AD through VOL_CH6, can be staged and
+// applied together by a write to REG_COMMIT
+#define NUM_STAGED_REGS (NUM_PRESET_REGS)
+static volatile bool staging = false;
+static uint8_t staged[NUM_STAGED_REGS];
+static uint16_t staged_dirty = 0; // Bit N set if register N was staged
+
+// Progress through startup, reported by BOOT_STATUS
+#define BOOT_ADDRESSED   (0x01) // I2C address received
+#define BOOT_INITIALIZED (0x02) // Channels, sources and status values initialized
+#define BOOT_PSU_GOOD    (0x04) // Both power supplies good, read from the status cache
+#define BOOT_CHAIN_DONE  (0x08) // The rest of the chain acknowledged or timed out
+#define BOOT_CHAIN_SHIFT (4)    // Upper nibble is the number of preamps after this one
+#define BOOT_CHAIN_MAX   (14)   // 0xFF is left for firmware without BOOT_STATUS
+static volatile uint8_t boot_status = 0;
+
+// PERF_SEL picks the counter read through PERF_DATA0-3. Reading PERF_DATA0
+// takes a snapshot so the four bytes are consistent.
+static volatile uint8_t perf_sel = 0;
+static volatile uint32_t perf_snapshot = 0;
+
+// STATUS_BLOCK returns its length followed by these registers, taken from
+// one snapshot when the first byte is read
+static const uint8_t status_block_regs[] = {
+	REG_POWER_GOOD,
+	REG_FAN_STATUS,
+	REG_EXTERNAL_GPIO,
+	REG_LED_OVERRIDE,
+	REG_HV1_VOLTAGE,
+	REG_HV2_VOLTAGE,
+	REG_HV1_TEMP,
+	REG_HV2_TEMP,
+	REG_STATUS_VALID,
+	REG_STATUS_AGE,
+	REG_POWER_STATE,
+	REG_BOOT_STATUS,
+	REG_VERSION_MAJOR,
+	REG_VERSION_MINOR,
+	REG_GIT_HASH_27_20,
+	REG_GIT_HASH_19_12,
+	REG_GIT_HASH_11_04,
+	REG_GIT_HASH_STATUS,
+	REG_EVENTS,
+	REG_XFER_COUNT,
+	REG_XFER_ERRORS,
+};
+#define STATUS_BLOCK_LEN (sizeof(status_block_regs))
+static uint8_t status_block[STATUS_BLOCK_LEN];
+
+// Returns the current value of a register being read by the controller board.
+// Everything is read from RAM so this is safe to call from the I2C1 interrupt.
+uint8_t readReg(uint8_t reg, uint8_t index){
+	uint8_t msg = 0; // Used as the pass through for various device data traveling to the Pi
+	uint8_t i;
+	switch(reg){
+		case REG_STATUS_BLOCK:
+			if(index == 0){
+				for(i = 0; i < STATUS_BLOCK_LEN; i++){
+					status_block[i] = readReg(status_block_regs[i], 0);
+				}
+				return STATUS_BLOCK_LEN;
+			}
+			return index <= STATUS_BLOCK_LEN ? status_block[index - 1] : 0xFF;
+		case REG_POWER_GOOD:
+			msg = getStatus(STATUS_PWR_GPIO);
+			uint8_t pg_mask = 0xf3; // 1111 0011
+
+			msg &= ~(pg_mask); // Gets the value of PG_12V, PG_9V, and nothing else
+			return msg >> 2; // Desired value is 0x03 - both good
+		case REG_FAN_STATUS:
+			msg = getStatus(STATUS_PWR_GPIO);
+			uint8_t fan_mask = 0x4f; // 0100 1111
+
+			msg &= ~(fan_mask); // Gets the value of FAN_ON, OVR_TMP, FAN_FAIL, and nothing else
+			return msg >> 4;
+		case REG_EXTERNAL_GPIO:
+			msg = getStatus(STATUS_PWR_GPIO);
+			uint8_t io_mask = 0xbf; // 1011 1111
+
+			msg &= ~(io_mask); // Gets the value of EXT_GPIO and nothing else
+			return msg >> 6;
+		case REG_LED_OVERRIDE:
+			return getStatus(STATUS_FRONT_PANEL); // Current state of the front panel
+		case REG_LED_PATTERN:
+			return getLedPattern();
+		case REG_LED_PERIOD:
+			return getLedPeriod();
+		case REG_PEC_CTRL:
+			return getPecCtrl();
+		case REG_XFER_COUNT:
+			return index == 0 ? getXferCount() : getXferErrors(); // Both with one read
+		case REG_XFER_ERRORS:
+			return getXferErrors();
+		case REG_HV1_VOLTAGE:
+			return getStatus(STATUS_HV1);
+		case REG_HV2_VOLTAGE:
+			return getStatus(STATUS_HV2);
+		case REG_HV1_TEMP:
+			return getStatus(STATUS_NTC1);
+		case REG_HV2_TEMP:
+			return getStatus(STATUS_NTC2);
+		case REG_FAN_MODE:
+			return getFanMode();
+		case REG_FAN_ON_TEMP:
+			return getFanOnTemp();
+		case REG_FAN_OFF_TEMP:
+			return getFanOffTemp();
+		case REG_FAN_DUTY:
+			return getFanDuty();
+		case REG_HV1_TEMP_C:
+		case REG_HV2_TEMP_C:
+			return getTemp(reg - REG_HV1_TEMP_C);
+		case REG_EVENTS:
+			return getEvents();
+		case REG_EVENT_MASK:
+			return getEventMask();
+		case REG_FW_CTRL:
+			return getFwUpdateState();
+		case REG_FW_OFFSET:
+			return readFwOffset(index);
+		case REG_IDLE:
+			return getIdlePercent();
+		case REG_PRESET_SAVE:
+			return getPresetSlots();
+		case REG_GROUP1_MEMBERS:
+		case REG_GROUP2_MEMBERS:
+		case REG_GROUP3_MEMBERS:
+		case REG_GROUP4_MEMBERS:
+			return getGroupMembers(reg - REG_GROUP1_MEMBERS);
+		case REG_GROUP1_VOL:
+		case REG_GROUP2_VOL:
+		case REG_GROUP3_VOL:
+		case REG_GROUP4_VOL:
+			return getGroupVolume(reg - REG_GROUP1_VOL);
+		case REG_GROUP1_MUTE:
+		case REG_GROUP2_MUTE:
+		case REG_GROUP3_MUTE:
+		case REG_GROUP4_MUTE:
+			return isGroupMuted(reg - REG_GROUP1_MUTE);
+		case REG_SNAPSHOT:
+			return getSnapshot();
+		case REG_TRACE_CTRL:
+			return getTraceCtrl();
+		case REG_TRACE_TRIG:
+			return getTraceTrigger();
+		case REG_TRACE_DATA:
+			return readTrace(index);
+		case REG_TELEM_PERIOD:
+			return getTelemPeriod();
+		case REG_TELEM_COUNT:
+			return getTelemCount();
+		case REG_TELEM_DATA:
+			return readTelem(index);
+		case REG_STATUS_PERIOD:
+			return getStatusPeriod();
+		case REG_STATUS_VALID:
+			return getStatusValid();
+		case REG_STATUS_AGE:
+			return getStatusAge();
+		case REG_BOOT_STATUS:
+			msg = boot_status;
+			if((getStatusValid() & (1 << STATUS_PWR_GPIO)) && (getStatus(STATUS_PWR_GPIO) & 0x0C) == 0x0C){
+				msg |= BOOT_PSU_GOOD; // PG_12V and PG_9V
+			}
+			return msg;
+		case REG_PERF_SEL:
+			return perf_sel;
+		case REG_PERF_DATA0:
+			perf_snapshot = perfGet(perf_sel);
+			return perf_snapshot & 0xFF;
+		case REG_PERF_DATA1:
+		case REG_PERF_DATA2:
+		case REG_PERF_DATA3:
+			return (perf_snapshot >> (8 * (reg - REG_PERF_DATA0))) & 0xFF;
+		case REG_POWER_STATE:
+			return getPowerState();
+		case REG_STAGE:
+			return staging;
+		case REG_RAMP_CH1:
+		case REG_RAMP_CH2:
+		case REG_RAMP_CH3:
+		case REG_RAMP_CH4:
+		case REG_RAMP_CH5:
+		case REG_RAMP_CH6:
+			return getRampTarget(reg - REG_RAMP_CH1);
+		case REG_RAMP_INT_CH1:
+		case REG_RAMP_INT_CH2:
+		case REG_RAMP_INT_CH3:
+		case REG_RAMP_INT_CH4:
+		case REG_RAMP_INT_CH5:
+		case REG_RAMP_INT_CH6:
+			return getRampInterval(reg - REG_RAMP_INT_CH1);
+		case REG_VERSION_MAJOR:
+			return VERSION_MAJOR;
+		case REG_VERSION_MINOR:
+			return VERSION_MINOR;
+		case REG_GIT_HASH_27_20:
+			return GIT_HASH_27_20;
+		case REG_GIT_HASH_19_12:
+			return GIT_HASH_19_12;
+		case REG_GIT_HASH_11_04:
+			return GIT_HASH_11_04;
+		case REG_GIT_HASH_STATUS:
+			return GIT_HASH_03_00_STATUS; // LSB is the clean/dirty status according to Git
+		default:
+			return 0xFF; // Return FF if a non-existent register is selected
+	}
 }
 
+// Registers every preamp can be written at once through I2C_BROADCAST_ADDR.
+// Anything that is read back or reports status is left out.
+bool broadcastReg(uint8_t reg){
+	switch(reg){
+		case REG_SRC_AD:
+		case REG_CH321:
+		case REG_CH654:
+		case REG_MUTE:
+		case REG_STANDBY:
+		case REG_VOL_CH1:
+		case REG_VOL_CH2:
+		case REG_VOL_CH3:
+		case REG_VOL_CH4:
+		case REG_VOL_CH5:
+		case REG_VOL_CH6:
+		case REG_STAGE:
+		case REG_COMMIT:
+		case REG_RAMP_CH1:
+		case REG_RAMP_CH2:
+		case REG_RAMP_CH3:
+		case REG_RAMP_CH4:
+		case REG_RAMP_CH5:
+		case REG_RAMP_CH6:
+		case REG_FW_CTRL:
+		case REG_FW_DATA:
+		case REG_FW_CRC:
+		case REG_PRESET_SAVE:
+		case REG_PRESET_RECALL:
+		case REG_GROUP1_VOL:
+		case REG_GROUP2_VOL:
+		case REG_GROUP3_VOL:
+		case REG_GROUP4_VOL:
+		case REG_GROUP1_MUTE:
+		case REG_GROUP2_MUTE:
+		case REG_GROUP3_MUTE:
+		case REG_GROUP4_MUTE:
+		case REG_LED_PATTERN:
+		case REG_LED_PERIOD:
+		case REG_PEC_CTRL:
+			return true;
+		default:
+			return false;
+	}
+}
 
-int main(void)
-{
-	// VARIABLES
-	uint8_t reg;          // The register that AmpliPi is reading/writing to. See "preamp_i2c_regs.xlsx"
-	uint8_t data;         // The actual value being written to the register
-	uint8_t ch, src;      // variables holding zone and source information
-	uint8_t i2c_addr;     // I2C address received via UART
-	uint32_t blink;       // Counter for alternating the Standby/On LED
-	uint8_t red_on = 1;   // Used for switching the Standby/On LED
+// FW_DATA and FW_CRC take a stream of bytes, so a whole chunk of an image
+// can be sent in one transaction
+bool streamReg(uint8_t reg){
+	return reg == REG_FW_DATA || reg == REG_FW_CRC;
+}
 
-	// INIT
-	init_gpio();		  // UART and I2C require GPIO pins
-	init_uart();		  // The preamp will receive its I2C network address via UART
-	init_i2c2();		  // Need I2C2 initialized for the front panel functionality during the address loop
-	enableFrontPanel();   // setup the I2C->GPIO chip
-	enablePowerBoard();   // setup the power supply chip
-	enablePSU();          // turn on 9V/12V power
-	systickInit();        // Initialize the clock ticks for delay_ms and other timing functionality
+// Length of the data a read returns before its PEC. Multi-byte registers
+// start with a count of what follows.
+uint8_t readLen(uint8_t reg, uint8_t first){
+	switch(reg){
+		case REG_STATUS_BLOCK:
+			return 1 + first;
+		case REG_TELEM_DATA:
+			return TELEM_HEADER_LEN + first * TELEM_RECORD_LEN;
+		case REG_TRACE_DATA:
+			return TRACE_HEADER_LEN + first * TRACE_RECORD_LEN;
+		case REG_FW_OFFSET:
+		case REG_XFER_COUNT:
+			return 2;
+		default:
+			return 1;
+	}
+}
+
+// Applies every staged register at once
+static void commitStaged(){
+	uint8_t srcs[NUM_CHANNELS];
+	uint8_t vols[NUM_CHANNELS];
+	uint8_t mutes = 0;
+	uint8_t ch;
+	staging = false;
+
+	if(staged_dirty & (1 << REG_SRC_AD)){
+		writeReg(REG_SRC_AD, staged[REG_SRC_AD]);
+	}
+
+	// Start from the current state of each channel and replace what was staged
+	for(ch = 0; ch < NUM_CHANNELS; ch++){
+		srcs[ch] = getChannelSource(ch);
+		vols[ch] = getChannelVolume(ch);
+		mutes |= (isOn(ch) ? 0 : 1) << ch;
+	}
+	for(ch = 0; ch < NUM_CHANNELS; ch++){
+		uint8_t reg = ch < 3 ? REG_CH321 : REG_CH654;
+		if(staged_dirty & (1 << reg)){
+			srcs[ch] = (staged[reg] >> (2 * (ch % 3))) % 4;
+		}
+		if(staged_dirty & (1 << (REG_VOL_CH1 + ch))){
+			vols[ch] = staged[REG_VOL_CH1 + ch];
+		}
+	}
+	if(staged_dirty & (1 << REG_MUTE)){
+		mutes = staged[REG_MUTE];
+	}
+	setChannels(srcs, mutes, vols);
+
+	if(staged_dirty & (1 << REG_STANDBY)){
+		writeReg(REG_STANDBY, staged[REG_STANDBY]);
+	}
+	staged_dirty = 0;
+}
+
+// Acts on a register written by the controller board
+void writeReg(uint8_t reg, uint8_t data){
+	if(staging && reg < NUM_STAGED_REGS){
+		staged[reg] = data;
+		staged_dirty |= 1 << reg;
+		return;
+	}
+
+	uint8_t ch, src; // variables holding zone and source information
+	uint8_t srcs[3];
+	switch(reg){
+
+		case REG_SRC_AD:
+			for(src =0; src < NUM_SRCS; src++){
+				InputType type = data % 2 ? IT_DIGITAL : IT_ANALOG; // Analog = low, Digital = high
+				configInput(src, type);
+				data = data >> 1;
+			}
+			break;
+
+		case REG_CH321:
+		case REG_CH654:
+			// Places one of the four sources on each of the lower or upper three channels
+			for(ch = 0; ch < 3; ch++){
+				srcs[ch] = data % 4;
+				data = data >> 2;
+			}
+			connectChannels(reg == REG_CH321 ? 0 : 3, 3, srcs);
+			break;
+
+		case REG_MUTE:
+			setMutes(data); // Bit N set mutes channel N
+			break;
+
+		case REG_STANDBY:
+			// Writes to this register now directly handle standby and audio power
+			if (data == 0){
+				standby();
+			}
+			else{
+				unstandby();
+			}
+			break;
+
+		case REG_VOL_CH1:
+		case REG_VOL_CH2:
+		case REG_VOL_CH3:
+		case REG_VOL_CH4:
+		case REG_VOL_CH5:
+		case REG_VOL_CH6:
+			ch = reg - REG_VOL_CH1;
+			setChannelVolume(ch, data);
+			break;
+		case REG_RAMP_CH1:
+		case REG_RAMP_CH2:
+		case REG_RAMP_CH3:
+		case REG_RAMP_CH4:
+		case REG_RAMP_CH5:
+		case REG_RAMP_CH6:
+			rampChannelVolume(reg - REG_RAMP_CH1, data);
+			break;
+		case REG_RAMP_INT_CH1:
+		case REG_RAMP_INT_CH2:
+		case REG_RAMP_INT_CH3:
+		case REG_RAMP_INT_CH4:
+		case REG_RAMP_INT_CH5:
+		case REG_RAMP_INT_CH6:
+			setRampInterval(reg - REG_RAMP_INT_CH1, data);
+			break;
+		case REG_PERF_SEL:
+			perf_sel = data;
+			break;
+		case REG_PERF_RESET:
+			if(data == 1){
+				perfReset();
+			}
+			break;
+		case REG_FAN_STATUS:
+			// Writing to this register is only used for turning the fan on full bore
+			if(data == 0){ // Release or force FAN_ON
+				forceFan(false);
+			} else if(data == 1){
+				forceFan(true);
+			}
+			break;
+		case REG_FAN_MODE:
+			setFanMode(data);
+			break;
+		case REG_FAN_ON_TEMP:
+			setFanOnTemp(data);
+			break;
+		case REG_FAN_OFF_TEMP:
+			setFanOffTemp(data);
+			break;
+		case REG_EXTERNAL_GPIO:
+			if(intLineEnabled()){
+				break; // EXT_GPIO is the event interrupt line
+			}
+			writePowerGpio(PWR_EXT_GPIO, data != 0);
+			break;
+		case REG_LED_OVERRIDE:
+			writeFrontPanel(data); // Full front panel control
+			break;
+		case REG_LED_PATTERN:
+			setLedPattern(data);
+			break;
+		case REG_LED_PERIOD:
+			setLedPeriod(data);
+			break;
+		case REG_PEC_CTRL:
+			setPecCtrl(data); // From the next transaction on
+			break;
+		case REG_STATUS_PERIOD:
+			setStatusPeriod(data);
+			break;
+		case REG_TELEM_PERIOD:
+			setTelemPeriod(data);
+			break;
+		case REG_EVENTS:
+			clearEvents(data); // Write 1 to clear
+			break;
+		case REG_EVENT_MASK:
+			setEventMask(data);
+			break;
+		case REG_FW_CTRL:
+			fwUpdateCtrl(data);
+			break;
+		case REG_FW_DATA:
+			fwUpdateData(data);
+			break;
+		case REG_FW_CRC:
+			fwUpdateCrc(data);
+			break;
+		case REG_STAGE:
+			// 1 starts staging, 0 discards anything staged
+			staging = data != 0;
+			staged_dirty = 0;
+			break;
+		case REG_COMMIT:
+			commitStaged();
+			break;
+		case REG_GROUP1_MEMBERS:
+		case REG_GROUP2_MEMBERS:
+		case REG_GROUP3_MEMBERS:
+		case REG_GROUP4_MEMBERS:
+			setGroupMembers(reg - REG_GROUP1_MEMBERS, data); // Bit N set adds channel N
+			break;
+		case REG_GROUP1_VOL:
+		case REG_GROUP2_VOL:
+		case REG_GROUP3_VOL:
+		case REG_GROUP4_VOL:
+			setGroupVolume(reg - REG_GROUP1_VOL, data);
+			break;
+		case REG_GROUP1_MUTE:
+		case REG_GROUP2_MUTE:
+		case REG_GROUP3_MUTE:
+		case REG_GROUP4_MUTE:
+			setGroupMute(reg - REG_GROUP1_MUTE, data != 0);
+			break;
+		case REG_SNAPSHOT:
+			setSnapshot(data);
+			break;
+		case REG_TRACE_CTRL:
+			setTraceCtrl(data);
+			break;
+		case REG_TRACE_TRIG:
+			setTraceTrigger(data);
+			break;
+		case REG_PRESET_SAVE:
+			// Keeps what was staged as a preset instead of applying it
+			savePreset(data & PRESET_SLOT_MASK, staged, staged_dirty);
+			staging = false;
+			staged_dirty = 0;
+			if(data & PRESET_PERSIST){
+				storePresets();
+			}
+			break;
+		case REG_PRESET_RECALL:
+			// Replaces anything staged. An empty slot applies nothing.
+			if(loadPreset(data, staged, &staged_dirty)){
+				commitStaged();
+			}
+			staging = false;
+			break;
+		case 0x99:
+			// free write to the ADC for debug purposes (writing to setup byte is possible)
+			write_ADC(data);
+			break;
+		default:
+			// do nothing
+			break;
+	}
+}
+
+// Incomplete or invalid address messages are dropped once any extra garbage data has shifted in
+static bool uart_clearing = false;
+static void clearUartGarbage(){
+	uartDiscard(&uart1);
+	USART_RequestCmd(USART1, USART_Request_ABRRQ, ENABLE); // The baud rate may have been measured from noise
+	uart_clearing = false;
+}
+
+// Sends "N<count>\r\n" up the chain, count is the number of preamps from this one down
+static void sendChainAck(uint8_t count){
+	uint8_t ack[] = {CHAIN_ACK, '0' + count, 0x0D, 0x0A};
+	uartWrite(&uart1, ack, sizeof(ack));
+
+	uint8_t after = count - 1;
+	if(after > BOOT_CHAIN_MAX){
+		after = BOOT_CHAIN_MAX;
+	}
+	boot_status |= BOOT_CHAIN_DONE | (after << BOOT_CHAIN_SHIFT);
+	initDiag(); // Addressing is done with the UARTs
+
+	// A watchdog reset from here on comes back without addressing again
+	RetainedLink link = {
+		.i2c_addr = i2c_addr,
+		.boot_status = boot_status,
+		.downstream = downstream_listening,
+		.event_mask = getEventMask(),
+		.pec_ctrl = getPecCtrl(),
+		.brr = USART1->BRR,
+	};
+	retainLink(&link);
+}
+
+// Passes the acknowledgement from the rest of the chain up once it arrives
+static uint32_t chain_ack_deadline;
+static TimerId chain_ack_timer = NO_TIMER;
+static void relayChainAck(){
+	uint8_t count = 1; // If the rest of the chain never answers only count this preamp
+	readDownstream();
+	if(downstream_acked){
+		uint8_t found = downstream_line.data[1] - '0';
+		if(found <= CHAIN_COUNT_MAX){
+			count = found < CHAIN_COUNT_MAX ? found + 1 : CHAIN_COUNT_MAX; // Ignore a garbled count
+		}
+	}else if((int32_t)(millis() - chain_ack_deadline) < 0){
+		return;
+	}
+	sendChainAck(count);
+	stopTimer(chain_ack_timer);
+}
+
+#ifndef DEBUG_OVER_UART2
+// Runs USART2 at the baud rate the address arrived at if there is a next
+// preamp, otherwise turns it off
+static void startDownstream(){
+	if(downstream_listening){
+		uartFlush(&uart1);
+		USART_Cmd(USART2, DISABLE);
+		USART2->BRR = USART1->BRR; // Use the baud rate the address arrived at
+		USART_Cmd(USART2, ENABLE);
+	}else{
+		// The last preamp in the chain has nothing to talk to downstream
+		NVIC_DisableIRQ(USART2_IRQn);
+		USART_Cmd(USART2, DISABLE);
+		RCC_APB1PeriphClockCmd(RCC_APB1Periph_USART2, DISABLE);
+	}
+}
+#endif
 
+// Turns the address message into the one for the next preamp
+static void nextAddress(UartLine * line){
+	uint8_t * d = line->data;
+	if(line->len == ADDR_MSG_SPLIT_LEN){
+		uint16_t next = d[1] + d[2];
+		d[1] = next > d[4] ? d[3] : next; // Wrap to the start of the next bus
+	}else{
+		d[line->len - 3] += ADDR_STRIDE; // The left digit incremented. Ex. A00 -> A10 -> A20 ...
+	}
+}
+
+// Resets the rest of the chain, then waits for this preamp's address over
+// UART and passes the next address on
+static void receiveAddress(){
 	// RESET AND PIN SETUP
-	Pin f0 = {'F',0};     // NRST_OUT
-	Pin f1 = {'F',1};     // BOOT0_OUT
+	Pin f0 = PIN(F, 0);   // NRST_OUT
+	Pin f1 = PIN(F, 1);   // BOOT0_OUT
 	clearPin(f0);         // Low-pulse on NRST_OUT so expansion boards are reset by the controller board
 	clearPin(f1);	      // Needs to be low so the subsequent preamp board doesn't start in 'Boot Mode'
 	delay_ms(1);          // Hold low for 1 ms
 	setPin(f0);		      // Needs to be high so the subsequent preamp board is not held in 'Reset Mode'
+#ifndef DEBUG_OVER_UART2
+	uint32_t downstream_reset = millis();
+#endif
+
+	uint8_t listening = CHAIN_LISTENING;
+	uartWrite(&uart1, &listening, 1); // Let the previous preamp know it can send our address
 
+	setLedPeriod(200);                 // Alternate red light status once per second
+	setLedPattern(LED_PATTERN_FAULT);
 	while(1){
-		if(UART_Preamp_RxBuffer.done == 1)
+		if(!uart_clearing && uartReadLine(&uart1, &address_line))
 		{
-			if(UART_Preamp_RxBuffer.data[0] == 0x41) // "A" - address identifier. Defends against potential noise on the UART line
+			if(!address_line.ovf && address_line.len >= 4 && address_line.data[0] == 0x41) // "A" - address identifier. Defends against potential noise on the UART line
 			{
-				i2c_addr = UART_Preamp_RxBuffer.data[1]; // This will be the device address on I2C1
-				UART_Preamp_TxBuffer = UART_Preamp_RxBuffer; // Need to send the new address to any subsequent boards. The left digit is incremented
-				UART_Preamp_TxBuffer.data[UART_Preamp_TxBuffer.ind-3] = UART_Preamp_TxBuffer.data[UART_Preamp_TxBuffer.ind-3] +16; // Ex. A00 -> A10 -> A20 ...
-#ifndef DEBUG_OVER_UART2
-				USART_PutString(USART2, UART_Preamp_TxBuffer.data); // Send the new address to the next preamp unless UART2 is used by the debugger
-#endif
+				i2c_addr = address_line.data[1]; // This will be the device address on I2C1
+				nextAddress(&address_line); // Send the next address to any subsequent boards
 				break;
 			}
-			delay_ms(2);  // allow time for any extra garbage data to shift in
-			RxBuf_Clear(&UART_Preamp_RxBuffer); // Only necessary for multiple runs without cycling power
-		} else if(UART_Preamp_RxBuffer.ovf == 1)
-		{
-			RxBuf_Clear(&UART_Preamp_RxBuffer); // Clear the buffers if they overflow
-			RxBuf_Clear(&UART_Preamp_TxBuffer);
-		}
-		blink = millis() / 1000; // Alternate red light status once per second
-		if(red_on != (blink % 2)){
-			red_on = blink % 2;
-			updateFrontPanel(red_on);
+			// Too long or not an address, which is usually noise or the wrong baud rate
+			uart_clearing = true;
+			startTimer(clearUartGarbage, 2, 0); // allow time for any extra garbage data to shift in
 		}
+#ifndef DEBUG_OVER_UART2
+		readDownstream();
+#endif
+		runScheduler();
+		kickWatchdog();
+		sleepIfIdle();
+	}
+	setLedPattern(LED_PATTERN_STATUS);
+	setLedPeriod(LED_PERIOD_DEFAULT);
+
+#ifndef DEBUG_OVER_UART2
+	// Send the new address to the next preamp unless UART2 is used by the debugger.
+	// Wait until it is listening, or until it is clear there is no next preamp.
+	while(!downstream_listening && millis() - downstream_reset < DOWNSTREAM_TIMEOUT){
+		readDownstream();
+		sleepIfIdle();
+	}
+	startDownstream();
+	if(downstream_listening){
+		uartWrite(&uart2, address_line.data, address_line.len);
+	}
+#endif
+}
+
+// Puts the address and UARTs back as addressing left them before a watchdog
+// reset. The rest of the chain kept running, so it isn't reset or addressed.
+static void resumeAddress(const RetainedLink * link){
+	i2c_addr = link->i2c_addr;
+	USART_Cmd(USART1, DISABLE);
+	USART_AutoBaudRateCmd(USART1, DISABLE);
+	USART1->BRR = link->brr;
+	USART_Cmd(USART1, ENABLE);
+#ifndef DEBUG_OVER_UART2
+	downstream_listening = link->downstream;
+	startDownstream();
+#endif
+}
+
+int main(void)
+{
+	// INIT
+	relocateVectors();    // Must come before any interrupt is enabled
+	init_gpio();		  // UART and I2C require GPIO pins
+	init_uart();		  // The preamp will receive its I2C network address via UART
+	init_i2c2();		  // Need I2C2 initialized for the front panel functionality during the address loop
+	enableFrontPanel();   // setup the I2C->GPIO chip
+	enablePowerBoard();   // setup the power supply chip
+	enablePSU();          // turn on 9V/12V power
+	systickInit();        // Initialize the clock ticks for delay_ms and other timing functionality
+	initSleep();          // Sleep between commands and measure how long for
+#ifdef PREAMP_BENCH
+	runBench();           // Time the I2C2 and GPIO paths instead of running normally, never returns
+#endif
+	initWatchdog();       // Reset if the main loop stops, the benchmark above doesn't kick it
+
+	const RetainedLink * recovered = recoveredLink();
+	if(recovered){
+		resumeAddress(recovered); // Back within a few ms of a watchdog reset
+	}else{
+		receiveAddress();
 	}
 
 	updateFrontPanel(true); // Stabilize the blinking red LED once an address is given
 	init_i2c1(i2c_addr);   // Initialize I2C with the new address
+	if(recovered){
+		setPecCtrl(recovered->pec_ctrl); // The controller board still adds the PEC to its writes
+	}
+	boot_status = BOOT_ADDRESSED;
+	enableI2CSlave();     // Start responding to the controller board, writes are held until the main loop
 	initChannels();       // Initialize each channel's volume state (does not write to volume control ICs)
 	initSources();       // Initialize each source's analog/digital state
+	initPresets();       // Load any presets stored in flash
+	initSnapshot(recoveredChannels()); // Restore the channels from before a watchdog reset, or from flash if snapshots are enabled
+	initStatus();        // Take the first sample of each status value
+	initThermal();       // Start controlling the fan from the heatsink temperatures
+	initTelemetry();     // Record the power board history once TELEM_PERIOD is set
+	initEvents();        // Latch power board changes from here on
+	boot_status |= BOOT_INITIALIZED;
 
-	uint8_t msg = 0;    // Used as the pass through for various device data traveling to the Pi
+	if(recovered){
+		// The chain acknowledged before the reset
+		boot_status |= recovered->boot_status;
+		setEventMask(recovered->event_mask);
+		latchEvents(EVENT_WATCHDOG);
+		initDiag();
+	}else if(downstream_listening){
+		// Acknowledge the address now that I2C is running, including the count from the rest of the chain
+		chain_ack_deadline = millis() + CHAIN_ACK_TIMEOUT;
+		chain_ack_timer = startTimer(relayChainAck, 0, 1);
+	}else{
+		sendChainAck(1);
+	}
 
-	// main loop, awaiting I2C commands
+	// main loop, servicing I2C commands
 	while(1){
-
-		// wait for address match
-		while(I2C_GetFlagStatus(I2C1, I2C_FLAG_ADDR) == RESET);
-		I2C_ClearFlag(I2C1,I2C_FLAG_ADDR);
-
-		// wait for reg address
-		while(I2C_GetFlagStatus(I2C1, I2C_FLAG_RXNE) == RESET);
-		reg = I2C_ReceiveData(I2C1);
-
-		// Determine if the controller is trying to read/write from/to you
-		int reading = 0;
-		int i;
-		for(i = 0; i < 100; i++){
-			reading |= I2C_GetFlagStatus(I2C1, 0x10000);
+		// Apply writes in the order they were received. They were ACKed by the
+		// I2C1 interrupt so the controller is not held up while they are applied.
+		RegWrite w;
+		bool wrote = false;
+		while(popRegWrite(&w)){
+			uint32_t start = micros();
+			writeReg(w.reg, w.data);
+			flushFrontPanel(); // Write the LEDs once for however many channels the write changed
+			perfCmdTime(micros() - start);
+			perfCountReg(w.reg);
+			traceAccess(w.reg, w.data, false, start);
+			wrote = true;
+		}
+		if(wrote){
+			retainState(); // A watchdog reset comes back with these writes applied
 		}
 
-		// Provide registers to be read
-		if (reading == 1){
-			// During reads, the address flag is set twice
-			while(I2C_GetFlagStatus(I2C1, I2C_FLAG_ADDR) == RESET);
-			I2C_ClearFlag(I2C1,I2C_FLAG_ADDR);
-
-			while(I2C_GetFlagStatus(I2C1, I2C_FLAG_TXIS) == RESET);
-			switch(reg){
-				case REG_POWER_GOOD:
-					msg = readI2C2(pwr_temp_mntr_gpio);
-					uint8_t pg_mask = 0xf3; // 1111 0011
-					uint8_t pg_status = 0;
-
-					msg &= ~(pg_mask); // Gets the value of PG_12V, PG_9V, and nothing else
-					pg_status = msg >> 2;
-					I2C_SendData(I2C1, pg_status); // Desired value is 0x03 - both good
-					break;
-				case REG_FAN_STATUS:
-					msg = readI2C2(pwr_temp_mntr_gpio);
-					uint8_t fan_mask = 0x4f; // 0100 1111
-					uint8_t fan_status = 0;
-
-					msg &= ~(fan_mask); // Gets the value of FAN_ON, OVR_TMP, FAN_FAIL, and nothing else
-					fan_status = msg >> 4;
-					I2C_SendData(I2C1, fan_status);
-					break;
-				case REG_EXTERNAL_GPIO:
-					msg = readI2C2(pwr_temp_mntr_gpio);
-					uint8_t io_mask = 0xbf; // 1011 1111
-					uint8_t io_status = 0;
-
-					msg &= ~(io_mask); // Gets the value of EXT_GPIO and nothing else
-					io_status = msg >> 6;
-					I2C_SendData(I2C1, io_status);
-					break;
-				case REG_LED_OVERRIDE:
-					msg = readI2C2(front_panel); // Current state of the front panel
-					I2C_SendData(I2C1, msg);
-					break;
-				case REG_HV1_VOLTAGE:
-					write_ADC(0x61); // Selects HV1 (AIN0)
-					msg = read_ADC();
-					I2C_SendData(I2C1, msg);
-					break;
-				case REG_HV2_VOLTAGE:
-					write_ADC(0x63); // Selects HV2 (AIN1)
-					msg = read_ADC();
-					I2C_SendData(I2C1, msg);
-					break;
-				case REG_HV1_TEMP:
-					write_ADC(0x65); // Selects NTC1 (AIN2)
-					msg = read_ADC();
-					I2C_SendData(I2C1, msg);
-					break;
-				case REG_HV2_TEMP:
-					write_ADC(0x67); // Selects NTC2 (AIN3)
-					msg = read_ADC();
-					I2C_SendData(I2C1, msg);
-					break;
-				case REG_VERSION_MAJOR:
-					I2C_SendData(I2C1, VERSION_MAJOR);
-					break;
-				case REG_VERSION_MINOR:
-					I2C_SendData(I2C1, VERSION_MINOR);
-					break;
-				case REG_GIT_HASH_27_20:
-					I2C_SendData(I2C1, GIT_HASH_27_20);
-					break;
-				case REG_GIT_HASH_19_12:
-					I2C_SendData(I2C1, GIT_HASH_19_12);
-					break;
-				case REG_GIT_HASH_11_04:
-					I2C_SendData(I2C1, GIT_HASH_11_04);
-					break;
-				case REG_GIT_HASH_STATUS:
-					I2C_SendData(I2C1, GIT_HASH_03_00_STATUS); // LSB is the clean/dirty status according to Git
-					break;
-				default:
-					I2C_SendData(I2C1, 0xFF); // Return FF if a non-existent register is selected
-			}
-		}else if (reading == 0){// Writing
-			// wait for reg data
-			while(I2C_GetFlagStatus(I2C1, I2C_FLAG_RXNE) == RESET);
-			data = I2C_ReceiveData(I2C1);
-
-			// act on command
-			switch(reg){
-
-				case REG_SRC_AD:
-					for(src =0; src < NUM_SRCS; src++){
-						InputType type = data % 2 ? IT_DIGITAL : IT_ANALOG; // Analog = low, Digital = high
-						configInput(src, type);
-						data = data >> 1;
-					}
-					break;
-
-				case REG_CH321:
-					for(ch =0; ch < 3; ch++){
-						src = data % 4;
-						connectChannel(src, ch); // Places one of the four sources on the lower three channels
-						data = data >> 2;
-					}
-					break;
-
-				case REG_CH654:
-					for(ch =3; ch < 6; ch++){
-						src = data % 4;
-						connectChannel(src, ch); // Places one of the four sources on the upper three channels
-						data = data >> 2;
-					}
-					break;
-
-				case REG_MUTE:
-					for(ch = 0; ch < 6; ch++){
-						if(data % 2){
-							mute(ch);
-						}else{
-							unmute(ch);
-						}
-						data = data >> 1;
-					}
-					break;
-
-				case REG_STANDBY:
-					// Writes to this register now directly handle standby and audio power
-					if (data == 0){
-						standby();
-					}
-					else{
-						unstandby();
-					}
-					break;
-
-				case REG_VOL_CH1:
-				case REG_VOL_CH2:
-				case REG_VOL_CH3:
-				case REG_VOL_CH4:
-				case REG_VOL_CH5:
-				case REG_VOL_CH6:
-					ch = reg - REG_VOL_CH1;
-					setChannelVolume(ch, data);
-					break;
-				case REG_FAN_STATUS:
-					// Writing to this register is only used for turning the fan on full bore
-					msg = readI2C2(pwr_temp_mntr_gpio);
-					uint8_t full_mask = 0x80; // 1000 0000
-
-					if(data == 0){ // Set FAN_ON to ON/OFF
-						msg &= ~(full_mask);
-					} else if(data == 1){
-						msg |= full_mask;
-					}
-					writeI2C2(pwr_temp_mntr_olat, msg);
-					break;
-				case REG_EXTERNAL_GPIO:
-					msg = readI2C2(pwr_temp_mntr_gpio);
-					uint8_t gpio_mask = 0x40; // 0100 0000
-
-					if(data == 0){ // Set EXT_GPIO to 0 or 1
-						msg &= ~(gpio_mask);
-					} else if(data == 1){
-						msg |= gpio_mask;
-					}
-					writeI2C2(pwr_temp_mntr_olat, msg);
-					break;
-				case REG_LED_OVERRIDE:
-					writeI2C2(front_panel, data); // Full front panel control
-					break;
-				case 0x99:
-					// free write to the ADC for debug purposes (writing to setup byte is possible)
-					write_ADC(data);
-					break;
-				default:
-					// do nothing
-					break;
-			}
+		// Reads are normally answered by the I2C1 interrupt. Only reads that
+		// arrive while writes are queued wait here, so they reflect those writes.
+		uint8_t reg, index;
+		if(regReadPending(&reg, &index)){
+			replyRegRead(readReg(reg, index));
 		}
-	}
-}
 
-/*
- * Function to send a string over USART
- * Inputs: USARTx (1 or 2), string
- * Process: Sends out string character-by-character and then sends
- * carriage return and line feed when done if needed
- */
-void USART_PutString(USART_TypeDef* USARTx, volatile uint8_t * str)
-{
-	int dt = 2; // delay time in ms. Increase to send out message more slowly. At 9600 baud, UART sends roughly 1 char each millisecond
-	while(*str != 0)
-	{
-		USART_SendData(USARTx, *str);
-		str++;
-		delay_ms(dt);
+		// Background jobs: status sampling, volume ramps, power sequencing and LED updates
+		runScheduler();
+		kickWatchdog();
+		sleepIfIdle();
 	}
-	delay_ms(dt);
-//	USART_SendData(USARTx, 0x0D); // Use these for terminal comms
-//	delay_ms(dt);                 // The message from ctrl bd should
-//	USART_SendData(USARTx, 0x0A); // already have \r\n at the end
-//	delay_ms(dt);
 }
 
 // Handles the interrupt on UART data reception
 void USART1_IRQHandler(void)
 {
-	if(USART_GetITStatus(USART1, USART_IT_RXNE) != RESET)
-	{
-		unsigned char m = USART_ReceiveData(USART1);
-		RxBuf_Add(&UART_Preamp_RxBuffer, m);
-	}
+	uartIrq(&uart1);
+}
+
+// Handles messages travelling back up the chain from the next preamp
+void USART2_IRQHandler(void)
+{
+	uartIrq(&uart2);
 }
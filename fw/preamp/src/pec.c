@@ -0,0 +1,69 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * SMBus packet error checking and transaction status for I2C1
+ *
+ * With PEC_ENABLE set every write transaction from the controller board
+ * ends with the SMBus PEC, a CRC-8 of the address byte and everything
+ * after it. The writes of a transaction are held until its stop and only
+ * applied if the PEC matches, so a corrupted write changes nothing. Each
+ * write transaction is counted in XFER_COUNT, and XFER_ERRORS keeps which
+ * of the last eight were rejected, so the controller can confirm a batch of
+ * writes with one read and resend only the ones that failed.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "pec.h"
+
+static volatile uint8_t pec_ctrl = 0;
+static volatile uint8_t xfer_count = 0;
+static volatile uint8_t xfer_errors = 0; // Bit 0 is the newest transaction, set if it was rejected
+
+// CRC-8 with the polynomial x^8 + x^2 + x + 1, as used by SMBus
+uint8_t updatePec(uint8_t pec, uint8_t data){
+	uint8_t i;
+	pec ^= data;
+	for(i = 0; i < 8; i++){
+		pec = (pec & 0x80) ? (pec << 1) ^ 0x07 : pec << 1;
+	}
+	return pec;
+}
+
+void setPecCtrl(uint8_t ctrl){
+	pec_ctrl = ctrl & PEC_ENABLE;
+}
+
+uint8_t getPecCtrl(){
+	return pec_ctrl;
+}
+
+bool pecEnabled(){
+	return pec_ctrl & PEC_ENABLE;
+}
+
+// Called once per write transaction that had data, from the I2C1 interrupt
+void countWriteXfer(bool ok){
+	xfer_count++;
+	xfer_errors = (xfer_errors << 1) | (ok ? 0 : 1);
+}
+
+uint8_t getXferCount(){
+	return xfer_count;
+}
+
+uint8_t getXferErrors(){
+	return xfer_errors;
+}
@@ -0,0 +1,40 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * SMBus packet error checking and transaction status for I2C1
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PEC_H_
+#define PEC_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// PEC_CTRL bits
+#define PEC_ENABLE (0x01) // Writes must end with a PEC byte, reads can be followed by one
+
+uint8_t updatePec(uint8_t pec, uint8_t data);
+
+void setPecCtrl(uint8_t ctrl);
+uint8_t getPecCtrl();
+bool pecEnabled();
+
+void countWriteXfer(bool ok);
+uint8_t getXferCount();
+uint8_t getXferErrors();
+
+#endif /* PEC_H_ */
@@ -0,0 +1,111 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Performance counters
+ *
+ * Counts the work done by the firmware so polling rates can be sized and
+ * changes measured on real hardware. Each counter is only incremented from
+ * one context (the I2C1 interrupt, the I2C2 interrupt or the main loop) so no
+ * locking is needed on increment. All counters wrap at 2^32.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "perf.h"
+#include "stm32f0xx.h"
+#include "systick.h"
+
+static volatile uint32_t counters[NUM_PERF];
+static volatile uint32_t reg_counts[PERF_NUM_REGS]; // Reads and writes of each register
+static volatile uint32_t cmd_total_us = 0;          // For the average
+static volatile uint32_t stretch_start = 0;
+static volatile uint8_t stretching = 0;             // Nested stretch reasons
+
+void perfCount(PerfCounter c, uint32_t n){
+	counters[c] += n;
+}
+
+void perfSet(PerfCounter c, uint32_t val){
+	counters[c] = val;
+}
+
+void perfCountReg(uint8_t reg){
+	if(reg < PERF_NUM_REGS){
+		reg_counts[reg]++;
+	}
+}
+
+// Records the time taken to apply one register write
+void perfCmdTime(uint32_t us){
+	counters[PERF_I2C1_WRITES]++;
+	cmd_total_us += us;
+	if(us > counters[PERF_CMD_MAX_US]){
+		counters[PERF_CMD_MAX_US] = us;
+	}
+}
+
+// Called when the controller's clock starts being stretched and when it is
+// released. Queued writes and a pending read can overlap, only the total
+// time the bus is held is counted.
+void perfStretchStart(){
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if(stretching++ == 0){
+		stretch_start = micros();
+	}
+	__set_PRIMASK(primask);
+}
+
+void perfStretchEnd(){
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if(stretching > 0 && --stretching == 0){
+		counters[PERF_I2C1_STRETCH_US] += micros() - stretch_start;
+	}
+	__set_PRIMASK(primask);
+}
+
+// Returns a PerfCounter, or the access count of a register if
+// sel is PERF_REG_BASE + register. Returns 0 for anything else.
+uint32_t perfGet(uint8_t sel){
+	if(sel >= PERF_REG_BASE){
+		sel -= PERF_REG_BASE;
+		return sel < PERF_NUM_REGS ? reg_counts[sel] : 0;
+	}
+	switch(sel){
+	case PERF_CMD_AVG_US:
+		return counters[PERF_I2C1_WRITES] ? cmd_total_us / counters[PERF_I2C1_WRITES] : 0;
+	case PERF_UPTIME_MS:
+		return millis();
+	default:
+		return sel < NUM_PERF ? counters[sel] : 0;
+	}
+}
+
+void perfReset(){
+	uint8_t i;
+	__disable_irq();
+	for(i = 0; i < NUM_PERF; i++){
+		counters[i] = 0;
+	}
+	for(i = 0; i < PERF_NUM_REGS; i++){
+		reg_counts[i] = 0;
+	}
+	cmd_total_us = 0;
+	if(stretching){
+		stretch_start = micros();
+	}
+	__enable_irq();
+}
@@ -0,0 +1,61 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Performance counters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PERF_H_
+#define PERF_H_
+
+#include <stdint.h>
+
+typedef enum{
+	PERF_I2C1_XFERS,      // Transactions from the controller board
+	PERF_I2C1_WRITES,     // Register writes applied
+	PERF_I2C1_READS,      // Register reads answered
+	PERF_I2C1_STRETCH_US, // Total time the controller was held by clock stretching
+	PERF_CMD_MAX_US,      // Longest time to apply a register write
+	PERF_CMD_AVG_US,      // Average time to apply a register write
+	PERF_I2C2_XFERS,      // Transactions with the volume ICs, power board and front panel
+	PERF_I2C2_BYTES,      // Bytes written or read on I2C2
+	PERF_I2C2_NACKS,      // I2C2 transactions a device did not acknowledge
+	PERF_UART_OVF,        // UART receive buffer overflows
+	PERF_UPTIME_MS,       // Time since power up or reset, not cleared by perfReset()
+	PERF_I2C2_TIMEOUTS,   // I2C2 transactions that did not finish in time
+	PERF_I2C2_BUS_ERRORS, // I2C2 transactions ended by a bus error or lost arbitration
+	PERF_I2C2_RECOVERIES, // Times a device was holding the I2C2 bus and was clocked free
+	PERF_I2C2_LAST_ERROR, // Device address << 8 | I2CError of the last failed I2C2 transaction
+	PERF_SLEEP_US,        // Total time asleep waiting for an interrupt
+	PERF_I2C1_REJECTS,    // Write transactions dropped for a bad PEC
+	NUM_PERF
+}PerfCounter;
+
+// Per-register access counts are selected with PERF_REG_BASE + register
+#define PERF_REG_BASE (0x80)
+#define PERF_NUM_REGS (0x60)
+
+void perfCount(PerfCounter c, uint32_t n);
+void perfSet(PerfCounter c, uint32_t val);
+void perfCountReg(uint8_t reg);
+void perfCmdTime(uint32_t us);
+void perfStretchStart();
+void perfStretchEnd();
+
+uint32_t perfGet(uint8_t sel);
+void perfReset();
+
+#endif /* PERF_H_ */
@@ -23,44 +23,44 @@
 // Enable pin mapping for each channel's four sources
 // Each channel can enable all or none of its sources. This firmware currently allows only one to be enabled at a time
 const Pin ch_src[NUM_CHANNELS][NUM_SRCS] = {
-	{{'A', 3},{'F', 5},{'A', 4},{'F', 4}},
-	{{'A', 5},{'A', 7},{'C', 4},{'A', 6}},
-	{{'C', 5},{'B', 1},{'B', 2},{'B', 0}},
-	{{'C', 1},{'B', 8},{'C',11},{'C', 0}},
-	{{'F', 7},{'B', 3},{'C',12},{'B', 5}},
-	{{'C',10},{'A', 2},{'A', 1},{'A', 0}}
+	{PIN(A, 3),PIN(F, 5),PIN(A, 4),PIN(F, 4)},
+	{PIN(A, 5),PIN(A, 7),PIN(C, 4),PIN(A, 6)},
+	{PIN(C, 5),PIN(B, 1),PIN(B, 2),PIN(B, 0)},
+	{PIN(C, 1),PIN(B, 8),PIN(C,11),PIN(C, 0)},
+	{PIN(F, 7),PIN(B, 3),PIN(C,12),PIN(B, 5)},
+	{PIN(C,10),PIN(A, 2),PIN(A, 1),PIN(A, 0)}
 };
 
 const Pin ch_mute[NUM_CHANNELS] = {
-	{'B',14},
-	{'C', 6},
-	{'C', 8},
-	{'A', 8},
-	{'A',12},
-	{'F', 6}
+	PIN(B,14),
+	PIN(C, 6),
+	PIN(C, 8),
+	PIN(A, 8),
+	PIN(A,12),
+	PIN(F, 6)
 };
 
 const Pin ch_standby[NUM_CHANNELS] = {
-	{'B',12},
-	{'B',13},
-	{'B',15},
-	{'C', 7},
-	{'C', 9},
-	{'A',11}
+	PIN(B,12),
+	PIN(B,13),
+	PIN(B,15),
+	PIN(C, 7),
+	PIN(C, 9),
+	PIN(A,11)
 };
 
 const Pin src_aen[NUM_CHANNELS] = {
-	{'B', 4},
-	{'B', 9},
-	{'C',15},
-	{'C', 2}
+	PIN(B, 4),
+	PIN(B, 9),
+	PIN(C,15),
+	PIN(C, 2)
 };
 
 const Pin src_den[NUM_CHANNELS] = {
-	{'D', 2},
-	{'C',13},
-	{'C',14},
-	{'C', 3}
+	PIN(D, 2),
+	PIN(C,13),
+	PIN(C,14),
+	PIN(C, 3)
 };
 
 const I2CReg ch_left[NUM_CHANNELS] = {
@@ -46,13 +46,78 @@ typedef enum {
 	REG_HV2_VOLTAGE = 17,
 	REG_HV1_TEMP = 18,
 	REG_HV2_TEMP = 19,
+	REG_STATUS_PERIOD = 20,
+	REG_STATUS_VALID = 21,
+	REG_STATUS_AGE = 22,
+	REG_POWER_STATE = 23,
+	REG_STAGE = 24,
+	REG_COMMIT = 25,
+	REG_RAMP_CH1 = 26,
+	REG_RAMP_CH2 = 27,
+	REG_RAMP_CH3 = 28,
+	REG_RAMP_CH4 = 29,
+	REG_RAMP_CH5 = 30,
+	REG_RAMP_CH6 = 31,
+	REG_RAMP_INT_CH1 = 32,
+	REG_RAMP_INT_CH2 = 33,
+	REG_RAMP_INT_CH3 = 34,
+	REG_RAMP_INT_CH4 = 35,
+	REG_RAMP_INT_CH5 = 36,
+	REG_RAMP_INT_CH6 = 37,
+	REG_BOOT_STATUS = 38,
+	REG_PERF_SEL = 39,
+	REG_PERF_DATA0 = 40,
+	REG_PERF_DATA1 = 41,
+	REG_PERF_DATA2 = 42,
+	REG_PERF_DATA3 = 43,
+	REG_PERF_RESET = 44,
+	REG_STATUS_BLOCK = 45,
+	REG_FAN_MODE = 46,
+	REG_FAN_ON_TEMP = 47,
+	REG_FAN_OFF_TEMP = 48,
+	REG_FAN_DUTY = 49,
+	REG_HV1_TEMP_C = 50,
+	REG_HV2_TEMP_C = 51,
+	REG_TELEM_PERIOD = 52,
+	REG_TELEM_COUNT = 53,
+	REG_TELEM_DATA = 54,
+	REG_EVENTS = 55,
+	REG_EVENT_MASK = 56,
+	REG_FW_CTRL = 57,
+	REG_FW_DATA = 58,
+	REG_FW_CRC = 59,
+	REG_FW_OFFSET = 60,
+	REG_IDLE = 61,
+	REG_PRESET_SAVE = 62,
+	REG_PRESET_RECALL = 63,
+	REG_GROUP1_MEMBERS = 64,
+	REG_GROUP2_MEMBERS = 65,
+	REG_GROUP3_MEMBERS = 66,
+	REG_GROUP4_MEMBERS = 67,
+	REG_GROUP1_VOL = 68,
+	REG_GROUP2_VOL = 69,
+	REG_GROUP3_VOL = 70,
+	REG_GROUP4_VOL = 71,
+	REG_GROUP1_MUTE = 72,
+	REG_GROUP2_MUTE = 73,
+	REG_GROUP3_MUTE = 74,
+	REG_GROUP4_MUTE = 75,
+	REG_SNAPSHOT = 76,
+	REG_TRACE_CTRL = 77,
+	REG_TRACE_TRIG = 78,
+	REG_TRACE_DATA = 79,
+	REG_LED_PATTERN = 80,
+	REG_LED_PERIOD = 81,
+	REG_PEC_CTRL = 82,
+	REG_XFER_COUNT = 83,
+	REG_XFER_ERRORS = 84,
 	REG_VERSION_MAJOR = 250,
 	REG_VERSION_MINOR = 251,
 	REG_GIT_HASH_27_20 = 252,
 	REG_GIT_HASH_19_12 = 253,
 	REG_GIT_HASH_11_04 = 254,
 	REG_GIT_HASH_STATUS = 255,
-	NUM_REGS = 25
+	NUM_REGS = 90
 } CmdReg;
 
 extern const Pin ch_src[NUM_CHANNELS][NUM_SRCS];
@@ -19,96 +19,71 @@
  */
 
 #include "ports.h"
+#include "i2c_master.h"
 #include "stm32f0xx.h"
 
-static GPIO_TypeDef * getPort(Pin pp){
-	switch(pp.port){
-	case 'A':
-		return GPIOA;
-	case 'B':
-		return GPIOB;
-	case 'C':
-		return GPIOC;
-	case 'D':
-		return GPIOD;
-	case 'F':
-		return GPIOF;
-	default:
-		return 0;
+static GPIO_TypeDef * const ports[NUM_PORTS] = {GPIOA, GPIOB, GPIOC, GPIOD, GPIOF};
+
+// Adds a pin to be driven high or low, replacing any earlier change to it
+void addPin(PinMasks * m, Pin pp, bool high){
+	if(high){
+		m->set[pp.port] |= pp.mask;
+		m->clear[pp.port] &= ~pp.mask;
+	}else{
+		m->clear[pp.port] |= pp.mask;
+		m->set[pp.port] &= ~pp.mask;
 	}
 }
 
-void setPin(Pin pp){
-	GPIO_TypeDef * port = getPort(pp);
-	port->BSRR = 1 << pp.pin; // lower 16 bits of BSRR used for setting, upper for clearing
+// Changes all the pins of each port at once
+void applyPinMasks(const PinMasks * m){
+	uint8_t i;
+	for(i = 0; i < NUM_PORTS; i++){
+		if(m->set[i] | m->clear[i]){
+			ports[i]->BSRR = m->set[i] | ((uint32_t)m->clear[i] << 16); // lower 16 bits of BSRR used for setting, upper for clearing
+		}
+	}
 }
 
-void clearPin(Pin pp){
-	GPIO_TypeDef * port = getPort(pp);
-	port->BRR = 1 << pp.pin; // lower 16 bits of BRR used for clearing
-}
+static bool read_ok; // Result of the last readI2C2()
 
-bool readPin(Pin pp){
-	GPIO_TypeDef * port = getPort(pp);
-	if(port->ODR & (1 << pp.pin)){
-		return true;
-	}else{
-		return false;
-	}
+static void readDone(bool ok){
+	read_ok = ok;
 }
 
+// Returns the register value, or -1 if the device NACKed or timed out
 int readI2C2(I2CReg r){
 
-	uint8_t data;
-
-	// wait if I2C2 is busy
-	while(I2C_GetFlagStatus(I2C2, I2C_FLAG_BUSY));
-
-	// setup to write start, addr, subaddr
-	I2C_TransferHandling(I2C2, r.dev, 1, I2C_SoftEnd_Mode, I2C_Generate_Start_Write);
-
-	// wait for transmit flag
-	while(I2C_GetFlagStatus(I2C2, I2C_FLAG_TXIS) == RESET);
-
-	// send register address
-	I2C_SendData(I2C2, r.reg);
+	uint8_t data = 0xFF;
 
-	// wait for transfer complete flag
-	while(I2C_GetFlagStatus(I2C2, I2C_ISR_TC) == RESET);
+	// write the register address then read one byte back after a repeated start
+	I2CXfer x = {.dev = r.dev, .tx_len = 1, .tx = {r.reg}, .rx_len = 1, .rx = &data, .done = readDone};
 
-	// this is the actual read transfer setup
-	I2C_TransferHandling(I2C2, r.dev, 1, I2C_AutoEnd_Mode, I2C_Generate_Start_Read);
-
-	// wait until we get the rx data then read it out
-	while(I2C_GetFlagStatus(I2C2, I2C_FLAG_RXNE) == RESET);
-	data = I2C_ReceiveData(I2C2);
-
-	// wait for stop condition to get sent then clear it
-	while(I2C_GetFlagStatus(I2C2, I2C_FLAG_STOPF) == RESET);
-	I2C_ClearFlag(I2C2, I2C_FLAG_STOPF);
+	// wait for this read, and any writes queued before it, to finish
+	read_ok = false;
+	waitI2C2(queueI2C2(&x));
 
 	// Return data that was read
-	return data;
+	return read_ok ? data : -1;
 }
 
 void writeI2C2(I2CReg r,  uint8_t data)
 {
-	// wait if I2C2 is busy
-	while(I2C_GetFlagStatus(I2C2, I2C_FLAG_BUSY));
-
-	// setup to send send start, addr, subaddr
-	I2C_TransferHandling(I2C2, r.dev, 2, I2C_AutoEnd_Mode, I2C_Generate_Start_Write);
-
-	// wait for transmit interrupted flag
-	while(I2C_GetFlagStatus(I2C2, I2C_FLAG_TXIS) == RESET);
-
-	// send subaddress and data
-	I2C_SendData(I2C2, r.reg);
-	I2C_SendData(I2C2, data);
+	// queued writes are sent in the background by the I2C2 interrupt
+	I2CXfer x = {.dev = r.dev, .tx_len = 2, .tx = {r.reg, data}};
+	queueI2C2(&x);
+}
 
-	// wait for stop flag to be sent and then clear it
-	while(I2C_GetFlagStatus(I2C2, I2C_FLAG_STOPF) == RESET);
-	I2C_ClearFlag(I2C2, I2C_FLAG_STOPF);
+// Writes len consecutive registers starting at r in one transaction.
+// The device must auto-increment its register address.
+void writeBurstI2C2(I2CReg r, const uint8_t * data, uint8_t len)
+{
+	I2CXfer x = {.dev = r.dev, .tx_len = len + 1, .tx = {r.reg}};
+	uint8_t i;
+	for(i = 0; i < len; i++){
+		x.tx[i + 1] = data[i];
+	}
+	queueI2C2(&x);
 }
 
 void writeI2C1(uint8_t data)
@@ -23,23 +23,56 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include "stm32f0xx.h"
 
+#define NUM_PORTS (5) // A, B, C, D, F
+
+// Index of each port in PinMasks
+#define PORT_A (0)
+#define PORT_B (1)
+#define PORT_C (2)
+#define PORT_D (3)
+#define PORT_F (4)
+
+// A pin resolved at compile time, so using it needs no lookup
 typedef struct{
-	char port; // Valid ports in our case are A,B,C,D,F
-	unsigned char pin : 4;
+	GPIO_TypeDef * gpio;
+	uint16_t mask;
+	uint8_t port; // PORT_x
 }Pin;
 
-void setPin(Pin pp);
-void clearPin(Pin pp);
-bool readPin(Pin pp);
+// Pin definition from its port letter and number, e.g. PIN(B, 14)
+#define PIN(p, n) {GPIO##p, 1 << (n), PORT_##p}
+
+static inline void setPin(Pin pp){
+	pp.gpio->BSRR = pp.mask; // lower 16 bits of BSRR used for setting, upper for clearing
+}
+
+static inline void clearPin(Pin pp){
+	pp.gpio->BRR = pp.mask; // lower 16 bits of BRR used for clearing
+}
+
+static inline bool readPin(Pin pp){
+	return (pp.gpio->ODR & pp.mask) != 0;
+}
+
+// Pin changes collected per port and applied with one BSRR write per port
+typedef struct{
+	uint16_t set[NUM_PORTS];
+	uint16_t clear[NUM_PORTS];
+}PinMasks;
+
+void addPin(PinMasks * m, Pin pp, bool high);
+void applyPinMasks(const PinMasks * m);
 
 typedef struct{
 	uint8_t dev;
 	uint8_t reg;
 }I2CReg;
 
-int readI2C2(I2CReg r);
+int readI2C2(I2CReg r); // -1 if the device did not respond
 void writeI2C2(I2CReg r, uint8_t data);
+void writeBurstI2C2(I2CReg r, const uint8_t * data, uint8_t len);
 void writeI2C1(uint8_t data);
 
 #endif /* PORTS_H_ */
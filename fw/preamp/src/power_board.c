@@ -22,60 +22,103 @@
 #include <stdbool.h>
 #include "ports.h"
 #include "channel.h"
+#include "status.h"
 #include "stm32f0xx.h"
 
+static bool int_line = false; // EXT_GPIO is the event interrupt line
+
+// The outputs last written to the power board GPIO. Only writePowerGpio()
+// changes it, the sampled STATUS_PWR_GPIO can be older than a write.
+static uint8_t olat = 0;
+
 void enablePowerBoard(){
 	// init the direction for the power board GPIO
-	writeI2C2(pwr_temp_mntr_dir, 0x3C); // Input or Output based on 0011 1100
+	writeI2C2(pwr_temp_mntr_dir, PWR_GPIO_DIR); // Input or Output based on 0011 1100
+	int prev = readI2C2(pwr_temp_mntr_olat);
+	if(prev >= 0){
+		olat = prev & PWR_GPIO_OUT; // Unchanged over a watchdog reset
+	}
 }
 
-void enablePSU(){
-	// 12V supply controls the fans, so it should typically be on
-	// New controller board requires 9V supply - this should always be on
-	uint8_t msg = 0;
-	uint8_t fp_mask = 0x03;
-
-	// Get current GPIO values from power board
-	msg = readI2C2(pwr_temp_mntr_gpio);
-
-	// Enable 9V/12V power supply
-	msg |= fp_mask;
+// Sets or clears outputs of the power board GPIO, leaving the other outputs as last written
+void writePowerGpio(uint8_t mask, bool high){
+	if(high){
+		olat |= mask & PWR_GPIO_OUT;
+	}else{
+		olat &= ~mask;
+	}
+
+	// Show the new outputs until the next sample reads them back
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	setStatus(STATUS_PWR_GPIO, (getStatus(STATUS_PWR_GPIO) & ~PWR_GPIO_OUT) | olat);
+	__set_PRIMASK(primask);
+
+	uint8_t msg = olat;
+	if(int_line){
+		msg &= ~PWR_EXT_GPIO; // The interrupt line only ever drives low
+	}
 	writeI2C2(pwr_temp_mntr_olat, msg);
 }
 
-void write_ADC(uint8_t data){
-	// wait if I2C2 is busy
-	while(I2C_GetFlagStatus(I2C2, I2C_FLAG_BUSY));
+// Hands EXT_GPIO over to the event interrupt line, released to start with,
+// or back to EXTERNAL_GPIO as a low output
+void enableIntLine(bool enable){
+	if(enable == int_line){
+		return;
+	}
+	writePowerGpio(PWR_EXT_GPIO, false);
+	int_line = enable;
+	writeI2C2(pwr_temp_mntr_dir, enable ? PWR_GPIO_DIR | PWR_EXT_GPIO : PWR_GPIO_DIR);
+}
 
-	// setup to send send start, addr, subaddr
-	I2C_TransferHandling(I2C2, adc_dev.dev, 1, I2C_AutoEnd_Mode, I2C_Generate_Start_Write);
+bool intLineEnabled(){
+	return int_line;
+}
 
-	// wait for transmit interrupted flag
-	while(I2C_GetFlagStatus(I2C2, I2C_FLAG_TXIS) == RESET);
+// Pulls the open-drain interrupt line low, or releases it to the pull-up.
+// The latch is always low so only the direction changes.
+void assertIntLine(bool assert){
+	if(int_line){
+		writeI2C2(pwr_temp_mntr_dir, assert ? PWR_GPIO_DIR : PWR_GPIO_DIR | PWR_EXT_GPIO);
+	}
+}
 
-	I2C_SendData(I2C2, data);
+void enablePSU(){
+	// 12V supply controls the fans, so it should typically be on
+	// New controller board requires 9V supply - this should always be on
+	writePowerGpio(PWR_EN_9V | PWR_EN_12V, true);
+}
 
-	// wait for stop flag to be sent and then clear it
-	while(I2C_GetFlagStatus(I2C2, I2C_FLAG_STOPF) == RESET);
-	I2C_ClearFlag(I2C2, I2C_FLAG_STOPF);
+void write_ADC(uint8_t data){
+	I2CXfer x = {.dev = adc_dev.dev, .tx_len = 1, .tx = {data}};
+	queueI2C2(&x);
 }
 
 int read_ADC(){
 
 	uint8_t data;
 
-	// Taken from the latter half of readI2C2(). The ADC only has the one reg to read from, so none of the reg specifying is necessary
-	while(I2C_GetFlagStatus(I2C2, I2C_FLAG_BUSY));
-
-	I2C_TransferHandling(I2C2, adc_dev.dev, 1, I2C_AutoEnd_Mode, I2C_Generate_Start_Read);
+	// The ADC only has the one reg to read from, so none of the reg specifying is necessary
+	I2CXfer x = {.dev = adc_dev.dev, .rx_len = 1, .rx = &data};
+	waitI2C2(queueI2C2(&x));
 
-	while(I2C_GetFlagStatus(I2C2, I2C_FLAG_RXNE) == RESET);
-	data = I2C_ReceiveData(I2C2);
+	return data;
 
-	while(I2C_GetFlagStatus(I2C2, I2C_FLAG_STOPF) == RESET);
-	I2C_ClearFlag(I2C2, I2C_FLAG_STOPF);
+}
 
-	return data;
+void scan_ADC(uint8_t * vals){
+	// Converts all four channels in one transaction instead of selecting and reading each channel
+	write_ADC(ADC_SCAN_CONFIG);
 
+	I2CXfer x = {.dev = adc_dev.dev, .rx_len = NUM_ADC_CH, .rx = vals};
+	waitI2C2(queueI2C2(&x));
 }
 
+// Same as scan_ADC() but returns immediately, done is called once vals is filled
+void queueScanADC(uint8_t * vals, I2CDone done){
+	write_ADC(ADC_SCAN_CONFIG);
+
+	I2CXfer x = {.dev = adc_dev.dev, .rx_len = NUM_ADC_CH, .rx = vals, .done = done};
+	queueI2C2(&x);
+}
@@ -22,10 +22,32 @@
 #define POWER_BOARD_H_
 
 #include "port_defs.h"
+#include "i2c_master.h"
+
+#define NUM_ADC_CH (4) // HV1, HV2, NTC1, NTC2
+#define ADC_SCAN_CONFIG (0x07) // Configuration byte: scan AIN0 up to AIN3 (CS=3), single-ended
+
+// Power board GPIO expander
+#define PWR_GPIO_DIR (0x3C) // EN_9V, EN_12V, EXT_GPIO and FAN_ON are outputs
+#define PWR_GPIO_OUT ((uint8_t)~PWR_GPIO_DIR)
+#define PWR_EN_9V    (0x01)
+#define PWR_EN_12V   (0x02)
+#define PWR_PG_9V    (0x04)
+#define PWR_PG_12V   (0x08)
+#define PWR_FAN_FAIL (0x10) // Active-low
+#define PWR_OVR_TMP  (0x20) // Active-low
+#define PWR_EXT_GPIO (0x40)
+#define PWR_FAN_ON   (0x80)
 
 void enablePowerBoard();
 void enablePSU();
+void writePowerGpio(uint8_t mask, bool high);
+void enableIntLine(bool enable);
+bool intLineEnabled();
+void assertIntLine(bool assert);
 void write_ADC(uint8_t data);
 int read_ADC();
+void scan_ADC(uint8_t * vals);
+void queueScanADC(uint8_t * vals, I2CDone done);
 
 #endif /* POWER_BOARD_H_ */
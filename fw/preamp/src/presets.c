@@ -0,0 +1,113 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Scene presets, recalled with a single register write
+ *
+ * A preset is a set of staged audio register writes, SRC_AD through
+ * CH6_ATTEN, kept so it can be committed again later. Recalling one goes
+ * through the same path as COMMIT, so a scene change costs one write per
+ * preamp (or one broadcast) and the sources still switch inside a single
+ * mute window. Like a commit, only the registers that were staged are
+ * applied, so a preset can change just the volumes.
+ *
+ * The presets can be stored in the last page of flash and are loaded from
+ * it at startup. Storing erases and programs the page, which stalls the
+ * core for about 40 ms while the controller is held by clock stretching.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "presets.h"
+#include <stddef.h>
+#include "flash.h"
+#include "fw_update.h"
+
+#define PRESET_MAGIC (0x31525050) // "PPR1"
+
+typedef struct{
+	uint32_t magic;
+	uint16_t mask[NUM_PRESETS]; // Bit N set if register N is part of the preset, 0 if unused
+	uint8_t vals[NUM_PRESETS][NUM_PRESET_REGS];
+	uint32_t crc; // CRC-32 of everything before it
+}PresetStore;
+
+// Half-words are programmed, and the CRC must follow the values directly
+_Static_assert(sizeof(PresetStore) % 4 == 0 &&
+		offsetof(PresetStore, crc) == sizeof(PresetStore) - 4, "PresetStore padding");
+
+static PresetStore presets;
+
+static uint32_t presetCrc(const PresetStore * p){
+	return crc32(0, (const uint8_t *)p, offsetof(PresetStore, crc));
+}
+
+void savePreset(uint8_t slot, const uint8_t * vals, uint16_t mask){
+	uint8_t i;
+	slot &= PRESET_SLOT_MASK;
+	presets.mask[slot] = mask;
+	for(i = 0; i < NUM_PRESET_REGS; i++){
+		presets.vals[slot][i] = vals[i];
+	}
+}
+
+// Returns false if nothing was saved in slot
+bool loadPreset(uint8_t slot, uint8_t * vals, uint16_t * mask){
+	uint8_t i;
+	slot &= PRESET_SLOT_MASK;
+	*mask = presets.mask[slot];
+	for(i = 0; i < NUM_PRESET_REGS; i++){
+		vals[i] = presets.vals[slot][i];
+	}
+	return *mask != 0;
+}
+
+// Writes every preset to flash, returns false if that failed or a
+// firmware update is using the flash
+bool storePresets(){
+	if(fwUpdateUsingFlash()){
+		return false;
+	}
+	presets.magic = PRESET_MAGIC;
+	presets.crc = presetCrc(&presets);
+
+	const uint16_t * p = (const uint16_t *)&presets;
+	bool ok;
+	uint8_t i;
+	flashUnlock();
+	ok = flashErasePage(PRESET_ADDR);
+	for(i = 0; ok && i < sizeof(presets) / 2; i++){
+		ok = flashProgram(PRESET_ADDR + 2 * i, p[i]);
+	}
+	flashLock();
+	return ok;
+}
+
+// Bit N set if slot N holds a preset
+uint8_t getPresetSlots(){
+	uint8_t slots = 0;
+	uint8_t i;
+	for(i = 0; i < NUM_PRESETS; i++){
+		slots |= (presets.mask[i] != 0) << i;
+	}
+	return slots;
+}
+
+// Loads the stored presets, if any
+void initPresets(){
+	const PresetStore * stored = (const PresetStore *)PRESET_ADDR;
+	if(stored->magic == PRESET_MAGIC && stored->crc == presetCrc(stored)){
+		presets = *stored;
+	}
+}
@@ -0,0 +1,39 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Scene presets, recalled with a single register write
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PRESETS_H_
+#define PRESETS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "port_defs.h"
+
+#define NUM_PRESETS      (8)
+#define NUM_PRESET_REGS  (REG_VOL_CH6 + 1) // The registers that can be staged
+#define PRESET_SLOT_MASK (0x07)            // PRESET_SAVE bits holding the slot
+#define PRESET_PERSIST   (0x80)            // PRESET_SAVE bit that also stores every preset in flash
+
+void initPresets();
+void savePreset(uint8_t slot, const uint8_t * vals, uint16_t mask);
+bool loadPreset(uint8_t slot, uint8_t * vals, uint16_t * mask);
+bool storePresets();
+uint8_t getPresetSlots();
+
+#endif /* PRESETS_H_ */
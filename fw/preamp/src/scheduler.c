@@ -0,0 +1,124 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Cooperative millisecond timer and deferred work scheduler
+ *
+ * Background jobs (status sampling, volume ramps, power sequencing, LED
+ * updates) run as short tasks from the main loop between I2C commands
+ * instead of blocking in delay_ms(). Tasks run to completion so they must
+ * not wait on anything. Only call these functions from the main loop.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "scheduler.h"
+#include "systick.h"
+
+typedef struct{
+	Task task;       // NULL if the timer is free
+	uint32_t due;    // millis() when the task next runs
+	uint32_t period; // ms between runs, 0 for a one-shot timer
+}Timer;
+
+static Timer timers[MAX_TIMERS];
+
+// Work to run once on the next pass of the scheduler, in the order it was added
+static Task deferred[MAX_DEFERRED];
+static uint8_t num_deferred = 0;
+static uint8_t next_deferred = 0; // Next to run, earlier entries have already run
+
+static bool timerDue(const Timer * t, uint32_t now){
+	return t->task && (int32_t)(now - t->due) >= 0;
+}
+
+// Runs task after delay ms, then every period ms if period is not 0.
+// Returns an id for stopTimer(), or NO_TIMER if every timer is in use.
+TimerId startTimer(Task task, uint32_t delay, uint32_t period){
+	TimerId id;
+	for(id = 0; id < MAX_TIMERS; id++){
+		if(!timers[id].task){
+			timers[id].task = task;
+			timers[id].due = millis() + delay;
+			timers[id].period = period;
+			return id;
+		}
+	}
+	return NO_TIMER;
+}
+
+void stopTimer(TimerId id){
+	if(id < MAX_TIMERS){
+		timers[id].task = 0;
+	}
+}
+
+// Runs task once on the next pass of the scheduler. Adding a task that is
+// already waiting does nothing, so a burst of changes is handled once.
+void deferWork(Task task){
+	uint8_t i;
+	for(i = next_deferred; i < num_deferred; i++){
+		if(deferred[i] == task){
+			return;
+		}
+	}
+	if(num_deferred < MAX_DEFERRED){
+		deferred[num_deferred++] = task;
+	}else{
+		task(); // No room, run it now rather than lose it
+	}
+}
+
+// Runs deferred work and any timers that are due
+void runScheduler(){
+	uint32_t now = millis();
+	TimerId id;
+	for(id = 0; id < MAX_TIMERS; id++){
+		Timer * t = &timers[id];
+		if(timerDue(t, now)){
+			Task task = t->task;
+			if(t->period){
+				t->due += t->period;
+				if(timerDue(t, now)){
+					t->due = now + t->period; // Fell behind, skip the missed runs
+				}
+			}else{
+				t->task = 0; // Free before running so the task can restart it
+			}
+			task();
+		}
+	}
+
+	// Tasks may defer more work, which also runs in this pass
+	while(next_deferred < num_deferred){
+		deferred[next_deferred++]();
+	}
+	num_deferred = 0;
+	next_deferred = 0;
+}
+
+// True if runScheduler() has something to do right now
+bool schedulerBusy(){
+	uint32_t now = millis();
+	TimerId id;
+	if(num_deferred){
+		return true;
+	}
+	for(id = 0; id < MAX_TIMERS; id++){
+		if(timerDue(&timers[id], now)){
+			return true;
+		}
+	}
+	return false;
+}
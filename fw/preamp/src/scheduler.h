@@ -0,0 +1,41 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Cooperative millisecond timer and deferred work scheduler
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MAX_TIMERS (14)
+#define MAX_DEFERRED (8)
+#define NO_TIMER (0xFF)
+
+typedef void (*Task)(void);
+typedef uint8_t TimerId;
+
+TimerId startTimer(Task task, uint32_t delay, uint32_t period);
+void stopTimer(TimerId id);
+void deferWork(Task task);
+
+void runScheduler();
+bool schedulerBusy();
+
+#endif /* SCHEDULER_H_ */
@@ -0,0 +1,70 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Sleeping between commands and measuring the time spent asleep
+ *
+ * Every interrupt the firmware relies on wakes the core from Sleep mode, so
+ * the main loops sleep whenever no timer or deferred task is due and the
+ * controller isn't waiting on a read. SysTick wakes it every millisecond.
+ * Stop mode would save more, but the STM32F030's I2C1 can't wake the core
+ * from it on an address match and the millisecond timers would stop.
+ * The flash and SRAM interface clocks are also stopped while asleep, since
+ * nothing uses them until an interrupt wakes the core.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "sleep.h"
+#include "i2c_slave.h"
+#include "perf.h"
+#include "scheduler.h"
+#include "stm32f0xx.h"
+#include "systick.h"
+
+static uint32_t window_start = 0; // micros() at the start of the current window
+static uint32_t window_asleep = 0; // us asleep in the current window
+static uint8_t idle_percent = 0;   // Of the last full window
+
+// Sleeps until the next interrupt if there is nothing to do
+void sleepIfIdle(){
+	__disable_irq(); // An interrupt that arrives now still wakes the WFI
+	if(!schedulerBusy() && !i2cSlaveBusy()){
+		uint32_t start = micros();
+		__WFI();
+		uint32_t us = micros() - start; // Before the interrupt that woke the core runs
+		window_asleep += us;
+		perfCount(PERF_SLEEP_US, us);
+	}
+	__enable_irq();
+}
+
+static void updateIdle(){
+	uint32_t now = micros();
+	uint32_t elapsed = now - window_start;
+	idle_percent = elapsed ? window_asleep * 100 / elapsed : 0; // At most about 1000000 * 100
+	window_start = now;
+	window_asleep = 0;
+}
+
+// The percentage of the last IDLE_WINDOW ms spent asleep
+uint8_t getIdlePercent(){
+	return idle_percent;
+}
+
+void initSleep(){
+	RCC->AHBENR &= ~(RCC_AHBENR_FLITFEN | RCC_AHBENR_SRAMEN); // Only while asleep
+	window_start = micros();
+	startTimer(updateIdle, IDLE_WINDOW, IDLE_WINDOW);
+}
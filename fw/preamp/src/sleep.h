@@ -0,0 +1,32 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Sleeping between commands and measuring the time spent asleep
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SLEEP_H_
+#define SLEEP_H_
+
+#include <stdint.h>
+
+#define IDLE_WINDOW (1000) // ms over which IDLE is measured
+
+void initSleep();
+void sleepIfIdle();
+uint8_t getIdlePercent();
+
+#endif /* SLEEP_H_ */
@@ -0,0 +1,217 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Snapshots of the channel state in flash, restored after a reset
+ *
+ * While enabled, the volumes, sources, mutes, input types and whether the
+ * amps are on are written to flash once they have stayed the same for
+ * SNAPSHOT_SETTLE checks, so dragging a volume slider costs one record.
+ * At startup the newest record is applied before the controller board has
+ * said anything, so a preamp that browned out or was reset comes back
+ * playing without the Pi replaying every zone.
+ *
+ * Records are appended in turn to the two flash pages after the bootloader's
+ * code, and the newest valid one wins. A page is only erased once the writes
+ * have moved on to it, by which time the other page holds the newest record,
+ * so the state survives losing power at any point. Erasing stalls the core
+ * for about 20 ms, once every 42 records, so the record that starts a page
+ * waits until the I2C1 slave is idle. A transaction that starts during the
+ * erase is still held by clock stretching until it ends.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "snapshot.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include "channel.h"
+#include "flash.h"
+#include "fw_update.h"
+#include "i2c_slave.h"
+#include "port_defs.h"
+#include "scheduler.h"
+
+typedef struct{
+	uint32_t seq; // Counts up with each record, erased flash reads 0xFFFFFFFF
+	ChannelSnapshot state;
+	uint32_t crc; // CRC-32 of everything before it
+}SnapshotRecord;
+
+_Static_assert(sizeof(SnapshotRecord) % 4 == 0 &&
+		offsetof(SnapshotRecord, crc) == sizeof(SnapshotRecord) - 4, "SnapshotRecord padding");
+
+#define SEQ_ERASED   (0xFFFFFFFF)
+#define PAGE_RECORDS (FLASH_PAGE_SIZE / sizeof(SnapshotRecord))
+#define NUM_RECORDS  (PAGE_RECORDS * SNAPSHOT_PAGES)
+
+static uint8_t flags = 0;          // SNAPSHOT register
+static ChannelSnapshot written;    // The state in the newest record
+static ChannelSnapshot pending;    // The state at the last check
+static uint8_t stable = 0;         // Checks pending has stayed the same for
+static uint16_t next_record = 0;
+static uint32_t next_seq = 0;
+
+static const SnapshotRecord * record(uint16_t i){
+	const SnapshotRecord * page = (const SnapshotRecord *)(SNAPSHOT_ADDR + (i / PAGE_RECORDS) * FLASH_PAGE_SIZE);
+	return &page[i % PAGE_RECORDS];
+}
+
+static uint32_t recordCrc(const SnapshotRecord * r){
+	return crc32(0, (const uint8_t *)r, offsetof(SnapshotRecord, crc));
+}
+
+static bool recordErased(const SnapshotRecord * r){
+	const uint16_t * p = (const uint16_t *)r;
+	uint8_t i;
+	for(i = 0; i < sizeof(SnapshotRecord) / 2; i++){
+		if(p[i] != 0xFFFF){
+			return false;
+		}
+	}
+	return true;
+}
+
+bool sameChannels(const ChannelSnapshot * a, const ChannelSnapshot * b){
+	const uint8_t * pa = (const uint8_t *)a;
+	const uint8_t * pb = (const uint8_t *)b;
+	uint8_t i;
+	for(i = 0; i < sizeof(ChannelSnapshot); i++){
+		if(pa[i] != pb[i]){
+			return false;
+		}
+	}
+	return true;
+}
+
+void captureChannels(ChannelSnapshot * s){
+	uint8_t ch;
+	for(ch = 0; ch < NUM_CHANNELS; ch++){
+		s->vol[ch] = getRampTarget(ch);
+		s->src[ch] = getChannelSource(ch);
+	}
+	s->mutes = getMutes();
+	s->digital = getDigitalInputs();
+	s->powered = getPowerState() == PWR_READY || getPowerState() == PWR_POWERING_UP;
+	s->flags = flags & SNAPSHOT_ENABLE;
+}
+
+// Appends a record, erasing the next page first when the writes move on to
+// it. A record left half written by a reset is skipped along with the rest
+// of its page.
+static bool writeRecord(const ChannelSnapshot * s){
+	if(fwUpdateUsingFlash()){
+		return false; // Tried again at the next check
+	}
+	if(next_record % PAGE_RECORDS != 0 && !recordErased(record(next_record))){
+		next_record = (next_record / PAGE_RECORDS + 1) * PAGE_RECORDS % NUM_RECORDS;
+	}
+	if(next_record % PAGE_RECORDS == 0 && !i2cSlaveIdle()){
+		return false; // Erasing now would stretch I2C1, tried again at the next check
+	}
+
+	SnapshotRecord r = {.seq = next_seq, .state = *s};
+	r.crc = recordCrc(&r);
+	uint32_t addr = (uint32_t)(uintptr_t)record(next_record);
+	const uint16_t * p = (const uint16_t *)&r;
+	bool ok = true;
+	uint8_t i;
+	flashUnlock();
+	if(next_record % PAGE_RECORDS == 0){
+		ok = flashErasePage(addr);
+	}
+	for(i = 0; ok && i < sizeof(r) / 2; i++){
+		ok = flashProgram(addr + 2 * i, p[i]);
+	}
+	flashLock();
+
+	next_record = (next_record + 1) % NUM_RECORDS;
+	next_seq++;
+	return ok;
+}
+
+// Writes the state once it has settled and differs from the newest record.
+// While disabled only a record left over from setSnapshot() is written.
+static void checkSnapshot(){
+	if(!(flags & SNAPSHOT_ENABLE) && !(written.flags & SNAPSHOT_ENABLE)){
+		return;
+	}
+	ChannelSnapshot now;
+	captureChannels(&now);
+	if(!sameChannels(&now, &pending)){
+		pending = now;
+		stable = 0;
+	}else if(stable < SNAPSHOT_SETTLE){
+		stable++;
+	}else if(!sameChannels(&now, &written) && writeRecord(&now)){
+		written = now;
+	}
+}
+
+// Enabling writes the current state right away, or at the next check if the
+// record would erase a page. Disabling writes a record without
+// SNAPSHOT_ENABLE the same way, so nothing is restored at the next startup.
+void setSnapshot(uint8_t val){
+	if((val & SNAPSHOT_ENABLE) == (flags & SNAPSHOT_ENABLE)){
+		return;
+	}
+	flags = (flags & ~SNAPSHOT_ENABLE) | (val & SNAPSHOT_ENABLE);
+	captureChannels(&pending);
+	stable = SNAPSHOT_SETTLE;
+	if(writeRecord(&pending)){
+		written = pending;
+	}
+}
+
+uint8_t getSnapshot(){
+	return flags;
+}
+
+static void restore(const ChannelSnapshot * s){
+	uint8_t src;
+	for(src = 0; src < NUM_SRCS; src++){
+		configInput(src, s->digital & (1 << src) ? IT_DIGITAL : IT_ANALOG);
+	}
+	setChannels(s->src, s->mutes, s->vol);
+	if(s->powered){
+		unstandby();
+	}
+	flags = (s->flags & SNAPSHOT_ENABLE) | SNAPSHOT_RESTORED;
+}
+
+// Finds the newest record and restores it if snapshots were enabled. The
+// state kept in RAM over a watchdog reset, if given, is newer than any record
+// so it is restored instead. Must run after initChannels() and initSources().
+void initSnapshot(const ChannelSnapshot * retained){
+	const SnapshotRecord * newest = NULL;
+	uint16_t i;
+	for(i = 0; i < NUM_RECORDS; i++){
+		const SnapshotRecord * r = record(i);
+		if(r->seq != SEQ_ERASED && r->crc == recordCrc(r) && (!newest || r->seq > newest->seq)){
+			newest = r;
+			next_record = (i + 1) % NUM_RECORDS;
+		}
+	}
+	if(newest){
+		next_seq = newest->seq + 1;
+		written = newest->state;
+	}
+	if(retained){
+		restore(retained);
+	}else if(newest && (written.flags & SNAPSHOT_ENABLE)){
+		restore(&written);
+	}
+	captureChannels(&pending);
+	startTimer(checkSnapshot, SNAPSHOT_CHECK, SNAPSHOT_CHECK);
+}
@@ -0,0 +1,50 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Snapshots of the channel state in flash, restored after a reset
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "port_defs.h"
+
+#define SNAPSHOT_CHECK  (1000) // ms between checks for a changed state
+#define SNAPSHOT_SETTLE (10)   // Checks the state must stay the same before it is written
+
+// SNAPSHOT register bits
+#define SNAPSHOT_ENABLE   (0x01) // Snapshots are taken and restored at startup
+#define SNAPSHOT_RESTORED (0x02) // Read-only, the state was restored at startup
+
+typedef struct{
+	uint8_t vol[NUM_CHANNELS]; // Ramp targets, so a ramp in progress is restored finished
+	uint8_t src[NUM_CHANNELS];
+	uint8_t mutes;
+	uint8_t digital;
+	uint8_t powered;           // The amps were on or turning on
+	uint8_t flags;             // SNAPSHOT_ENABLE
+}ChannelSnapshot;
+
+void initSnapshot(const ChannelSnapshot * retained);
+void captureChannels(ChannelSnapshot * s);
+bool sameChannels(const ChannelSnapshot * a, const ChannelSnapshot * b);
+void setSnapshot(uint8_t val);
+uint8_t getSnapshot();
+
+#endif /* SNAPSHOT_H_ */
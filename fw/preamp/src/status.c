@@ -0,0 +1,181 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Background-sampled cache of the power board and front panel status
+ *
+ * Reading these values requires an I2C2 transaction, which is too slow to
+ * do while the controller board is waiting on I2C1. Instead each value is
+ * periodically sampled in the background and reads are answered from RAM.
+ * Samples are queued on I2C2 and stored when the transaction completes.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "status.h"
+#include "i2c_master.h"
+#include "scheduler.h"
+#include "ports.h"
+#include "port_defs.h"
+#include "power_board.h"
+#include "systick.h"
+
+typedef struct{
+	uint8_t val;
+	bool valid;     // Sampled at least once
+	uint32_t stamp; // millis() at the last sample
+}StatusValue;
+
+static volatile StatusValue status[NUM_STATUS];
+static volatile uint8_t period = DEFAULT_STATUS_PERIOD;
+static uint8_t next_item = 0; // Periodic samples are taken round-robin
+
+// Buffers filled by the I2C2 interrupt
+static uint8_t gpio_rx;
+static uint8_t front_panel_rx;
+static uint8_t adc_rx[NUM_ADC_CH];
+static volatile bool in_flight[NUM_STATUS];
+
+static void gpioDone(bool ok){
+	if(ok){
+		setStatus(STATUS_PWR_GPIO, gpio_rx);
+	}
+	in_flight[STATUS_PWR_GPIO] = false;
+}
+
+static void frontPanelDone(bool ok){
+	if(ok){
+		setStatus(STATUS_FRONT_PANEL, front_panel_rx);
+	}
+	in_flight[STATUS_FRONT_PANEL] = false;
+}
+
+static void adcDone(bool ok){
+	uint8_t ch;
+	for(ch = 0; ch < NUM_ADC_CH; ch++){
+		if(ok){
+			setStatus(STATUS_HV1 + ch, adc_rx[ch]);
+		}
+		in_flight[STATUS_HV1 + ch] = false;
+	}
+}
+
+// Queues a sample, the value is updated once the transaction completes
+static void sample(StatusItem item){
+	in_flight[item] = true;
+
+	I2CXfer x = {.tx_len = 1, .rx_len = 1};
+	uint8_t ch;
+	switch(item){
+	case STATUS_PWR_GPIO:
+		x.dev = pwr_temp_mntr_gpio.dev;
+		x.tx[0] = pwr_temp_mntr_gpio.reg;
+		x.rx = &gpio_rx;
+		x.done = gpioDone;
+		queueI2C2(&x);
+		break;
+	case STATUS_FRONT_PANEL:
+		x.dev = front_panel.dev;
+		x.tx[0] = front_panel.reg;
+		x.rx = &front_panel_rx;
+		x.done = frontPanelDone;
+		queueI2C2(&x);
+		break;
+	default:
+		// All the ADC channels are converted at once
+		for(ch = 0; ch < NUM_ADC_CH; ch++){
+			in_flight[STATUS_HV1 + ch] = true;
+		}
+		queueScanADC(adc_rx, adcDone);
+		break;
+	}
+}
+
+// Runs every millisecond to keep the cache up to date
+static void serviceStatus(){
+	if(period == 0){
+		return; // Background sampling is paused
+	}
+
+	// Only take one periodic sample per call to keep the main loop responsive
+	uint32_t now = millis();
+	uint8_t item, i;
+	for(i = 0; i < NUM_STATUS; i++){
+		item = (next_item + i) % NUM_STATUS;
+		if(!in_flight[item] && now - status[item].stamp >= period){
+			sample(item);
+			next_item = (item + 1) % NUM_STATUS;
+			break;
+		}
+	}
+}
+
+void initStatus(){
+	sample(STATUS_PWR_GPIO);
+	sample(STATUS_FRONT_PANEL);
+	sample(STATUS_HV1); // Samples all ADC channels
+	flushI2C2();        // Start with every value valid
+	startTimer(serviceStatus, 1, 1);
+}
+
+// Samples a value now unless a sample is already on the way, e.g. while
+// background sampling is paused
+void refreshStatus(StatusItem item){
+	if(!in_flight[item]){
+		sample(item);
+	}
+}
+
+// Update a value that is already known, e.g. after writing it
+void setStatus(StatusItem item, uint8_t val){
+	status[item].val = val;
+	status[item].stamp = millis();
+	status[item].valid = true;
+}
+
+uint8_t getStatus(StatusItem item){
+	return status[item].val;
+}
+
+// Bitmask of which values have been sampled, bit N corresponds to StatusItem N
+uint8_t getStatusValid(){
+	uint8_t valid = 0;
+	uint8_t item;
+	for(item = 0; item < NUM_STATUS; item++){
+		valid |= (status[item].valid ? 1 : 0) << item;
+	}
+	return valid;
+}
+
+// Age of the oldest value in ms, saturated to 255
+uint8_t getStatusAge(){
+	uint32_t now = millis();
+	uint32_t age = 0;
+	uint8_t item;
+	for(item = 0; item < NUM_STATUS; item++){
+		if(status[item].valid && now - status[item].stamp > age){
+			age = now - status[item].stamp;
+		}
+	}
+	return age > 255 ? 255 : age;
+}
+
+// Period in ms between samples of each value, 0 pauses background sampling
+void setStatusPeriod(uint8_t p){
+	period = p;
+}
+
+uint8_t getStatusPeriod(){
+	return period;
+}
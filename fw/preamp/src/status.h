@@ -0,0 +1,50 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Background-sampled cache of the power board and front panel status
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATUS_H_
+#define STATUS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DEFAULT_STATUS_PERIOD (50) // ms between samples of each status value
+
+typedef enum{
+	STATUS_PWR_GPIO,    // Power board GPIO expander inputs
+	STATUS_FRONT_PANEL, // Front panel LEDs
+	STATUS_HV1,         // ADC AIN0
+	STATUS_HV2,         // ADC AIN1
+	STATUS_NTC1,        // ADC AIN2
+	STATUS_NTC2,        // ADC AIN3
+	NUM_STATUS
+}StatusItem;
+
+void initStatus();
+void setStatus(StatusItem item, uint8_t val);
+void refreshStatus(StatusItem item);
+
+uint8_t getStatus(StatusItem item);
+uint8_t getStatusValid();
+uint8_t getStatusAge();
+
+void setStatusPeriod(uint8_t period);
+uint8_t getStatusPeriod();
+
+#endif /* STATUS_H_ */
@@ -43,7 +43,7 @@
   *=============================================================================
   *                         System Clock Configuration
   *=============================================================================
-  *        System Clock source          | PLL(HSE)
+  *        System Clock source          | PLL(HSE), or PLL(HSI/2) * 12 if HSE is off
   *-----------------------------------------------------------------------------
   *        SYSCLK                       | 48000000 Hz
   *-----------------------------------------------------------------------------
@@ -130,6 +130,8 @@
 /** @addtogroup STM32F0xx_System_Private_Variables
   * @{
   */
+uint32_t SystemCoreClock = 48000000;
+
 __I uint8_t AHBPrescTable[16] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 3, 4, 6, 7, 8, 9};
 
 /**
@@ -300,12 +302,13 @@ static void SetSysClock(void)
   // turn off HSE
   //RCC->CR &= ~((uint32_t)RCC_CR_HSEON);
 
-  /* Wait till HSE is ready and if Time out is reached exit */
-  do
+  /* Wait till HSE is ready and if Time out is reached exit.
+     HSE is never enabled above, so skip the wait to speed up boot. */
+  while((RCC->CR & RCC_CR_HSEON) && (HSEStatus == 0) && (StartUpCounter != HSE_STARTUP_TIMEOUT))
   {
     HSEStatus = RCC->CR & RCC_CR_HSERDY;
     StartUpCounter++;
-  } while((HSEStatus == 0) && (StartUpCounter != HSE_STARTUP_TIMEOUT));
+  }
 
   if ((RCC->CR & RCC_CR_HSERDY) != RESET)
   {
@@ -349,8 +352,26 @@ static void SetSysClock(void)
     }
   }
   else
-  { /* If HSE fails to start-up, the application will have wrong clock
-         configuration. User can add here some code to deal with this error */
+  { /* HSE is disabled above so pins F0 and F1 can be used. Run from the PLL
+       with the HSI instead: (HSI / 2) * 12 = 48 MHz */
+    FLASH->ACR = FLASH_ACR_PRFTBE | FLASH_ACR_LATENCY;
+
+    /* HCLK = SYSCLK, PCLK = HCLK */
+    RCC->CFGR |= (uint32_t)(RCC_CFGR_HPRE_DIV1 | RCC_CFGR_PPRE_DIV1);
+
+    RCC->CFGR &= (uint32_t)((uint32_t)~(RCC_CFGR_PLLSRC | RCC_CFGR_PLLXTPRE | RCC_CFGR_PLLMULL));
+    RCC->CFGR |= (uint32_t)(RCC_CFGR_PLLSRC_HSI_Div2 | RCC_CFGR_PLLMULL12);
+
+    RCC->CR |= RCC_CR_PLLON;
+    while((RCC->CR & RCC_CR_PLLRDY) == 0)
+    {
+    }
+
+    RCC->CFGR &= (uint32_t)((uint32_t)~(RCC_CFGR_SW));
+    RCC->CFGR |= (uint32_t)RCC_CFGR_SW_PLL;
+    while ((RCC->CFGR & (uint32_t)RCC_CFGR_SWS) != (uint32_t)RCC_CFGR_SWS_PLL)
+    {
+    }
   }
 }
 #endif
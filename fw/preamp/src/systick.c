@@ -21,11 +21,12 @@
 #include "systick.h"
 #include <stm32f0xx.h>
 
-// Initialize the system ticks. Change CPU_FREQ according to the frequency being used. (E.g. 8 MHz, 48 MHz, etc)
+// Initialize the system ticks from the core clock set up by SystemInit()
 void systickInit ()
 {
 #define SYSTICK_FREQ 1000 // 1000 Hz = 1 ms ticks
-   SysTick_Config (HSI_VALUE / SYSTICK_FREQ);
+   SystemCoreClockUpdate();
+   SysTick_Config (SystemCoreClock / SYSTICK_FREQ);
 }
 
 // The actual tick counter
@@ -41,6 +42,22 @@ inline uint32_t millis (void)
    return systick_count_;
 }
 
+// Return the system clock as a number of microseconds, wraps every 71 minutes
+uint32_t micros (void)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t ms = systick_count_;
+  uint32_t val = SysTick->VAL;
+  if (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) {
+    // The counter reloaded but the tick hasn't been counted yet
+    val = SysTick->VAL;
+    ms++;
+  }
+  __set_PRIMASK(primask);
+  return ms * 1000 + (SysTick->LOAD - val) / (SystemCoreClock / 1000000);
+}
+
 // Synchronous delay in milliseconds
 void delay_ms (uint32_t t)
 {
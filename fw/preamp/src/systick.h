@@ -26,5 +26,6 @@
 void systickInit ();
 void delay_ms (uint32_t t);
 uint32_t millis (void);
+uint32_t micros (void);
 
 #endif /* SYSTICK_H_ */
@@ -0,0 +1,180 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Fixed-rate history of the power board ADC and GPIO
+ *
+ * While TELEM_PERIOD is set, the four ADC channels and the power board GPIO
+ * are sampled every period into a ring of records, each with a sequence
+ * number. The controller board drains the ring with one multi-byte read of
+ * TELEM_DATA every few seconds instead of polling each value at a high rate.
+ * If the ring fills, the oldest records are dropped and the gap shows up in
+ * the sequence numbers. Every sample also refreshes the status cache.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "telemetry.h"
+#include "i2c_master.h"
+#include "port_defs.h"
+#include "power_board.h"
+#include "scheduler.h"
+#include "status.h"
+#include "systick.h"
+#include "stm32f0xx.h"
+
+// Records are indexed by sequence number, head is the next to be written and
+// tail the oldest not yet read. Both are free-running.
+static uint8_t ring[TELEM_LEN][TELEM_RECORD_LEN];
+static volatile uint16_t head = 0;
+static volatile uint16_t tail = 0;
+
+static volatile uint8_t period = 0; // ms between records, 0 stops recording
+static uint32_t last_sample = 0;
+static volatile bool in_flight = false;
+
+// Buffers filled by the I2C2 interrupt
+static uint8_t gpio_rx;
+static bool gpio_ok;
+static uint8_t adc_rx[NUM_ADC_CH];
+
+// Copy of the records being read, taken when a read of TELEM_DATA starts
+static uint8_t drain[TELEM_HEADER_LEN + TELEM_DRAIN_MAX * TELEM_RECORD_LEN];
+static uint16_t drain_seq;
+static uint8_t drain_count;
+
+static void gpioDone(bool ok){
+	gpio_ok = ok;
+	if(ok){
+		setStatus(STATUS_PWR_GPIO, gpio_rx);
+	}
+}
+
+// The ADC scan is queued after the GPIO read, so both are done
+static void adcDone(bool ok){
+	uint8_t ch;
+	if(ok){
+		for(ch = 0; ch < NUM_ADC_CH; ch++){
+			setStatus(STATUS_HV1 + ch, adc_rx[ch]);
+		}
+	}
+
+	// A failed sample is kept as all 0xFF so the time of every record stays known
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	uint8_t * r = ring[head & (TELEM_LEN - 1)];
+	for(ch = 0; ch < NUM_ADC_CH; ch++){
+		r[ch] = ok && gpio_ok ? adc_rx[ch] : 0xFF;
+	}
+	r[NUM_ADC_CH] = ok && gpio_ok ? gpio_rx : 0xFF;
+	head++;
+	if((uint16_t)(head - tail) > TELEM_LEN){
+		tail = head - TELEM_LEN; // Full, drop the oldest
+	}
+	__set_PRIMASK(primask);
+
+	in_flight = false;
+}
+
+// Runs every millisecond, taking a record every period ms
+static void serviceTelemetry(){
+	uint32_t now = millis();
+	if(period == 0 || in_flight || now - last_sample < period){
+		return;
+	}
+	last_sample += period;
+	if(now - last_sample >= period){
+		last_sample = now; // Fell behind, skip the missed records
+	}
+	in_flight = true;
+
+	I2CXfer x = {
+		.dev = pwr_temp_mntr_gpio.dev,
+		.tx_len = 1,
+		.tx = {pwr_temp_mntr_gpio.reg},
+		.rx_len = 1,
+		.rx = &gpio_rx,
+		.done = gpioDone
+	};
+	queueI2C2(&x);
+	queueScanADC(adc_rx, adcDone);
+}
+
+void initTelemetry(){
+	startTimer(serviceTelemetry, 1, 1);
+}
+
+// Period in ms between records, 0 stops recording. Changing it starts a new history.
+void setTelemPeriod(uint8_t p){
+	if(p != 0 && p < TELEM_MIN_PERIOD){
+		p = TELEM_MIN_PERIOD;
+	}
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	tail = head;
+	__set_PRIMASK(primask);
+	last_sample = millis() - p; // First record on the next tick
+	period = p;
+}
+
+uint8_t getTelemPeriod(){
+	return period;
+}
+
+// Records waiting to be read, saturated to 255
+uint8_t getTelemCount(){
+	uint16_t count = head - tail;
+	return count > 255 ? 255 : count;
+}
+
+// Byte index of a read of TELEM_DATA. The first byte copies up to
+// TELEM_DRAIN_MAX records and returns how many. A record is removed from
+// the ring once its last byte has been read, so a read that stops early
+// leaves the rest for the next one.
+uint8_t readTelem(uint8_t index){
+	uint32_t primask = __get_PRIMASK();
+	uint8_t i, j;
+	if(index == 0){
+		__disable_irq();
+		uint16_t count = head - tail;
+		drain_count = count > TELEM_DRAIN_MAX ? TELEM_DRAIN_MAX : count;
+		drain_seq = tail;
+		for(i = 0; i < drain_count; i++){
+			const uint8_t * r = ring[(drain_seq + i) & (TELEM_LEN - 1)];
+			for(j = 0; j < TELEM_RECORD_LEN; j++){
+				drain[TELEM_HEADER_LEN + i * TELEM_RECORD_LEN + j] = r[j];
+			}
+		}
+		__set_PRIMASK(primask);
+		drain[0] = drain_count;
+		drain[1] = drain_seq & 0xFF;
+		drain[2] = drain_seq >> 8;
+		return drain[0];
+	}
+
+	uint16_t end = TELEM_HEADER_LEN + drain_count * TELEM_RECORD_LEN;
+	if(index >= end){
+		return 0xFF;
+	}
+	if(index >= TELEM_HEADER_LEN && (index - TELEM_HEADER_LEN) % TELEM_RECORD_LEN == TELEM_RECORD_LEN - 1){
+		// Last byte of a record, it is read unless it was dropped in the meantime
+		uint16_t next = drain_seq + (index - TELEM_HEADER_LEN) / TELEM_RECORD_LEN + 1;
+		__disable_irq();
+		if((int16_t)(next - tail) > 0){
+			tail = next;
+		}
+		__set_PRIMASK(primask);
+	}
+	return drain[index];
+}
@@ -0,0 +1,39 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Fixed-rate history of the power board ADC and GPIO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+
+#include <stdint.h>
+
+#define TELEM_LEN         (128) // Records held, must be a power of 2
+#define TELEM_RECORD_LEN  (5)   // HV1, HV2, NTC1, NTC2, power board GPIO
+#define TELEM_HEADER_LEN  (3)   // Record count, then the first sequence number
+#define TELEM_DRAIN_MAX   (48)  // Records returned by one read of TELEM_DATA
+#define TELEM_MIN_PERIOD  (5)   // ms, each record takes three I2C2 transactions
+
+void initTelemetry();
+
+void setTelemPeriod(uint8_t period);
+uint8_t getTelemPeriod();
+uint8_t getTelemCount();
+uint8_t readTelem(uint8_t index);
+
+#endif /* TELEMETRY_H_ */
@@ -0,0 +1,171 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Closed-loop fan control from the heatsink temperatures
+ *
+ * The NTC thermistors on the power board are read by the background status
+ * sampling, so the loop never waits on I2C2. Once per PWM period the hotter
+ * of the two readings sets the fan duty. The fan override line on the power
+ * board GPIO expander is only written when it changes, so a steady fan costs
+ * no I2C2 traffic and the controller board only has to set the policy.
+ * The loop starts in host mode, so the fan follows FAN_STATUS alone until
+ * the controller board selects a policy.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "thermal.h"
+#include "port_defs.h"
+#include "ports.h"
+#include "power_board.h"
+#include "scheduler.h"
+#include "status.h"
+
+// Temperature in 1/4 degC every 8 ADC counts from 0 to 256, from
+// T = 1/(ln(Rt/10k)/3900 + 1/298.5) - 273.15 with Rt = 4.7k * (255/ADC - 1).
+// Clamped to what fits in an int8_t, interpolation is within 0.25 degC over 0-100 degC.
+#define TEMP_TABLE_SHIFT (3)
+static const int16_t temp_table[(256 >> TEMP_TABLE_SHIFT) + 1] = {
+	-512, -102, -54, -22, 2, 22, 40, 56,
+	71, 85, 99, 112, 125, 137, 150, 163,
+	175, 189, 202, 216, 231, 246, 263, 281,
+	301, 323, 349, 379, 417, 468, 508, 508,
+	508,
+};
+
+static volatile uint8_t mode = FAN_MODE_HOST; // The controller board opts in to a policy
+static volatile uint8_t on_temp = DEFAULT_FAN_ON_TEMP;
+static volatile uint8_t off_temp = DEFAULT_FAN_OFF_TEMP;
+static volatile bool forced = false; // FAN_STATUS override from the controller board
+static volatile uint8_t duty = 0;    // Percent of each period the fan is on, a multiple of 100/THERMAL_STEPS
+static uint8_t step = 0;             // Position in the PWM period
+static bool fan_on = false;          // Last state written to FAN_ON
+
+// Converts an NTC reading to 1/4 degC
+int16_t adcToTemp(uint8_t adc){
+	uint8_t i = adc >> TEMP_TABLE_SHIFT;
+	int16_t f = adc & ((1 << TEMP_TABLE_SHIFT) - 1);
+	int16_t lo = temp_table[i];
+	int16_t hi = temp_table[i + 1];
+	return lo + (((hi - lo) * f) >> TEMP_TABLE_SHIFT);
+}
+
+static bool sensorValid(uint8_t adc){
+	return adc != 0 && adc != 255;
+}
+
+// Temperature of heatsink 0 or 1 in degC, TEMP_INVALID if the sensor is open or shorted
+int8_t getTemp(uint8_t sensor){
+	uint8_t adc = getStatus(STATUS_NTC1 + sensor);
+	if(!sensorValid(adc)){
+		return TEMP_INVALID;
+	}
+	return (adcToTemp(adc) + 2) >> 2; // Rounded
+}
+
+static void writeFan(bool on){
+	if(on == fan_on){
+		return;
+	}
+	fan_on = on;
+	writePowerGpio(PWR_FAN_ON, on);
+}
+
+// Picks the duty cycle for the next period from the hotter heatsink
+static void updateDuty(){
+	uint8_t adc1 = getStatus(STATUS_NTC1);
+	uint8_t adc2 = getStatus(STATUS_NTC2);
+	if(!sensorValid(adc1) || !sensorValid(adc2) || !(getStatus(STATUS_PWR_GPIO) & PWR_OVR_TMP)){
+		duty = 100; // Fail safe, run the fan if a temperature can't be trusted or the power board is over temp
+		return;
+	}
+
+	int16_t hot = adcToTemp(adc1 > adc2 ? adc1 : adc2); // The ADC value rises with temperature
+	int16_t on = on_temp << 2;
+	int16_t off = off_temp << 2;
+	if(hot >= on){
+		duty = 100;
+	}else if(hot <= off){
+		duty = 0;
+	}else if(mode == FAN_MODE_PWM){
+		uint8_t steps = ((hot - off) * THERMAL_STEPS + (on - off) / 2) / (on - off);
+		duty = steps * (100 / THERMAL_STEPS);
+	}
+	// Between the thresholds hysteresis mode keeps the previous state
+}
+
+// True if the fan is in the on part of the current PWM period
+static bool pwmOn(){
+	return mode != FAN_MODE_HOST && step < duty / (100 / THERMAL_STEPS);
+}
+
+static void serviceThermal(){
+	if(step == 0 && mode != FAN_MODE_HOST){
+		updateDuty();
+		if(getStatusPeriod() == 0){
+			refreshStatus(STATUS_NTC1); // Sampling is paused, fetch the next reading ourselves
+		}
+	}
+
+	writeFan(forced || pwmOn());
+	step = (step + 1) % THERMAL_STEPS;
+}
+
+void initThermal(){
+	fan_on = (getStatus(STATUS_PWR_GPIO) & PWR_FAN_ON) != 0;
+	startTimer(serviceThermal, 0, THERMAL_TICK);
+}
+
+// Runs the fan fully on regardless of the mode until released
+void forceFan(bool on){
+	forced = on;
+	writeFan(forced || pwmOn());
+}
+
+void setFanMode(uint8_t m){
+	if(m < NUM_FAN_MODES){
+		mode = m;
+		duty = 0;
+		step = 0; // Start a new period with the new mode
+	}
+}
+
+uint8_t getFanMode(){
+	return mode;
+}
+
+void setFanOnTemp(uint8_t temp){
+	on_temp = temp;
+}
+
+uint8_t getFanOnTemp(){
+	return on_temp;
+}
+
+void setFanOffTemp(uint8_t temp){
+	off_temp = temp;
+}
+
+uint8_t getFanOffTemp(){
+	return off_temp;
+}
+
+// Percent of the time the fan is on
+uint8_t getFanDuty(){
+	if(forced){
+		return 100;
+	}
+	return mode == FAN_MODE_HOST ? 0 : duty;
+}
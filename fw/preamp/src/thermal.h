@@ -0,0 +1,55 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Closed-loop fan control from the heatsink temperatures
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef THERMAL_H_
+#define THERMAL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define THERMAL_TICK  (100) // ms per fan PWM step
+#define THERMAL_STEPS (10)  // PWM steps per period, the loop updates once per period
+
+#define DEFAULT_FAN_ON_TEMP  (45) // degC
+#define DEFAULT_FAN_OFF_TEMP (40) // degC
+#define TEMP_INVALID (-128)       // Reported for a sensor that is open or shorted
+
+typedef enum{
+	FAN_MODE_HOST,       // The fan only follows FAN_STATUS writes
+	FAN_MODE_HYSTERESIS, // On at FAN_ON_TEMP, off again at FAN_OFF_TEMP
+	FAN_MODE_PWM,        // Duty cycle rises from 0% at FAN_OFF_TEMP to 100% at FAN_ON_TEMP
+	NUM_FAN_MODES
+}FanMode;
+
+void initThermal();
+
+int16_t adcToTemp(uint8_t adc);
+int8_t getTemp(uint8_t sensor);
+
+void forceFan(bool on);
+void setFanMode(uint8_t mode);
+uint8_t getFanMode();
+void setFanOnTemp(uint8_t temp);
+uint8_t getFanOnTemp();
+void setFanOffTemp(uint8_t temp);
+uint8_t getFanOffTemp();
+uint8_t getFanDuty();
+
+#endif /* THERMAL_H_ */
@@ -0,0 +1,159 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Trace of the register reads and writes from the controller board
+ *
+ * While TRACE_CTRL has TRACE_RECORD set, every register write applied and
+ * every register read answered is recorded into a ring with the time it
+ * started and how long the preamp took to service it, so polling intervals
+ * and coalescing can be tuned from what the controller board really sends.
+ * A read is recorded once, with the first byte returned. The ring keeps the
+ * newest TRACE_LEN records. With TRACE_TRIGGER set recording stops by itself
+ * TRACE_LEN / 2 records after a write to TRACE_TRIG, so the trace is centred
+ * on that write. Reading the trace, through TRACE_DATA or the diagnostics
+ * UART, stops recording first so the records don't move while being read.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+#include "port_defs.h"
+#include "systick.h"
+#include "stm32f0xx.h"
+
+// Records are indexed by sequence number, head is the next to be written and
+// tail the oldest not yet read. Both are free-running.
+static uint8_t ring[TRACE_LEN][TRACE_RECORD_LEN];
+static volatile uint16_t head = 0;
+static volatile uint16_t tail = 0;
+static volatile uint16_t stop_at = 0; // head once a triggered trace is complete
+
+static volatile uint8_t ctrl = 0;
+static uint8_t trigger_reg = 0;
+
+// The read of TRACE_DATA in progress
+static uint16_t read_seq;
+static uint8_t read_count;
+
+void setTraceCtrl(uint8_t c){
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if(c & TRACE_RECORD){
+		head = 0;
+		tail = 0;
+		ctrl = c & (TRACE_RECORD | TRACE_TRIGGER);
+	}else{
+		ctrl &= ~TRACE_RECORD; // Keeps the records and whether it triggered
+	}
+	__set_PRIMASK(primask);
+}
+
+uint8_t getTraceCtrl(){
+	return ctrl;
+}
+
+void setTraceTrigger(uint8_t reg){
+	trigger_reg = reg;
+}
+
+uint8_t getTraceTrigger(){
+	return trigger_reg;
+}
+
+bool tracing(){
+	return ctrl & TRACE_RECORD;
+}
+
+// Records one access that started at start_us. Called from the main loop
+// for writes and from the I2C1 interrupt for most reads. Accesses of the
+// trace registers themselves aren't recorded.
+void traceAccess(uint8_t reg, uint8_t data, bool read, uint32_t start_us){
+	if(!(ctrl & TRACE_RECORD) || (reg >= REG_TRACE_CTRL && reg <= REG_TRACE_DATA)){
+		return;
+	}
+	uint32_t service = micros() - start_us;
+	if(service >= TRACE_READ){
+		service = TRACE_READ - 1;
+	}
+	if(read){
+		service |= TRACE_READ;
+	}
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	uint8_t * r = ring[head & (TRACE_LEN - 1)];
+	r[0] = start_us;
+	r[1] = start_us >> 8;
+	r[2] = start_us >> 16;
+	r[3] = start_us >> 24;
+	r[4] = reg;
+	r[5] = data;
+	r[6] = service;
+	r[7] = service >> 8;
+	head++;
+	if((uint16_t)(head - tail) > TRACE_LEN){
+		tail = head - TRACE_LEN; // Full, drop the oldest
+	}
+	if((ctrl & (TRACE_TRIGGER | TRACE_TRIGGERED)) == TRACE_TRIGGER && !read && reg == trigger_reg){
+		ctrl |= TRACE_TRIGGERED;
+		stop_at = head + TRACE_LEN / 2;
+	}
+	if((ctrl & TRACE_TRIGGERED) && head == stop_at){
+		ctrl &= ~TRACE_RECORD;
+	}
+	__set_PRIMASK(primask);
+}
+
+// Byte index of a read of TRACE_DATA. The first byte stops recording and
+// returns how many records, up to TRACE_READ_MAX, follow the header. As with
+// TELEM_DATA a record is removed once its last byte has been read.
+uint8_t readTrace(uint8_t index){
+	if(index == 0){
+		setTraceCtrl(0);
+		uint16_t count = head - tail;
+		read_count = count > TRACE_READ_MAX ? TRACE_READ_MAX : count;
+		read_seq = tail;
+		return read_count;
+	}
+	if(index < TRACE_HEADER_LEN){
+		return index == 1 ? read_seq & 0xFF : read_seq >> 8;
+	}
+
+	uint8_t i = (index - TRACE_HEADER_LEN) / TRACE_RECORD_LEN;
+	uint8_t byte = (index - TRACE_HEADER_LEN) % TRACE_RECORD_LEN;
+	if(i >= read_count){
+		return 0xFF;
+	}
+	uint16_t seq = read_seq + i;
+	if(byte == TRACE_RECORD_LEN - 1 && (int16_t)(seq + 1 - tail) > 0){
+		tail = seq + 1;
+	}
+	return ring[seq & (TRACE_LEN - 1)][byte];
+}
+
+// Removes the oldest record for the diagnostics UART, false if there are none
+bool nextTraceRecord(uint16_t * seq, uint8_t * record){
+	uint8_t i;
+	setTraceCtrl(0);
+	if(head == tail){
+		return false;
+	}
+	*seq = tail;
+	for(i = 0; i < TRACE_RECORD_LEN; i++){
+		record[i] = ring[tail & (TRACE_LEN - 1)][i];
+	}
+	tail++;
+	return true;
+}
@@ -0,0 +1,49 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Trace of the register reads and writes from the controller board
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TRACE_LEN        (64) // Records held, must be a power of 2
+#define TRACE_RECORD_LEN (8)  // Time in us, register, data, service time in us | TRACE_READ
+#define TRACE_HEADER_LEN (3)  // Record count, then the first sequence number
+#define TRACE_READ_MAX   (31) // Records returned by one read of TRACE_DATA
+
+// TRACE_CTRL bits
+#define TRACE_RECORD    (0x01) // Write 1 to clear the trace and start recording, 0 to stop
+#define TRACE_TRIGGER   (0x02) // Stop TRACE_LEN / 2 records after a write to TRACE_TRIG
+#define TRACE_TRIGGERED (0x04) // Read-only, the trigger write was recorded
+
+#define TRACE_READ (0x8000) // Set in the service time of a read
+
+void setTraceCtrl(uint8_t ctrl);
+uint8_t getTraceCtrl();
+void setTraceTrigger(uint8_t reg);
+uint8_t getTraceTrigger();
+
+bool tracing();
+void traceAccess(uint8_t reg, uint8_t data, bool read, uint32_t start_us);
+uint8_t readTrace(uint8_t index);
+bool nextTraceRecord(uint16_t * seq, uint8_t * record);
+
+#endif /* TRACE_H_ */
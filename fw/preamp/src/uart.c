@@ -0,0 +1,136 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Interrupt-driven UART receive and transmit rings
+ *
+ * Each USART interrupt moves one received byte into its RX ring and sends
+ * one byte from its TX ring, disabling the TXE interrupt once the ring is
+ * empty. The main loop consumes RX and produces TX, so each ring has one
+ * writer per index and no locking. A received byte that doesn't fit is
+ * dropped and counted as PERF_UART_OVF.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "uart.h"
+#include "perf.h"
+
+#define RING_MASK (UART_RING_LEN - 1)
+
+Uart uart1 = {.usart = USART1};
+Uart uart2 = {.usart = USART2};
+
+static uint8_t ringCount(const UartRing * r){
+	return (uint8_t)(r->head - r->tail);
+}
+
+void uartIrq(Uart * u){
+	USART_TypeDef * usart = u->usart;
+	if(USART_GetFlagStatus(usart, USART_FLAG_ORE) != RESET){
+		// A byte was lost before this interrupt ran, and the flag would keep it pending
+		USART_ClearFlag(usart, USART_FLAG_ORE);
+		perfCount(PERF_UART_OVF, 1);
+	}
+	if(USART_GetITStatus(usart, USART_IT_RXNE) != RESET){
+		uint8_t c = USART_ReceiveData(usart);
+		if(ringCount(&u->rx) < UART_RING_LEN){
+			u->rx.data[u->rx.head & RING_MASK] = c;
+			u->rx.head++;
+		}else{
+			perfCount(PERF_UART_OVF, 1);
+		}
+	}
+	if(USART_GetITStatus(usart, USART_IT_TXE) != RESET){
+		if(u->tx.tail != u->tx.head){
+			USART_SendData(usart, u->tx.data[u->tx.tail & RING_MASK]);
+			u->tx.tail++;
+		}else{
+			USART_ITConfig(usart, USART_IT_TXE, DISABLE);
+		}
+	}
+}
+
+// Takes the oldest received byte, returns false if there is none
+bool uartRead(Uart * u, uint8_t * c){
+	if(u->rx.tail == u->rx.head){
+		return false;
+	}
+	*c = u->rx.data[u->rx.tail & RING_MASK];
+	u->rx.tail++;
+	return true;
+}
+
+// Adds received bytes to l. Returns true once l holds a line ending in
+// "\r\n", or has overflowed, after which the next call starts a new line.
+bool uartReadLine(Uart * u, UartLine * l){
+	uint8_t c;
+	if(l->len >= 2 && l->data[l->len - 2] == 0x0D && l->data[l->len - 1] == 0x0A){
+		l->len = 0; // The last call returned this line
+		l->ovf = false;
+	}else if(l->ovf){
+		l->len = 0;
+		l->ovf = false;
+	}
+	while(uartRead(u, &c)){
+		l->data[l->len++] = c;
+		if(l->len >= 2 && l->data[l->len - 2] == 0x0D && c == 0x0A){
+			return true;
+		}
+		if(l->len >= UART_LINE_MAX){
+			l->ovf = true;
+			perfCount(PERF_UART_OVF, 1);
+			return true;
+		}
+	}
+	return false;
+}
+
+// Drops everything received so far
+void uartDiscard(Uart * u){
+	u->rx.tail = u->rx.head;
+}
+
+// Queues up to len bytes to be sent and returns how many fit, never waits
+uint8_t uartWrite(Uart * u, const uint8_t * data, uint8_t len){
+	uint8_t n = 0;
+	while(n < len && ringCount(&u->tx) < UART_RING_LEN){
+		u->tx.data[u->tx.head & RING_MASK] = data[n++];
+		u->tx.head++;
+	}
+	if(n){
+		USART_ITConfig(u->usart, USART_IT_TXE, ENABLE);
+	}
+	return n;
+}
+
+// Queues a whole string, waiting for room in the ring if it has to
+void uartPutString(Uart * u, const char * str){
+	uint8_t len = 0;
+	while(str[len] != 0 && len < 255){
+		len++;
+	}
+	const uint8_t * p = (const uint8_t *)str;
+	while(len){
+		uint8_t n = uartWrite(u, p, len);
+		p += n;
+		len -= n;
+	}
+}
+
+// Waits until everything queued has been sent
+void uartFlush(Uart * u){
+	while(u->tx.tail != u->tx.head);
+	while(USART_GetFlagStatus(u->usart, USART_FLAG_TC) == RESET);
+}
@@ -0,0 +1,66 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Interrupt-driven UART receive and transmit rings
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef UART_H_
+#define UART_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "stm32f0xx.h"
+
+#define UART_RING_LEN (64) // Bytes, must be a power of 2 that divides 256
+#define UART_LINE_MAX (32) // Longest line uartReadLine() assembles, including "\r\n"
+
+// Bytes passed between a USART interrupt and the main loop. Only the
+// producer writes head and only the consumer writes tail, so neither side
+// has to disable interrupts. Both are free-running.
+typedef struct{
+	volatile uint8_t head;
+	volatile uint8_t tail;
+	uint8_t data[UART_RING_LEN];
+}UartRing;
+
+typedef struct{
+	USART_TypeDef * usart;
+	UartRing rx; // Filled by the interrupt
+	UartRing tx; // Emptied by the interrupt
+}Uart;
+
+// A line being received, complete once it ends in "\r\n"
+typedef struct{
+	uint8_t data[UART_LINE_MAX];
+	uint8_t len;
+	bool ovf; // Longer than UART_LINE_MAX, the bytes kept are only the start
+}UartLine;
+
+extern Uart uart1; // Upstream: the controller board or the previous preamp
+extern Uart uart2; // Downstream: the next preamp
+
+void uartIrq(Uart * u);
+
+bool uartRead(Uart * u, uint8_t * c);
+bool uartReadLine(Uart * u, UartLine * l);
+void uartDiscard(Uart * u);
+
+uint8_t uartWrite(Uart * u, const uint8_t * data, uint8_t len);
+void uartPutString(Uart * u, const char * str);
+void uartFlush(Uart * u);
+
+#endif /* UART_H_ */
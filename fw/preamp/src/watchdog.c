@@ -0,0 +1,138 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Independent watchdog, and the state kept in RAM to recover from it
+ *
+ * The IWDG resets the preamp if the main loop stops kicking it for
+ * WATCHDOG_TIMEOUT, e.g. from a hang in one of the I2C2 spin-waits. Once
+ * addressing is done the I2C address, the UART baud rate and the channel
+ * state are kept in .noinit RAM with a CRC, which the startup code leaves
+ * alone. After a watchdog reset with a valid copy the preamp skips
+ * addressing, so the rest of the chain isn't reset, and comes back at the
+ * same address with the same outputs a few milliseconds later instead of
+ * waiting for the controller board to reset and readdress every preamp.
+ * Any other reset, or a copy that fails its check, starts from scratch.
+ * A preamp that keeps hanging soon after recovering also starts from
+ * scratch after WATCHDOG_MAX_RESETS, in case the restored state causes it.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "watchdog.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include "events.h"
+#include "flash.h"
+#include "pec.h"
+#include "scheduler.h"
+#include "stm32f0xx.h"
+
+#define IWDG_KEY_START  (0xCCCC)
+#define IWDG_KEY_ACCESS (0x5555) // Unlocks PR and RLR
+#define IWDG_KEY_RELOAD (0xAAAA)
+#define IWDG_DIV_32     (IWDG_PR_PR_1 | IWDG_PR_PR_0)
+#define LSI_HZ          (40000)  // Nominal, the LSI is anywhere from 30 to 50 kHz
+#define IWDG_RELOAD     (WATCHDOG_TIMEOUT * (LSI_HZ / 32) / 1000)
+
+#define RETAINED_MAGIC (0x57444F47) // "WDOG"
+
+typedef struct{
+	uint32_t magic;           // RETAINED_MAGIC once addressing has finished
+	RetainedLink link;
+	ChannelSnapshot channels;
+	uint8_t resets;           // Recoveries without WATCHDOG_STABLE in between
+	uint32_t crc;             // CRC-32 of everything before it
+}RetainedState;
+
+// Placed by LinkerScript.ld below anything the bootloader uses
+static RetainedState retained __attribute__((section(".noinit")));
+static bool recovered = false;
+
+static uint32_t retainedCrc(){
+	return crc32(0, (const uint8_t *)&retained, offsetof(RetainedState, crc));
+}
+
+static void forgetResets(){
+	if(retained.magic == RETAINED_MAGIC){
+		retained.resets = 0;
+		retained.crc = retainedCrc();
+	}
+}
+
+// Checks what was kept over the reset, then starts the watchdog. Must come
+// before anything that could hang.
+void initWatchdog(){
+	recovered = RCC_GetFlagStatus(RCC_FLAG_IWDGRST) == SET &&
+	            retained.magic == RETAINED_MAGIC && retained.crc == retainedCrc() &&
+	            retained.resets < WATCHDOG_MAX_RESETS;
+	RCC_ClearFlag();
+	if(recovered){
+		retained.resets++;
+		retained.crc = retainedCrc();
+	}else{
+		retained.magic = 0; // Nothing is kept until addressing is done again
+	}
+	startTimer(forgetResets, WATCHDOG_STABLE, 0);
+
+	IWDG->KR = IWDG_KEY_START;
+	IWDG->KR = IWDG_KEY_ACCESS;
+	IWDG->PR = IWDG_DIV_32;
+	IWDG->RLR = IWDG_RELOAD;
+	while(IWDG->SR); // The new values take a few LSI cycles to arrive
+	IWDG->KR = IWDG_KEY_RELOAD;
+}
+
+void kickWatchdog(){
+	IWDG->KR = IWDG_KEY_RELOAD;
+}
+
+// What addressing left behind before the watchdog reset, NULL if the
+// preamp has to be addressed again
+const RetainedLink * recoveredLink(){
+	return recovered ? &retained.link : NULL;
+}
+
+// The channel state before the watchdog reset, NULL if there is none
+const ChannelSnapshot * recoveredChannels(){
+	return recovered ? &retained.channels : NULL;
+}
+
+// Called once addressing is done, from then on a watchdog reset can recover
+void retainLink(const RetainedLink * link){
+	retained.magic = RETAINED_MAGIC;
+	retained.link = *link;
+	retained.resets = 0;
+	captureChannels(&retained.channels);
+	retained.crc = retainedCrc();
+}
+
+// Keeps the retained channel state, event mask and PEC_CTRL up to date,
+// called after writes are applied. The CRC is only recomputed on a change.
+void retainState(){
+	if(retained.magic != RETAINED_MAGIC){
+		return;
+	}
+	ChannelSnapshot now;
+	captureChannels(&now);
+	uint8_t mask = getEventMask();
+	uint8_t pec = getPecCtrl();
+	if(!sameChannels(&now, &retained.channels) || mask != retained.link.event_mask ||
+	   pec != retained.link.pec_ctrl){
+		retained.channels = now;
+		retained.link.event_mask = mask;
+		retained.link.pec_ctrl = pec;
+		retained.crc = retainedCrc();
+	}
+}
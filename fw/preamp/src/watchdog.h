@@ -0,0 +1,50 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Independent watchdog, and the state kept in RAM to recover from it
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef WATCHDOG_H_
+#define WATCHDOG_H_
+
+#include <stdint.h>
+#include "snapshot.h"
+
+#define WATCHDOG_TIMEOUT    (100)   // ms without a kick before the preamp is reset
+#define WATCHDOG_MAX_RESETS (3)     // Recoveries in a row before addressing is done again
+#define WATCHDOG_STABLE     (10000) // ms running before the recoveries are forgotten
+
+// What addressing left behind, so the preamp can come back at the same
+// address without the controller board
+typedef struct{
+	uint8_t i2c_addr;    // As given to init_i2c1()
+	uint8_t boot_status; // BOOT_STATUS once the chain acknowledged
+	uint8_t downstream;  // The next preamp was listening for its address
+	uint8_t event_mask;  // EVENT_MASK as last written
+	uint8_t pec_ctrl;    // PEC_CTRL as last written
+	uint16_t brr;        // USART1 baud rate the address arrived at
+}RetainedLink;
+
+void initWatchdog();
+void kickWatchdog();
+
+const RetainedLink * recoveredLink();
+const ChannelSnapshot * recoveredChannels();
+void retainLink(const RetainedLink * link);
+void retainState();
+
+#endif /* WATCHDOG_H_ */
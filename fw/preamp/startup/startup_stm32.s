@@ -162,12 +162,12 @@ g_pfnVectors:
 	.word	0
 	.word	0
 	.word	0
-	.word	0
-	.word	0
+	.word	I2C1_IRQHandler
+	.word	I2C2_IRQHandler
 	.word	0
 	.word	0
     .word   USART1_IRQHandler
-	.word	0
+	.word	USART2_IRQHandler
 	.word	0
 	.word	0
 	.word	0
@@ -260,6 +260,15 @@ g_pfnVectors:
 	.weak   USART1_IRQHandler
 	.thumb_set USART1_IRQHandler, Default_Handler
 
+	.weak   I2C1_IRQHandler
+	.thumb_set I2C1_IRQHandler, Default_Handler
+
+	.weak   I2C2_IRQHandler
+	.thumb_set I2C2_IRQHandler, Default_Handler
+
+	.weak   USART2_IRQHandler
+	.thumb_set USART2_IRQHandler, Default_Handler
+
 	.weak	SystemInit
 
 /************************ (C) COPYRIGHT Ac6 *****END OF FILE****/
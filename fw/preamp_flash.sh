@@ -6,6 +6,9 @@
 # Origin: https://sourceforge.net/projects/stm32flash/
 # -b sets the baudrate - here we are using 38400. The UART communication with the chip typically runs at 9600 baud
 # -w specifies that you are writing from a file, in this case preamp_bd.bin from its directory. Change this section in order to flash different software
+# -S sets the flash address to write at. preamp_bd_full.bin holds the bootloader followed by the firmware and, like the
+# older preamp_X.Y.bin releases, starts at 0x08000000. preamp_bd.bin is the firmware alone, linked to run behind the
+# 4 KB bootloader, so it is written at 0x08001000 and needs the bootloader to already be on the board
 # -v specifies a verify on writes during the flashing process
 # -R resets the device when flashing is complete. Allows for seamless use after a flash
 # -i calls for a GPIO string. This sequence specifies the process needed for flashing, and makes use of GPIO 4 and 5 which are connected to the NRST and BOOT0 pins respectively.
@@ -21,8 +24,17 @@ if ! which stm32flash; then
 fi
 
 if [[ $1 == *.bin ]]; then
-  sudo stm32flash -b 38400 -w $1 -v -R -i 5,-4,4 /dev/ttyAMA0
+  # The reset vector, the second word of the image, is in the bootloader for images that start at 0x08000000
+  reset=$(od -A n -t x4 -j 4 -N 4 $1 | tr -d ' ')
+  if (( 0x$reset < 0x08001000 )); then
+    addr=0x08000000
+  else
+    addr=0x08001000
+    echo "$1 is the firmware alone, writing it after the bootloader at $addr"
+  fi
+  sudo stm32flash -b 38400 -S $addr -w $1 -v -R -i 5,-4,4 /dev/ttyAMA0
 else
-  echo "Firmware binary not specified. Please try again using './preamp_flash.sh preamp_X.Y.bin'"
+  echo "Firmware binary not specified. Please try again using './preamp_flash.sh preamp_bd_full.bin'"
+  echo "preamp_bd_full.bin includes the bootloader, preamp_bd.bin is written after it and needs it on the board already"
   exit 1
 fi
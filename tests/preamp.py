@@ -55,6 +55,7 @@ parser.add_argument('-b', action='store_true', default=False, help='enter bootlo
 parser.add_argument('-a', action='store_true', default=False, help="set i2c address, currently only can set master's address")
 parser.add_argument('-f', action='store_true', default=False, help='force fans on')
 parser.add_argument('-l', type=auto_int, metavar='0xXX', help="override the LEDs")
+parser.add_argument('-t', action='store_true', default=False, help='summarize the commands traced since the last -t, then start a new trace')
 args = parser.parse_args()
 
 # Force a reset if bootloader is requested
@@ -88,4 +89,8 @@ if not args.b:
 
   print_status(preamps, args.u)
 
+  if args.t:
+    print(amplipi.rt.summarize_trace(preamps.read_trace(args.u)))
+    preamps.start_trace(args.u)
+
 # TODO? 'STANDBY' : 0x04
@@ -0,0 +1,63 @@
+#!/usr/bin/python3
+
+"""
+Test amplipi.rt's preamp transactions, with the I2C bus replaced by a recorder
+this file is expected to be run using pytest, ie. pytest tests/test_rt.py
+"""
+
+import threading
+import time
+
+# use the internal amplipi library
+from context import amplipi
+
+PREAMP = 0x08
+HOLD_S = 0.001 # write-behind period, short so the write-behind thread runs during the tests
+REGS = amplipi.rt._REG_ADDRS
+
+class RecordingBus:
+  """ Stands in for the I2C bus, keeping each write as (i2c address, [register, data...]) """
+  def __init__(self):
+    self.writes = []
+
+  def i2c_rdwr(self, *msgs):
+    for msg in msgs:
+      self.writes.append((msg.addr, list(msg)))
+
+def preamps_w_write_behind():
+  """ A preamp holding zone writes for HOLD_S, as the controller runs one """
+  preamps = amplipi.rt._Preamps(write_behind=HOLD_S) # Not on AmpliPi hardware, so no bus is opened
+  preamps.bus = RecordingBus()
+  preamps.new_preamp(PREAMP)
+  threading.Thread(target=preamps._write_behind, daemon=True).start()
+  return preamps
+
+def test_save_preset_sends_held_writes_first():
+  """ A zone write held just before a preset is saved is applied, not saved in the preset """
+  preamps = preamps_w_write_behind()
+  preamps._write(PREAMP, REGS['CH1_ATTEN'], [0x10])
+  preamps.save_preset(1, 2, {REGS['CH1_ATTEN']: 0x20, REGS['CH2_ATTEN']: 0x21})
+  time.sleep(10 * HOLD_S)
+  assert preamps.bus.writes == [
+    (PREAMP, [REGS['CH1_ATTEN'], 0x10]),
+    (PREAMP, [REGS['STAGE'], 1]),
+    (PREAMP, [REGS['CH1_ATTEN'], 0x20]),
+    (PREAMP, [REGS['CH2_ATTEN'], 0x21]),
+    (PREAMP, [REGS['PRESET_SAVE'], 2]),
+  ]
+
+def test_save_preset_isnt_written_behind():
+  """ The write-behind thread running partway through saving a preset doesn't apply any of it """
+  preamps = preamps_w_write_behind()
+  write = preamps._write
+  def slow_write(*args):
+    write(*args)
+    time.sleep(10 * HOLD_S) # Gives the write-behind thread time to run
+  preamps._write = slow_write
+  preamps.save_preset(1, 0, {REGS['CH3_ATTEN']: 0x30})
+  time.sleep(10 * HOLD_S)
+  assert preamps.bus.writes == [
+    (PREAMP, [REGS['STAGE'], 1]),
+    (PREAMP, [REGS['CH3_ATTEN'], 0x30]),
+    (PREAMP, [REGS['PRESET_SAVE'], 0]),
+  ]